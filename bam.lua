@@ -1,7 +1,20 @@
 settings = NewSettings()
 settings.debug = 1
-source = Collect("*.c")
+if family == "unix" then
+   settings.link.libs:Add("pthread")
+   settings.link.libs:Add("rt")
+end
+if family == "windows" then
+   settings.cc.flags_cxx:Add("/std:c++20")
+else
+   settings.cc.flags_cxx:Add("-std=c++20")
+end
 
-objects = Compile(settings, source)
-exe = Link(settings, "ryannet_test", objects)
+library = Compile(settings, "ryannet.c")
+test = Compile(settings, "main.c")
+bench = Compile(settings, "bench.c")
+bench_cpp = Compile(settings, "bench_cpp.cpp")
 
+exe = Link(settings, "ryannet_test", test, library)
+bench_exe = Link(settings, "ryannet_bench", bench, library)
+bench_cpp_exe = Link(settings, "ryannet_bench_cpp", bench_cpp, library)
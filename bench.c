@@ -0,0 +1,1007 @@
+#include "ryannet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#else // _WIN32
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#endif // _WIN32
+
+#define ROUND_TRIPS 20000
+#define MESSAGE_SIZE 64
+
+#ifdef _WIN32
+typedef HANDLE bench_thread;
+#else // _WIN32
+typedef pthread_t bench_thread;
+#endif // _WIN32
+
+static long long bench_time_ns(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER counter, frequency;
+   QueryPerformanceCounter(&counter);
+   QueryPerformanceFrequency(&frequency);
+   return (long long)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else // _WIN32
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif // _WIN32
+}
+
+#ifdef _WIN32
+static bench_thread bench_thread_start(DWORD (WINAPI * function)(void *), void * arg)
+{
+   return CreateThread(NULL, 0, function, arg, 0, NULL);
+}
+
+static void bench_thread_join(bench_thread thread)
+{
+   WaitForSingleObject(thread, INFINITE);
+   CloseHandle(thread);
+}
+#define BENCH_THREAD_FUNCTION(name) DWORD WINAPI name(void * arg)
+#define BENCH_THREAD_RETURN return 0
+#else // _WIN32
+static bench_thread bench_thread_start(void * (* function)(void *), void * arg)
+{
+   pthread_t thread;
+   pthread_create(&thread, NULL, function, arg);
+   return thread;
+}
+
+static void bench_thread_join(bench_thread thread)
+{
+   pthread_join(thread, NULL);
+}
+#define BENCH_THREAD_FUNCTION(name) void * name(void * arg)
+#define BENCH_THREAD_RETURN return NULL
+#endif // _WIN32
+
+static int bench_compare_long_long(const void * a, const void * b)
+{
+   long long left, right;
+   left = *(const long long *)a;
+   right = *(const long long *)b;
+   return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+static void bench_report(const char * name, long long * samples, int count)
+{
+   long long total;
+   int i;
+   total = 0;
+   for(i = 0; i < count; i++)
+   {
+      total += samples[i];
+   }
+   qsort(samples, (size_t)count, sizeof(long long), bench_compare_long_long);
+   printf("%-28s avg %8.2f us  p50 %8.2f us  p99 %8.2f us\n", name,
+          (double)total / count / 1000.0,
+          samples[count / 2] / 1000.0,
+          samples[(count * 99) / 100] / 1000.0);
+}
+
+static int bench_receive_all(struct ryannet_socket_tcp * socket, char * buffer, int size)
+{
+   int received, rv;
+   received = 0;
+   while(received < size)
+   {
+      rv = ryannet_socket_tcp_receive(socket, buffer + received, size - received);
+      if(rv <= 0)
+      {
+         return 1;
+      }
+      received += rv;
+   }
+   return 0;
+}
+
+static BENCH_THREAD_FUNCTION(bench_echo_server)
+{
+   struct ryannet_socket_tcp * server_socket, * con;
+   char buffer[MESSAGE_SIZE];
+   int i;
+
+   server_socket = arg;
+   con = ryannet_socket_tcp_accept(server_socket);
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      if(bench_receive_all(con, buffer, MESSAGE_SIZE) != 0)
+      {
+         break;
+      }
+      ryannet_socket_tcp_send(con, buffer, MESSAGE_SIZE);
+   }
+   ryannet_socket_tcp_destroy(con);
+   BENCH_THREAD_RETURN;
+}
+
+static void bench_round_trip(const char * name, const char * bind_address, const char * connect_address, const char * port)
+{
+   struct ryannet_socket_tcp * server_socket, * client_socket;
+   bench_thread thread;
+   char buffer[MESSAGE_SIZE];
+   long long * samples;
+   long long start;
+   int i;
+
+   server_socket = ryannet_socket_tcp_new();
+   if(ryannet_socket_tcp_bind(server_socket, bind_address, port) != 0)
+   {
+      ryannet_socket_tcp_destroy(server_socket);
+      return;
+   }
+   thread = bench_thread_start(bench_echo_server, server_socket);
+
+   client_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_connect(client_socket, connect_address, port);
+   samples = malloc(sizeof(long long) * ROUND_TRIPS);
+   memset(buffer, 'x', MESSAGE_SIZE);
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      start = bench_time_ns();
+      ryannet_socket_tcp_send(client_socket, buffer, MESSAGE_SIZE);
+      if(bench_receive_all(client_socket, buffer, MESSAGE_SIZE) != 0)
+      {
+         break;
+      }
+      samples[i] = bench_time_ns() - start;
+   }
+   bench_report(name, samples, i);
+
+   free(samples);
+   ryannet_socket_tcp_destroy(client_socket);
+   bench_thread_join(thread);
+   ryannet_socket_tcp_destroy(server_socket);
+}
+
+// One entity's networked state, the way a game would lay it out
+struct bench_entity
+{
+   unsigned int id;
+   float position[3];
+   float velocity[3];
+   float yaw;
+   unsigned short health;
+   unsigned short flags;
+   unsigned int animation;
+};
+
+#define DELTA_ENTITIES 1000
+#define DELTA_TICKS 2000
+static void bench_delta(int moving_percent)
+{
+   struct bench_entity * baseline, * current, * decoded;
+   struct ryannet_bitwriter writer;
+   unsigned char * encoded;
+   long long start, encode_time, decode_time, pack_time, encoded_bytes;
+   int snapshot_size, tick, size, i;
+
+   snapshot_size = (int)sizeof(struct bench_entity) * DELTA_ENTITIES;
+   baseline = calloc(DELTA_ENTITIES, sizeof(struct bench_entity));
+   current = calloc(DELTA_ENTITIES, sizeof(struct bench_entity));
+   decoded = calloc(DELTA_ENTITIES, sizeof(struct bench_entity));
+   encoded = malloc((size_t)snapshot_size * 2);
+   for(i = 0; i < DELTA_ENTITIES; i++)
+   {
+      current[i].id = (unsigned int)i;
+      current[i].position[0] = (float)(i % 100) * 10.0f;
+      current[i].position[2] = (float)(i / 100) * 10.0f;
+      current[i].health = 100;
+   }
+   memcpy(baseline, current, (size_t)snapshot_size);
+
+   srand(3);
+   encode_time = 0;
+   decode_time = 0;
+   pack_time = 0;
+   encoded_bytes = 0;
+   for(tick = 0; tick < DELTA_TICKS; tick++)
+   {
+      for(i = 0; i < DELTA_ENTITIES; i++)
+      {
+         if(rand() % 100 < moving_percent)
+         {
+            current[i].velocity[0] = (float)(rand() % 21 - 10) * 0.1f;
+            current[i].position[0] += current[i].velocity[0];
+            current[i].position[2] += 0.25f;
+            current[i].yaw = (float)(rand() % 360);
+            current[i].animation ++;
+         }
+      }
+
+      start = bench_time_ns();
+      size = ryannet_delta_encode(baseline, current, snapshot_size, encoded, snapshot_size * 2);
+      encode_time += bench_time_ns() - start;
+      encoded_bytes += size;
+      start = bench_time_ns();
+      ryannet_delta_decode(baseline, encoded, size, decoded, snapshot_size);
+      decode_time += bench_time_ns() - start;
+
+      // The same states packed field by field with the bit writer instead
+      start = bench_time_ns();
+      ryannet_bitwriter_init(&writer, encoded, snapshot_size * 2);
+      for(i = 0; i < DELTA_ENTITIES; i++)
+      {
+         ryannet_bitwriter_write_varint(&writer, current[i].id);
+         ryannet_bitwriter_write_float_quantized(&writer, current[i].position[0], -4096.0f, 4096.0f, 20);
+         ryannet_bitwriter_write_float_quantized(&writer, current[i].position[1], -4096.0f, 4096.0f, 20);
+         ryannet_bitwriter_write_float_quantized(&writer, current[i].position[2], -4096.0f, 4096.0f, 20);
+         ryannet_bitwriter_write_float_quantized(&writer, current[i].yaw, 0.0f, 360.0f, 9);
+         ryannet_bitwriter_write_bits(&writer, current[i].health, 7);
+         ryannet_bitwriter_write_varint(&writer, current[i].animation);
+      }
+      pack_time += bench_time_ns() - start;
+
+      // The peer acks every tick, so this tick is the next baseline
+      memcpy(baseline, current, (size_t)snapshot_size);
+   }
+   // A 60Hz server has 16.6ms per tick for everything
+   printf("delta %4d entities %3d%% moving  %6d byte snapshot to %7.0f bytes  encode %7.0f ns  decode %7.0f ns  bit pack all %7.0f ns  %5.2f%% of a 60Hz tick\n",
+          DELTA_ENTITIES, moving_percent, snapshot_size, (double)encoded_bytes / DELTA_TICKS,
+          (double)encode_time / DELTA_TICKS, (double)decode_time / DELTA_TICKS, (double)pack_time / DELTA_TICKS,
+          (double)(encode_time + decode_time) / DELTA_TICKS / 16666666.0 * 100.0);
+
+   free(baseline);
+   free(current);
+   free(decoded);
+   free(encoded);
+}
+
+#define SECURE_PACKETS 100000
+static void bench_secure(int payload_size)
+{
+   struct ryannet_secure_session * server_session, * client_session;
+   unsigned char hello[RYANNET_SECURE_HANDSHAKE_SIZE], welcome[RYANNET_SECURE_HANDSHAKE_SIZE];
+   unsigned char * payload, * packet, * opened;
+   long long start, seal_time, open_time;
+   int i, size;
+
+   client_session = ryannet_secure_session_new(NULL);
+   server_session = ryannet_secure_session_new(NULL);
+   ryannet_secure_session_client_hello(client_session, hello, RYANNET_SECURE_HANDSHAKE_SIZE);
+   ryannet_secure_session_server_accept(server_session, hello, RYANNET_SECURE_HANDSHAKE_SIZE, welcome, RYANNET_SECURE_HANDSHAKE_SIZE);
+   ryannet_secure_session_client_finish(client_session, welcome, RYANNET_SECURE_HANDSHAKE_SIZE);
+
+   payload = malloc((size_t)payload_size);
+   opened = malloc((size_t)payload_size);
+   packet = malloc((size_t)(payload_size + RYANNET_SECURE_OVERHEAD));
+   memset(payload, 'x', (size_t)payload_size);
+   seal_time = 0;
+   open_time = 0;
+   for(i = 0; i < SECURE_PACKETS; i++)
+   {
+      start = bench_time_ns();
+      size = ryannet_secure_session_seal(client_session, payload, payload_size, packet, payload_size + RYANNET_SECURE_OVERHEAD);
+      seal_time += bench_time_ns() - start;
+      start = bench_time_ns();
+      ryannet_secure_session_open(server_session, packet, size, opened, payload_size);
+      open_time += bench_time_ns() - start;
+   }
+   // At 100k packets a second each packet has 10us to play with
+   printf("secure %5d byte packets     seal %6.0f ns  open %6.0f ns  %5.2f%% of a core at 100k packets/s\n",
+          payload_size, (double)seal_time / SECURE_PACKETS, (double)open_time / SECURE_PACKETS,
+          (double)(seal_time + open_time) / SECURE_PACKETS / 10000.0 * 100.0);
+
+   free(payload);
+   free(opened);
+   free(packet);
+   ryannet_secure_session_destroy(client_session);
+   ryannet_secure_session_destroy(server_session);
+}
+
+#define COOKIE_PACKETS 1000000
+static void bench_cookie(void)
+{
+   struct ryannet_cookie_guard * guard;
+   struct ryannet_address * source;
+   unsigned char cookie[RYANNET_COOKIE_SIZE];
+   long long start, allow_time, check_time;
+   int i, allowed, valid;
+
+   guard = ryannet_cookie_guard_new(1000, 100, 30);
+   source = ryannet_address_new();
+   ryannet_address_set(source, "192.0.2.1", "4000");
+   ryannet_cookie_guard_make(guard, source, cookie);
+   // A junk cookie from a spoofed source is the common case under a flood
+   cookie[5] ^= 1;
+
+   allowed = 0;
+   start = bench_time_ns();
+   for(i = 0; i < COOKIE_PACKETS; i++)
+   {
+      allowed += ryannet_cookie_guard_allow(guard, source);
+   }
+   allow_time = bench_time_ns() - start;
+
+   valid = 0;
+   start = bench_time_ns();
+   for(i = 0; i < COOKIE_PACKETS; i++)
+   {
+      valid += ryannet_cookie_guard_check(guard, source, cookie);
+   }
+   check_time = bench_time_ns() - start;
+
+   printf("cookie guard                 allow %6.1f ns  check %6.1f ns  (%d allowed, %d valid)\n",
+          (double)allow_time / COOKIE_PACKETS, (double)check_time / COOKIE_PACKETS, allowed, valid);
+   ryannet_address_destroy(source);
+   ryannet_cookie_guard_destroy(guard);
+}
+
+#define IMPAIRED_PINGS 1000
+static void bench_impaired_udp(void)
+{
+   struct ryannet_socket_udp * server_socket, * client_socket;
+   struct ryannet_impaired_udp * server, * client;
+   struct ryannet_impairment impairment;
+   struct ryannet_address * server_address, * source;
+   long long * sent_at, * samples;
+   long long now, last_send;
+   char buffer[MESSAGE_SIZE];
+   int sent, received, index, size;
+
+   server_socket = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(server_socket, "127.0.0.1", "1242");
+   client_socket = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(client_socket, "127.0.0.1", "1243");
+   server_address = ryannet_address_new();
+   ryannet_address_set(server_address, "127.0.0.1", "1242");
+   source = ryannet_address_new();
+
+   // 75ms each way gives a 150ms round trip, each leg drops 5%
+   ryannet_impairment_init(&impairment);
+   impairment.latency_ms = 75;
+   impairment.jitter_ms = 5;
+   impairment.jitter_distribution = RYANNET_JITTER_NORMAL;
+   impairment.loss = 0.05;
+   impairment.seed = 1;
+   client = ryannet_impaired_udp_new(client_socket, &impairment, NULL);
+   impairment.seed = 2;
+   server = ryannet_impaired_udp_new(server_socket, &impairment, NULL);
+
+   sent_at = malloc(sizeof(long long) * IMPAIRED_PINGS);
+   samples = malloc(sizeof(long long) * IMPAIRED_PINGS);
+   memset(buffer, 'x', MESSAGE_SIZE);
+   sent = 0;
+   received = 0;
+   last_send = bench_time_ns();
+   while(1)
+   {
+      now = bench_time_ns();
+      // One ping a millisecond, then wait out the last round trip
+      if(sent < IMPAIRED_PINGS && now - last_send >= 1000000)
+      {
+         memcpy(buffer, &sent, sizeof(int));
+         sent_at[sent] = now;
+         ryannet_impaired_udp_send(client, server_address, buffer, MESSAGE_SIZE);
+         sent ++;
+         last_send = now;
+      }
+      else if(sent == IMPAIRED_PINGS && now - last_send > 500000000LL)
+      {
+         break;
+      }
+      while((size = ryannet_impaired_udp_receive_nonblock(server, buffer, MESSAGE_SIZE, source)) > 0)
+      {
+         ryannet_impaired_udp_send(server, source, buffer, size);
+      }
+      while((size = ryannet_impaired_udp_receive_nonblock(client, buffer, MESSAGE_SIZE, source)) > 0)
+      {
+         memcpy(&index, buffer, sizeof(int));
+         samples[received] = bench_time_ns() - sent_at[index];
+         received ++;
+      }
+   }
+   bench_report("udp 150ms rtt 5% loss", samples, received);
+   printf("%-28s %d of %d pings came back (%.1f%% lost)\n", "", received, IMPAIRED_PINGS,
+          100.0 - received * 100.0 / IMPAIRED_PINGS);
+
+   free(sent_at);
+   free(samples);
+   ryannet_impaired_udp_destroy(client);
+   ryannet_impaired_udp_destroy(server);
+   ryannet_address_destroy(server_address);
+   ryannet_address_destroy(source);
+   ryannet_socket_udp_destroy(client_socket);
+   ryannet_socket_udp_destroy(server_socket);
+}
+
+#define IMPAIRED_TCP_BYTES (1024 * 1024)
+#define IMPAIRED_TCP_CHUNK 16384
+static volatile long long bench_impaired_tcp_time;
+
+static BENCH_THREAD_FUNCTION(bench_impaired_tcp_server)
+{
+   struct ryannet_socket_tcp * con;
+   char buffer[IMPAIRED_TCP_CHUNK];
+   int total, size;
+
+   con = ryannet_socket_tcp_accept(arg);
+   total = 0;
+   while(total < IMPAIRED_TCP_BYTES)
+   {
+      size = ryannet_socket_tcp_receive(con, buffer, IMPAIRED_TCP_CHUNK);
+      if(size <= 0)
+      {
+         break;
+      }
+      total += size;
+   }
+   ryannet_socket_tcp_send(con, "k", 1);
+   ryannet_socket_tcp_destroy(con);
+   BENCH_THREAD_RETURN;
+}
+
+static BENCH_THREAD_FUNCTION(bench_impaired_tcp_client)
+{
+   struct ryannet_socket_tcp * client_socket;
+   char buffer[IMPAIRED_TCP_CHUNK];
+   long long start;
+   int total;
+
+   (void)arg;
+   memset(buffer, 'x', IMPAIRED_TCP_CHUNK);
+   start = bench_time_ns();
+   client_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_connect(client_socket, "127.0.0.1", "1244");
+   for(total = 0; total < IMPAIRED_TCP_BYTES; total += IMPAIRED_TCP_CHUNK)
+   {
+      ryannet_socket_tcp_send(client_socket, buffer, IMPAIRED_TCP_CHUNK);
+   }
+   ryannet_socket_tcp_receive(client_socket, buffer, 1);
+   ryannet_socket_tcp_destroy(client_socket);
+   bench_impaired_tcp_time = bench_time_ns() - start;
+   BENCH_THREAD_RETURN;
+}
+
+static void bench_impaired_tcp(void)
+{
+   struct ryannet_socket_tcp * server_socket;
+   struct ryannet_impaired_proxy * proxy;
+   struct ryannet_impairment impairment;
+   bench_thread server_thread, client_thread;
+
+   server_socket = ryannet_socket_tcp_new();
+   if(ryannet_socket_tcp_bind(server_socket, "127.0.0.1", "1245") != 0)
+   {
+      ryannet_socket_tcp_destroy(server_socket);
+      return;
+   }
+   ryannet_impairment_init(&impairment);
+   impairment.latency_ms = 75;
+   impairment.bytes_per_second = 4 * 1024 * 1024;
+   proxy = ryannet_impaired_proxy_new("127.0.0.1", "1244", "127.0.0.1", "1245", &impairment);
+   if(proxy == NULL)
+   {
+      ryannet_socket_tcp_destroy(server_socket);
+      return;
+   }
+
+   bench_impaired_tcp_time = 0;
+   server_thread = bench_thread_start(bench_impaired_tcp_server, server_socket);
+   client_thread = bench_thread_start(bench_impaired_tcp_client, NULL);
+   while(bench_impaired_tcp_time == 0)
+   {
+      ryannet_impaired_proxy_pump(proxy);
+   }
+   bench_thread_join(client_thread);
+   bench_thread_join(server_thread);
+   printf("%-28s %d KB in %.0f ms, %.2f MB/s over a 4 MB/s link\n", "tcp 150ms rtt proxy",
+          IMPAIRED_TCP_BYTES / 1024, bench_impaired_tcp_time / 1000000.0,
+          IMPAIRED_TCP_BYTES / (bench_impaired_tcp_time / 1000000000.0) / (1024.0 * 1024.0));
+
+   ryannet_impaired_proxy_destroy(proxy);
+   ryannet_socket_tcp_destroy(server_socket);
+}
+
+#define REPLAY_PEERS 8
+#define REPLAY_PACKETS 2000
+#define REPLAY_FANOUT 4
+
+static BENCH_THREAD_FUNCTION(bench_replay_echo)
+{
+   struct ryannet_address * source;
+   char buffer[MESSAGE_SIZE];
+   int size;
+
+   source = ryannet_address_new();
+   while((size = ryannet_socket_udp_receive(arg, buffer, MESSAGE_SIZE, source)) > 0)
+   {
+      if(size == 4 && memcmp(buffer, "stop", 4) == 0)
+      {
+         break;
+      }
+      ryannet_socket_udp_send(arg, source, buffer, size);
+   }
+   ryannet_address_destroy(source);
+   BENCH_THREAD_RETURN;
+}
+
+static void bench_replay(void)
+{
+   struct ryannet_socket_udp * server_socket, * clients[REPLAY_PEERS];
+   struct ryannet_address * server_address, * source;
+   struct ryannet_recorder * recorder;
+   struct ryannet_replay * replay;
+   struct ryannet_replay_stats stats;
+   bench_thread server_thread;
+   char buffer[MESSAGE_SIZE];
+   long long start, elapsed;
+   int i, k;
+
+   // Record a server taking traffic from a handful of peers
+   server_socket = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(server_socket, "127.0.0.1", "1246");
+   recorder = ryannet_recorder_new("ryannet_bench.cap", 0);
+   if(recorder == NULL)
+   {
+      ryannet_socket_udp_destroy(server_socket);
+      return;
+   }
+   ryannet_socket_udp_set_recorder(server_socket, recorder);
+   server_address = ryannet_address_new();
+   ryannet_address_set(server_address, "127.0.0.1", "1246");
+   source = ryannet_address_new();
+   for(i = 0; i < REPLAY_PEERS; i++)
+   {
+      clients[i] = ryannet_socket_udp_new();
+   }
+   memset(buffer, 'x', MESSAGE_SIZE);
+   elapsed = 0;
+   for(k = 0; k < REPLAY_PACKETS; k++)
+   {
+      for(i = 0; i < REPLAY_PEERS; i++)
+      {
+         ryannet_socket_udp_send(clients[i], server_address, buffer, MESSAGE_SIZE);
+         start = bench_time_ns();
+         ryannet_socket_udp_receive(server_socket, buffer, MESSAGE_SIZE, source);
+         elapsed += bench_time_ns() - start;
+      }
+   }
+   printf("%-28s %llu packets, %.2f us per recorded receive\n", "udp record",
+          ryannet_recorder_get_count(recorder), elapsed / 1000.0 / (REPLAY_PEERS * REPLAY_PACKETS));
+   for(i = 0; i < REPLAY_PEERS; i++)
+   {
+      ryannet_socket_udp_destroy(clients[i]);
+   }
+   ryannet_recorder_destroy(recorder);
+   ryannet_socket_udp_destroy(server_socket);
+
+   // Play it back flat out into an echo server
+   server_socket = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(server_socket, "127.0.0.1", "1247");
+   server_thread = bench_thread_start(bench_replay_echo, server_socket);
+   replay = ryannet_replay_new("ryannet_bench.cap");
+   ryannet_replay_run(replay, "127.0.0.1", "1247", 0, 0.0, REPLAY_FANOUT, &stats);
+   printf("%-28s %d clients, %.0f packets/s, %llu of %llu echoed\n", "udp replay flat out", stats.clients,
+          stats.packets_sent / (stats.elapsed_ns / 1000000000.0), stats.packets_received, stats.packets_sent);
+   printf("%-28s p50 %8.2f us  p99 %8.2f us\n", "udp replay response",
+          ryannet_histogram_get_percentile(&stats.response, 50.0) / 1000.0,
+          ryannet_histogram_get_percentile(&stats.response, 99.0) / 1000.0);
+   ryannet_address_set(server_address, "127.0.0.1", "1247");
+   ryannet_socket_udp_send(server_socket, server_address, "stop", 4);
+   bench_thread_join(server_thread);
+
+   ryannet_replay_destroy(replay);
+   remove("ryannet_bench.cap");
+   ryannet_address_destroy(server_address);
+   ryannet_address_destroy(source);
+   ryannet_socket_udp_destroy(server_socket);
+}
+
+static void bench_wait_readable(struct ryannet_socket_tcp * socket, int timeout_ms)
+{
+#ifdef _WIN32
+   WSAPOLLFD fds;
+   fds.fd = (SOCKET)ryannet_socket_tcp_get_handle(socket);
+   fds.events = POLLRDNORM;
+   (void)WSAPoll(&fds, 1, timeout_ms);
+#else // _WIN32
+   struct pollfd fds;
+   fds.fd = ryannet_socket_tcp_get_handle(socket);
+   fds.events = POLLIN;
+   (void)poll(&fds, 1, timeout_ms);
+#endif // _WIN32
+}
+
+// Stream 1 carries records, a 'b' and 16KB less one of asset or a 'p' and
+// an 8 byte ping. Pings go on stream 1 behind the asset to show plain
+// FIFO, or on stream 2 on their own.
+#define MUX_PINGS 2000
+#define MUX_BULK_RECORD 16384
+#define MUX_BULK_BACKLOG (4 * MUX_BULK_RECORD)
+static volatile long long bench_mux_bulk_bytes;
+
+static BENCH_THREAD_FUNCTION(bench_mux_server)
+{
+   struct ryannet_socket_tcp * con;
+   struct ryannet_mux * mux;
+   char buffer[MUX_BULK_RECORD], ping[8];
+   int size, offset, record_left, ping_used, piece, running;
+   long long bulk_bytes;
+
+   con = ryannet_socket_tcp_accept(arg);
+   mux = ryannet_mux_new(con);
+   record_left = 0;
+   ping_used = -1;
+   bulk_bytes = 0;
+   running = 1;
+   while(running && ryannet_mux_pump(mux) != -1)
+   {
+      while((size = ryannet_mux_receive(mux, 1, buffer, MUX_BULK_RECORD)) > 0)
+      {
+         for(offset = 0; offset < size; offset += piece)
+         {
+            if(record_left == 0)
+            {
+               ping_used = buffer[offset] == 'p' ? 0 : -1;
+               record_left = buffer[offset] == 'p' ? 8 : MUX_BULK_RECORD - 1;
+               piece = 1;
+               continue;
+            }
+            piece = size - offset < record_left ? size - offset : record_left;
+            if(ping_used >= 0)
+            {
+               memcpy(ping + ping_used, buffer + offset, (size_t)piece);
+               ping_used += piece;
+               if(ping_used == 8)
+               {
+                  ryannet_mux_send(mux, 2, ping, 8);
+               }
+            }
+            else
+            {
+               bulk_bytes += piece;
+            }
+            record_left -= piece;
+         }
+      }
+      while(ryannet_mux_receive(mux, 2, ping, 8) == 8)
+      {
+         ryannet_mux_send(mux, 2, ping, 8);
+      }
+      if(ryannet_mux_receive(mux, 3, ping, 8) > 0)
+      {
+         running = 0;
+      }
+      ryannet_mux_flush(mux);
+      bench_wait_readable(con, 1);
+   }
+   bench_mux_bulk_bytes = bulk_bytes;
+   ryannet_mux_destroy(mux);
+   ryannet_socket_tcp_destroy(con);
+   BENCH_THREAD_RETURN;
+}
+
+static void bench_mux(const char * name, const char * port, int ping_stream, int ping_priority)
+{
+   struct ryannet_socket_tcp * server_socket, * client_socket;
+   struct ryannet_mux * mux;
+   bench_thread thread;
+   char * bulk, ping[9];
+   long long * samples;
+   long long start, now, last_ping, sent_at;
+   int sent, received;
+
+   server_socket = ryannet_socket_tcp_new();
+   if(ryannet_socket_tcp_bind(server_socket, "127.0.0.1", port) != 0)
+   {
+      ryannet_socket_tcp_destroy(server_socket);
+      return;
+   }
+   thread = bench_thread_start(bench_mux_server, server_socket);
+   client_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_connect(client_socket, "127.0.0.1", port);
+   mux = ryannet_mux_new(client_socket);
+   ryannet_mux_open_stream(mux, 1, 0, 1);
+   ryannet_mux_open_stream(mux, 2, ping_priority, 1);
+
+   bulk = malloc(MUX_BULK_RECORD);
+   memset(bulk, 'x', MUX_BULK_RECORD);
+   bulk[0] = 'b';
+   ping[0] = 'p';
+   samples = malloc(sizeof(long long) * MUX_PINGS);
+   sent = 0;
+   received = 0;
+   start = bench_time_ns();
+   last_ping = start;
+   while(received < MUX_PINGS)
+   {
+      // Keep the asset stream backed up the whole time
+      while(ryannet_mux_get_queued_bytes(mux, 1) < MUX_BULK_BACKLOG)
+      {
+         ryannet_mux_send(mux, 1, bulk, MUX_BULK_RECORD);
+      }
+      now = bench_time_ns();
+      if(sent < MUX_PINGS && sent == received && now - last_ping >= 1000000)
+      {
+         memcpy(ping + 1, &now, 8);
+         if(ping_stream == 1)
+         {
+            ryannet_mux_send(mux, 1, ping, 9);
+         }
+         else
+         {
+            ryannet_mux_send(mux, 2, ping + 1, 8);
+         }
+         sent ++;
+         last_ping = now;
+      }
+      ryannet_mux_flush(mux);
+      bench_wait_readable(client_socket, 1);
+      if(ryannet_mux_pump(mux) == -1)
+      {
+         break;
+      }
+      while(ryannet_mux_receive(mux, 2, &sent_at, 8) == 8)
+      {
+         samples[received] = bench_time_ns() - sent_at;
+         received ++;
+      }
+   }
+   ryannet_mux_send(mux, 3, "stop", 4);
+   ryannet_mux_flush(mux);
+   // The server hangs up with asset data still in flight, so stop on a reset
+   while(!ryannet_socket_tcp_queue_is_empty(client_socket) && ryannet_mux_flush(mux) != -1)
+   {
+   }
+   bench_thread_join(thread);
+   now = bench_time_ns();
+   bench_report(name, samples, received);
+   printf("%-28s asset stream %.1f MB/s alongside\n", "",
+          bench_mux_bulk_bytes / ((now - start) / 1000000000.0) / (1024.0 * 1024.0));
+
+   free(samples);
+   free(bulk);
+   ryannet_mux_destroy(mux);
+   ryannet_socket_tcp_destroy(client_socket);
+   ryannet_socket_tcp_destroy(server_socket);
+}
+
+#define FASTOPEN_CONNECTS 2000
+
+static BENCH_THREAD_FUNCTION(bench_fastopen_server)
+{
+   struct ryannet_socket_tcp * con;
+   char buffer[MESSAGE_SIZE];
+   int i;
+
+   for(i = 0; i < FASTOPEN_CONNECTS; i++)
+   {
+      con = ryannet_socket_tcp_accept(arg);
+      if(con == NULL)
+      {
+         break;
+      }
+      if(bench_receive_all(con, buffer, MESSAGE_SIZE) == 0)
+      {
+         ryannet_socket_tcp_send(con, buffer, MESSAGE_SIZE);
+      }
+      ryannet_socket_tcp_destroy(con);
+   }
+   BENCH_THREAD_RETURN;
+}
+
+// Connect, send a login and wait for the reply, once per connection
+static void bench_fastopen(const char * name, const char * port, int fastopen_flag)
+{
+   struct ryannet_socket_tcp * server_socket, * client_socket;
+   bench_thread thread;
+   char buffer[MESSAGE_SIZE];
+   long long * samples;
+   long long start;
+   int i, rv;
+
+   server_socket = ryannet_socket_tcp_new();
+   if(fastopen_flag && ryannet_socket_tcp_enable_fastopen(server_socket) != 0)
+   {
+      printf("%-28s not available\n", name);
+      ryannet_socket_tcp_destroy(server_socket);
+      return;
+   }
+   if(ryannet_socket_tcp_bind(server_socket, "127.0.0.1", port) != 0)
+   {
+      ryannet_socket_tcp_destroy(server_socket);
+      return;
+   }
+   thread = bench_thread_start(bench_fastopen_server, server_socket);
+
+   samples = malloc(sizeof(long long) * FASTOPEN_CONNECTS);
+   memset(buffer, 'x', MESSAGE_SIZE);
+   for(i = 0; i < FASTOPEN_CONNECTS; i++)
+   {
+      start = bench_time_ns();
+      client_socket = ryannet_socket_tcp_new();
+      if(fastopen_flag)
+      {
+         ryannet_socket_tcp_enable_fastopen(client_socket);
+         rv = ryannet_socket_tcp_connect_with_data(client_socket, "127.0.0.1", port, buffer, MESSAGE_SIZE);
+      }
+      else
+      {
+         rv = ryannet_socket_tcp_connect(client_socket, "127.0.0.1", port) == 0 ?
+              ryannet_socket_tcp_send(client_socket, buffer, MESSAGE_SIZE) : -1;
+      }
+      if(rv != MESSAGE_SIZE || bench_receive_all(client_socket, buffer, MESSAGE_SIZE) != 0)
+      {
+         ryannet_socket_tcp_destroy(client_socket);
+         break;
+      }
+      samples[i] = bench_time_ns() - start;
+      ryannet_socket_tcp_destroy(client_socket);
+   }
+   bench_report(name, samples, i);
+
+   free(samples);
+   bench_thread_join(thread);
+   ryannet_socket_tcp_destroy(server_socket);
+}
+
+// Game traffic, json-ish state updates where only the numbers change
+static int bench_game_message(char * out, int size, int index)
+{
+   int used, rv;
+   used = 0;
+   while(used < size)
+   {
+      rv = snprintf(out + used, (size_t)(size - used + 1), "{\"type\":\"move\",\"player\":%d,\"x\":%d,\"y\":%d,\"health\":%d}",
+                    index % 64, (index * 37) % 2048, (index * 91) % 2048, 100 - index % 100);
+      used += rv;
+      index ++;
+   }
+   return size;
+}
+
+#define COMPRESS_BYTES (16 * 1024 * 1024)
+static void bench_compress(const char * name, int message_size, int connection_messages, int dictionary_flag, int random_flag)
+{
+   struct ryannet_compressor * compressor;
+   struct ryannet_decompressor * decompressor;
+   char dictionary[4096];
+   char * messages, * encoded, * decoded;
+   int * sizes;
+   long long start, compress_time, decompress_time, total_in, total_out;
+   int count, dictionary_size, i, j;
+
+   // Build the input up front so only the codec is timed
+   count = COMPRESS_BYTES / message_size;
+   messages = malloc((size_t)count * (size_t)message_size + 1);
+   encoded = malloc((size_t)count * (size_t)RYANNET_COMPRESS_BOUND(message_size));
+   decoded = malloc((size_t)message_size);
+   sizes = malloc(sizeof(int) * (size_t)count);
+   srand(7);
+   for(i = 0; i < count; i++)
+   {
+      if(random_flag)
+      {
+         for(j = 0; j < message_size; j++)
+         {
+            messages[i * message_size + j] = (char)rand();
+         }
+      }
+      else
+      {
+         bench_game_message(messages + i * message_size, message_size, rand());
+      }
+   }
+   dictionary_size = 0;
+   if(dictionary_flag)
+   {
+      dictionary_size = bench_game_message(dictionary, sizeof(dictionary) - 1, 1000);
+   }
+
+   compressor = ryannet_compressor_new(dictionary, dictionary_size);
+   decompressor = ryannet_decompressor_new(dictionary, dictionary_size);
+   total_out = 0;
+   start = bench_time_ns();
+   for(i = 0; i < count; i++)
+   {
+      // A fresh connection starts over from just the dictionary
+      if(connection_messages > 0 && i > 0 && i % connection_messages == 0)
+      {
+         ryannet_compressor_destroy(compressor);
+         compressor = ryannet_compressor_new(dictionary, dictionary_size);
+      }
+      sizes[i] = ryannet_compressor_compress(compressor, messages + i * message_size, message_size,
+                                             encoded + total_out, RYANNET_COMPRESS_BOUND(message_size));
+      total_out += sizes[i];
+   }
+   compress_time = bench_time_ns() - start;
+   total_out = 0;
+   start = bench_time_ns();
+   for(i = 0; i < count; i++)
+   {
+      if(connection_messages > 0 && i > 0 && i % connection_messages == 0)
+      {
+         ryannet_decompressor_destroy(decompressor);
+         decompressor = ryannet_decompressor_new(dictionary, dictionary_size);
+      }
+      ryannet_decompressor_decompress(decompressor, encoded + total_out, sizes[i], decoded, message_size);
+      total_out += sizes[i];
+   }
+   decompress_time = bench_time_ns() - start;
+   total_in = (long long)count * message_size;
+
+   printf("%-22s %5d bytes  ratio %5.3f  compress %7.1f MB/s  decompress %7.1f MB/s  %6.0f ns and %6.1f bytes saved per message\n",
+          name, message_size, (double)total_out / (double)total_in,
+          (double)total_in / 1048576.0 / ((double)compress_time / 1e9),
+          (double)total_in / 1048576.0 / ((double)decompress_time / 1e9),
+          (double)(compress_time + decompress_time) / count,
+          (double)(total_in - total_out) / count);
+
+   ryannet_compressor_destroy(compressor);
+   ryannet_decompressor_destroy(decompressor);
+   free(messages);
+   free(encoded);
+   free(decoded);
+   free(sizes);
+}
+
+int main(int argc, char * args[])
+{
+   (void)argc;
+   (void)args;
+   (void)ryannet_init();
+#ifndef _WIN32
+   // Some benches hang up with data still in flight
+   signal(SIGPIPE, SIG_IGN);
+#endif // _WIN32
+
+   printf("Round trip latency, %d byte messages\n", MESSAGE_SIZE);
+   bench_round_trip("loopback tcp", "127.0.0.1", "127.0.0.1", "1240");
+   bench_round_trip("shared memory", "shm:ryannet_bench", "shm:ryannet_bench", NULL);
+
+   printf("\nSnapshot delta encoding per tick\n");
+   bench_delta(0);
+   bench_delta(10);
+   bench_delta(100);
+
+   printf("\nChaCha20-Poly1305 secure datagrams\n");
+   bench_secure(64);
+   bench_secure(512);
+   bench_secure(1200);
+
+   printf("\nHandshake flood filtering\n");
+   bench_cookie();
+
+   printf("\nImpaired links\n");
+   bench_impaired_udp();
+   bench_impaired_tcp();
+
+   printf("\nCapture and replay\n");
+   bench_replay();
+
+   printf("\nPing under asset download, one tcp connection\n");
+   bench_mux("fifo behind asset", "1256", 1, 0);
+   bench_mux("mux stream equal priority", "1257", 2, 0);
+   bench_mux("mux stream high priority", "1258", 2, 10);
+
+   printf("\nTime to first response on a new connection\n");
+   bench_fastopen("connect then send", "1260", 0);
+   bench_fastopen("fast open", "1261", 1);
+
+   printf("\nStreaming compression\n");
+   bench_compress("game messages", 32, 0, 0, 0);
+   bench_compress("game messages", 128, 0, 0, 0);
+   bench_compress("game messages", 512, 0, 0, 0);
+   bench_compress("game messages", 4096, 0, 0, 0);
+   bench_compress("game messages", 65536, 0, 0, 0);
+   bench_compress("16 per connection", 32, 16, 0, 0);
+   bench_compress("16 per connection dict", 32, 16, 1, 0);
+   bench_compress("16 per connection", 128, 16, 0, 0);
+   bench_compress("16 per connection dict", 128, 16, 1, 0);
+   bench_compress("random bypass", 128, 0, 0, 1);
+   bench_compress("random bypass", 65536, 0, 0, 1);
+
+   ryannet_destroy();
+   return 0;
+}
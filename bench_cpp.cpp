@@ -0,0 +1,209 @@
+#include "ryannet.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Same round trips as bench.c, once through the C API and once through
+// ryannet.hpp, so any cost the wrapper adds shows up side by side.
+#define ROUND_TRIPS 20000
+#define MESSAGE_SIZE 64
+
+static long long bench_time_ns()
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void bench_report(const char * name, std::vector<long long> & samples)
+{
+   long long total;
+   std::size_t count;
+   count = samples.size();
+   if(count == 0)
+   {
+      std::printf("%-28s no samples\n", name);
+      return;
+   }
+   total = 0;
+   for(long long sample : samples)
+   {
+      total += sample;
+   }
+   std::sort(samples.begin(), samples.end());
+   std::printf("%-28s avg %8.2f us  p50 %8.2f us  p99 %8.2f us\n", name,
+               (double)total / count / 1000.0,
+               samples[count / 2] / 1000.0,
+               samples[(count * 99) / 100] / 1000.0);
+}
+
+static void bench_echo_server(ryannet_socket_tcp * server_socket)
+{
+   ryannet_socket_tcp * con;
+   char buffer[MESSAGE_SIZE];
+   int received, rv, i;
+
+   con = ryannet_socket_tcp_accept(server_socket);
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      for(received = 0; received < MESSAGE_SIZE; received += rv)
+      {
+         rv = ryannet_socket_tcp_receive(con, buffer + received, MESSAGE_SIZE - received);
+         if(rv <= 0)
+         {
+            ryannet_socket_tcp_destroy(con);
+            return;
+         }
+      }
+      ryannet_socket_tcp_send(con, buffer, MESSAGE_SIZE);
+   }
+   ryannet_socket_tcp_destroy(con);
+}
+
+static void bench_c_blocking(const char * port)
+{
+   ryannet_socket_tcp * server_socket, * client_socket;
+   std::vector<long long> samples;
+   char buffer[MESSAGE_SIZE];
+   long long start;
+   int received, rv, i;
+
+   server_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_bind(server_socket, "127.0.0.1", port);
+   std::thread server(bench_echo_server, server_socket);
+   client_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_connect(client_socket, "127.0.0.1", port);
+   samples.reserve(ROUND_TRIPS);
+   std::memset(buffer, 'x', MESSAGE_SIZE);
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      start = bench_time_ns();
+      ryannet_socket_tcp_send(client_socket, buffer, MESSAGE_SIZE);
+      for(received = 0, rv = 1; received < MESSAGE_SIZE && rv > 0; received += rv)
+      {
+         rv = ryannet_socket_tcp_receive(client_socket, buffer + received, MESSAGE_SIZE - received);
+      }
+      samples.push_back(bench_time_ns() - start);
+   }
+   bench_report("c api blocking", samples);
+   ryannet_socket_tcp_destroy(client_socket);
+   server.join();
+   ryannet_socket_tcp_destroy(server_socket);
+}
+
+static void bench_cpp_blocking(const char * port)
+{
+   std::vector<long long> samples;
+   char buffer[MESSAGE_SIZE];
+   long long start;
+   int received, rv, i;
+
+   ryannet::tcp_socket server_socket;
+   server_socket.bind("127.0.0.1", port);
+   std::thread server(bench_echo_server, server_socket.native());
+   ryannet::tcp_socket client_socket;
+   client_socket.connect("127.0.0.1", port);
+   samples.reserve(ROUND_TRIPS);
+   std::memset(buffer, 'x', MESSAGE_SIZE);
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      start = bench_time_ns();
+      client_socket.send(std::span(buffer));
+      for(received = 0, rv = 1; received < MESSAGE_SIZE && rv > 0; received += rv)
+      {
+         rv = client_socket.receive(std::span(buffer).subspan(received));
+      }
+      samples.push_back(bench_time_ns() - start);
+   }
+   bench_report("c++ wrapper blocking", samples);
+   server.join();
+}
+
+// What a hand written C event loop does: poll, then receive
+static void bench_c_poll(const char * port)
+{
+   ryannet_socket_tcp * server_socket, * client_socket;
+   std::vector<long long> samples;
+   char buffer[MESSAGE_SIZE];
+   struct pollfd fds;
+   long long start;
+   int received, rv, i;
+
+   server_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_bind(server_socket, "127.0.0.1", port);
+   std::thread server(bench_echo_server, server_socket);
+   client_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_connect(client_socket, "127.0.0.1", port);
+   samples.reserve(ROUND_TRIPS);
+   std::memset(buffer, 'x', MESSAGE_SIZE);
+   fds.fd = ryannet_socket_tcp_get_handle(client_socket);
+   fds.events = POLLIN;
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      start = bench_time_ns();
+      ryannet_socket_tcp_send(client_socket, buffer, MESSAGE_SIZE);
+      for(received = 0, rv = 1; received < MESSAGE_SIZE && rv > 0; received += rv)
+      {
+#ifdef _WIN32
+         (void)WSAPoll(&fds, 1, -1);
+#else // _WIN32
+         (void)poll(&fds, 1, -1);
+#endif // _WIN32
+         rv = ryannet_socket_tcp_receive(client_socket, buffer + received, MESSAGE_SIZE - received);
+      }
+      samples.push_back(bench_time_ns() - start);
+   }
+   bench_report("c api poll loop", samples);
+   ryannet_socket_tcp_destroy(client_socket);
+   server.join();
+   ryannet_socket_tcp_destroy(server_socket);
+}
+
+static ryannet::task<void> bench_cpp_client(ryannet::event_loop & loop, ryannet::tcp_socket & socket, std::vector<long long> & samples)
+{
+   char buffer[MESSAGE_SIZE];
+   long long start;
+   int received, rv, i;
+
+   std::memset(buffer, 'x', MESSAGE_SIZE);
+   for(i = 0; i < ROUND_TRIPS; i++)
+   {
+      start = bench_time_ns();
+      co_await loop.send(socket, std::span(buffer));
+      for(received = 0, rv = 1; received < MESSAGE_SIZE && rv > 0; received += rv)
+      {
+         rv = co_await loop.receive(socket, std::span(buffer).subspan(received));
+      }
+      samples.push_back(bench_time_ns() - start);
+   }
+}
+
+static void bench_cpp_coroutine(const char * port)
+{
+   std::vector<long long> samples;
+   ryannet::event_loop loop;
+
+   ryannet::tcp_socket server_socket;
+   server_socket.bind("127.0.0.1", port);
+   std::thread server(bench_echo_server, server_socket.native());
+   ryannet::tcp_socket client_socket;
+   client_socket.connect("127.0.0.1", port);
+   samples.reserve(ROUND_TRIPS);
+   loop.spawn(bench_cpp_client(loop, client_socket, samples));
+   loop.run();
+   bench_report("c++ coroutine loop", samples);
+   server.join();
+}
+
+int main()
+{
+   ryannet::library library;
+
+   std::printf("Round trip latency, %d byte messages\n", MESSAGE_SIZE);
+   bench_c_blocking("1250");
+   bench_cpp_blocking("1251");
+   bench_c_poll("1252");
+   bench_cpp_coroutine("1253");
+   return 0;
+}
@@ -1,14 +1,165 @@
 #include "ryannet.h"
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else // _WIN32
+#include <pthread.h>
+#include <poll.h>
+#endif // _WIN32
 
 #define PORT "1234"
+#define SNAPSHOT_SIZE 16000
+#define SEND_FILE_SIZE (16 * 1024 * 1024)
+#define QUEUE_PRODUCERS 4
+#define QUEUE_MESSAGES 1000
+#define TIMESTAMP_ROUNDS 40
+#define TIMESTAMP_ROUND_SENDS 50
+#define TIMESTAMP_ROUND_REPLIES 8
+
+// Each message is the producer's index then its sequence number
+struct queue_producer
+{
+   struct ryannet_socket_tcp * socket;
+   unsigned int index;
+};
+
+#ifdef _WIN32
+typedef HANDLE test_thread;
+#define TEST_THREAD_FUNCTION(name) DWORD WINAPI name(void * arg)
+#define TEST_THREAD_RETURN return 0
+#else // _WIN32
+typedef pthread_t test_thread;
+#define TEST_THREAD_FUNCTION(name) void * name(void * arg)
+#define TEST_THREAD_RETURN return NULL
+#endif // _WIN32
+
+static TEST_THREAD_FUNCTION(queue_producer_run)
+{
+   struct queue_producer * producer;
+   unsigned int record[2];
+   producer = arg;
+   record[0] = producer->index;
+   for(record[1] = 0; record[1] < QUEUE_MESSAGES; record[1]++)
+   {
+      ryannet_socket_tcp_enqueue(producer->socket, record, sizeof(record));
+   }
+   ryannet_buffer_thread_release();
+   TEST_THREAD_RETURN;
+}
+
+static int test_hex(unsigned char * out, const char * hex)
+{
+   unsigned int byte;
+   int i;
+   for(i = 0; hex[i * 2] != '\0'; i++)
+   {
+      sscanf(hex + i * 2, "%2x", &byte);
+      out[i] = (unsigned char)byte;
+   }
+   return i;
+}
+
+static test_thread test_thread_start(struct queue_producer * producer)
+{
+#ifdef _WIN32
+   return CreateThread(NULL, 0, queue_producer_run, producer, 0, NULL);
+#else // _WIN32
+   pthread_t thread;
+   pthread_create(&thread, NULL, queue_producer_run, producer);
+   return thread;
+#endif // _WIN32
+}
+
+// Raw mux frame with a one byte payload, or four bytes of credit for windows
+static int test_mux_frame(unsigned char * out, int type, unsigned int stream_id)
+{
+   int length;
+   length = type == 1 ? 4 : 1;
+   memset(out, 0, 8 + length);
+   out[0] = (unsigned char)length;
+   out[2] = (unsigned char)type;
+   out[4] = (unsigned char)stream_id;
+   out[5] = (unsigned char)(stream_id >> 8);
+   out[8] = 1;
+   return 8 + length;
+}
+
+static void test_sleep_ms(int milliseconds)
+{
+#ifdef _WIN32
+   Sleep(milliseconds);
+#else // _WIN32
+   (void)poll(NULL, 0, milliseconds);
+#endif // _WIN32
+}
+
+static void test_thread_join(test_thread thread)
+{
+#ifdef _WIN32
+   WaitForSingleObject(thread, INFINITE);
+   CloseHandle(thread);
+#else // _WIN32
+   pthread_join(thread, NULL);
+#endif // _WIN32
+}
+
 int main(int argc, char * args[])
 {
    struct ryannet_socket_tcp * client_socket, * server_socket, * con;
-   struct ryannet_address * addy;
+   struct ryannet_socket_udp * udp_server, * udp_client;
+   struct ryannet_address * addy, * source;
+   struct ryannet_group * group;
+   struct ryannet_message * message;
+   struct ryannet_buffer_stats stats;
+   void * pool_buffer;
+   struct ryannet_secure_session * server_session, * client_session;
+   char sealed[255];
+   struct ryannet_cookie_guard * guard;
+   unsigned char cookie[RYANNET_COOKIE_SIZE];
+   struct ryannet_pacer * pacer;
+   struct ryannet_histogram * histogram;
+   long long kernel_ns;
+   struct ryannet_impairment impairment;
+   struct ryannet_impairment_stats impairment_stats;
+   struct ryannet_impaired_udp * impaired;
+   struct ryannet_impaired_proxy * proxy;
+   struct ryannet_socket_tcp * proxy_client, * proxy_server, * proxy_con;
+   struct ryannet_recorder * recorder;
+   struct ryannet_replay * replay;
+   struct ryannet_replay_stats replay_stats;
+   struct ryannet_mux * client_mux, * server_mux;
+   unsigned char mux_frames[(RYANNET_MUX_MAX_PEER_STREAMS + 1) * 9];
+   int mux_window, mux_credit, mux_type, mux_streams, mux_stream;
+   struct ryannet_compressor * compressor;
+   struct ryannet_decompressor * decompressor;
+   static const char dictionary[] = "{\"type\":\"move\",\"player\":0,\"x\":0,\"y\":0}";
+   unsigned char compressed[RYANNET_COMPRESS_BOUND(255)];
+   char * bulk;
+   int sent;
+   struct ryannet_bitwriter writer;
+   struct ryannet_bitreader reader;
+   unsigned int bits;
+   unsigned long long varint;
+   float quantized;
+   static unsigned char baseline[SNAPSHOT_SIZE], snapshot[SNAPSHOT_SIZE], delta[SNAPSHOT_SIZE];
+   int i;
    char buffer[255];
    int size;
    int rv;
+   FILE * file;
+   long long offset, file_bytes;
+   struct queue_producer producers[QUEUE_PRODUCERS];
+   test_thread threads[QUEUE_PRODUCERS];
+   static unsigned int queued_records[QUEUE_PRODUCERS * QUEUE_MESSAGES * 2];
+   unsigned int next_sequence[QUEUE_PRODUCERS];
+   int received, in_order, wake;
+   unsigned char kat_key[32], kat_nonce[12], kat_additional[12], kat_point[32], kat_out[32];
+   unsigned char kat_expected[130], kat_sealed[130], kat_opened[114];
+   static const char kat_plain[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+   int kat_seal, kat_open, kat_forged, kat_x25519[3];
    
    (void)ryannet_init();
    
@@ -36,10 +187,705 @@ int main(int argc, char * args[])
    printf("Local ( %s : %s)\n", ryannet_address_get_address(addy), ryannet_address_get_port(addy));
    
    
+   // Send File
+   file = tmpfile();
+   fputs("Sent straight from a file", file);
+   fflush(file);
+   offset = 0;
+   file_bytes = ryannet_socket_tcp_send_file(con, fileno(file), &offset, 26);
+   fclose(file);
+   size = ryannet_socket_tcp_receive(client_socket, buffer, 254);
+   buffer[size > 0 ? size : 0] = '\0';
+   printf("Send File %lld (offset %lld), Message Length %d, Message: %s\n", file_bytes, offset, size, buffer);
+
+   // A file bigger than both socket buffers, the first nonblocking call has
+   // to stop partway and the rest goes out as the client reads
+   file = tmpfile();
+   for(i = 0; i < SEND_FILE_SIZE; i++)
+   {
+      fputc((i * 7) & 255, file);
+   }
+   fflush(file);
+   offset = 0;
+   file_bytes = ryannet_socket_tcp_send_file_nonblock(con, fileno(file), &offset, SEND_FILE_SIZE);
+   in_order = file_bytes > 0 && file_bytes < SEND_FILE_SIZE;
+   printf("Send File Nonblock Stopped Partway %d", in_order);
+   received = 0;
+   in_order = 1;
+   while(received < SEND_FILE_SIZE && file_bytes >= 0)
+   {
+      if(offset < SEND_FILE_SIZE)
+      {
+         file_bytes = ryannet_socket_tcp_send_file_nonblock(con, fileno(file), &offset, SEND_FILE_SIZE - offset);
+      }
+      size = ryannet_socket_tcp_receive_nonblock(client_socket, buffer, 255);
+      if(size < 0)
+      {
+         break;
+      }
+      for(i = 0; i < size; i++)
+      {
+         in_order &= (unsigned char)buffer[i] == (unsigned char)(((received + i) * 7) & 255);
+      }
+      received += size;
+   }
+   fclose(file);
+   printf(", Received %d of %d, In Order %d\n", received, SEND_FILE_SIZE, in_order);
+   
+   // Queue from several threads, the owner flushes
+   wake = ryannet_socket_tcp_enable_queue_wake(con);
+   for(i = 0; i < QUEUE_PRODUCERS; i++)
+   {
+      producers[i].socket = con;
+      producers[i].index = (unsigned int)i;
+      next_sequence[i] = 0;
+      threads[i] = test_thread_start(&producers[i]);
+   }
+   received = 0;
+   while(received < (int)sizeof(queued_records))
+   {
+#ifndef _WIN32
+      if(wake == 0)
+      {
+         // Sleep until a producer has something
+         struct pollfd fds;
+         fds.fd = ryannet_socket_tcp_get_queue_wake_handle(con);
+         fds.events = POLLIN;
+         (void)poll(&fds, 1, 10);
+      }
+#endif // _WIN32
+      if(ryannet_socket_tcp_flush_nonblock(con) == -1)
+      {
+         break;
+      }
+      size = ryannet_socket_tcp_receive_nonblock(client_socket, (char *)queued_records + received, (int)sizeof(queued_records) - received);
+      if(size < 0)
+      {
+         break;
+      }
+      received += size;
+   }
+   for(i = 0; i < QUEUE_PRODUCERS; i++)
+   {
+      test_thread_join(threads[i]);
+   }
+   in_order = 1;
+   for(i = 0; i < received / (int)sizeof(unsigned int) / 2; i++)
+   {
+      if(queued_records[i * 2] >= QUEUE_PRODUCERS ||
+         queued_records[i * 2 + 1] != next_sequence[queued_records[i * 2]]++)
+      {
+         in_order = 0;
+      }
+   }
+   printf("Queue Wake %d, %d Producers Sent %d bytes of %d, In Order %d\n", wake, QUEUE_PRODUCERS,
+          received, (int)sizeof(queued_records), in_order);
+
+   // Broadcast
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_server, NULL, "1235");
+   udp_client = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_client, "127.0.0.1", "1236");
+   addy = ryannet_address_new();
+   ryannet_address_set(addy, "127.0.0.1", "1236");
+   group = ryannet_group_new();
+   ryannet_group_add_tcp(group, con);
+   ryannet_group_add_udp(group, udp_server, addy);
+   message = ryannet_message_new("World State", 12);
+   rv = ryannet_group_send(group, message);
+   ryannet_message_release(message);
+   // TCP members are only queued, the owner sends
+   ryannet_socket_tcp_flush_nonblock(con);
+   size = ryannet_socket_tcp_receive(client_socket, buffer, 255);
+   printf("Broadcast %d, TCP Message Length %d, Message: %s\n", rv, size, buffer);
+   pool_buffer = ryannet_socket_udp_receive_buffer(udp_client, 1500, addy, &size);
+   printf("Broadcast %d, UDP Message Length %d, Message: %s\n", rv, size, (char *)pool_buffer);
+   ryannet_buffer_free(pool_buffer);
+   for(i = 0; i < ryannet_buffer_get_class_count(); i++)
+   {
+      ryannet_buffer_get_stats(i, &stats);
+      if(stats.allocations > 0)
+      {
+         printf("Buffer Pool %d: %llu of %llu free, %llu allocations, %llu releases\n", stats.block_size, 
+                stats.blocks_free, stats.blocks_total, stats.allocations, stats.releases);
+      }
+   }
+   ryannet_group_destroy(group);
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_client);
+   ryannet_socket_udp_destroy(udp_server);
+
    ryannet_socket_tcp_destroy(con);
    ryannet_socket_tcp_destroy(server_socket);
    ryannet_socket_tcp_destroy(client_socket);
 
+   // Shared Memory
+   server_socket = ryannet_socket_tcp_new();
+   rv = ryannet_socket_tcp_bind(server_socket, "shm:ryannet_test", NULL);
+   client_socket = ryannet_socket_tcp_new();
+   rv |= ryannet_socket_tcp_connect(client_socket, "shm:ryannet_test", NULL);
+   con = ryannet_socket_tcp_accept(server_socket);
+   if(rv == 0 && con != NULL)
+   {
+      size = sprintf(buffer, "Hey, Whazzup!") + 1;
+      ryannet_socket_tcp_send(con, buffer, size);
+      sprintf(buffer, "This is not the message you want");
+      size = ryannet_socket_tcp_receive(client_socket, buffer, 255);
+      printf("Shared Memory Message Length %d, Message: %s\n", size, buffer);
+      addy = ryannet_socket_tcp_get_address_remote(client_socket);
+      printf("Remote ( %s )\n", ryannet_address_get_address(addy));
+      ryannet_socket_tcp_destroy(con);
+      size = ryannet_socket_tcp_receive(client_socket, buffer, 255);
+      printf("Shared Memory After Close %d, Connected %d\n", size, ryannet_socket_tcp_is_connected(client_socket));
+   }
+   ryannet_socket_tcp_destroy(server_socket);
+   ryannet_socket_tcp_destroy(client_socket);
+
+   // Unix Sockets
+   server_socket = ryannet_socket_tcp_new();
+   rv = ryannet_socket_tcp_bind(server_socket, "unixpacket:@ryannet_test", NULL);
+   client_socket = ryannet_socket_tcp_new();
+   rv |= ryannet_socket_tcp_connect(client_socket, "unixpacket:@ryannet_test", NULL);
+   con = ryannet_socket_tcp_accept(server_socket);
+   if(rv == 0 && con != NULL)
+   {
+      ryannet_socket_tcp_send(con, "One", 4);
+      ryannet_socket_tcp_send(con, "Two", 4);
+      size = ryannet_socket_tcp_receive(client_socket, buffer, 255);
+      printf("Seqpacket Message Length %d, Message: %s\n", size, buffer);
+      addy = ryannet_socket_tcp_get_address_remote(client_socket);
+      printf("Remote ( %s )\n", ryannet_address_get_address(addy));
+      ryannet_socket_tcp_destroy(con);
+   }
+   ryannet_socket_tcp_destroy(server_socket);
+   ryannet_socket_tcp_destroy(client_socket);
+
+   udp_client = ryannet_socket_udp_new();
+   rv = ryannet_socket_udp_bind(udp_client, "unix:/tmp/ryannet_test.sock", NULL);
+   udp_server = ryannet_socket_udp_new();
+   addy = ryannet_address_new();
+   rv |= ryannet_address_set(addy, "unix:/tmp/ryannet_test.sock", NULL);
+   if(rv == 0)
+   {
+      ryannet_socket_udp_send(udp_server, addy, "Datagram", 9);
+      size = ryannet_socket_udp_receive(udp_client, buffer, 255, addy);
+      printf("Unix Datagram Length %d, Message: %s\n", size, buffer);
+   }
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_server);
+   ryannet_socket_udp_destroy(udp_client);
+
+   // Known answers, RFC 8439 2.8.2
+   test_hex(kat_key, "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f");
+   test_hex(kat_nonce, "070000004041424344454647");
+   test_hex(kat_additional, "50515253c0c1c2c3c4c5c6c7");
+   test_hex(kat_expected, "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+                          "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+                          "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+                          "3ff4def08e4b7a9de576d26586cec64b6116"
+                          "1ae10b594f09e26a7e902ecbd0600691");
+   ryannet_crypto_aead_seal(kat_key, kat_nonce, kat_additional, 12, kat_plain, 114, kat_sealed);
+   kat_seal = memcmp(kat_sealed, kat_expected, 130) == 0;
+   kat_open = ryannet_crypto_aead_open(kat_key, kat_nonce, kat_additional, 12, kat_sealed, 130, kat_opened) == 0 &&
+              memcmp(kat_opened, kat_plain, 114) == 0;
+   kat_sealed[129] ^= 1;
+   kat_forged = ryannet_crypto_aead_open(kat_key, kat_nonce, kat_additional, 12, kat_sealed, 130, kat_opened) != 0;
+   printf("Known Answer ChaCha20-Poly1305 Seal %d, Open %d, Forgery Rejected %d\n", kat_seal, kat_open, kat_forged);
+
+   // RFC 7748 5.2, both vectors and one iteration from the base point
+   test_hex(kat_key, "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4");
+   test_hex(kat_point, "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c");
+   test_hex(kat_expected, "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+   ryannet_crypto_x25519(kat_out, kat_key, kat_point);
+   kat_x25519[0] = memcmp(kat_out, kat_expected, 32) == 0;
+   test_hex(kat_key, "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d");
+   test_hex(kat_point, "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493");
+   test_hex(kat_expected, "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957");
+   ryannet_crypto_x25519(kat_out, kat_key, kat_point);
+   kat_x25519[1] = memcmp(kat_out, kat_expected, 32) == 0;
+   memset(kat_key, 0, 32);
+   kat_key[0] = 9;
+   test_hex(kat_expected, "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079");
+   ryannet_crypto_x25519(kat_out, kat_key, kat_key);
+   kat_x25519[2] = memcmp(kat_out, kat_expected, 32) == 0;
+   printf("Known Answer X25519 %d %d, Iteration %d\n", kat_x25519[0], kat_x25519[1], kat_x25519[2]);
+
+   // RFC 7693 appendix B
+   test_hex(kat_expected, "508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982");
+   ryannet_crypto_blake2s(kat_out, NULL, 0, "abc", 3);
+   printf("Known Answer BLAKE2s %d\n", memcmp(kat_out, kat_expected, 32) == 0);
+
+   // Secure Datagrams
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_server, "127.0.0.1", "1237");
+   udp_client = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_client, "127.0.0.1", "1238");
+   addy = ryannet_address_new();
+   server_session = ryannet_secure_session_new(NULL);
+   client_session = ryannet_secure_session_new(NULL);
+   ryannet_address_set(addy, "127.0.0.1", "1237");
+   size = ryannet_secure_session_client_hello(client_session, buffer, 255);
+   ryannet_socket_udp_send(udp_client, addy, buffer, size);
+   size = ryannet_socket_udp_receive(udp_server, buffer, 255, addy);
+   size = ryannet_secure_session_server_accept(server_session, buffer, size, buffer, 255);
+   ryannet_socket_udp_send(udp_server, addy, buffer, size);
+   size = ryannet_socket_udp_receive(udp_client, buffer, 255, addy);
+   rv = ryannet_secure_session_client_finish(client_session, buffer, size);
+   ryannet_socket_udp_send_secure(udp_client, client_session, addy, "Secret", 7);
+   size = ryannet_socket_udp_receive(udp_server, buffer, 255, addy);
+   memcpy(sealed, buffer, (size_t)size);
+   size = ryannet_secure_session_open(server_session, sealed, size, buffer, 255);
+   printf("Secure Handshake %d, Message Length %d, Message: %s\n", rv, size, buffer);
+   size = ryannet_secure_session_open(server_session, sealed, 7 + RYANNET_SECURE_OVERHEAD, buffer, 255);
+   printf("Secure Replay %d\n", size);
+   ryannet_secure_session_destroy(server_session);
+   ryannet_secure_session_destroy(client_session);
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_client);
+   ryannet_socket_udp_destroy(udp_server);
+
+   // Cookies
+   guard = ryannet_cookie_guard_new(10, 3, 30);
+   addy = ryannet_address_new();
+   ryannet_address_set(addy, "127.0.0.1", "4000");
+   size = 0;
+   for(i = 0; i < 10; i++)
+   {
+      size += ryannet_cookie_guard_allow(guard, addy);
+   }
+   ryannet_cookie_guard_make(guard, addy, cookie);
+   rv = ryannet_cookie_guard_check(guard, addy, cookie);
+   printf("Cookie Allowed %d of 10, Check %d", size, rv);
+   ryannet_address_set(addy, "127.0.0.1", "4001");
+   printf(", Other Source Check %d\n", ryannet_cookie_guard_check(guard, addy, cookie));
+   ryannet_address_destroy(addy);
+   ryannet_cookie_guard_destroy(guard);
+
+   // Pacing
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_server, "127.0.0.1", "1239");
+   udp_client = ryannet_socket_udp_new();
+   addy = ryannet_address_new();
+   ryannet_address_set(addy, "127.0.0.1", "1239");
+   // Loopback has no fq qdisc, so this stays in userspace
+   printf("Txtime Without Fq %d\n", ryannet_socket_udp_enable_txtime(udp_client, 0));
+   pacer = ryannet_pacer_new(udp_client, addy, 20000, 128);
+   sprintf(buffer, "Snapshot A");
+   message = ryannet_message_new(buffer, 100);
+   ryannet_pacer_queue(pacer, message, 0);
+   ryannet_message_release(message);
+   sprintf(buffer, "Event");
+   message = ryannet_message_new(buffer, 100);
+   ryannet_pacer_queue(pacer, message, 5);
+   ryannet_message_release(message);
+   sprintf(buffer, "Snapshot B");
+   message = ryannet_message_new(buffer, 100);
+   ryannet_pacer_queue(pacer, message, 0);
+   ryannet_message_release(message);
+   ryannet_pacer_begin_tick(pacer, 250);
+   sent = 0;
+   while(ryannet_pacer_get_wait_us(pacer) >= 0)
+   {
+      sent += ryannet_pacer_flush(pacer);
+   }
+   printf("Paced %d, Left %d bytes:", sent, ryannet_pacer_get_queued_bytes(pacer));
+   for(i = 0; i < sent; i++)
+   {
+      ryannet_socket_udp_receive(udp_server, buffer, 255, addy);
+      printf(" %s", buffer);
+   }
+   printf(", Dropped %d\n", ryannet_pacer_drop(pacer, 1));
+   ryannet_pacer_destroy(pacer);
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_client);
+   ryannet_socket_udp_destroy(udp_server);
+
+   // Timestamps
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_enable_timestamps(udp_server);
+   ryannet_socket_udp_bind(udp_server, "127.0.0.1", "1241");
+   udp_client = ryannet_socket_udp_new();
+   rv = ryannet_socket_udp_enable_timestamps(udp_client);
+   addy = ryannet_address_new();
+   ryannet_address_set(addy, "127.0.0.1", "1241");
+   for(i = 0; i < 10; i++)
+   {
+      ryannet_socket_udp_send(udp_client, addy, "Tick", 5);
+   }
+   for(i = 0; i < 10; i++)
+   {
+      size = ryannet_socket_udp_receive_timestamped(udp_server, buffer, 255, addy, &kernel_ns);
+   }
+   printf("Timestamps %d, Last Stamped %d", rv, kernel_ns != 0);
+   if(rv == 0)
+   {
+      ryannet_socket_udp_collect_timestamps(udp_client);
+      histogram = ryannet_socket_udp_get_receive_delay(udp_server);
+      printf(", Receive Delays %llu", histogram->count);
+      histogram = ryannet_socket_udp_get_send_delay(udp_client);
+      printf(", Send Delays %llu", histogram->count);
+   }
+   printf("\n");
+   // A client that only blocks in receive between sends must not let send
+   // timestamps fill its buffer, or replies stop arriving
+   ryannet_address_set(addy, "127.0.0.1", "1241");
+   source = ryannet_address_new();
+   received = 0;
+   for(i = 0; i < TIMESTAMP_ROUNDS; i++)
+   {
+      for(size = 0; size < TIMESTAMP_ROUND_SENDS; size++)
+      {
+         ryannet_socket_udp_send(udp_client, addy, "Tick", 5);
+      }
+      while(ryannet_socket_udp_receive_nonblock(udp_server, buffer, 255, source) > 0)
+      {
+      }
+      // A full buffer still takes one datagram, so reply with a burst
+      for(size = 0; size < TIMESTAMP_ROUND_REPLIES; size++)
+      {
+         ryannet_socket_udp_send(udp_server, source, "Reply", 6);
+      }
+      for(size = 0; size < TIMESTAMP_ROUND_REPLIES; size++)
+      {
+         if(ryannet_socket_udp_receive(udp_client, buffer, 255, source) == 6)
+         {
+            received ++;
+         }
+      }
+   }
+   printf("Blocking Receives With Send Timestamps %d of %d\n", received, TIMESTAMP_ROUNDS * TIMESTAMP_ROUND_REPLIES);
+   ryannet_address_destroy(source);
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_client);
+   ryannet_socket_udp_destroy(udp_server);
+
+   // Impairment
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_server, "127.0.0.1", "1242");
+   udp_client = ryannet_socket_udp_new();
+   addy = ryannet_address_new();
+   ryannet_address_set(addy, "127.0.0.1", "1242");
+   ryannet_impairment_init(&impairment);
+   impairment.loss = 0.25;
+   impairment.duplicate = 0.1;
+   impairment.seed = 42;
+   impaired = ryannet_impaired_udp_new(udp_client, &impairment, NULL);
+   for(i = 0; i < 100; i++)
+   {
+      ryannet_impaired_udp_send(impaired, addy, "Lossy", 6);
+   }
+   ryannet_impaired_udp_pump(impaired);
+   size = 0;
+   while(ryannet_socket_udp_receive_nonblock(udp_server, buffer, 255, addy) > 0)
+   {
+      size ++;
+   }
+   ryannet_impaired_udp_get_stats(impaired, &impairment_stats, NULL);
+   printf("Impaired Sent 100, Dropped %llu, Duplicated %llu, Received %d\n",
+          impairment_stats.dropped, impairment_stats.duplicated, size);
+   ryannet_impaired_udp_destroy(impaired);
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_client);
+   ryannet_socket_udp_destroy(udp_server);
+
+   // Impaired TCP, the client half closes after its request and still gets
+   // the response
+   proxy_server = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_bind(proxy_server, "127.0.0.1", "1246");
+   ryannet_impairment_init(&impairment);
+   impairment.latency_ms = 5;
+   proxy = ryannet_impaired_proxy_new("127.0.0.1", "1243", "127.0.0.1", "1246", &impairment);
+   proxy_client = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_connect(proxy_client, "127.0.0.1", "1243");
+   ryannet_socket_tcp_send(proxy_client, "Request", 8);
+   ryannet_socket_tcp_shutdown(proxy_client);
+   proxy_con = NULL;
+   received = 0;
+   for(i = 0; i < 1000 && ryannet_socket_tcp_is_connected(proxy_client); i++)
+   {
+      ryannet_impaired_proxy_pump(proxy);
+      if(proxy_con == NULL)
+      {
+         proxy_con = ryannet_socket_tcp_accept_nonblock(proxy_server);
+      }
+      else if(ryannet_socket_tcp_is_connected(proxy_con))
+      {
+         size = ryannet_socket_tcp_receive_nonblock(proxy_con, buffer, 255);
+         if(!ryannet_socket_tcp_is_connected(proxy_con))
+         {
+            ryannet_socket_tcp_send(proxy_con, "Response", 9);
+            ryannet_socket_tcp_shutdown(proxy_con);
+         }
+      }
+      size = ryannet_socket_tcp_receive_nonblock(proxy_client, buffer + received, 255 - received);
+      if(size > 0)
+      {
+         received += size;
+      }
+      test_sleep_ms(1);
+   }
+   for(i = 0; i < 100 && ryannet_impaired_proxy_get_connection_count(proxy) > 0; i++)
+   {
+      ryannet_impaired_proxy_pump(proxy);
+      test_sleep_ms(1);
+   }
+   printf("Proxy Half Close Response %s, Connections Left %d\n", received == 9 ? buffer : "missing",
+          ryannet_impaired_proxy_get_connection_count(proxy));
+   ryannet_socket_tcp_destroy(proxy_client);
+   if(proxy_con != NULL)
+   {
+      ryannet_socket_tcp_destroy(proxy_con);
+   }
+   ryannet_impaired_proxy_destroy(proxy);
+   ryannet_socket_tcp_destroy(proxy_server);
+
+   // Capture and Replay
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_server, "127.0.0.1", "1248");
+   recorder = ryannet_recorder_new("ryannet_test.cap", 0);
+   ryannet_socket_udp_set_recorder(udp_server, recorder);
+   addy = ryannet_address_new();
+   ryannet_address_set(addy, "127.0.0.1", "1248");
+   for(i = 0; i < 3; i++)
+   {
+      udp_client = ryannet_socket_udp_new();
+      ryannet_socket_udp_send(udp_client, addy, "Capture", 8);
+      ryannet_socket_udp_send(udp_client, addy, "Capture", 8);
+      ryannet_socket_udp_destroy(udp_client);
+   }
+   while(ryannet_socket_udp_receive_nonblock(udp_server, buffer, 255, addy) > 0)
+   {
+   }
+   printf("Recorded %llu\n", ryannet_recorder_get_count(recorder));
+   ryannet_socket_udp_destroy(udp_server);
+   ryannet_recorder_destroy(recorder);
+
+   udp_server = ryannet_socket_udp_new();
+   ryannet_socket_udp_bind(udp_server, "127.0.0.1", "1249");
+   replay = ryannet_replay_new("ryannet_test.cap");
+   ryannet_replay_run(replay, "127.0.0.1", "1249", 0, 10.0, 2, &replay_stats);
+   size = 0;
+   while(ryannet_socket_udp_receive_nonblock(udp_server, buffer, 255, addy) > 0)
+   {
+      size ++;
+   }
+   printf("Replayed %llu from %d clients, Server Got %d\n", replay_stats.packets_sent, replay_stats.clients, size);
+   ryannet_replay_destroy(replay);
+   remove("ryannet_test.cap");
+   ryannet_address_destroy(addy);
+   ryannet_socket_udp_destroy(udp_server);
+
+   // Multiplexed Streams
+   server_socket = ryannet_socket_tcp_new();
+   rv = ryannet_socket_tcp_bind(server_socket, "127.0.0.1", "1255");
+   client_socket = ryannet_socket_tcp_new();
+   rv |= ryannet_socket_tcp_connect(client_socket, "127.0.0.1", "1255");
+   con = ryannet_socket_tcp_accept(server_socket);
+   if(rv == 0 && con != NULL)
+   {
+      client_mux = ryannet_mux_new(client_socket);
+      server_mux = ryannet_mux_new(con);
+      ryannet_mux_open_stream(client_mux, 1, 0, 1);
+      ryannet_mux_open_stream(client_mux, 2, 10, 1);
+      bulk = ryannet_buffer_alloc(100000);
+      memset(bulk, 'b', 100000);
+      // The asset goes in first but the move still goes out ahead of it
+      ryannet_mux_send(client_mux, 1, bulk, 100000);
+      ryannet_mux_send(client_mux, 2, "Move", 5);
+      ryannet_mux_flush(client_mux);
+      ryannet_mux_pump(server_mux);
+      ryannet_mux_receive(server_mux, 2, buffer, 255);
+      printf("Mux Urgent %s, Bulk Arrived %d, Bulk Waiting On Window %d\n", buffer,
+             ryannet_mux_get_receive_size(server_mux, 1), ryannet_mux_get_queued_bytes(client_mux, 1));
+      size = 0;
+      for(i = 0; i < 4; i++)
+      {
+         size += ryannet_mux_receive(server_mux, 1, bulk, 100000);
+         ryannet_mux_flush(server_mux);
+         ryannet_mux_pump(client_mux);
+         ryannet_mux_flush(client_mux);
+         ryannet_mux_pump(server_mux);
+      }
+      printf("Mux Bulk After Window Updates %d\n", size);
+      ryannet_buffer_free(bulk);
+      ryannet_mux_destroy(client_mux);
+      ryannet_mux_destroy(server_mux);
+      ryannet_socket_tcp_destroy(con);
+   }
+   ryannet_socket_tcp_destroy(client_socket);
+
+   // A peer may not credit streams that are not open, overflow a window, send
+   // frames of unknown types or open too many streams
+   mux_window = 0;
+   mux_streams = 0;
+   mux_credit = 0;
+   mux_type = 0;
+   for(i = 0; i < 4 && rv == 0; i++)
+   {
+      client_socket = ryannet_socket_tcp_new();
+      ryannet_socket_tcp_connect(client_socket, "127.0.0.1", "1255");
+      con = ryannet_socket_tcp_accept(server_socket);
+      server_mux = ryannet_mux_new(con);
+      if(i == 0)
+      {
+         size = test_mux_frame(mux_frames, 1, 7);
+         ryannet_socket_tcp_send(client_socket, mux_frames, size);
+         mux_window = ryannet_mux_pump(server_mux);
+      }
+      else if(i == 1)
+      {
+         size = test_mux_frame(mux_frames, 0, 7);
+         size += test_mux_frame(mux_frames + size, 1, 7);
+         memset(mux_frames + size - 4, 0xFF, 4);
+         ryannet_socket_tcp_send(client_socket, mux_frames, size);
+         mux_credit = ryannet_mux_pump(server_mux);
+      }
+      else if(i == 2)
+      {
+         size = test_mux_frame(mux_frames, 2, 7);
+         ryannet_socket_tcp_send(client_socket, mux_frames, size);
+         mux_type = ryannet_mux_pump(server_mux);
+      }
+      else
+      {
+         size = 0;
+         for(mux_stream = 0; mux_stream <= RYANNET_MUX_MAX_PEER_STREAMS; mux_stream++)
+         {
+            size += test_mux_frame(mux_frames + size, 0, 100 + (unsigned int)mux_stream);
+         }
+         ryannet_socket_tcp_send(client_socket, mux_frames, size);
+         mux_streams = ryannet_mux_pump(server_mux);
+      }
+      ryannet_mux_destroy(server_mux);
+      ryannet_socket_tcp_destroy(con);
+      ryannet_socket_tcp_destroy(client_socket);
+   }
+   printf("Mux Unknown Window %d, Excess Credit %d, Unknown Type %d, Over %d Streams %d\n", mux_window, mux_credit,
+          mux_type, RYANNET_MUX_MAX_PEER_STREAMS, mux_streams);
+   ryannet_socket_tcp_destroy(server_socket);
+
+   // Fast Open
+   server_socket = ryannet_socket_tcp_new();
+   ryannet_socket_tcp_enable_fastopen(server_socket);
+   rv = ryannet_socket_tcp_bind(server_socket, "127.0.0.1", "1259");
+   for(i = 0; i < 2 && rv == 0; i++)
+   {
+      // The first connection picks up the cookie, the second uses it
+      client_socket = ryannet_socket_tcp_new();
+      ryannet_socket_tcp_enable_fastopen(client_socket);
+      size = ryannet_socket_tcp_connect_with_data(client_socket, "127.0.0.1", "1259", "Login", 6);
+      con = ryannet_socket_tcp_accept(server_socket);
+      if(con != NULL)
+      {
+         sprintf(buffer, "This is not the message you want");
+         ryannet_socket_tcp_receive(con, buffer, 255);
+         printf("Fast Open Sent %d, Message: %s\n", size, buffer);
+         ryannet_socket_tcp_destroy(con);
+      }
+      ryannet_socket_tcp_destroy(client_socket);
+   }
+   ryannet_socket_tcp_destroy(server_socket);
+
+   // Nobody listening, every transport has to fail the same way
+   client_socket = ryannet_socket_tcp_new();
+   size = ryannet_socket_tcp_connect_with_data(client_socket, "shm:ryannet_nobody", NULL, "Login", 6);
+   printf("Connect With Data To Nobody shm %d", size);
+   ryannet_socket_tcp_destroy(client_socket);
+   client_socket = ryannet_socket_tcp_new();
+   size = ryannet_socket_tcp_connect_with_data(client_socket, "unix:@ryannet_nobody", NULL, "Login", 6);
+   printf(", unix %d", size);
+   ryannet_socket_tcp_destroy(client_socket);
+   client_socket = ryannet_socket_tcp_new();
+   size = ryannet_socket_tcp_connect_with_data(client_socket, "127.0.0.1", "1263", "Login", 6);
+   printf(", tcp %d", size);
+   ryannet_socket_tcp_destroy(client_socket);
+   client_socket = ryannet_socket_tcp_new();
+   printf(", Plain Connect shm %d\n", ryannet_socket_tcp_connect(client_socket, "shm:ryannet_nobody", NULL));
+   ryannet_socket_tcp_destroy(client_socket);
+
+   // Compression
+   compressor = ryannet_compressor_new(dictionary, (int)strlen(dictionary));
+   decompressor = ryannet_decompressor_new(dictionary, (int)strlen(dictionary));
+   sprintf(buffer, "{\"type\":\"move\",\"player\":12,\"x\":104,\"y\":-33}");
+   size = (int)strlen(buffer) + 1;
+   for(i = 0; i < 2; i++)
+   {
+      // The second one mostly points back at the first
+      sent = ryannet_compressor_compress(compressor, buffer, size, compressed, sizeof(compressed));
+      rv = ryannet_decompressor_decompress(decompressor, compressed, sent, buffer, 255);
+      printf("Compress %d bytes down to %d, decompress %d\n", size, sent, rv);
+   }
+   // Too small a buffer fails but the block still decodes after, and so
+   // does the next one that points back into it
+   size = sprintf(buffer, "{\"type\":\"chat\",\"player\":12,\"text\":\"gg\"}") + 1;
+   sent = ryannet_compressor_compress(compressor, buffer, size, compressed, sizeof(compressed));
+   rv = ryannet_decompressor_decompress(decompressor, compressed, sent, buffer, 8);
+   printf("Decompress Into 8 bytes %d", rv);
+   rv = ryannet_decompressor_decompress(decompressor, compressed, sent, buffer, 255);
+   printf(", Retry %d", rv);
+   sprintf(buffer, "{\"type\":\"chat\",\"player\":12,\"text\":\"gg\"}");
+   sent = ryannet_compressor_compress(compressor, buffer, size, compressed, sizeof(compressed));
+   sprintf(buffer, "This is not the message you want");
+   rv = ryannet_decompressor_decompress(decompressor, compressed, sent, buffer, 255);
+   printf(", Next Block %d bytes from %d: %s\n", rv, sent, buffer);
+   ryannet_compressor_destroy(compressor);
+   ryannet_decompressor_destroy(decompressor);
+
+   server_socket = ryannet_socket_tcp_new();
+   rv = ryannet_socket_tcp_bind(server_socket, "127.0.0.1", "1262");
+   client_socket = ryannet_socket_tcp_new();
+   rv = ryannet_socket_tcp_connect(client_socket, "127.0.0.1", "1262");
+   con = ryannet_socket_tcp_accept(server_socket);
+   if(rv == 0 && con != NULL)
+   {
+      ryannet_socket_tcp_enable_compression(client_socket, dictionary, (int)strlen(dictionary));
+      ryannet_socket_tcp_enable_compression(con, dictionary, (int)strlen(dictionary));
+      ryannet_socket_tcp_send_compressed(client_socket, "Hello Compressed", 17);
+      sprintf(buffer, "This is not the message you want");
+      ryannet_socket_tcp_receive_compressed(con, buffer, 255);
+      printf("Compressed Message: %s\n", buffer);
+      ryannet_socket_tcp_destroy(con);
+   }
+   ryannet_socket_tcp_destroy(client_socket);
+   ryannet_socket_tcp_destroy(server_socket);
+
+   // Serialization
+   ryannet_bitwriter_init(&writer, buffer, 255);
+   ryannet_bitwriter_write_bits(&writer, 5, 3);
+   ryannet_bitwriter_write_varint(&writer, 300000);
+   ryannet_bitwriter_write_float_quantized(&writer, 12.5f, -100.0f, 100.0f, 16);
+   ryannet_bitreader_init(&reader, buffer, ryannet_bitwriter_get_size(&writer));
+   bits = ryannet_bitreader_read_bits(&reader, 3);
+   varint = ryannet_bitreader_read_varint(&reader);
+   quantized = ryannet_bitreader_read_float_quantized(&reader, -100.0f, 100.0f, 16);
+   printf("Serialize %d bytes: %u %llu %f\n", ryannet_bitwriter_get_size(&writer), bits, varint, quantized);
+   ryannet_bitwriter_init(&writer, buffer, 255);
+   ryannet_bitwriter_write_float_quantized(&writer, NAN, -100.0f, 100.0f, 16);
+   ryannet_bitreader_init(&reader, buffer, ryannet_bitwriter_get_size(&writer));
+   quantized = ryannet_bitreader_read_float_quantized(&reader, -100.0f, 100.0f, 16);
+   ryannet_bitwriter_write_bits(&writer, 1, 33);
+   (void)ryannet_bitreader_read_bits(&reader, 0);
+   printf("Serialize NaN As %f, Bad Bit Count Overflow %d %d\n", quantized,
+          ryannet_bitwriter_has_overflow(&writer), ryannet_bitreader_has_overflow(&reader));
+
+   for(i = 0; i < SNAPSHOT_SIZE; i++)
+   {
+      baseline[i] = (unsigned char)(i / 16);
+      snapshot[i] = baseline[i];
+   }
+   for(i = 0; i < SNAPSHOT_SIZE; i += 160)
+   {
+      snapshot[i] ++;
+   }
+   size = ryannet_delta_encode(baseline, snapshot, SNAPSHOT_SIZE, delta, SNAPSHOT_SIZE);
+   rv = ryannet_delta_decode(baseline, delta, size, baseline, SNAPSHOT_SIZE);
+   printf("Delta %d bytes down to %d, decode %d, match %d\n", SNAPSHOT_SIZE, size, rv,
+          memcmp(baseline, snapshot, SNAPSHOT_SIZE) == 0);
+   size = ryannet_delta_encode(NULL, snapshot, SNAPSHOT_SIZE, delta, SNAPSHOT_SIZE);
+   rv = ryannet_delta_decode(NULL, delta, size, baseline, SNAPSHOT_SIZE);
+   printf("Delta From Zeros %d bytes down to %d, decode %d, match %d\n", SNAPSHOT_SIZE, size, rv,
+          memcmp(baseline, snapshot, SNAPSHOT_SIZE) == 0);
+
    sprintf(buffer, "This is not the message you want");
 
    if( argc == 3)
@@ -81,6 +927,18 @@ int main(int argc, char * args[])
    }
 
 
+   // A message outliving ryannet_destroy is released into the next init
+   message = ryannet_message_new("Across Init", 12);
+   ryannet_destroy();
+   (void)ryannet_init();
+   ryannet_message_release(message);
+   message = ryannet_message_new("Second", 7);
+   pool_buffer = ryannet_message_new("Third", 6);
+   printf("Message Across Init, Distinct Buffers %d, Data: %s %s\n", (void *)message != pool_buffer,
+          (char *)ryannet_message_get_data(message), (char *)ryannet_message_get_data(pool_buffer));
+   ryannet_message_release(pool_buffer);
+   ryannet_message_release(message);
+
    ryannet_destroy();
    printf("End\n");
    return 0;
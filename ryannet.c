@@ -1,9 +1,13 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif // __linux__
 #include "ryannet.h"
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <io.h>
 #else // _WIN32
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -15,17 +19,54 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif // __linux__
 #endif // _WIN32
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RYANNET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define RYANNET_SSE2
+// Builds without -mavx2 still get AVX2 when the CPU has it, picked at init
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define RYANNET_AVX2_DISPATCH
+#endif
+#endif
+#if defined(RYANNET_AVX2_DISPATCH) && defined(_MSC_VER)
+#include <intrin.h>
+#define RYANNET_TARGET_AVX2
+#elif defined(RYANNET_AVX2_DISPATCH)
+#define RYANNET_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+#define RYANNET_TIMESTAMPING
+#endif
 
 
 #ifdef _WIN32
 #pragma comment (lib, "Ws2_32.lib")
 #pragma comment (lib, "Mswsock.lib")
 #pragma comment (lib, "AdvApi32.lib")
+#define RtlGenRandom SystemFunction036
+BOOLEAN NTAPI RtlGenRandom(PVOID buffer, ULONG length);
 #endif // _WIN32
 
 // Define Close based on system arch
@@ -35,6 +76,39 @@
 #define ryannet_close(fd) close(fd)
 #endif // _WIN32
 
+// Atomics used by structures that can be touched from more than one thread
+#ifdef _WIN32
+#define ryannet_atomic_increment(value) InterlockedIncrement((value))
+#define ryannet_atomic_decrement(value) InterlockedDecrement((value))
+#define ryannet_atomic_exchange_pointer(target, value) InterlockedExchangePointer((PVOID volatile *)(target), (value))
+#define ryannet_atomic_compare_exchange_pointer(target, expected, value) \
+   (InterlockedCompareExchangePointer((PVOID volatile *)(target), (value), (expected)) == (PVOID)(expected))
+// Volatile reads already acquire on MSVC
+#define ryannet_atomic_load_pointer(target) (*(target))
+#define ryannet_atomic_lock(lock) InterlockedExchange((lock), 1)
+#define ryannet_atomic_unlock(lock) InterlockedExchange((lock), 0)
+#define ryannet_yield() SwitchToThread()
+#define RYANNET_THREAD_LOCAL __declspec(thread)
+static int ryannet_count_trailing_zeros(unsigned int value)
+{
+   unsigned long index;
+   _BitScanForward(&index, value);
+   return (int)index;
+}
+#else // _WIN32
+#define ryannet_atomic_increment(value) __sync_add_and_fetch((value), 1)
+#define ryannet_atomic_decrement(value) __sync_sub_and_fetch((value), 1)
+#define ryannet_atomic_exchange_pointer(target, value) __sync_lock_test_and_set((target), (value))
+#define ryannet_atomic_compare_exchange_pointer(target, expected, value) \
+   __sync_bool_compare_and_swap((target), (expected), (value))
+#define ryannet_atomic_load_pointer(target) __atomic_load_n((target), __ATOMIC_ACQUIRE)
+#define ryannet_atomic_lock(lock) __sync_lock_test_and_set((lock), 1)
+#define ryannet_atomic_unlock(lock) __sync_lock_release((lock))
+#define ryannet_yield() sched_yield()
+#define RYANNET_THREAD_LOCAL __thread
+#define ryannet_count_trailing_zeros(value) __builtin_ctz((value))
+#endif // _WIN32
+
 struct ryannet_address
 {
    char * address;
@@ -42,19 +116,117 @@ struct ryannet_address
    struct sockaddr_storage raw;
 };
 
+struct ryannet_buffer_header
+{
+   struct ryannet_buffer_header * next;
+   int class_index;
+   int capacity;
+};
+
+struct ryannet_buffer_slab
+{
+   struct ryannet_buffer_slab * next;
+   // Padding so blocks carved after this stay pointer aligned
+   void * padding;
+};
+
+struct ryannet_buffer_class
+{
+   int block_size;
+   volatile long lock;
+   struct ryannet_buffer_header * free_list;
+   struct ryannet_buffer_slab * slabs;
+   unsigned long long slab_bytes;
+   unsigned long long blocks_total;
+   unsigned long long blocks_free;
+   unsigned long long allocations;
+   unsigned long long releases;
+};
+
+struct ryannet_buffer_cache
+{
+   struct ryannet_buffer_header * free_list;
+   int count;
+   unsigned long long allocations;
+   unsigned long long releases;
+};
+
+struct ryannet_message
+{
+   volatile long reference_count;
+   int size;
+   unsigned char * data;
+};
+
+struct ryannet_queued_message
+{
+   struct ryannet_message * message;
+   struct ryannet_queued_message * next;
+};
+
+// Send times waiting for their kernel transmit timestamp, matched by the
+// OPT_ID key (datagram count for UDP, last byte offset for TCP)
+#define TIMESTAMP_RING_SIZE 256
+struct ryannet_timestamps
+{
+   struct ryannet_histogram rx;
+   struct ryannet_histogram tx;
+   int stream_flag;
+   long long pending_ns;
+   unsigned int next_id;
+   int ring_head;
+   unsigned int ring_id[TIMESTAMP_RING_SIZE];
+   long long ring_ns[TIMESTAMP_RING_SIZE];
+};
+
+struct ryannet_shm;
+
 struct ryannet_socket_tcp
 {
    struct ryannet_address local;
    struct ryannet_address remote;
    int fd;
+   int unlink_flag;
+   struct ryannet_shm * shm;
    int connected_flag;
    int remote_closed_flag;
+   int fastopen_flag;
+   struct ryannet_compression * compression;
+   struct ryannet_timestamps * timestamps;
+   struct ryannet_recorder * recorder;
+   // Pushed by any thread, taken in one go by the thread that flushes
+   struct ryannet_queued_message * volatile queue_incoming;
+   // Only touched by the thread that flushes
+   struct ryannet_queued_message * queue_head;
+   struct ryannet_queued_message * queue_tail;
+   int queue_offset;
+   // Read and write ends of the queue wake handle, -1 until enabled
+   int wake_fd[2];
 };
 
 struct ryannet_socket_udp
 {
    int fd;
+   int unlink_flag;
    struct ryannet_address local;
+   unsigned long long max_pacing_rate;
+   int txtime_flag;
+   struct ryannet_timestamps * timestamps;
+   struct ryannet_recorder * recorder;
+};
+
+struct ryannet_group_member
+{
+   struct ryannet_socket_tcp * tcp;
+   struct ryannet_socket_udp * udp;
+   struct ryannet_address destination;
+};
+
+struct ryannet_group
+{
+   struct ryannet_group_member * members;
+   int count;
+   int size;
 };
 
 static char * ryannet_string_copy(const char * src)
@@ -74,861 +246,7866 @@ static char * ryannet_string_copy(const char * src)
    return out;
 }
 
-int ryannet_init(void)
+static long long ryannet_time_ns(void)
 {
 #ifdef _WIN32
-   WSADATA wsa_data;
-   int rv, wsas_rv;
-   wsas_rv = WSAStartup(MAKEWORD(2, 2), &wsa_data);
-   if(wsas_rv != 0)
-   {
-      fprintf(stderr, "WSAStartup Failed with error %d\n", wsas_rv);
-      rv = 1;
-   }
-   else
-   {
-      rv = 0;
-   }
-   return rv;
+   LARGE_INTEGER counter, frequency;
+   QueryPerformanceCounter(&counter);
+   QueryPerformanceFrequency(&frequency);
+   return (long long)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
 #else // _WIN32
-   return 0;
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
 #endif // _WIN32
 }
 
-void ryannet_destroy(void)
+void ryannet_histogram_clear(struct ryannet_histogram * histogram)
 {
-#ifdef _WIN32
-   WSACleanup();
-#endif // _WIN32
+   memset(histogram, 0, sizeof(struct ryannet_histogram));
 }
 
-
-#define PORT_STRING_SIZE 8
-static void ryannet_fill_address(struct ryannet_address * address)
+void ryannet_histogram_add(struct ryannet_histogram * histogram, long long value_ns)
 {
-   size_t size_address, size_port;
-   int rv;
-
-   // Address
-   if(address->address != NULL)
-   {
-      free(address->address);
-      address->address = NULL;
-   }
-   switch(address->raw.ss_family)
+   int bucket;
+   if(value_ns < 0)
    {
-   case AF_INET:
-      size_address = INET_ADDRSTRLEN;
-      break;
-   case AF_INET6:
-      size_address = INET6_ADDRSTRLEN;
-      break;
-   default:
-      size_address = 0;
-      break;
+      value_ns = 0;
    }
-
-   if(size_address > 0)
+   // Bucket n holds values below 2^n nanoseconds
+   bucket = 0;
+   while(bucket < RYANNET_HISTOGRAM_BUCKETS - 1 && (value_ns >> bucket) != 0)
    {
-      address->address = malloc(sizeof(char) * size_address);
+      bucket ++;
    }
-
-   // Port
-   if(address->port != NULL)
+   histogram->buckets[bucket] ++;
+   histogram->count ++;
+   histogram->total_ns += value_ns;
+   if(value_ns > histogram->max_ns)
    {
-      free(address->port);
-      address->port = NULL;
+      histogram->max_ns = value_ns;
    }
+}
 
-   switch(address->raw.ss_family)
+long long ryannet_histogram_get_percentile(struct ryannet_histogram * histogram, double percentile)
+{
+   unsigned long long rank, seen;
+   long long bound;
+   int bucket;
+   if(histogram->count == 0)
    {
-   case AF_INET:
-      size_port = PORT_STRING_SIZE;
-      break;
-   case AF_INET6:
-      size_port = PORT_STRING_SIZE;
-      break;
-   default:
-      size_port = 0;
-      break;
+      return 0;
    }
-   if(size_port > 0)
+   rank = (unsigned long long)(percentile / 100.0 * (double)histogram->count);
+   if(rank >= histogram->count)
    {
-      address->port = malloc(sizeof(char) * size_port);
+      rank = histogram->count - 1;
    }
-
-   rv = getnameinfo((struct sockaddr *)&address->raw, sizeof(struct sockaddr_storage),
-                    address->address, size_address,
-                    address->port, size_port, NI_NUMERICHOST | NI_NUMERICSERV);
-
-   if(rv != 0)
+   seen = 0;
+   for(bucket = 0; bucket < RYANNET_HISTOGRAM_BUCKETS; bucket++)
    {
-      fprintf(stderr, "Error getnameinfo: %s\n", gai_strerror(rv));
-      if(address->address != NULL)
-      {
-         free(address->address);
-      }
-      if(address->port != NULL)
+      seen += histogram->buckets[bucket];
+      if(seen > rank)
       {
-         free(address->port);
+         break;
       }
    }
+   bound = bucket < RYANNET_HISTOGRAM_BUCKETS - 1 ? (1LL << bucket) - 1 : histogram->max_ns;
+   return bound < histogram->max_ns ? bound : histogram->max_ns;
+}
 
+#ifdef RYANNET_TIMESTAMPING
+// Kernel timestamps are on the realtime clock
+static long long ryannet_time_realtime_ns(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-static void ryannet_getaddrinfo_dump(const char * node, const char * port)
+static struct ryannet_timestamps * ryannet_timestamps_new(int stream_flag)
 {
+   struct ryannet_timestamps * timestamps;
+   timestamps = malloc(sizeof(struct ryannet_timestamps));
+   memset(timestamps, 0, sizeof(struct ryannet_timestamps));
+   timestamps->stream_flag = stream_flag;
+   return timestamps;
+}
 
-   struct addrinfo hints, *servinfo, *p;
-   struct ryannet_address * address;
-   int rv;
+static int ryannet_timestamps_apply(int fd)
+{
+   int flags;
+   flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+           SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+   return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1 ? 1 : 0;
+}
 
-   address = ryannet_address_new();
+static void ryannet_timestamps_push(struct ryannet_timestamps * timestamps, unsigned int id, long long now)
+{
+   timestamps->ring_id[timestamps->ring_head] = id;
+   timestamps->ring_ns[timestamps->ring_head] = now;
+   timestamps->ring_head = (timestamps->ring_head + 1) % TIMESTAMP_RING_SIZE;
+}
 
-   memset(&hints, 0, sizeof(struct addrinfo));
-   hints.ai_family = AF_UNSPEC;
-   hints.ai_socktype = SOCK_STREAM;
-   hints.ai_flags = AI_PASSIVE; // Use any local IPV4 or IPV6 address I have
-   
-   rv = getaddrinfo(node, port, &hints, &servinfo);
-   if(rv != 0)
+// Called just before the send call, the kernel stamps inside it
+static void ryannet_timestamps_begin(struct ryannet_timestamps * timestamps)
+{
+   if(timestamps != NULL)
    {
-      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
-      return;
+      timestamps->pending_ns = ryannet_time_realtime_ns();
    }
+}
 
-   for(p = servinfo; p != NULL; p = p->ai_next)
+// Count is datagrams for UDP and bytes for TCP
+static void ryannet_timestamps_sent(struct ryannet_timestamps * timestamps, int count)
+{
+   long long now;
+   int i;
+   if(timestamps == NULL || count <= 0)
    {
-      memcpy(&address->raw, p->ai_addr, p->ai_addrlen);
-      ryannet_fill_address(address);
-      printf("getaddrinfo: %s : %s\n", address->address, address->port);
-
+      return;
+   }
+   now = timestamps->pending_ns;
+   if(timestamps->stream_flag)
+   {
+      timestamps->next_id += (unsigned int)count;
+      ryannet_timestamps_push(timestamps, timestamps->next_id - 1, now);
+   }
+   else
+   {
+      for(i = 0; i < count; i++)
+      {
+         ryannet_timestamps_push(timestamps, timestamps->next_id, now);
+         timestamps->next_id ++;
+      }
    }
-   freeaddrinfo(servinfo);
-   ryannet_address_destroy(address);
-
 }
 
-struct ryannet_address * ryannet_address_new(void)
+static long long ryannet_timestamps_take(struct ryannet_timestamps * timestamps, unsigned int id)
 {
-   struct ryannet_address * addy;
-   addy = malloc(sizeof(struct ryannet_address));
-   addy->address = NULL;
-   addy->port = NULL;
-   memset(&addy->raw, 0, sizeof(struct sockaddr_storage));
-   return addy;
+   long long sent_ns;
+   int i, index;
+   // Newest first, completions almost always belong to recent sends
+   for(i = 1; i <= TIMESTAMP_RING_SIZE; i++)
+   {
+      index = (timestamps->ring_head - i + TIMESTAMP_RING_SIZE) % TIMESTAMP_RING_SIZE;
+      if(timestamps->ring_id[index] == id && timestamps->ring_ns[index] != 0)
+      {
+         sent_ns = timestamps->ring_ns[index];
+         timestamps->ring_ns[index] = 0;
+         return sent_ns;
+      }
+   }
+   return 0;
 }
 
-int ryannet_address_set(struct ryannet_address * address, const char * node, const char * port)
+static long long ryannet_timestamps_find(struct msghdr * header)
 {
-   struct addrinfo hints, *servinfo, *p;
-   int rv;
-   socklen_t length;
-
-   memset(&hints, 0, sizeof(struct addrinfo));
-   hints.ai_family = AF_UNSPEC;
-   
-   rv = getaddrinfo(node, port, &hints, &servinfo);
-   if(rv != 0)
+   struct scm_timestamping * stamp;
+   struct cmsghdr * cmsg;
+   for(cmsg = CMSG_FIRSTHDR(header); cmsg != NULL; cmsg = CMSG_NXTHDR(header, cmsg))
    {
-      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
-      return 1;
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+      {
+         stamp = (struct scm_timestamping *)CMSG_DATA(cmsg);
+         return (long long)stamp->ts[0].tv_sec * 1000000000LL + stamp->ts[0].tv_nsec;
+      }
    }
-
-   memcpy(&address->raw, &servinfo->ai_addr, servinfo->ai_addrlen);
-   ryannet_fill_address(address);
-
-   freeaddrinfo(servinfo);
    return 0;
 }
 
-void ryannet_address_destroy(struct ryannet_address * address)
+// Records how long a received packet sat in the socket buffer
+static long long ryannet_timestamps_received(struct ryannet_timestamps * timestamps, struct msghdr * header)
 {
-   if(address->address != NULL)
+   long long kernel_ns;
+   kernel_ns = ryannet_timestamps_find(header);
+   if(kernel_ns != 0)
    {
-      free(address->address);
-   }
-   if(address->port != NULL)
-   {
-      free(address->port);
+      ryannet_histogram_add(&timestamps->rx, ryannet_time_realtime_ns() - kernel_ns);
    }
-   free(address);
+   return kernel_ns;
 }
 
-const char * ryannet_address_get_address(struct ryannet_address * address)
+// Drains the error queue, recording how long each send took to reach the
+// driver
+static int ryannet_timestamps_collect(struct ryannet_timestamps * timestamps, int fd)
 {
-   return address->address;
+   union
+   {
+      char buffer[256];
+      struct cmsghdr align;
+   } control;
+   struct sock_extended_err * error;
+   struct cmsghdr * cmsg;
+   struct msghdr header;
+   long long kernel_ns, sent_ns;
+   int count;
+
+   count = 0;
+   while(1)
+   {
+      memset(&header, 0, sizeof(struct msghdr));
+      header.msg_control = control.buffer;
+      header.msg_controllen = sizeof(control.buffer);
+      if(recvmsg(fd, &header, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      {
+         break;
+      }
+      error = NULL;
+      for(cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg))
+      {
+         if((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+         {
+            error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+         }
+      }
+      kernel_ns = ryannet_timestamps_find(&header);
+      if(error == NULL || error->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || kernel_ns == 0)
+      {
+         continue;
+      }
+      sent_ns = ryannet_timestamps_take(timestamps, error->ee_data);
+      if(sent_ns != 0)
+      {
+         ryannet_histogram_add(&timestamps->tx, kernel_ns - sent_ns);
+         count ++;
+      }
+   }
+   return count;
 }
 
-const char * ryannet_address_get_port(struct ryannet_address * address)
+// Send timestamps are charged to the receive buffer, so a receiver that
+// only blocks would let them pile up until incoming data is dropped. Wait
+// in poll instead and drain the error queue each time it is what woke us.
+static int ryannet_timestamps_wait(struct ryannet_timestamps * timestamps, int fd)
 {
-   return address->port;
+   struct pollfd fds;
+   int collected;
+
+   while(1)
+   {
+      fds.fd = fd;
+      fds.events = POLLIN;
+      fds.revents = 0;
+      if(poll(&fds, 1, -1) == -1)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      collected = 0;
+      if(fds.revents & POLLERR)
+      {
+         collected = ryannet_timestamps_collect(timestamps, fd);
+      }
+      // Data, a hang up, or an error that is not a timestamp is left for the
+      // receive to report
+      if((fds.revents & ~POLLERR) || collected == 0)
+      {
+         return 0;
+      }
+   }
 }
+#else // RYANNET_TIMESTAMPING
+#define ryannet_timestamps_begin(timestamps) ((void)(timestamps))
+#define ryannet_timestamps_sent(timestamps, count) ((void)(timestamps), (void)(count))
+#endif // RYANNET_TIMESTAMPING
 
+#define BUFFER_CLASS_COUNT 7
+#define BUFFER_SLAB_SIZE 65536
+#define BUFFER_SLAB_MIN_BLOCKS 8
+#define BUFFER_CACHE_LIMIT 64
+#define BUFFER_CACHE_BATCH 32
+static struct ryannet_buffer_class ryannet_buffer_classes[BUFFER_CLASS_COUNT + 1] =
+{
+   { .block_size = 64 }, { .block_size = 256 }, { .block_size = 1024 }, { .block_size = 2048 },
+   { .block_size = 4096 }, { .block_size = 16384 }, { .block_size = 65536 },
+   // Anything larger goes straight to malloc, this only keeps the stats
+   { .block_size = 0 }
+};
+static RYANNET_THREAD_LOCAL struct ryannet_buffer_cache ryannet_buffer_caches[BUFFER_CLASS_COUNT];
 
-struct ryannet_socket_tcp * ryannet_socket_tcp_new(void)
+static struct ryannet_buffer_cache * ryannet_buffer_cache_get(int class_index)
 {
-   struct ryannet_socket_tcp * socket;
-   socket = malloc(sizeof(struct ryannet_socket_tcp));
-   socket->fd = -1;
-   socket->local.address = NULL;
-   socket->local.port = NULL;
-   memset(&socket->local.raw, 0, sizeof(struct sockaddr_storage));
-   socket->remote.address = NULL;
-   socket->remote.port = NULL;
-   memset(&socket->remote.raw, 0, sizeof(struct sockaddr_storage));
-   socket->connected_flag = 0;
-   socket->remote_closed_flag = 0;
-   return socket;
+   return &ryannet_buffer_caches[class_index];
 }
 
-void ryannet_socket_tcp_destroy(struct ryannet_socket_tcp * socket)
+static void ryannet_buffer_class_lock(struct ryannet_buffer_class * buffer_class)
 {
-   if(socket->fd != -1)
+   while(ryannet_atomic_lock(&buffer_class->lock))
    {
-      ryannet_close(socket->fd);
+      ryannet_yield();
    }
-   if(socket->local.address != NULL)
+}
+
+static void ryannet_buffer_class_unlock(struct ryannet_buffer_class * buffer_class)
+{
+   ryannet_atomic_unlock(&buffer_class->lock);
+}
+
+// Must be called with the class locked
+static void ryannet_buffer_class_sync_stats(struct ryannet_buffer_class * buffer_class, struct ryannet_buffer_cache * cache)
+{
+   buffer_class->allocations += cache->allocations;
+   buffer_class->releases += cache->releases;
+   cache->allocations = 0;
+   cache->releases = 0;
+}
+
+// Must be called with the class locked
+static void ryannet_buffer_class_grow(struct ryannet_buffer_class * buffer_class, int class_index)
+{
+   struct ryannet_buffer_slab * slab;
+   struct ryannet_buffer_header * header;
+   size_t stride, slab_size;
+   int count, i;
+
+   stride = sizeof(struct ryannet_buffer_header) + (size_t)buffer_class->block_size;
+   count = BUFFER_SLAB_SIZE / (int)stride;
+   if(count < BUFFER_SLAB_MIN_BLOCKS)
    {
-      free(socket->local.address);
+      count = BUFFER_SLAB_MIN_BLOCKS;
    }
-   if(socket->local.port != NULL)
+   slab_size = sizeof(struct ryannet_buffer_slab) + stride * (size_t)count;
+   slab = malloc(slab_size);
+   slab->next = buffer_class->slabs;
+   buffer_class->slabs = slab;
+   buffer_class->slab_bytes += slab_size;
+   buffer_class->blocks_total += count;
+   buffer_class->blocks_free += count;
+
+   for(i = 0; i < count; i++)
    {
-      free(socket->local.port);
+      header = (struct ryannet_buffer_header *)((char *)(slab + 1) + stride * (size_t)i);
+      header->class_index = class_index;
+      header->capacity = buffer_class->block_size;
+      header->next = buffer_class->free_list;
+      buffer_class->free_list = header;
+   }
+}
+
+static void ryannet_buffer_cache_refill(int class_index)
+{
+   struct ryannet_buffer_class * buffer_class;
+   struct ryannet_buffer_cache * cache;
+   struct ryannet_buffer_header * header;
+   int i;
+
+   buffer_class = &ryannet_buffer_classes[class_index];
+   cache = ryannet_buffer_cache_get(class_index);
+   ryannet_buffer_class_lock(buffer_class);
+   ryannet_buffer_class_sync_stats(buffer_class, cache);
+   for(i = 0; i < BUFFER_CACHE_BATCH; i++)
+   {
+      if(buffer_class->free_list == NULL)
+      {
+         ryannet_buffer_class_grow(buffer_class, class_index);
+      }
+      header = buffer_class->free_list;
+      buffer_class->free_list = header->next;
+      buffer_class->blocks_free --;
+      header->next = cache->free_list;
+      cache->free_list = header;
+      cache->count ++;
+   }
+   ryannet_buffer_class_unlock(buffer_class);
+}
+
+static void ryannet_buffer_cache_spill(int class_index, int keep)
+{
+   struct ryannet_buffer_class * buffer_class;
+   struct ryannet_buffer_cache * cache;
+   struct ryannet_buffer_header * header;
+
+   buffer_class = &ryannet_buffer_classes[class_index];
+   cache = ryannet_buffer_cache_get(class_index);
+   ryannet_buffer_class_lock(buffer_class);
+   ryannet_buffer_class_sync_stats(buffer_class, cache);
+   while(cache->count > keep)
+   {
+      header = cache->free_list;
+      cache->free_list = header->next;
+      cache->count --;
+      header->next = buffer_class->free_list;
+      buffer_class->free_list = header;
+      buffer_class->blocks_free ++;
+   }
+   ryannet_buffer_class_unlock(buffer_class);
+}
+
+void * ryannet_buffer_alloc(int size_in_bytes)
+{
+   struct ryannet_buffer_header * header;
+   struct ryannet_buffer_cache * cache;
+   struct ryannet_buffer_class * buffer_class;
+   int class_index;
+
+   class_index = 0;
+   while(class_index < BUFFER_CLASS_COUNT && ryannet_buffer_classes[class_index].block_size < size_in_bytes)
+   {
+      class_index ++;
+   }
+
+   if(class_index == BUFFER_CLASS_COUNT)
+   {
+      header = malloc(sizeof(struct ryannet_buffer_header) + (size_t)size_in_bytes);
+      header->class_index = BUFFER_CLASS_COUNT;
+      header->capacity = size_in_bytes;
+      buffer_class = &ryannet_buffer_classes[BUFFER_CLASS_COUNT];
+      ryannet_buffer_class_lock(buffer_class);
+      buffer_class->allocations ++;
+      buffer_class->slab_bytes += (unsigned long long)size_in_bytes;
+      ryannet_buffer_class_unlock(buffer_class);
+   }
+   else
+   {
+      cache = ryannet_buffer_cache_get(class_index);
+      if(cache->free_list == NULL)
+      {
+         ryannet_buffer_cache_refill(class_index);
+      }
+      header = cache->free_list;
+      cache->free_list = header->next;
+      cache->count --;
+      cache->allocations ++;
+   }
+   header->next = NULL;
+   return header + 1;
+}
+
+void ryannet_buffer_free(void * buffer)
+{
+   struct ryannet_buffer_header * header;
+   struct ryannet_buffer_cache * cache;
+   struct ryannet_buffer_class * buffer_class;
+
+   if(buffer == NULL)
+   {
+      return;
+   }
+   header = (struct ryannet_buffer_header *)buffer - 1;
+   if(header->class_index == BUFFER_CLASS_COUNT)
+   {
+      buffer_class = &ryannet_buffer_classes[BUFFER_CLASS_COUNT];
+      ryannet_buffer_class_lock(buffer_class);
+      buffer_class->releases ++;
+      buffer_class->slab_bytes -= (unsigned long long)header->capacity;
+      ryannet_buffer_class_unlock(buffer_class);
+      free(header);
+   }
+   else
+   {
+      cache = ryannet_buffer_cache_get(header->class_index);
+      header->next = cache->free_list;
+      cache->free_list = header;
+      cache->count ++;
+      cache->releases ++;
+      if(cache->count > BUFFER_CACHE_LIMIT)
+      {
+         ryannet_buffer_cache_spill(header->class_index, BUFFER_CACHE_LIMIT - BUFFER_CACHE_BATCH);
+      }
+   }
+}
+
+int ryannet_buffer_get_capacity(void * buffer)
+{
+   return ((struct ryannet_buffer_header *)buffer - 1)->capacity;
+}
+
+void ryannet_buffer_thread_release(void)
+{
+   int i;
+   for(i = 0; i < BUFFER_CLASS_COUNT; i++)
+   {
+      ryannet_buffer_cache_spill(i, 0);
+   }
+}
+
+int ryannet_buffer_get_class_count(void)
+{
+   return BUFFER_CLASS_COUNT + 1;
+}
+
+int ryannet_buffer_get_stats(int class_index, struct ryannet_buffer_stats * stats)
+{
+   struct ryannet_buffer_class * buffer_class;
+   if(class_index < 0 || class_index > BUFFER_CLASS_COUNT)
+   {
+      memset(stats, 0, sizeof(struct ryannet_buffer_stats));
+      return -1;
+   }
+   buffer_class = &ryannet_buffer_classes[class_index];
+   if(class_index < BUFFER_CLASS_COUNT)
+   {
+      // Fold in this thread's counts so a single threaded caller sees exact numbers
+      ryannet_buffer_class_lock(buffer_class);
+      ryannet_buffer_class_sync_stats(buffer_class, ryannet_buffer_cache_get(class_index));
+   }
+   else
+   {
+      ryannet_buffer_class_lock(buffer_class);
+   }
+   stats->block_size = buffer_class->block_size;
+   stats->reserved_bytes = buffer_class->slab_bytes;
+   stats->blocks_total = buffer_class->blocks_total;
+   stats->blocks_free = buffer_class->blocks_free;
+   stats->allocations = buffer_class->allocations;
+   stats->releases = buffer_class->releases;
+   ryannet_buffer_class_unlock(buffer_class);
+   return 0;
+}
+
+#ifdef RYANNET_AVX2_DISPATCH
+static int ryannet_cpu_avx2_flag = 0;
+
+static void ryannet_detect_cpu(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 1);
+   // The OS has to save the YMM registers too
+   if((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+   {
+      return;
+   }
+   __cpuidex(info, 7, 0);
+   ryannet_cpu_avx2_flag = (info[1] & (1 << 5)) != 0;
+#else // _MSC_VER
+   __builtin_cpu_init();
+   ryannet_cpu_avx2_flag = __builtin_cpu_supports("avx2") != 0;
+#endif // _MSC_VER
+}
+#else // RYANNET_AVX2_DISPATCH
+#define ryannet_detect_cpu()
+#endif // RYANNET_AVX2_DISPATCH
+
+int ryannet_init(void)
+{
+#ifdef _WIN32
+   WSADATA wsa_data;
+   int rv, wsas_rv;
+   ryannet_detect_cpu();
+   wsas_rv = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+   if(wsas_rv != 0)
+   {
+      fprintf(stderr, "WSAStartup Failed with error %d\n", wsas_rv);
+      rv = 1;
+   }
+   else
+   {
+      rv = 0;
+   }
+   return rv;
+#else // _WIN32
+   ryannet_detect_cpu();
+   return 0;
+#endif // _WIN32
+}
+
+void ryannet_destroy(void)
+{
+   // Slabs stay until the process exits, buffers still out in messages or
+   // other threads' caches keep pointing into them
+   ryannet_buffer_thread_release();
+#ifdef _WIN32
+   WSACleanup();
+#endif // _WIN32
+}
+
+
+// Unix domain sockets are addressed as "unix:/path" for streams and datagrams
+// and "unixpacket:/path" for seqpacket. A path starting with @ is in the
+// abstract namespace.
+#define UNIX_SCHEME "unix:"
+#define UNIX_SCHEME_SIZE 5
+#define UNIX_PACKET_SCHEME "unixpacket:"
+#define UNIX_PACKET_SCHEME_SIZE 11
+
+static int ryannet_unix_is_address(const char * address)
+{
+   return (address != NULL &&
+           (strncmp(address, UNIX_SCHEME, UNIX_SCHEME_SIZE) == 0 ||
+            strncmp(address, UNIX_PACKET_SCHEME, UNIX_PACKET_SCHEME_SIZE) == 0)) ? 1 : 0;
+}
+
+#ifndef _WIN32
+// Fills in raw from a unix address and returns the socket type it asks for,
+// or -1 if the path does not fit
+static int ryannet_unix_set_raw(struct sockaddr_storage * raw, const char * address, int default_type)
+{
+   struct sockaddr_un * unix_address;
+   const char * path;
+   size_t length;
+   int type;
+
+   if(strncmp(address, UNIX_PACKET_SCHEME, UNIX_PACKET_SCHEME_SIZE) == 0)
+   {
+      path = address + UNIX_PACKET_SCHEME_SIZE;
+      type = SOCK_SEQPACKET;
+   }
+   else
+   {
+      path = address + UNIX_SCHEME_SIZE;
+      type = default_type;
+   }
+
+   unix_address = (struct sockaddr_un *)raw;
+   length = strlen(path);
+   if(length == 0 || length >= sizeof(unix_address->sun_path))
+   {
+      fprintf(stderr, "Error: Bad unix socket path %s\n", address);
+      return -1;
+   }
+   memset(raw, 0, sizeof(struct sockaddr_storage));
+   unix_address->sun_family = AF_UNIX;
+   memcpy(unix_address->sun_path, path, length);
+   if(path[0] == '@')
+   {
+      unix_address->sun_path[0] = '\0';
+   }
+   return type;
+}
+#endif // _WIN32
+
+static socklen_t ryannet_address_raw_length(const struct sockaddr_storage * raw)
+{
+   socklen_t length;
+#ifndef _WIN32
+   const struct sockaddr_un * unix_address;
+#endif // _WIN32
+   switch(raw->ss_family)
+   {
+   case AF_INET:
+      length = sizeof(struct sockaddr_in);
+      break;
+   case AF_INET6:
+      length = sizeof(struct sockaddr_in6);
+      break;
+#ifndef _WIN32
+   case AF_UNIX:
+      // Abstract names matter down to the byte, so never pad them
+      unix_address = (const struct sockaddr_un *)raw;
+      if(unix_address->sun_path[0] == '\0')
+      {
+         length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(unix_address->sun_path + 1));
+      }
+      else
+      {
+         length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(unix_address->sun_path) + 1);
+      }
+      break;
+#endif // _WIN32
+   default:
+      length = sizeof(struct sockaddr_storage);
+      break;
+   }
+   return length;
+}
+
+#ifndef _WIN32
+// Clears out a socket file left by a server that is gone. A socket file
+// nobody answers on refuses the connection, anything that connects or is
+// just busy belongs to a running server, so that fails with EADDRINUSE.
+static int ryannet_unix_unlink_stale(int fd, struct sockaddr_storage * raw)
+{
+   struct sockaddr_un * unix_address;
+   struct stat file_stat;
+   socklen_t length;
+   int type, probe, rv;
+   unix_address = (struct sockaddr_un *)raw;
+   // Only ever touch an old socket file, never anything else living at the path
+   if(unix_address->sun_path[0] == '\0' ||
+      stat(unix_address->sun_path, &file_stat) != 0 ||
+      !S_ISSOCK(file_stat.st_mode))
+   {
+      return 0;
+   }
+   length = sizeof(int);
+   if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == -1)
+   {
+      return -1;
+   }
+   probe = socket(AF_UNIX, type, 0);
+   if(probe == -1)
+   {
+      return -1;
+   }
+   // Non blocking so a full backlog doesn't stall the probe
+   (void)fcntl(probe, F_SETFL, O_NONBLOCK);
+   rv = connect(probe, (struct sockaddr *)raw, ryannet_address_raw_length(raw));
+   if(rv == -1 && errno == ECONNREFUSED)
+   {
+      close(probe);
+      (void)unlink(unix_address->sun_path);
+      return 0;
+   }
+   close(probe);
+   if(rv == 0 || errno == EAGAIN || errno == EINPROGRESS)
+   {
+      fprintf(stderr, "Error: %s is in use by a running server\n", unix_address->sun_path);
+      errno = EADDRINUSE;
+   }
+   return -1;
+}
+#endif // _WIN32
+
+static unsigned int ryannet_load32(const unsigned char * in)
+{
+   return (unsigned int)in[0] | ((unsigned int)in[1] << 8) |
+          ((unsigned int)in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+static void ryannet_store32(unsigned char * out, unsigned int value)
+{
+   out[0] = (unsigned char)value;
+   out[1] = (unsigned char)(value >> 8);
+   out[2] = (unsigned char)(value >> 16);
+   out[3] = (unsigned char)(value >> 24);
+}
+
+static void ryannet_store64(unsigned char * out, unsigned long long value)
+{
+   ryannet_store32(out, (unsigned int)value);
+   ryannet_store32(out + 4, (unsigned int)(value >> 32));
+}
+
+static unsigned long long ryannet_load64(const unsigned char * in)
+{
+   return (unsigned long long)ryannet_load32(in) | ((unsigned long long)ryannet_load32(in + 4) << 32);
+}
+
+#define ADDRESS_KEY_SIZE 112
+static int ryannet_address_key(const struct sockaddr_storage * raw, unsigned char key[ADDRESS_KEY_SIZE])
+{
+   const struct sockaddr_in * ipv4;
+   const struct sockaddr_in6 * ipv6;
+   int size;
+
+   key[0] = (unsigned char)raw->ss_family;
+   switch(raw->ss_family)
+   {
+   case AF_INET:
+      ipv4 = (const struct sockaddr_in *)raw;
+      memcpy(key + 1, &ipv4->sin_port, 2);
+      memcpy(key + 3, &ipv4->sin_addr, 4);
+      size = 7;
+      break;
+   case AF_INET6:
+      ipv6 = (const struct sockaddr_in6 *)raw;
+      memcpy(key + 1, &ipv6->sin6_port, 2);
+      memcpy(key + 3, &ipv6->sin6_addr, 16);
+      size = 19;
+      break;
+   default:
+      size = (int)ryannet_address_raw_length(raw);
+      if(size > ADDRESS_KEY_SIZE - 1)
+      {
+         size = ADDRESS_KEY_SIZE - 1;
+      }
+      memcpy(key + 1, raw, (size_t)size);
+      size ++;
+      break;
+   }
+   return size;
+}
+
+// Capture files start with the magic and the wall clock second recording
+// began, then records of
+//   8 bytes  nanoseconds since recording began
+//   4 bytes  payload size
+//   1 byte   flags, always including RECORD_FLAG_VALID
+//   1 byte   peer address key size
+//   2 bytes  zero
+// followed by the address key and the payload, all little endian. Space
+// past the last record is zero, so a reader stops at the first record
+// without the valid flag even if the writer died.
+#define RECORDER_MAGIC "RYNCAP1"
+#define RECORDER_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 16
+#define RECORD_FLAG_VALID 0x80
+#define RECORDER_INITIAL_CAPACITY (1024 * 1024)
+
+struct ryannet_recorder
+{
+   volatile long lock;
+   long long start_ns;
+   long long used;
+   long long capacity;
+   long long limit;
+   unsigned long long records;
+   unsigned long long dropped;
+#ifdef _WIN32
+   FILE * file;
+#else // _WIN32
+   int fd;
+   unsigned char * map;
+#endif // _WIN32
+};
+
+#ifndef _WIN32
+// Must be called with the recorder locked
+static int ryannet_recorder_grow(struct ryannet_recorder * recorder, long long need)
+{
+   long long capacity;
+   capacity = recorder->capacity;
+   while(capacity < need)
+   {
+      capacity *= 2;
+   }
+   if(recorder->limit > 0 && capacity > recorder->limit)
+   {
+      capacity = recorder->limit;
+   }
+   if(ftruncate(recorder->fd, (off_t)capacity) == -1)
+   {
+      return 1;
+   }
+   (void)munmap(recorder->map, (size_t)recorder->capacity);
+   recorder->map = mmap(NULL, (size_t)capacity, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0);
+   if(recorder->map == MAP_FAILED)
+   {
+      // Nothing more can be recorded, what is already written is safe
+      recorder->map = NULL;
+      recorder->capacity = 0;
+      recorder->limit = recorder->used;
+      return 1;
+   }
+   recorder->capacity = capacity;
+   return 0;
+}
+#endif // _WIN32
+
+static void ryannet_recorder_write(struct ryannet_recorder * recorder, int flags, const struct sockaddr_storage * raw, const void * buffer, int size)
+{
+   unsigned char header[RECORD_HEADER_SIZE];
+   unsigned char key[ADDRESS_KEY_SIZE];
+   long long need;
+   int key_size;
+
+   if(recorder == NULL || size < 0)
+   {
+      return;
+   }
+   key_size = raw != NULL ? ryannet_address_key(raw, key) : 0;
+   need = RECORD_HEADER_SIZE + key_size + size;
+   while(ryannet_atomic_lock(&recorder->lock))
+   {
+      ryannet_yield();
+   }
+   // Stamped under the lock so records are always in time order
+   ryannet_store64(header, (unsigned long long)(ryannet_time_ns() - recorder->start_ns));
+   ryannet_store32(header + 8, (unsigned int)size);
+   header[12] = (unsigned char)(flags | RECORD_FLAG_VALID);
+   header[13] = (unsigned char)key_size;
+   header[14] = 0;
+   header[15] = 0;
+   if(recorder->limit > 0 && recorder->used + need > recorder->limit)
+   {
+      recorder->dropped ++;
+   }
+#ifdef _WIN32
+   else
+   {
+      fwrite(header, 1, RECORD_HEADER_SIZE, recorder->file);
+      fwrite(key, 1, (size_t)key_size, recorder->file);
+      fwrite(buffer, 1, (size_t)size, recorder->file);
+      recorder->used += need;
+      recorder->records ++;
+   }
+#else // _WIN32
+   else if(recorder->used + need > recorder->capacity &&
+           ryannet_recorder_grow(recorder, recorder->used + need) != 0)
+   {
+      recorder->dropped ++;
+   }
+   else
+   {
+      memcpy(recorder->map + recorder->used + RECORD_HEADER_SIZE, key, (size_t)key_size);
+      memcpy(recorder->map + recorder->used + RECORD_HEADER_SIZE + key_size, buffer, (size_t)size);
+      // Header last, the valid flag is what makes the record visible
+      memcpy(recorder->map + recorder->used, header, RECORD_HEADER_SIZE);
+      recorder->used += need;
+      recorder->records ++;
+   }
+#endif // _WIN32
+   ryannet_atomic_unlock(&recorder->lock);
+}
+
+#define PORT_STRING_SIZE 8
+static void ryannet_fill_address(struct ryannet_address * address)
+{
+   size_t size_address, size_port;
+   int rv;
+#ifndef _WIN32
+   struct sockaddr_un * unix_address;
+
+   if(address->raw.ss_family == AF_UNIX)
+   {
+      if(address->address != NULL)
+      {
+         free(address->address);
+      }
+      if(address->port != NULL)
+      {
+         free(address->port);
+      }
+      unix_address = (struct sockaddr_un *)&address->raw;
+      size_address = UNIX_SCHEME_SIZE + sizeof(unix_address->sun_path) + 1;
+      address->address = malloc(sizeof(char) * size_address);
+      if(unix_address->sun_path[0] == '\0' && unix_address->sun_path[1] != '\0')
+      {
+         snprintf(address->address, size_address, "%s@%s", UNIX_SCHEME, unix_address->sun_path + 1);
+      }
+      else
+      {
+         snprintf(address->address, size_address, "%s%s", UNIX_SCHEME, unix_address->sun_path);
+      }
+      address->port = ryannet_string_copy("");
+      return;
+   }
+#endif // _WIN32
+
+   // Address
+   if(address->address != NULL)
+   {
+      free(address->address);
+      address->address = NULL;
+   }
+   switch(address->raw.ss_family)
+   {
+   case AF_INET:
+      size_address = INET_ADDRSTRLEN;
+      break;
+   case AF_INET6:
+      size_address = INET6_ADDRSTRLEN;
+      break;
+   default:
+      size_address = 0;
+      break;
+   }
+
+   if(size_address > 0)
+   {
+      address->address = malloc(sizeof(char) * size_address);
+   }
+
+   // Port
+   if(address->port != NULL)
+   {
+      free(address->port);
+      address->port = NULL;
+   }
+
+   switch(address->raw.ss_family)
+   {
+   case AF_INET:
+      size_port = PORT_STRING_SIZE;
+      break;
+   case AF_INET6:
+      size_port = PORT_STRING_SIZE;
+      break;
+   default:
+      size_port = 0;
+      break;
+   }
+   if(size_port > 0)
+   {
+      address->port = malloc(sizeof(char) * size_port);
+   }
+
+   rv = getnameinfo((struct sockaddr *)&address->raw, sizeof(struct sockaddr_storage),
+                    address->address, size_address,
+                    address->port, size_port, NI_NUMERICHOST | NI_NUMERICSERV);
+
+   if(rv != 0)
+   {
+      fprintf(stderr, "Error getnameinfo: %s\n", gai_strerror(rv));
+      if(address->address != NULL)
+      {
+         free(address->address);
+      }
+      if(address->port != NULL)
+      {
+         free(address->port);
+      }
+   }
+
+}
+
+static void ryannet_getaddrinfo_dump(const char * node, const char * port)
+{
+
+   struct addrinfo hints, *servinfo, *p;
+   struct ryannet_address * address;
+   int rv;
+
+   address = ryannet_address_new();
+
+   memset(&hints, 0, sizeof(struct addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE; // Use any local IPV4 or IPV6 address I have
+   
+   rv = getaddrinfo(node, port, &hints, &servinfo);
+   if(rv != 0)
+   {
+      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+      return;
+   }
+
+   for(p = servinfo; p != NULL; p = p->ai_next)
+   {
+      memcpy(&address->raw, p->ai_addr, p->ai_addrlen);
+      ryannet_fill_address(address);
+      printf("getaddrinfo: %s : %s\n", address->address, address->port);
+
+   }
+   freeaddrinfo(servinfo);
+   ryannet_address_destroy(address);
+
+}
+
+struct ryannet_address * ryannet_address_new(void)
+{
+   struct ryannet_address * addy;
+   addy = malloc(sizeof(struct ryannet_address));
+   addy->address = NULL;
+   addy->port = NULL;
+   memset(&addy->raw, 0, sizeof(struct sockaddr_storage));
+   return addy;
+}
+
+int ryannet_address_set(struct ryannet_address * address, const char * node, const char * port)
+{
+   struct addrinfo hints, *servinfo, *p;
+   int rv;
+   socklen_t length;
+
+   if(ryannet_unix_is_address(node))
+   {
+#ifdef _WIN32
+      fprintf(stderr, "Error: Unix sockets not supported on this platform\n");
+      return 1;
+#else // _WIN32
+      if(ryannet_unix_set_raw(&address->raw, node, SOCK_DGRAM) == -1)
+      {
+         return 1;
+      }
+      ryannet_fill_address(address);
+      return 0;
+#endif // _WIN32
+   }
+
+   memset(&hints, 0, sizeof(struct addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   
+   rv = getaddrinfo(node, port, &hints, &servinfo);
+   if(rv != 0)
+   {
+      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+      return 1;
+   }
+
+   memcpy(&address->raw, servinfo->ai_addr, servinfo->ai_addrlen);
+   ryannet_fill_address(address);
+
+   freeaddrinfo(servinfo);
+   return 0;
+}
+
+void ryannet_address_destroy(struct ryannet_address * address)
+{
+   if(address->address != NULL)
+   {
+      free(address->address);
+   }
+   if(address->port != NULL)
+   {
+      free(address->port);
+   }
+   free(address);
+}
+
+const char * ryannet_address_get_address(struct ryannet_address * address)
+{
+   return address->address;
+}
+
+const char * ryannet_address_get_port(struct ryannet_address * address)
+{
+   return address->port;
+}
+
+
+// Shared memory transport used by tcp sockets bound or connected to "shm:name"
+#define SHM_SCHEME "shm:"
+#define SHM_SCHEME_SIZE 4
+#define SHM_NAME_SIZE 96
+#define SHM_BACKLOG 16
+#define SHM_RING_SIZE (256 * 1024)
+// Blocked calls wake this often to check the peer is still around
+#define SHM_WAIT_MS 100
+
+static int ryannet_shm_is_address(const char * address)
+{
+   return (address != NULL && strncmp(address, SHM_SCHEME, SHM_SCHEME_SIZE) == 0) ? 1 : 0;
+}
+
+#ifdef __linux__
+struct ryannet_shm_listener_shared
+{
+   volatile unsigned int sequence;
+   volatile long lock;
+   volatile unsigned int head;
+   volatile unsigned int tail;
+   char requests[SHM_BACKLOG][SHM_NAME_SIZE];
+};
+
+struct ryannet_shm_ring
+{
+   // The positions double as the futex words the other side sleeps on
+   volatile unsigned int write_position;
+   volatile unsigned int read_position;
+   volatile unsigned int reader_waiting;
+   volatile unsigned int writer_waiting;
+   volatile unsigned int closed;
+   unsigned char data[SHM_RING_SIZE];
+};
+
+struct ryannet_shm_connection_shared
+{
+   // 0 is client to server, 1 is server to client
+   struct ryannet_shm_ring rings[2];
+   // Set once the server holds its lock, see ryannet_shm_peer_is_alive
+   volatile unsigned int accepted;
+};
+
+// Each process holds a lock on its segment for as long as it has it open,
+// byte 0 for whoever created it and byte 1 for the server end of a
+// connection. The kernel drops them when a process dies, so a free lock
+// means the owner is gone.
+#define SHM_LOCK_CREATOR 0
+#define SHM_LOCK_SERVER 1
+
+struct ryannet_shm
+{
+   void * memory;
+   size_t size;
+   char * name;
+   int fd;
+   int listener_flag;
+   // Lock the other end holds, -1 for listeners
+   int peer_lock;
+   struct ryannet_shm_ring * send_ring;
+   struct ryannet_shm_ring * receive_ring;
+};
+
+static unsigned int ryannet_shm_counter = 0;
+
+static int ryannet_shm_lock(int fd, int lock)
+{
+   struct flock range;
+   memset(&range, 0, sizeof(struct flock));
+   range.l_type = F_WRLCK;
+   range.l_whence = SEEK_SET;
+   range.l_start = lock;
+   range.l_len = 1;
+   return fcntl(fd, F_OFD_SETLK, &range);
+}
+
+static int ryannet_shm_is_locked(int fd, int lock)
+{
+   struct flock range;
+   memset(&range, 0, sizeof(struct flock));
+   range.l_type = F_WRLCK;
+   range.l_whence = SEEK_SET;
+   range.l_start = lock;
+   range.l_len = 1;
+   if(fcntl(fd, F_OFD_GETLK, &range) == -1)
+   {
+      // Can't tell, so assume the owner is alive
+      return 1;
+   }
+   return range.l_type != F_UNLCK;
+}
+
+// Returns 0 when woken or the value moved, -1 on timeout
+static int ryannet_shm_wait(volatile unsigned int * address, unsigned int value)
+{
+   struct timespec timeout;
+   timeout.tv_sec = 0;
+   timeout.tv_nsec = SHM_WAIT_MS * 1000000L;
+   if(syscall(SYS_futex, address, FUTEX_WAIT, value, &timeout, NULL, 0) == -1 && errno == ETIMEDOUT)
+   {
+      return -1;
+   }
+   return 0;
+}
+
+static void ryannet_shm_wake(volatile unsigned int * address)
+{
+   (void)syscall(SYS_futex, address, FUTEX_WAKE, 0x7FFFFFFF, NULL, NULL, 0);
+}
+
+static struct ryannet_shm * ryannet_shm_map(const char * name, size_t size, int create_flag)
+{
+   struct ryannet_shm * shm;
+   void * memory;
+   int fd;
+
+   if(create_flag)
+   {
+      fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+      if(fd == -1 && errno == EEXIST)
+      {
+         // Only take the name over from an owner that died without cleaning up
+         fd = shm_open(name, O_RDWR, 0600);
+         if(fd != -1 && ryannet_shm_is_locked(fd, SHM_LOCK_CREATOR))
+         {
+            ryannet_close(fd);
+            fprintf(stderr, "Error: %s is in use by a running process\n", name);
+            errno = EADDRINUSE;
+            return NULL;
+         }
+         if(fd != -1)
+         {
+            ryannet_close(fd);
+         }
+         (void)shm_unlink(name);
+         fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+      }
+      if(fd != -1 && (ryannet_shm_lock(fd, SHM_LOCK_CREATOR) == -1 || ftruncate(fd, (off_t)size) == -1))
+      {
+         ryannet_close(fd);
+         (void)shm_unlink(name);
+         fd = -1;
+      }
+   }
+   else
+   {
+      fd = shm_open(name, O_RDWR, 0600);
+   }
+   if(fd == -1)
+   {
+      return NULL;
+   }
+
+   memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if(memory == MAP_FAILED)
+   {
+      ryannet_close(fd);
+      if(create_flag)
+      {
+         (void)shm_unlink(name);
+      }
+      return NULL;
+   }
+
+   shm = malloc(sizeof(struct ryannet_shm));
+   shm->memory = memory;
+   shm->size = size;
+   shm->name = ryannet_string_copy(name);
+   // Kept open for as long as the mapping, closing it drops our lock
+   shm->fd = fd;
+   shm->listener_flag = 0;
+   shm->peer_lock = -1;
+   shm->send_ring = NULL;
+   shm->receive_ring = NULL;
+   return shm;
+}
+
+static void ryannet_shm_destroy(struct ryannet_shm * shm)
+{
+   struct ryannet_shm_ring * rings[2];
+   int i;
+   if(shm->listener_flag)
+   {
+      (void)shm_unlink(shm->name);
+   }
+   else
+   {
+      rings[0] = shm->send_ring;
+      rings[1] = shm->receive_ring;
+      for(i = 0; i < 2; i++)
+      {
+         rings[i]->closed = 1;
+         __sync_synchronize();
+         ryannet_shm_wake(&rings[i]->write_position);
+         ryannet_shm_wake(&rings[i]->read_position);
+      }
+      // Normally gone after accept, this covers a connection never accepted
+      (void)shm_unlink(shm->name);
+   }
+   munmap(shm->memory, shm->size);
+   ryannet_close(shm->fd);
+   free(shm->name);
+   free(shm);
+}
+
+// Once the peer's lock is free it died, so close both rings the way a
+// clean shutdown would and let blocked calls return
+static int ryannet_shm_peer_is_alive(struct ryannet_shm * shm)
+{
+   struct ryannet_shm_connection_shared * connection;
+   connection = shm->memory;
+   if(shm->peer_lock == SHM_LOCK_SERVER && !connection->accepted)
+   {
+      // Not accepted yet, nothing to check
+      return 1;
+   }
+   if(ryannet_shm_is_locked(shm->fd, shm->peer_lock))
+   {
+      return 1;
+   }
+   shm->send_ring->closed = 1;
+   shm->receive_ring->closed = 1;
+   __sync_synchronize();
+   return 0;
+}
+
+static struct ryannet_shm * ryannet_shm_listen(const char * address)
+{
+   struct ryannet_shm * shm;
+   char name[SHM_NAME_SIZE];
+
+   snprintf(name, SHM_NAME_SIZE, "/ryannet-%s", address + SHM_SCHEME_SIZE);
+   shm = ryannet_shm_map(name, sizeof(struct ryannet_shm_listener_shared), 1);
+   if(shm != NULL)
+   {
+      shm->listener_flag = 1;
+   }
+   return shm;
+}
+
+static struct ryannet_shm * ryannet_shm_connect(const char * address)
+{
+   struct ryannet_shm * listener, * shm;
+   struct ryannet_shm_listener_shared * shared;
+   struct ryannet_shm_connection_shared * connection;
+   char name[SHM_NAME_SIZE];
+   int queued_flag;
+
+   snprintf(name, SHM_NAME_SIZE, "/ryannet-%s", address + SHM_SCHEME_SIZE);
+   listener = ryannet_shm_map(name, sizeof(struct ryannet_shm_listener_shared), 0);
+   if(listener != NULL && !ryannet_shm_is_locked(listener->fd, SHM_LOCK_CREATOR))
+   {
+      // Left behind by a listener that died
+      munmap(listener->memory, listener->size);
+      ryannet_close(listener->fd);
+      free(listener->name);
+      free(listener);
+      listener = NULL;
+   }
+   if(listener == NULL)
+   {
+      return NULL;
+   }
+
+   snprintf(name, SHM_NAME_SIZE, "/ryannet-%s-%d-%u", address + SHM_SCHEME_SIZE,
+            (int)getpid(), ryannet_atomic_increment(&ryannet_shm_counter));
+   shm = ryannet_shm_map(name, sizeof(struct ryannet_shm_connection_shared), 1);
+   if(shm == NULL)
+   {
+      ryannet_shm_destroy(listener);
+      return NULL;
+   }
+   connection = shm->memory;
+   shm->peer_lock = SHM_LOCK_SERVER;
+   shm->send_ring = &connection->rings[0];
+   shm->receive_ring = &connection->rings[1];
+
+   // Post the connection for accept
+   shared = listener->memory;
+   while(ryannet_atomic_lock(&shared->lock))
+   {
+      ryannet_yield();
+   }
+   if(shared->head - shared->tail < SHM_BACKLOG)
+   {
+      memcpy(shared->requests[shared->head % SHM_BACKLOG], name, SHM_NAME_SIZE);
+      __sync_synchronize();
+      shared->head ++;
+      queued_flag = 1;
+   }
+   else
+   {
+      queued_flag = 0;
+   }
+   ryannet_atomic_unlock(&shared->lock);
+
+   if(queued_flag)
+   {
+      (void)ryannet_atomic_increment(&shared->sequence);
+      ryannet_shm_wake(&shared->sequence);
+   }
+   else
+   {
+      ryannet_shm_destroy(shm);
+      shm = NULL;
+   }
+   // The listener mapping was only needed to post the request
+   munmap(listener->memory, listener->size);
+   ryannet_close(listener->fd);
+   free(listener->name);
+   free(listener);
+   return shm;
+}
+
+static struct ryannet_shm * ryannet_shm_accept(struct ryannet_shm * listener, int nonblock_flag)
+{
+   struct ryannet_shm_listener_shared * shared;
+   struct ryannet_shm_connection_shared * connection;
+   struct ryannet_shm * shm;
+   char name[SHM_NAME_SIZE];
+   unsigned int sequence;
+
+   shared = listener->memory;
+   shm = NULL;
+   while(shm == NULL)
+   {
+      sequence = shared->sequence;
+      __sync_synchronize();
+      if(shared->head == shared->tail)
+      {
+         if(nonblock_flag)
+         {
+            return NULL;
+         }
+         ryannet_shm_wait(&shared->sequence, sequence);
+         continue;
+      }
+
+      // Only the owner of the listener takes requests, so the tail needs no lock
+      memcpy(name, shared->requests[shared->tail % SHM_BACKLOG], SHM_NAME_SIZE);
+      __sync_synchronize();
+      shared->tail ++;
+
+      shm = ryannet_shm_map(name, sizeof(struct ryannet_shm_connection_shared), 0);
+      if(shm != NULL && ryannet_shm_lock(shm->fd, SHM_LOCK_SERVER) == -1)
+      {
+         ryannet_close(shm->fd);
+         munmap(shm->memory, shm->size);
+         free(shm->name);
+         free(shm);
+         shm = NULL;
+      }
+      if(shm != NULL)
+      {
+         (void)shm_unlink(name);
+         connection = shm->memory;
+         connection->accepted = 1;
+         shm->peer_lock = SHM_LOCK_CREATOR;
+         shm->send_ring = &connection->rings[1];
+         shm->receive_ring = &connection->rings[0];
+      }
+      else if(nonblock_flag)
+      {
+         return NULL;
+      }
+   }
+   return shm;
+}
+
+static int ryannet_shm_send(struct ryannet_shm * shm, const void * buffer, int buffer_size_in_bytes, int nonblock_flag)
+{
+   struct ryannet_shm_ring * ring;
+   unsigned int write_position, read_position, space, chunk, index;
+   int bytes_sent;
+
+   ring = shm->send_ring;
+   bytes_sent = 0;
+   while(bytes_sent < buffer_size_in_bytes)
+   {
+      if(ring->closed)
+      {
+         return bytes_sent > 0 ? bytes_sent : -1;
+      }
+      write_position = ring->write_position;
+      read_position = ring->read_position;
+      __sync_synchronize();
+      space = SHM_RING_SIZE - (write_position - read_position);
+      if(space == 0)
+      {
+         if(nonblock_flag)
+         {
+            break;
+         }
+         ring->writer_waiting = 1;
+         __sync_synchronize();
+         if(ring->read_position == read_position && !ring->closed &&
+            ryannet_shm_wait(&ring->read_position, read_position) == -1)
+         {
+            (void)ryannet_shm_peer_is_alive(shm);
+         }
+         ring->writer_waiting = 0;
+         continue;
+      }
+
+      if(space > (unsigned int)(buffer_size_in_bytes - bytes_sent))
+      {
+         space = (unsigned int)(buffer_size_in_bytes - bytes_sent);
+      }
+      index = write_position % SHM_RING_SIZE;
+      chunk = SHM_RING_SIZE - index;
+      if(chunk > space)
+      {
+         chunk = space;
+      }
+      memcpy(ring->data + index, (const char *)buffer + bytes_sent, chunk);
+      memcpy(ring->data, (const char *)buffer + bytes_sent + chunk, space - chunk);
+      __sync_synchronize();
+      ring->write_position = write_position + space;
+      __sync_synchronize();
+      if(ring->reader_waiting)
+      {
+         ryannet_shm_wake(&ring->write_position);
+      }
+      bytes_sent += (int)space;
+   }
+   return bytes_sent;
+}
+
+static int ryannet_shm_receive(struct ryannet_shm * shm, void * buffer, int buffer_size_in_bytes, int nonblock_flag)
+{
+   struct ryannet_shm_ring * ring;
+   unsigned int write_position, read_position, available, chunk, index;
+
+   ring = shm->receive_ring;
+   for(;;)
+   {
+      write_position = ring->write_position;
+      read_position = ring->read_position;
+      __sync_synchronize();
+      available = write_position - read_position;
+      if(available > 0)
+      {
+         break;
+      }
+      if(ring->closed || nonblock_flag)
+      {
+         return 0;
+      }
+      ring->reader_waiting = 1;
+      __sync_synchronize();
+      if(ring->write_position == write_position && !ring->closed &&
+         ryannet_shm_wait(&ring->write_position, write_position) == -1)
+      {
+         (void)ryannet_shm_peer_is_alive(shm);
+      }
+      ring->reader_waiting = 0;
+   }
+
+   if(available > (unsigned int)buffer_size_in_bytes)
+   {
+      available = (unsigned int)buffer_size_in_bytes;
+   }
+   index = read_position % SHM_RING_SIZE;
+   chunk = SHM_RING_SIZE - index;
+   if(chunk > available)
+   {
+      chunk = available;
+   }
+   memcpy(buffer, ring->data + index, chunk);
+   memcpy((char *)buffer + chunk, ring->data, available - chunk);
+   __sync_synchronize();
+   ring->read_position = read_position + available;
+   __sync_synchronize();
+   if(ring->writer_waiting)
+   {
+      ryannet_shm_wake(&ring->read_position);
+   }
+   return (int)available;
+}
+
+// Closes only the ring we write, the peer reads what is left then sees 0
+static void ryannet_shm_shutdown(struct ryannet_shm * shm)
+{
+   shm->send_ring->closed = 1;
+   __sync_synchronize();
+   ryannet_shm_wake(&shm->send_ring->write_position);
+}
+
+static int ryannet_shm_is_closed(struct ryannet_shm * shm)
+{
+   return shm->listener_flag == 0 &&
+          shm->receive_ring->closed &&
+          shm->receive_ring->write_position == shm->receive_ring->read_position;
+}
+#else // __linux__
+struct ryannet_shm
+{
+   int unused;
+};
+
+static void ryannet_shm_destroy(struct ryannet_shm * shm)
+{
+   free(shm);
+}
+
+static struct ryannet_shm * ryannet_shm_listen(const char * address)
+{
+   (void)address;
+   fprintf(stderr, "Error: Shared memory transport not supported on this platform\n");
+   return NULL;
+}
+
+static struct ryannet_shm * ryannet_shm_connect(const char * address)
+{
+   (void)address;
+   fprintf(stderr, "Error: Shared memory transport not supported on this platform\n");
+   return NULL;
+}
+
+static struct ryannet_shm * ryannet_shm_accept(struct ryannet_shm * listener, int nonblock_flag)
+{
+   (void)listener;
+   (void)nonblock_flag;
+   return NULL;
+}
+
+static int ryannet_shm_send(struct ryannet_shm * shm, const void * buffer, int buffer_size_in_bytes, int nonblock_flag)
+{
+   (void)shm;
+   (void)buffer;
+   (void)buffer_size_in_bytes;
+   (void)nonblock_flag;
+   return -1;
+}
+
+static int ryannet_shm_receive(struct ryannet_shm * shm, void * buffer, int buffer_size_in_bytes, int nonblock_flag)
+{
+   (void)shm;
+   (void)buffer;
+   (void)buffer_size_in_bytes;
+   (void)nonblock_flag;
+   return -1;
+}
+
+static void ryannet_shm_shutdown(struct ryannet_shm * shm)
+{
+   (void)shm;
+}
+
+static int ryannet_shm_is_closed(struct ryannet_shm * shm)
+{
+   (void)shm;
+   return 1;
+}
+#endif // __linux__
+
+static void ryannet_shm_fill_address(struct ryannet_address * address, const char * name)
+{
+   if(address->address != NULL)
+   {
+      free(address->address);
+   }
+   if(address->port != NULL)
+   {
+      free(address->port);
+   }
+   address->address = ryannet_string_copy(name);
+   address->port = ryannet_string_copy("");
+}
+
+struct ryannet_socket_tcp * ryannet_socket_tcp_new(void)
+{
+   struct ryannet_socket_tcp * socket;
+   socket = malloc(sizeof(struct ryannet_socket_tcp));
+   socket->fd = -1;
+   socket->unlink_flag = 0;
+   socket->shm = NULL;
+   socket->local.address = NULL;
+   socket->local.port = NULL;
+   memset(&socket->local.raw, 0, sizeof(struct sockaddr_storage));
+   socket->remote.address = NULL;
+   socket->remote.port = NULL;
+   memset(&socket->remote.raw, 0, sizeof(struct sockaddr_storage));
+   socket->connected_flag = 0;
+   socket->remote_closed_flag = 0;
+   socket->fastopen_flag = 0;
+   socket->compression = NULL;
+   socket->timestamps = NULL;
+   socket->recorder = NULL;
+   socket->queue_incoming = NULL;
+   socket->queue_head = NULL;
+   socket->queue_tail = NULL;
+   socket->queue_offset = 0;
+   socket->wake_fd[0] = -1;
+   socket->wake_fd[1] = -1;
+   return socket;
+}
+
+// Per connection compression state, see ryannet_socket_tcp_enable_compression
+struct ryannet_compression
+{
+   struct ryannet_compressor * compressor;
+   struct ryannet_decompressor * decompressor;
+   unsigned char * staging;
+   unsigned char * input;
+   int input_start;
+   int input_end;
+   // Decoded bytes still in the decompressor's history for the caller
+   int pending_start;
+   int pending_size;
+};
+
+static void ryannet_compression_destroy(struct ryannet_compression * compression)
+{
+   ryannet_compressor_destroy(compression->compressor);
+   ryannet_decompressor_destroy(compression->decompressor);
+   ryannet_buffer_free(compression->staging);
+   ryannet_buffer_free(compression->input);
+   free(compression);
+}
+
+void ryannet_socket_tcp_destroy(struct ryannet_socket_tcp * socket)
+{
+   struct ryannet_queued_message * queued;
+   if(socket->fd != -1)
+   {
+      ryannet_close(socket->fd);
+   }
+#ifndef _WIN32
+   if(socket->unlink_flag)
+   {
+      (void)unlink(((struct sockaddr_un *)&socket->local.raw)->sun_path);
+   }
+#endif // _WIN32
+   if(socket->shm != NULL)
+   {
+      ryannet_shm_destroy(socket->shm);
+   }
+   if(socket->compression != NULL)
+   {
+      ryannet_compression_destroy(socket->compression);
+   }
+#ifndef _WIN32
+   if(socket->wake_fd[0] != -1)
+   {
+      close(socket->wake_fd[0]);
+      if(socket->wake_fd[1] != socket->wake_fd[0])
+      {
+         close(socket->wake_fd[1]);
+      }
+   }
+#endif // _WIN32
+   free(socket->timestamps);
+   while(socket->queue_incoming != NULL)
+   {
+      queued = socket->queue_incoming;
+      socket->queue_incoming = queued->next;
+      ryannet_message_release(queued->message);
+      free(queued);
+   }
+   while(socket->queue_head != NULL)
+   {
+      queued = socket->queue_head;
+      socket->queue_head = queued->next;
+      ryannet_message_release(queued->message);
+      free(queued);
+   }
+   if(socket->local.address != NULL)
+   {
+      free(socket->local.address);
+   }
+   if(socket->local.port != NULL)
+   {
+      free(socket->local.port);
    }
    if(socket->remote.address != NULL)
    {
-      free(socket->remote.address);
+      free(socket->remote.address);
+   }
+   if(socket->remote.port != NULL)
+   {
+      free(socket->remote.port);
+   }
+   free(socket);
+}
+
+
+static int ryannet_set_tcp_nodelay(int fd)
+{
+   int rv;
+#ifdef _WIN32
+   char yes = TRUE;
+   int length = sizeof(BOOL);
+#else // _WIN32
+   int yes = 1;
+   socklen_t length = sizeof(int);
+#endif // _WIN32
+   if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, length) == -1)
+   {
+      rv = 1;
+   }
+   else
+   {
+      rv = 0;
+   }
+   return rv;
+}
+
+#ifdef TCP_FASTOPEN
+// Pending fast open connections a listener will hold before falling back
+#define FASTOPEN_QUEUE_LENGTH 128
+static int ryannet_set_fastopen(int fd)
+{
+   int rv;
+#ifdef _WIN32
+   DWORD yes = 1;
+   int length = sizeof(DWORD);
+#else // _WIN32
+   int yes = FASTOPEN_QUEUE_LENGTH;
+   socklen_t length = sizeof(int);
+#endif // _WIN32
+   if(setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (const void *)&yes, length) == -1)
+   {
+      rv = 1;
+   }
+   else
+   {
+      rv = 0;
+   }
+   return rv;
+}
+#endif // TCP_FASTOPEN
+
+static int ryannet_set_reuseaddr(int fd)
+{
+   int rv;
+#ifdef _WIN32
+   char yes = TRUE;
+   int length = sizeof(BOOL);
+#else // _WIN32
+   int yes = 1;
+   socklen_t length = sizeof(int);
+#endif // _WIN32
+   if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, length) == -1)
+   {
+      rv = 1;
+   }
+   else
+   {
+      rv = 0;
+   }
+   return rv;
+}
+
+static int ryannet_clear_v6only(int fd, int family)
+{
+   int rv;
+#ifdef _WIN32
+   char no = FALSE;
+   int length = sizeof(BOOL);
+#else // _WIN32
+   int no = 0;
+   socklen_t length = sizeof(int);
+#endif // _WIN32
+   if(family == AF_INET6)
+   {
+      if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, length) == -1)
+      {
+         rv = 1;
+      }
+      else
+      {
+         rv = 0;
+      }
+   }
+   else
+   {
+      rv = 0;
+   }
+
+   return rv;
+}
+
+static int ryannet_socket_unix_open(const char * address, int default_type, struct sockaddr_storage * raw)
+{
+#ifdef _WIN32
+   (void)address;
+   (void)default_type;
+   (void)raw;
+   fprintf(stderr, "Error: Unix sockets not supported on this platform\n");
+   return -1;
+#else // _WIN32
+   int type;
+   type = ryannet_unix_set_raw(raw, address, default_type);
+   if(type == -1)
+   {
+      return -1;
+   }
+   return socket(AF_UNIX, type, 0);
+#endif // _WIN32
+}
+
+static int ryannet_socket_tcp_connect_unix(struct ryannet_socket_tcp * sock, const char * remote_address)
+{
+   socklen_t length;
+
+   sock->fd = ryannet_socket_unix_open(remote_address, SOCK_STREAM, &sock->remote.raw);
+   if(sock->fd != -1 &&
+      connect(sock->fd, (struct sockaddr *)&sock->remote.raw, ryannet_address_raw_length(&sock->remote.raw)) == -1)
+   {
+      ryannet_close(sock->fd);
+      sock->fd = -1;
+   }
+   if(sock->fd == -1)
+   {
+      fprintf(stderr, "Error: Couldn't Connect to %s\n", remote_address);
+      return 1;
+   }
+   ryannet_fill_address(&sock->remote);
+   length = sizeof(struct sockaddr_storage);
+   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
+   ryannet_fill_address(&sock->local);
+   sock->connected_flag = 1;
+   return 0;
+}
+
+static int ryannet_socket_tcp_bind_unix(struct ryannet_socket_tcp * sock, const char * bind_address)
+{
+   sock->fd = ryannet_socket_unix_open(bind_address, SOCK_STREAM, &sock->local.raw);
+   if(sock->fd != -1)
+   {
+      if(
+#ifndef _WIN32
+         ryannet_unix_unlink_stale(sock->fd, &sock->local.raw) == -1 ||
+#endif // _WIN32
+         bind(sock->fd, (struct sockaddr *)&sock->local.raw, ryannet_address_raw_length(&sock->local.raw)) == -1 ||
+         listen(sock->fd, 10) == -1)
+      {
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+      }
+   }
+   if(sock->fd == -1)
+   {
+      fprintf(stderr, "Error: Couldn't Bind to %s\n", bind_address);
+      return 1;
+   }
+#ifndef _WIN32
+   sock->unlink_flag = ((struct sockaddr_un *)&sock->local.raw)->sun_path[0] != '\0';
+#endif // _WIN32
+   ryannet_fill_address(&sock->local);
+   sock->connected_flag = 1;
+   return 0;
+}
+
+// Connects and sends the first bytes, in the SYN when fast open allows it
+static int ryannet_socket_tcp_connect_data(struct ryannet_socket_tcp * sock, const char * remote_address, const char * remote_port, const void * buffer, int buffer_size_in_bytes)
+{
+   struct addrinfo hints, *servinfo, *p;
+   int rv, bytes_sent;
+   socklen_t length;
+
+   bytes_sent = -1;
+   if(ryannet_shm_is_address(remote_address))
+   {
+      sock->shm = ryannet_shm_connect(remote_address);
+      if(sock->shm == NULL)
+      {
+         fprintf(stderr, "Error: Couldn't Connect to %s\n", remote_address);
+         return -1;
+      }
+      ryannet_shm_fill_address(&sock->local, remote_address);
+      ryannet_shm_fill_address(&sock->remote, remote_address);
+      sock->connected_flag = 1;
+      return buffer_size_in_bytes > 0 ? ryannet_socket_tcp_send(sock, buffer, buffer_size_in_bytes) : 0;
+   }
+   if(ryannet_unix_is_address(remote_address))
+   {
+      if(ryannet_socket_tcp_connect_unix(sock, remote_address) != 0)
+      {
+         return -1;
+      }
+      return buffer_size_in_bytes > 0 ? ryannet_socket_tcp_send(sock, buffer, buffer_size_in_bytes) : 0;
+   }
+
+   memset(&hints, 0, sizeof(struct addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   
+   rv = getaddrinfo(remote_address, remote_port, &hints, &servinfo);
+   if(rv != 0)
+   {
+      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+      return -1;
+   }
+
+   for(p = servinfo; p != NULL; p = p->ai_next)
+   {
+      sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+      if(sock->fd == -1)
+      {
+         // TODO: Maybe Error Handling
+         continue;
+      }
+
+
+      rv = ryannet_set_tcp_nodelay(sock->fd);
+      if(rv == 1)
+      {
+         // TODO: Maybe Error Handling
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         continue;
+      }
+
+#ifdef MSG_FASTOPEN
+      if(sock->fastopen_flag && buffer_size_in_bytes > 0)
+      {
+         // With a cached cookie the data goes in the SYN, without one the
+         // kernel does a normal handshake and sends it right after
+         bytes_sent = (int)sendto(sock->fd, buffer, (size_t)buffer_size_in_bytes, MSG_FASTOPEN, p->ai_addr, p->ai_addrlen);
+         if(bytes_sent == -1 && errno == EOPNOTSUPP)
+         {
+            // Client fast open is turned off on this machine
+            rv = connect(sock->fd, p->ai_addr, p->ai_addrlen);
+         }
+         else
+         {
+            rv = bytes_sent == -1 ? -1 : 0;
+         }
+      }
+      else
+#endif // MSG_FASTOPEN
+      {
+         rv = connect(sock->fd, p->ai_addr, p->ai_addrlen);
+      }
+      if(rv == -1)
+      {
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         // TODO: Maybe Error Handling
+         continue;
+      }
+      break;
+   }
+
+
+   if(sock->fd == -1)
+   {
+      // TODO: Error Handing
+      fprintf(stderr, "Error: Couldn't Connect to %s : %s\n", remote_address, remote_port);
+      freeaddrinfo(servinfo);
+      return -1;
+   }
+
+
+   // Copy Local
+   length = sizeof(struct sockaddr_storage);
+   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
+   ryannet_fill_address(&sock->local);
+   // Copy Remote
+   memcpy(&sock->remote.raw, p->ai_addr, p->ai_addrlen);
+   ryannet_fill_address(&sock->remote);
+   
+   sock->connected_flag = 1;
+
+   freeaddrinfo(servinfo);
+
+   if(buffer_size_in_bytes <= 0)
+   {
+      return 0;
+   }
+   if(bytes_sent == -1)
+   {
+      return ryannet_socket_tcp_send(sock, buffer, buffer_size_in_bytes);
+   }
+   ryannet_recorder_write(sock->recorder, RYANNET_RECORD_SENT | RYANNET_RECORD_TCP, &sock->remote.raw, buffer, bytes_sent);
+   return bytes_sent;
+}
+
+int ryannet_socket_tcp_connect(struct ryannet_socket_tcp * sock, const char * remote_address, const char * remote_port)
+{
+   return ryannet_socket_tcp_connect_data(sock, remote_address, remote_port, NULL, 0) == -1 ? 1 : 0;
+}
+
+int ryannet_socket_tcp_connect_with_data(struct ryannet_socket_tcp * sock, const char * remote_address, const char * remote_port, const void * buffer, int buffer_size_in_bytes)
+{
+   return ryannet_socket_tcp_connect_data(sock, remote_address, remote_port, buffer, buffer_size_in_bytes);
+}
+
+int ryannet_socket_tcp_enable_fastopen(struct ryannet_socket_tcp * socket)
+{
+#ifdef TCP_FASTOPEN
+   socket->fastopen_flag = 1;
+   return 0;
+#else // TCP_FASTOPEN
+   (void)socket;
+   return 1;
+#endif // TCP_FASTOPEN
+}
+
+int ryannet_socket_tcp_bind(struct ryannet_socket_tcp * sock, const char * bind_address, const char * bind_port)
+{
+   struct addrinfo hints, *servinfo, *p;
+   int rv;
+   socklen_t length;
+
+   //ryannet_getaddrinfo_dump(bind_address, bind_port);
+
+   if(ryannet_shm_is_address(bind_address))
+   {
+      sock->shm = ryannet_shm_listen(bind_address);
+      if(sock->shm == NULL)
+      {
+         fprintf(stderr, "Error: Couldn't Bind to %s\n", bind_address);
+         return 1;
+      }
+      ryannet_shm_fill_address(&sock->local, bind_address);
+      sock->connected_flag = 1;
+      return 0;
+   }
+   if(ryannet_unix_is_address(bind_address))
+   {
+      return ryannet_socket_tcp_bind_unix(sock, bind_address);
+   }
+
+   memset(&hints, 0, sizeof(struct addrinfo));
+   if(bind_address == NULL)
+   {
+      // Windows and linux have differing opinons on what to do here, so
+      // we will take the choice away
+      hints.ai_family = AF_INET;
+   }
+   else
+   {
+      hints.ai_family = AF_UNSPEC;
+   }
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE; // Use any local IPV4 or IPV6 address I have
+   
+   rv = getaddrinfo(bind_address, bind_port, &hints, &servinfo);
+   if(rv != 0)
+   {
+      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+      return 1;
+   }
+
+   for(p = servinfo; p != NULL; p = p->ai_next)
+   {
+      sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+      if(sock->fd == -1)
+      {
+         // TODO: Maybe Error Handling
+         continue;
+      }
+
+
+      rv = ryannet_set_reuseaddr(sock->fd);
+      if(rv == 1)
+      {
+         // TODO: Maybe Error Handling
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         continue;
+      }
+
+      rv = ryannet_clear_v6only(sock->fd, p->ai_family);
+      if(rv == 1)
+      {
+         // TODO: Maybe Error Handling
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         continue;
+      }
+
+      rv = bind(sock->fd, p->ai_addr, p->ai_addrlen);
+      if(rv == -1)
+      {
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         // TODO: Maybe Error Handling
+         continue;
+      }
+      break;
+   }
+
+#ifdef TCP_FASTOPEN
+   if(sock->fd != -1 && sock->fastopen_flag)
+   {
+      // Not fatal, the listener just won't hand out cookies
+      (void)ryannet_set_fastopen(sock->fd);
+   }
+#endif // TCP_FASTOPEN
+   if(sock->fd != -1)
+   {
+      rv = listen(sock->fd, 10);
+      if(rv == -1)
+      {
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         // TODO: Error Handling
+      }
+   }
+
+
+   if(sock->fd == -1)
+   {
+      // TODO: Error Handing
+      fprintf(stderr, "Error: Couldn't Bind to %s : %s\n", bind_address, bind_port);
+      return 1;
+   }
+   
+   // Copy Local
+   length = sizeof(struct sockaddr_storage);
+   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
+   ryannet_fill_address(&sock->local);
+
+   sock->connected_flag = 1;
+   freeaddrinfo(servinfo);
+
+   return 0;
+   
+}
+
+static struct ryannet_socket_tcp * ryannet_socket_tcp_accept_shm(struct ryannet_socket_tcp * socket, int nonblock_flag)
+{
+   struct ryannet_socket_tcp * new_socket;
+   struct ryannet_shm * shm;
+   shm = ryannet_shm_accept(socket->shm, nonblock_flag);
+   if(shm == NULL)
+   {
+      return NULL;
+   }
+   new_socket = ryannet_socket_tcp_new();
+   new_socket->shm = shm;
+   ryannet_shm_fill_address(&new_socket->local, socket->local.address);
+   ryannet_shm_fill_address(&new_socket->remote, socket->local.address);
+   new_socket->connected_flag = 1;
+   return new_socket;
+}
+
+struct ryannet_socket_tcp * ryannet_socket_tcp_accept(struct ryannet_socket_tcp * socket)
+{
+   struct ryannet_socket_tcp * new_socket;
+   socklen_t length;
+   if(socket->shm != NULL)
+   {
+      return ryannet_socket_tcp_accept_shm(socket, 0);
+   }
+   length = sizeof(struct sockaddr_storage);
+   new_socket = ryannet_socket_tcp_new();
+   new_socket->fd = accept(socket->fd, (struct sockaddr *)&new_socket->remote.raw, &length);
+   if(new_socket->fd == -1)
+   {
+      // TODO: Error Handling
+      fprintf(stderr, "Error durring accept: %s\n", strerror(errno));
+      ryannet_socket_tcp_destroy(new_socket);
+      return NULL;
+   }
+
+   (void)ryannet_set_tcp_nodelay(new_socket->fd);
+
+   // Copy Remote
+   ryannet_fill_address(&new_socket->remote);
+
+   // Copy Local
+   length = sizeof(struct sockaddr_storage);
+   getsockname(new_socket->fd, (struct sockaddr *)&new_socket->local.raw, &length);
+   ryannet_fill_address(&new_socket->local);
+
+   new_socket->connected_flag = 1;
+   return new_socket;
+}
+
+struct ryannet_socket_tcp * ryannet_socket_tcp_accept_nonblock(struct ryannet_socket_tcp * socket)
+{
+   struct ryannet_socket_tcp * new_socket;
+   int rv;
+#ifdef _WIN32
+   WSAPOLLFD fds;
+#else // _WIN32
+   struct pollfd fds;
+#endif // _WIN32
+   if(socket->shm != NULL)
+   {
+      return ryannet_socket_tcp_accept_shm(socket, 1);
+   }
+#ifdef _WIN32
+   fds.fd = socket->fd;
+   fds.events = POLLRDNORM;
+
+   rv = WSAPoll(&fds, 1, 0);
+#else // _WIN32
+   fds.fd = socket->fd;
+   fds.events = POLLIN;
+
+   rv = poll(&fds, 1, 0);
+#endif // _WIN32
+   if(rv > 0)
+   {
+      new_socket = ryannet_socket_tcp_accept(socket);
+   }
+   else if(rv < 0)
+   {
+      // Error Here
+      fprintf(stderr, "polling Error: %s\n", strerror(errno));
+      new_socket = NULL;
+   }
+   else
+   {
+      new_socket = NULL;
+   }
+
+      
+
+   return new_socket;
+}
+
+static int ryannet_socket_tcp_receive_stamped(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes, long long * kernel_ns)
+{
+   int bytes_received;
+#ifdef RYANNET_TIMESTAMPING
+   union
+   {
+      char buffer[128];
+      struct cmsghdr align;
+   } control;
+   struct msghdr header;
+   struct iovec vector;
+#endif // RYANNET_TIMESTAMPING
+
+   if(kernel_ns != NULL)
+   {
+      *kernel_ns = 0;
+   }
+   if(socket->shm != NULL)
+   {
+      bytes_received = ryannet_shm_receive(socket->shm, buffer, buffer_size_in_bytes, 0);
+   }
+#ifdef RYANNET_TIMESTAMPING
+   else if(socket->timestamps != NULL)
+   {
+      vector.iov_base = buffer;
+      vector.iov_len = (size_t)buffer_size_in_bytes;
+      memset(&header, 0, sizeof(struct msghdr));
+      header.msg_iov = &vector;
+      header.msg_iovlen = 1;
+      header.msg_control = control.buffer;
+      header.msg_controllen = sizeof(control.buffer);
+      bytes_received = -1;
+      if(ryannet_timestamps_wait(socket->timestamps, socket->fd) == 0)
+      {
+         bytes_received = (int)recvmsg(socket->fd, &header, 0);
+      }
+      if(bytes_received > 0)
+      {
+         long long stamp;
+         stamp = ryannet_timestamps_received(socket->timestamps, &header);
+         if(kernel_ns != NULL)
+         {
+            *kernel_ns = stamp;
+         }
+      }
+   }
+#endif // RYANNET_TIMESTAMPING
+   else
+   {
+      bytes_received = recv(socket->fd, buffer, (size_t)buffer_size_in_bytes, 0);
+   }
+   if(bytes_received == 0)
+   {
+      socket->remote_closed_flag = 1;
+   }
+   else if(bytes_received == -1)
+   {
+      fprintf(stderr, "Error durring receive: %s\n", strerror(errno));
+   }
+   else
+   {
+      ryannet_recorder_write(socket->recorder, RYANNET_RECORD_TCP, &socket->remote.raw, buffer, bytes_received);
+   }
+   return bytes_received;
+}
+
+int ryannet_socket_tcp_receive(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes)
+{
+   return ryannet_socket_tcp_receive_stamped(socket, buffer, buffer_size_in_bytes, NULL);
+}
+
+int ryannet_socket_tcp_receive_timestamped(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes, long long * kernel_ns)
+{
+   return ryannet_socket_tcp_receive_stamped(socket, buffer, buffer_size_in_bytes, kernel_ns);
+}
+
+int ryannet_socket_tcp_receive_nonblock(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes)
+{
+   int bytes_sent;
+   int rv;
+#ifdef _WIN32
+   WSAPOLLFD fds;
+#else // _WIN32
+   struct pollfd fds;
+#endif // _WIN32
+   if(socket->shm != NULL)
+   {
+      bytes_sent = ryannet_shm_receive(socket->shm, buffer, buffer_size_in_bytes, 1);
+      if(bytes_sent == 0 && ryannet_shm_is_closed(socket->shm))
+      {
+         socket->remote_closed_flag = 1;
+      }
+      return bytes_sent;
+   }
+#ifdef _WIN32
+   fds.fd = socket->fd;
+   fds.events = POLLRDNORM;
+
+   rv = WSAPoll(&fds, 1, 0);
+#else // _WIN32
+   fds.fd = socket->fd;
+   fds.events = POLLIN;
+
+   rv = poll(&fds, 1, 0);
+#endif // _WIN32
+#ifdef RYANNET_TIMESTAMPING
+   if(rv > 0 && socket->timestamps != NULL)
+   {
+      // Transmit timestamps on the error queue wake poll too
+      (void)ryannet_timestamps_collect(socket->timestamps, socket->fd);
+      if(!(fds.revents & (POLLIN | POLLHUP)))
+      {
+         // An error still pending once the timestamps are drained goes to
+         // the receive so it gets reported
+         fds.revents = 0;
+         rv = poll(&fds, 1, 0);
+         if(rv > 0 && !(fds.revents & (POLLIN | POLLHUP | POLLERR)))
+         {
+            rv = 0;
+         }
+      }
+   }
+#endif // RYANNET_TIMESTAMPING
+   if(rv > 0)
+   {
+      bytes_sent = ryannet_socket_tcp_receive(socket, buffer, buffer_size_in_bytes);
+   }
+   else if(rv < 0)
+   {
+      // Error
+      bytes_sent = -1;
+      fprintf(stderr, "Error durring poll: %s\n", strerror(errno));
+   }
+   else
+   {
+      bytes_sent = 0;
+   }
+   return bytes_sent;
+
+}
+
+void * ryannet_socket_tcp_receive_buffer(struct ryannet_socket_tcp * socket, int max_size_in_bytes, int * received_bytes)
+{
+   void * buffer;
+   buffer = ryannet_buffer_alloc(max_size_in_bytes);
+   *received_bytes = ryannet_socket_tcp_receive(socket, buffer, max_size_in_bytes);
+   if(*received_bytes <= 0)
+   {
+      ryannet_buffer_free(buffer);
+      buffer = NULL;
+   }
+   return buffer;
+}
+
+int ryannet_socket_tcp_send(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes)
+{
+   int bytes_sent;
+
+   if(socket->shm != NULL)
+   {
+      bytes_sent = ryannet_shm_send(socket->shm, buffer, buffer_size_in_bytes, 0);
+   }
+   else
+   {
+      ryannet_timestamps_begin(socket->timestamps);
+      bytes_sent = (int)send(socket->fd, buffer, (size_t)buffer_size_in_bytes, 0);
+      ryannet_timestamps_sent(socket->timestamps, bytes_sent);
+   }
+   if(bytes_sent == -1)
+   {
+      fprintf(stderr, "Error durring send: %s\n", strerror(errno));
+   }
+   else
+   {
+      ryannet_recorder_write(socket->recorder, RYANNET_RECORD_SENT | RYANNET_RECORD_TCP, &socket->remote.raw, buffer, bytes_sent);
+   }
+   return bytes_sent;
+}
+
+#define SEND_FILE_CHUNK_SIZE 0x7ffff000
+#define SEND_FILE_BUFFER_SIZE 16384
+static long long ryannet_socket_tcp_send_file_chunk(struct ryannet_socket_tcp * socket, int file_fd, long long offset, long long count, int nonblock_flag)
+{
+   long long bytes_sent;
+   // No zero copy path that can stop when the socket is full, so anything
+   // nonblocking bounces through a buffer with one read per send
+   char buffer[SEND_FILE_BUFFER_SIZE];
+   int chunk, bytes_read, flags;
+#ifdef __linux__
+   off_t file_offset;
+   if(!nonblock_flag)
+   {
+      file_offset = (off_t)offset;
+      bytes_sent = (long long)sendfile(socket->fd, file_fd, &file_offset, count > SEND_FILE_CHUNK_SIZE ? SEND_FILE_CHUNK_SIZE : (size_t)count);
+      return bytes_sent;
+   }
+#endif // __linux__
+   chunk = count > SEND_FILE_BUFFER_SIZE ? SEND_FILE_BUFFER_SIZE : (int)count;
+#ifdef _WIN32
+   flags = 0;
+   if(_lseeki64(file_fd, offset, SEEK_SET) == -1)
+   {
+      return -1;
+   }
+   bytes_read = _read(file_fd, buffer, (unsigned int)chunk);
+#else // _WIN32
+   flags = nonblock_flag ? MSG_DONTWAIT : 0;
+   bytes_read = (int)pread(file_fd, buffer, (size_t)chunk, (off_t)offset);
+#endif // _WIN32
+   if(bytes_read <= 0)
+   {
+      return bytes_read;
+   }
+   bytes_sent = (long long)send(socket->fd, buffer, (size_t)bytes_read, flags);
+   return bytes_sent;
+}
+
+#ifdef _WIN32
+// Winsock has no per call nonblocking send, so check for room before each
+// chunk instead of touching the socket's mode
+static int ryannet_socket_tcp_send_file_room(struct ryannet_socket_tcp * socket)
+{
+   WSAPOLLFD fds;
+   int rv;
+   fds.fd = socket->fd;
+   fds.events = POLLWRNORM;
+   fds.revents = 0;
+
+   rv = WSAPoll(&fds, 1, 0);
+   if(rv < 0)
+   {
+      fprintf(stderr, "Error durring poll: %d\n", WSAGetLastError());
+      return -1;
+   }
+   // Errors and hang ups count as room so the send reports them
+   return rv;
+}
+#endif // _WIN32
+
+static long long ryannet_socket_tcp_send_file_loop(struct ryannet_socket_tcp * socket, int file_fd, long long * offset, long long count, int nonblock_flag)
+{
+   long long total_sent, bytes_sent, chunk;
+#ifdef _WIN32
+   int rv;
+#endif // _WIN32
+
+   total_sent = 0;
+   while(total_sent < count)
+   {
+      chunk = count - total_sent;
+#ifdef _WIN32
+      if(nonblock_flag)
+      {
+         rv = ryannet_socket_tcp_send_file_room(socket);
+         if(rv <= 0)
+         {
+            if(rv == -1 && total_sent == 0)
+            {
+               total_sent = -1;
+            }
+            break;
+         }
+      }
+#endif // _WIN32
+      ryannet_timestamps_begin(socket->timestamps);
+      bytes_sent = ryannet_socket_tcp_send_file_chunk(socket, file_fd, *offset, chunk, nonblock_flag);
+      if(bytes_sent > 0)
+      {
+         ryannet_timestamps_sent(socket->timestamps, (int)bytes_sent);
+         *offset += bytes_sent;
+         total_sent += bytes_sent;
+      }
+      else if(bytes_sent == 0)
+      {
+         // End of file
+         break;
+      }
+#ifndef _WIN32
+      else if(errno == EINTR)
+      {
+         continue;
+      }
+      else if(nonblock_flag && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+         break;
+      }
+#endif // _WIN32
+      else
+      {
+#ifdef _WIN32
+         fprintf(stderr, "Error durring send file: %d\n", WSAGetLastError());
+#else // _WIN32
+         fprintf(stderr, "Error durring send file: %s\n", strerror(errno));
+#endif // _WIN32
+         if(total_sent == 0)
+         {
+            total_sent = -1;
+         }
+         break;
+      }
+   }
+   return total_sent;
+}
+
+long long ryannet_socket_tcp_send_file(struct ryannet_socket_tcp * socket, int file_fd, long long * offset, long long count)
+{
+   if(socket->shm != NULL)
+   {
+      fprintf(stderr, "Error: send file is not supported on shared memory sockets\n");
+      return -1;
+   }
+   return ryannet_socket_tcp_send_file_loop(socket, file_fd, offset, count, 0);
+}
+
+long long ryannet_socket_tcp_send_file_nonblock(struct ryannet_socket_tcp * socket, int file_fd, long long * offset, long long count)
+{
+   if(socket->shm != NULL)
+   {
+      fprintf(stderr, "Error: send file is not supported on shared memory sockets\n");
+      return -1;
+   }
+   return ryannet_socket_tcp_send_file_loop(socket, file_fd, offset, count, 1);
+}
+struct ryannet_message * ryannet_message_new(const void * buffer, int buffer_size_in_bytes)
+{
+   struct ryannet_message * message;
+   message = ryannet_buffer_alloc((int)sizeof(struct ryannet_message) + buffer_size_in_bytes);
+   message->reference_count = 1;
+   message->size = buffer_size_in_bytes;
+   message->data = (unsigned char *)(message + 1);
+   if(buffer != NULL)
+   {
+      memcpy(message->data, buffer, (size_t)buffer_size_in_bytes);
+   }
+   return message;
+}
+
+void ryannet_message_retain(struct ryannet_message * message)
+{
+   (void)ryannet_atomic_increment(&message->reference_count);
+}
+
+void ryannet_message_release(struct ryannet_message * message)
+{
+   if(ryannet_atomic_decrement(&message->reference_count) <= 0)
+   {
+      ryannet_buffer_free(message);
+   }
+}
+
+const void * ryannet_message_get_data(struct ryannet_message * message)
+{
+   return message->data;
+}
+
+int ryannet_message_get_size(struct ryannet_message * message)
+{
+   return message->size;
+}
+
+int ryannet_socket_tcp_queue(struct ryannet_socket_tcp * socket, struct ryannet_message * message)
+{
+   struct ryannet_queued_message * queued, * head;
+   queued = malloc(sizeof(struct ryannet_queued_message));
+   ryannet_message_retain(message);
+   queued->message = message;
+   do
+   {
+      head = ryannet_atomic_load_pointer(&socket->queue_incoming);
+      queued->next = head;
+   } while(!ryannet_atomic_compare_exchange_pointer(&socket->queue_incoming, head, queued));
+#ifndef _WIN32
+   // Only the push that finds the queue empty has to wake the owner
+   if(head == NULL && socket->wake_fd[1] != -1)
+   {
+      unsigned long long one = 1;
+      if(write(socket->wake_fd[1], &one, sizeof(one)) == -1)
+      {
+         // Already full, so the owner is already awake
+      }
+   }
+#endif // _WIN32
+   return 0;
+}
+
+int ryannet_socket_tcp_enqueue(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes)
+{
+   struct ryannet_message * message;
+   int rv;
+   message = ryannet_message_new(buffer, buffer_size_in_bytes);
+   rv = ryannet_socket_tcp_queue(socket, message);
+   ryannet_message_release(message);
+   return rv;
+}
+
+int ryannet_socket_tcp_enable_queue_wake(struct ryannet_socket_tcp * socket)
+{
+#ifdef _WIN32
+   (void)socket;
+   return 1;
+#else // _WIN32
+   if(socket->wake_fd[0] != -1)
+   {
+      return 0;
+   }
+#ifdef __linux__
+   socket->wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   socket->wake_fd[1] = socket->wake_fd[0];
+   if(socket->wake_fd[0] == -1)
+   {
+      fprintf(stderr, "Error durring eventfd: %s\n", strerror(errno));
+      return -1;
+   }
+#else // __linux__
+   if(pipe(socket->wake_fd) == -1)
+   {
+      fprintf(stderr, "Error durring pipe: %s\n", strerror(errno));
+      socket->wake_fd[0] = -1;
+      socket->wake_fd[1] = -1;
+      return -1;
+   }
+   (void)fcntl(socket->wake_fd[0], F_SETFL, O_NONBLOCK);
+   (void)fcntl(socket->wake_fd[1], F_SETFL, O_NONBLOCK);
+#endif // __linux__
+   return 0;
+#endif // _WIN32
+}
+
+int ryannet_socket_tcp_get_queue_wake_handle(struct ryannet_socket_tcp * socket)
+{
+   return socket->wake_fd[0];
+}
+
+static void ryannet_socket_tcp_queue_collect(struct ryannet_socket_tcp * socket)
+{
+   struct ryannet_queued_message * incoming, * reversed, * next;
+
+#ifndef _WIN32
+   // Clear the wake before taking the queue, anything pushed after the
+   // exchange below finds the queue empty and wakes the owner again
+   if(socket->wake_fd[0] != -1)
+   {
+      unsigned long long value;
+      while(read(socket->wake_fd[0], &value, sizeof(value)) > 0)
+      {
+      }
+   }
+#endif // _WIN32
+   if(ryannet_atomic_load_pointer(&socket->queue_incoming) == NULL)
+   {
+      return;
+   }
+   incoming = ryannet_atomic_exchange_pointer(&socket->queue_incoming, NULL);
+
+   // Producers push on the front, so flip it back into send order
+   reversed = NULL;
+   while(incoming != NULL)
+   {
+      next = incoming->next;
+      incoming->next = reversed;
+      reversed = incoming;
+      incoming = next;
+   }
+   if(reversed == NULL)
+   {
+      return;
+   }
+
+   if(socket->queue_tail == NULL)
+   {
+      socket->queue_head = reversed;
+   }
+   else
+   {
+      socket->queue_tail->next = reversed;
+   }
+   while(reversed->next != NULL)
+   {
+      reversed = reversed->next;
+   }
+   socket->queue_tail = reversed;
+}
+
+int ryannet_socket_tcp_queue_is_empty(struct ryannet_socket_tcp * socket)
+{
+   return (socket->queue_head == NULL && ryannet_atomic_load_pointer(&socket->queue_incoming) == NULL) ? 1 : 0;
+}
+
+#define FLUSH_VECTOR_SIZE 64
+static int ryannet_socket_tcp_flush_once(struct ryannet_socket_tcp * socket, int nonblock_flag)
+{
+   struct ryannet_queued_message * queued;
+   int count, bytes_sent, bytes_left, remaining, i;
+#ifdef _WIN32
+   WSABUF vector[FLUSH_VECTOR_SIZE];
+   DWORD sent;
+#else // _WIN32
+   struct iovec vector[FLUSH_VECTOR_SIZE];
+   struct msghdr header;
+#endif // _WIN32
+
+   ryannet_timestamps_begin(socket->timestamps);
+   count = 0;
+   for(queued = socket->queue_head; queued != NULL && count < FLUSH_VECTOR_SIZE; queued = queued->next)
+   {
+      if(count == 0)
+      {
+         remaining = queued->message->size - socket->queue_offset;
+#ifdef _WIN32
+         vector[count].buf = (CHAR *)queued->message->data + socket->queue_offset;
+#else // _WIN32
+         vector[count].iov_base = queued->message->data + socket->queue_offset;
+#endif // _WIN32
+      }
+      else
+      {
+         remaining = queued->message->size;
+#ifdef _WIN32
+         vector[count].buf = (CHAR *)queued->message->data;
+#else // _WIN32
+         vector[count].iov_base = queued->message->data;
+#endif // _WIN32
+      }
+#ifdef _WIN32
+      vector[count].len = (ULONG)remaining;
+#else // _WIN32
+      vector[count].iov_len = (size_t)remaining;
+#endif // _WIN32
+      count ++;
+   }
+
+   if(count == 0)
+   {
+      return 0;
+   }
+
+   if(socket->shm != NULL)
+   {
+      // The ring is a byte stream already, so just copy in what fits
+      bytes_sent = 0;
+      for(i = 0; i < count; i++)
+      {
+#ifdef _WIN32
+         remaining = ryannet_shm_send(socket->shm, vector[i].buf, (int)vector[i].len, nonblock_flag);
+#else // _WIN32
+         remaining = ryannet_shm_send(socket->shm, vector[i].iov_base, (int)vector[i].iov_len, nonblock_flag);
+#endif // _WIN32
+         if(remaining == -1)
+         {
+            bytes_sent = bytes_sent > 0 ? bytes_sent : -1;
+            break;
+         }
+         bytes_sent += remaining;
+#ifdef _WIN32
+         if(remaining < (int)vector[i].len)
+#else // _WIN32
+         if(remaining < (int)vector[i].iov_len)
+#endif // _WIN32
+         {
+            break;
+         }
+      }
+   }
+#ifdef _WIN32
+   else if(WSASend(socket->fd, vector, (DWORD)count, &sent, 0, NULL, NULL) != 0)
+   {
+      bytes_sent = -1;
+   }
+   else
+   {
+      bytes_sent = (int)sent;
+   }
+#else // _WIN32
+   else
+   {
+      memset(&header, 0, sizeof(struct msghdr));
+      header.msg_iov = vector;
+      header.msg_iovlen = count;
+      bytes_sent = (int)sendmsg(socket->fd, &header, nonblock_flag ? MSG_DONTWAIT : 0);
+      if(bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      {
+         return 0;
+      }
+   }
+#endif // _WIN32
+   if(bytes_sent == -1)
+   {
+      fprintf(stderr, "Error durring flush: %s\n", strerror(errno));
+      return -1;
+   }
+   ryannet_timestamps_sent(socket->timestamps, bytes_sent);
+
+   // Release everything that made it out
+   bytes_left = bytes_sent;
+   while(socket->queue_head != NULL && bytes_left > 0)
+   {
+      queued = socket->queue_head;
+      remaining = queued->message->size - socket->queue_offset;
+      ryannet_recorder_write(socket->recorder, RYANNET_RECORD_SENT | RYANNET_RECORD_TCP, &socket->remote.raw,
+                             queued->message->data + socket->queue_offset, bytes_left < remaining ? bytes_left : remaining);
+      if(bytes_left >= remaining)
+      {
+         bytes_left -= remaining;
+         socket->queue_offset = 0;
+         socket->queue_head = queued->next;
+         ryannet_message_release(queued->message);
+         free(queued);
+      }
+      else
+      {
+         socket->queue_offset += bytes_left;
+         bytes_left = 0;
+      }
+   }
+   if(socket->queue_head == NULL)
+   {
+      socket->queue_tail = NULL;
+   }
+   return bytes_sent;
+}
+
+int ryannet_socket_tcp_flush(struct ryannet_socket_tcp * socket)
+{
+   int total_sent, bytes_sent;
+   ryannet_socket_tcp_queue_collect(socket);
+   total_sent = 0;
+   while(socket->queue_head != NULL)
+   {
+      bytes_sent = ryannet_socket_tcp_flush_once(socket, 0);
+      if(bytes_sent == -1)
+      {
+         return -1;
+      }
+      total_sent += bytes_sent;
+   }
+   return total_sent;
+}
+
+int ryannet_socket_tcp_flush_nonblock(struct ryannet_socket_tcp * socket)
+{
+   int total_sent, bytes_sent;
+#ifdef _WIN32
+   WSAPOLLFD fds;
+#endif // _WIN32
+   ryannet_socket_tcp_queue_collect(socket);
+#ifdef _WIN32
+   fds.fd = socket->fd;
+   fds.events = POLLWRNORM;
+
+   if(socket->queue_head == NULL || (socket->shm == NULL && WSAPoll(&fds, 1, 0) <= 0))
+   {
+      return 0;
+   }
+#endif // _WIN32
+   total_sent = 0;
+   while(socket->queue_head != NULL)
+   {
+      bytes_sent = ryannet_socket_tcp_flush_once(socket, 1);
+      if(bytes_sent == -1)
+      {
+         return -1;
+      }
+      else if(bytes_sent == 0)
+      {
+         break;
+      }
+      total_sent += bytes_sent;
+#ifdef _WIN32
+      break;
+#endif // _WIN32
+   }
+   return total_sent;
+}
+
+struct ryannet_address * ryannet_socket_tcp_get_address_local(struct ryannet_socket_tcp * socket)
+{
+   if(socket->fd == -1 && socket->shm == NULL)
+   {
+      return NULL;
+   }
+   return &socket->local;
+   
+}
+
+struct ryannet_address * ryannet_socket_tcp_get_address_remote(struct ryannet_socket_tcp * socket)
+{
+   if(socket->fd == -1 && socket->shm == NULL)
+   {
+      return NULL;
+   }
+   return &socket->remote;
+}
+
+int ryannet_socket_tcp_shutdown(struct ryannet_socket_tcp * socket)
+{
+   if(socket->shm != NULL)
+   {
+      ryannet_shm_shutdown(socket->shm);
+      return 0;
+   }
+   if(socket->fd == -1)
+   {
+      return -1;
+   }
+#ifdef _WIN32
+   if(shutdown(socket->fd, SD_SEND) != 0)
+   {
+      fprintf(stderr, "Error durring shutdown: %d\n", WSAGetLastError());
+      return -1;
+   }
+#else // _WIN32
+   if(shutdown(socket->fd, SHUT_WR) != 0)
+   {
+      fprintf(stderr, "Error durring shutdown: %s\n", strerror(errno));
+      return -1;
+   }
+#endif // _WIN32
+   return 0;
+}
+
+int ryannet_socket_tcp_is_connected(struct ryannet_socket_tcp * socket)
+{
+   int rv;
+   if(socket->connected_flag == 1 && 
+      socket->remote_closed_flag == 0 &&
+      (socket->fd != -1 || socket->shm != NULL))
+   {
+      rv = 1;
+   }
+   else
+   {
+      rv = 0;
+   }
+   return rv;
+}
+
+int ryannet_socket_tcp_get_handle(struct ryannet_socket_tcp * socket)
+{
+   if(socket->shm != NULL)
+   {
+      return -1;
+   }
+   return socket->fd;
+}
+
+struct ryannet_socket_udp * ryannet_socket_udp_new(void)
+{
+   struct ryannet_socket_udp * socket;
+   socket = malloc(sizeof(struct ryannet_socket_udp));
+   socket->fd = -1;
+   socket->unlink_flag = 0;
+   socket->local.address = NULL;
+   socket->local.port = NULL;
+   memset(&socket->local.raw, 0, sizeof(struct sockaddr_storage));
+   socket->max_pacing_rate = 0;
+   socket->txtime_flag = 0;
+   socket->timestamps = NULL;
+   socket->recorder = NULL;
+
+   return socket;
+}
+
+void ryannet_socket_udp_destroy(struct ryannet_socket_udp * socket)
+{
+   if(socket->fd != -1)
+   {
+      ryannet_close(socket->fd);
+   }
+   free(socket->timestamps);
+#ifndef _WIN32
+   if(socket->unlink_flag)
+   {
+      (void)unlink(((struct sockaddr_un *)&socket->local.raw)->sun_path);
+   }
+#endif // _WIN32
+   if(socket->local.address != NULL)
+   {
+      free(socket->local.address);
+   }
+   if(socket->local.port != NULL)
+   {
+      free(socket->local.port);
+   }
+   free(socket);
+}
+
+// Options set before the socket exists are applied once it is created.
+// A failed SO_TXTIME clears the flag so pacers fall back to userspace.
+static void ryannet_socket_udp_apply_options(struct ryannet_socket_udp * sock)
+{
+#if defined(__linux__) && defined(SO_MAX_PACING_RATE)
+   if(sock->max_pacing_rate > 0)
+   {
+      (void)setsockopt(sock->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &sock->max_pacing_rate, sizeof(sock->max_pacing_rate));
+   }
+#endif // SO_MAX_PACING_RATE
+#if defined(__linux__) && defined(SO_TXTIME)
+   if(sock->txtime_flag)
+   {
+      struct sock_txtime config;
+      // Pacers stamp with ryannet_time_ns, fq takes that clock as is
+      config.clockid = CLOCK_MONOTONIC;
+      config.flags = 0;
+      if(setsockopt(sock->fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == -1)
+      {
+         sock->txtime_flag = 0;
+      }
+   }
+#else // SO_TXTIME
+   sock->txtime_flag = 0;
+#endif // SO_TXTIME
+#ifdef RYANNET_TIMESTAMPING
+   if(sock->timestamps != NULL)
+   {
+      // Transmit keys count from when the option is set
+      sock->timestamps->next_id = 0;
+      if(ryannet_timestamps_apply(sock->fd) != 0)
+      {
+         free(sock->timestamps);
+         sock->timestamps = NULL;
+      }
+   }
+#endif // RYANNET_TIMESTAMPING
+}
+
+static int ryannet_socket_udp_bind_unix(struct ryannet_socket_udp * sock, const char * bind_address)
+{
+   sock->fd = ryannet_socket_unix_open(bind_address, SOCK_DGRAM, &sock->local.raw);
+   if(sock->fd != -1)
+   {
+      if(
+#ifndef _WIN32
+         ryannet_unix_unlink_stale(sock->fd, &sock->local.raw) == -1 ||
+#endif // _WIN32
+         bind(sock->fd, (struct sockaddr *)&sock->local.raw, ryannet_address_raw_length(&sock->local.raw)) == -1)
+      {
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+      }
+   }
+   if(sock->fd == -1)
+   {
+      fprintf(stderr, "Error: Couldn't Bind to %s\n", bind_address);
+      return 1;
+   }
+#ifndef _WIN32
+   sock->unlink_flag = ((struct sockaddr_un *)&sock->local.raw)->sun_path[0] != '\0';
+#endif // _WIN32
+   ryannet_fill_address(&sock->local);
+   ryannet_socket_udp_apply_options(sock);
+   return 0;
+}
+
+int ryannet_socket_udp_bind(struct ryannet_socket_udp * sock, const char * bind_address, const char * bind_port)
+{
+   struct addrinfo hints, *servinfo, *p;
+   int rv;
+   socklen_t length;
+
+   if(ryannet_unix_is_address(bind_address))
+   {
+      return ryannet_socket_udp_bind_unix(sock, bind_address);
+   }
+
+   memset(&hints, 0, sizeof(struct addrinfo));
+   if(bind_address == NULL)
+   {
+      // Windows and linux have differing opinons on what to do here, so
+      // we will take the choice away
+      hints.ai_family = AF_INET;
+   }
+   else
+   {
+      hints.ai_family = AF_UNSPEC;
+   }
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_flags = AI_PASSIVE; // Use any local IPV4 or IPV6 address I have
+   
+   rv = getaddrinfo(bind_address, bind_port, &hints, &servinfo);
+   if(rv != 0)
+   {
+      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+      return 1;
+   }
+
+   for(p = servinfo; p != NULL; p = p->ai_next)
+   {
+      sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+      if(sock->fd == -1)
+      {
+         // TODO: Maybe Error Handling
+         continue;
+      }
+
+      rv = ryannet_clear_v6only(sock->fd, p->ai_family);
+      if(rv == 1)
+      {
+         // TODO: Maybe Error Handling
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         continue;
+      }
+
+
+      rv = bind(sock->fd, p->ai_addr, p->ai_addrlen);
+      if(rv == -1)
+      {
+         ryannet_close(sock->fd);
+         sock->fd = -1;
+         // TODO: Maybe Error Handling
+         continue;
+      }
+      break;
+   }
+
+
+   if(sock->fd == -1)
+   {
+      // TODO: Error Handing
+      fprintf(stderr, "Error: Couldn't Bind to %s : %s\n", bind_address, bind_port);
+      return 1;
+   }
+
+   // Copy Local
+   length = sizeof(struct sockaddr_storage);
+   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
+   ryannet_fill_address(&sock->local);
+   ryannet_socket_udp_apply_options(sock);
+
+   freeaddrinfo(servinfo);
+
+   return 0;
+}
+
+// Creates the socket for an unbound sender from the first destination
+static int ryannet_socket_udp_open(struct ryannet_socket_udp * sock, struct ryannet_address * destination)
+{
+#ifndef _WIN32
+   if(sock->fd == -1 && destination->raw.ss_family == AF_UNIX)
+   {
+      // Unbound unix datagram sockets can send but never hear a reply
+      sock->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+      if(sock->fd != -1)
+      {
+         ryannet_socket_udp_apply_options(sock);
+      }
+   }
+#endif // _WIN32
+   if(sock->fd == -1)
+   {
+      struct addrinfo hints, *servinfo, *p;
+      int rv;
+      socklen_t length;
+
+      memset(&hints, 0, sizeof(struct addrinfo));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_DGRAM;
+      
+      rv = getaddrinfo(destination->address, destination->port, &hints, &servinfo);
+      if(rv != 0)
+      {
+         fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+         return 1;
+      }
+
+      for(p = servinfo; p != NULL; p = p->ai_next)
+      {
+         sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+         if(sock->fd == -1)
+         {
+            // TODO: Maybe Error Handling
+            continue;
+         }
+         break;
+      }
+
+      if(sock->fd == -1)
+      {
+         // TODO: Error Handing
+         fprintf(stderr, "Error: Couldn't Create Socket to %s : %s\n", destination->address, destination->port);
+         freeaddrinfo(servinfo);
+         return 1;
+      }
+      freeaddrinfo(servinfo);
+
+      // Copy Local
+      length = sizeof(struct sockaddr_storage);
+      getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
+      ryannet_fill_address(&sock->local);
+      ryannet_socket_udp_apply_options(sock);
+   }
+   return 0;
+}
+
+int ryannet_socket_udp_send(struct ryannet_socket_udp * sock, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes)
+{
+   int sent_bytes;
+   if(sock->fd == -1 && ryannet_socket_udp_open(sock, destination) != 0)
+   {
+      return 1;
+   }
+   if(sock->fd != -1)
+   {
+      ryannet_timestamps_begin(sock->timestamps);
+      sent_bytes = sendto(sock->fd, buffer, buffer_size_in_bytes, 0, (struct sockaddr *) &destination->raw, ryannet_address_raw_length(&destination->raw));
+      ryannet_timestamps_sent(sock->timestamps, sent_bytes >= 0 ? 1 : 0);
+      if(sent_bytes >= 0)
+      {
+         ryannet_recorder_write(sock->recorder, RYANNET_RECORD_SENT, &destination->raw, buffer, sent_bytes);
+      }
+   }
+   else
+   {
+      sent_bytes = 0;
+   }
+   return sent_bytes;
+}
+
+static int ryannet_socket_udp_receive_stamped(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source, long long * kernel_ns)
+{
+   int received_bytes;
+   socklen_t length;
+#ifdef RYANNET_TIMESTAMPING
+   union
+   {
+      char buffer[128];
+      struct cmsghdr align;
+   } control;
+   struct msghdr header;
+   struct iovec vector;
+#endif // RYANNET_TIMESTAMPING
+
+   length = sizeof(struct sockaddr_storage);
+   if(kernel_ns != NULL)
+   {
+      *kernel_ns = 0;
+   }
+#ifdef RYANNET_TIMESTAMPING
+   if(socket->fd != -1 && socket->timestamps != NULL)
+   {
+      vector.iov_base = buffer;
+      vector.iov_len = (size_t)buffer_size_in_bytes;
+      memset(&header, 0, sizeof(struct msghdr));
+      header.msg_name = &source->raw;
+      header.msg_namelen = length;
+      header.msg_iov = &vector;
+      header.msg_iovlen = 1;
+      header.msg_control = control.buffer;
+      header.msg_controllen = sizeof(control.buffer);
+      received_bytes = -1;
+      if(ryannet_timestamps_wait(socket->timestamps, socket->fd) == 0)
+      {
+         received_bytes = (int)recvmsg(socket->fd, &header, 0);
+      }
+      length = header.msg_namelen;
+      if(received_bytes >= 0)
+      {
+         long long stamp;
+         stamp = ryannet_timestamps_received(socket->timestamps, &header);
+         if(kernel_ns != NULL)
+         {
+            *kernel_ns = stamp;
+         }
+      }
+   }
+   else
+#endif // RYANNET_TIMESTAMPING
+   if(socket->fd != -1)
+   {
+      received_bytes = recvfrom(socket->fd, buffer, buffer_size_in_bytes, 0, (struct sockaddr *)&source->raw, &length);
+   }
+   else
+   {
+      return 0;
+   }
+#ifndef _WIN32
+   if(received_bytes >= 0 && source->raw.ss_family == AF_UNIX)
+   {
+      // Unix names are not fixed size, so clear whatever the last sender left
+      memset((char *)&source->raw + length, 0, sizeof(struct sockaddr_storage) - length);
+   }
+#endif // _WIN32
+   if(received_bytes >= 0)
+   {
+      ryannet_recorder_write(socket->recorder, 0, &source->raw, buffer, received_bytes);
+   }
+   return received_bytes;
+}
+
+int ryannet_socket_udp_receive(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source)
+{
+   return ryannet_socket_udp_receive_stamped(socket, buffer, buffer_size_in_bytes, source, NULL);
+}
+
+int ryannet_socket_udp_receive_timestamped(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source, long long * kernel_ns)
+{
+   return ryannet_socket_udp_receive_stamped(socket, buffer, buffer_size_in_bytes, source, kernel_ns);
+}
+
+int ryannet_socket_udp_receive_nonblock(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source)
+{
+   int received_bytes;
+   int rv;
+#ifdef _WIN32
+   WSAPOLLFD fds;
+   fds.fd = socket->fd;
+   fds.events = POLLRDNORM;
+
+   rv = WSAPoll(&fds, 1, 0);
+#else // _WIN32
+   struct pollfd fds;
+   fds.fd = socket->fd;
+   fds.events = POLLIN;
+
+   rv = poll(&fds, 1, 0);
+#endif // _WIN32
+#ifdef RYANNET_TIMESTAMPING
+   if(rv > 0 && socket->timestamps != NULL)
+   {
+      // Transmit timestamps on the error queue wake poll too
+      (void)ryannet_timestamps_collect(socket->timestamps, socket->fd);
+      if(!(fds.revents & POLLIN))
+      {
+         // An error still pending once the timestamps are drained goes to
+         // the receive so it gets reported
+         fds.revents = 0;
+         rv = poll(&fds, 1, 0);
+         if(rv > 0 && !(fds.revents & (POLLIN | POLLERR)))
+         {
+            rv = 0;
+         }
+      }
+   }
+#endif // RYANNET_TIMESTAMPING
+   if(rv > 0)
+   {
+      received_bytes = ryannet_socket_udp_receive(socket, buffer,  buffer_size_in_bytes, source);
+   }
+   else if(rv < 0)
+   {
+      // Error
+      received_bytes = -1;
+      fprintf(stderr, "Error durring poll: %s\n", strerror(errno));
+   }
+   else
+   {
+      received_bytes = 0;
+   }
+   return received_bytes;
+}
+
+void * ryannet_socket_udp_receive_buffer(struct ryannet_socket_udp * socket, int max_size_in_bytes, struct ryannet_address * source, int * received_bytes)
+{
+   void * buffer;
+   buffer = ryannet_buffer_alloc(max_size_in_bytes);
+   *received_bytes = ryannet_socket_udp_receive(socket, buffer, max_size_in_bytes, source);
+   if(*received_bytes <= 0)
+   {
+      ryannet_buffer_free(buffer);
+      buffer = NULL;
+   }
+   return buffer;
+}
+
+struct ryannet_address * ryannet_socket_udp_get_address_local(struct ryannet_socket_udp * socket)
+{
+   if(socket->fd == -1)
+   {
+      return NULL;
+   }
+   return &socket->local;
+}
+
+int ryannet_socket_udp_get_handle(struct ryannet_socket_udp * socket)
+{
+   return socket->fd;
+}
+
+
+struct ryannet_group * ryannet_group_new(void)
+{
+   struct ryannet_group * group;
+   group = malloc(sizeof(struct ryannet_group));
+   group->size = 16;
+   group->count = 0;
+   group->members = malloc(sizeof(struct ryannet_group_member) * group->size);
+   return group;
+}
+
+static struct ryannet_group_member * ryannet_group_add(struct ryannet_group * group)
+{
+   struct ryannet_group_member * member;
+   if(group->count >= group->size)
+   {
+      group->size = group->size * 2;
+      group->members = realloc(group->members, sizeof(struct ryannet_group_member) * group->size);
+   }
+   member = &group->members[group->count];
+   group->count ++;
+   member->tcp = NULL;
+   member->udp = NULL;
+   member->destination.address = NULL;
+   member->destination.port = NULL;
+   memset(&member->destination.raw, 0, sizeof(struct sockaddr_storage));
+   return member;
+}
+
+static void ryannet_group_remove_index(struct ryannet_group * group, int index)
+{
+   if(group->members[index].destination.address != NULL)
+   {
+      free(group->members[index].destination.address);
+   }
+   if(group->members[index].destination.port != NULL)
+   {
+      free(group->members[index].destination.port);
+   }
+   group->count --;
+   group->members[index] = group->members[group->count];
+}
+
+void ryannet_group_destroy(struct ryannet_group * group)
+{
+   while(group->count > 0)
+   {
+      ryannet_group_remove_index(group, group->count - 1);
+   }
+   free(group->members);
+   free(group);
+}
+
+int ryannet_group_add_tcp(struct ryannet_group * group, struct ryannet_socket_tcp * socket)
+{
+   struct ryannet_group_member * member;
+   member = ryannet_group_add(group);
+   member->tcp = socket;
+   return 0;
+}
+
+int ryannet_group_add_udp(struct ryannet_group * group, struct ryannet_socket_udp * socket, struct ryannet_address * destination)
+{
+   struct ryannet_group_member * member;
+   member = ryannet_group_add(group);
+   member->udp = socket;
+   member->destination.address = ryannet_string_copy(destination->address);
+   member->destination.port = ryannet_string_copy(destination->port);
+   memcpy(&member->destination.raw, &destination->raw, sizeof(struct sockaddr_storage));
+   return 0;
+}
+
+void ryannet_group_remove_tcp(struct ryannet_group * group, struct ryannet_socket_tcp * socket)
+{
+   int i;
+   for(i = group->count - 1; i >= 0; i--)
+   {
+      if(group->members[i].tcp == socket)
+      {
+         ryannet_group_remove_index(group, i);
+      }
+   }
+}
+
+void ryannet_group_remove_udp(struct ryannet_group * group, struct ryannet_socket_udp * socket, struct ryannet_address * destination)
+{
+   int i;
+   for(i = group->count - 1; i >= 0; i--)
+   {
+      if(group->members[i].udp == socket &&
+         memcmp(&group->members[i].destination.raw, &destination->raw, sizeof(struct sockaddr_storage)) == 0)
+      {
+         ryannet_group_remove_index(group, i);
+      }
+   }
+}
+
+int ryannet_group_get_count(struct ryannet_group * group)
+{
+   return group->count;
+}
+
+#define GROUP_BATCH_SIZE 64
+static void ryannet_group_record_batch(struct ryannet_socket_udp * socket, struct ryannet_group_member ** batch, int count, struct ryannet_message * message)
+{
+   int i;
+   if(socket->recorder != NULL)
+   {
+      for(i = 0; i < count; i++)
+      {
+         ryannet_recorder_write(socket->recorder, RYANNET_RECORD_SENT, &batch[i]->destination.raw, message->data, message->size);
+      }
+   }
+}
+
+static int ryannet_group_send_udp_batch(struct ryannet_socket_udp * socket, struct ryannet_group_member ** batch, int count, struct ryannet_message * message)
+{
+   int rv;
+#if defined(__linux__)
+   struct mmsghdr headers[GROUP_BATCH_SIZE];
+   struct iovec vector;
+   int i, sent;
+
+   vector.iov_base = message->data;
+   vector.iov_len = (size_t)message->size;
+   memset(headers, 0, sizeof(struct mmsghdr) * count);
+   for(i = 0; i < count; i++)
+   {
+      headers[i].msg_hdr.msg_name = &batch[i]->destination.raw;
+      headers[i].msg_hdr.msg_namelen = ryannet_address_raw_length(&batch[i]->destination.raw);
+      headers[i].msg_hdr.msg_iov = &vector;
+      headers[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   rv = 0;
+   i = 0;
+   while(i < count)
+   {
+      ryannet_timestamps_begin(socket->timestamps);
+      sent = sendmmsg(socket->fd, &headers[i], (unsigned int)(count - i), 0);
+      if(sent <= 0)
+      {
+         fprintf(stderr, "Error durring sendmmsg: %s\n", strerror(errno));
+         // Skip the peer that failed so the rest still get the message
+         rv = 1;
+         sent = 1;
+      }
+      else
+      {
+         ryannet_timestamps_sent(socket->timestamps, sent);
+         ryannet_group_record_batch(socket, &batch[i], sent, message);
+      }
+      i += sent;
+   }
+#else // defined(__linux__)
+   int i;
+   rv = 0;
+   for(i = 0; i < count; i++)
+   {
+      if(sendto(socket->fd, (const char *)message->data, message->size, 0,
+                (struct sockaddr *)&batch[i]->destination.raw, ryannet_address_raw_length(&batch[i]->destination.raw)) == -1)
+      {
+         rv = 1;
+      }
+      else
+      {
+         ryannet_group_record_batch(socket, &batch[i], 1, message);
+      }
+   }
+#endif // defined(__linux__)
+   return rv;
+}
+
+int ryannet_group_send(struct ryannet_group * group, struct ryannet_message * message)
+{
+   struct ryannet_group_member * batch[GROUP_BATCH_SIZE];
+   struct ryannet_socket_udp * batch_socket;
+   struct ryannet_group_member * member;
+   int batch_count;
+   int rv;
+   int i;
+
+   rv = 0;
+   batch_count = 0;
+   batch_socket = NULL;
+   for(i = 0; i < group->count; i++)
+   {
+      member = &group->members[i];
+      if(member->tcp != NULL)
+      {
+         // Only the owning thread may flush, its wake handle tells it to
+         (void)ryannet_socket_tcp_queue(member->tcp, message);
+      }
+      else if(member->udp->fd == -1)
+      {
+         // Let the normal send path create the socket
+         if(ryannet_socket_udp_send(member->udp, &member->destination, message->data, message->size) == -1)
+         {
+            rv = 1;
+         }
+      }
+      else
+      {
+         if(batch_count == GROUP_BATCH_SIZE ||
+            (batch_count > 0 && batch_socket != member->udp))
+         {
+            rv |= ryannet_group_send_udp_batch(batch_socket, batch, batch_count, message);
+            batch_count = 0;
+         }
+         batch_socket = member->udp;
+         batch[batch_count] = member;
+         batch_count ++;
+      }
+   }
+   if(batch_count > 0)
+   {
+      rv |= ryannet_group_send_udp_batch(batch_socket, batch, batch_count, message);
+   }
+   return rv;
+}
+
+void ryannet_bitwriter_init(struct ryannet_bitwriter * writer, void * buffer, int buffer_size_in_bytes)
+{
+   writer->buffer = buffer;
+   writer->size_in_bytes = buffer_size_in_bytes;
+   writer->bit_position = 0;
+   writer->overflow_flag = 0;
+}
+
+void ryannet_bitwriter_write_bits(struct ryannet_bitwriter * writer, unsigned int value, int bit_count)
+{
+   int byte_index, bit_offset, chunk;
+
+   if(writer->overflow_flag || bit_count < 1 || bit_count > 32 ||
+      writer->bit_position + bit_count > writer->size_in_bytes * 8)
+   {
+      writer->overflow_flag = 1;
+      return;
+   }
+   // Bits go in least significant first so the layout is the same on any host
+   while(bit_count > 0)
+   {
+      byte_index = writer->bit_position >> 3;
+      bit_offset = writer->bit_position & 7;
+      chunk = 8 - bit_offset;
+      if(chunk > bit_count)
+      {
+         chunk = bit_count;
+      }
+      if(bit_offset == 0)
+      {
+         writer->buffer[byte_index] = (unsigned char)(value & ((1u << chunk) - 1));
+      }
+      else
+      {
+         writer->buffer[byte_index] |= (unsigned char)((value & ((1u << chunk) - 1)) << bit_offset);
+      }
+      value >>= chunk;
+      bit_count -= chunk;
+      writer->bit_position += chunk;
+   }
+}
+
+void ryannet_bitwriter_write_varint(struct ryannet_bitwriter * writer, unsigned long long value)
+{
+   while(value >= 0x80)
+   {
+      ryannet_bitwriter_write_bits(writer, (unsigned int)(value & 0x7F) | 0x80, 8);
+      value >>= 7;
+   }
+   ryannet_bitwriter_write_bits(writer, (unsigned int)value, 8);
+}
+
+void ryannet_bitwriter_write_signed_varint(struct ryannet_bitwriter * writer, long long value)
+{
+   // Zig zag so small negative numbers stay small
+   ryannet_bitwriter_write_varint(writer, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+void ryannet_bitwriter_write_float(struct ryannet_bitwriter * writer, float value)
+{
+   unsigned int bits;
+   memcpy(&bits, &value, sizeof(unsigned int));
+   ryannet_bitwriter_write_bits(writer, bits, 32);
+}
+
+void ryannet_bitwriter_write_float_quantized(struct ryannet_bitwriter * writer, float value, float min, float max, int bit_count)
+{
+   unsigned int steps, quantized;
+   float normalized;
+
+   if(bit_count < 1 || bit_count > 32)
+   {
+      writer->overflow_flag = 1;
+      return;
+   }
+   steps = bit_count == 32 ? 0xFFFFFFFFu : (1u << bit_count) - 1;
+   // NaN fails every comparison, so send it as min
+   if(value != value || value <= min)
+   {
+      normalized = 0.0f;
+   }
+   else if(value >= max)
+   {
+      normalized = 1.0f;
+   }
+   else
+   {
+      normalized = (value - min) / (max - min);
+   }
+   quantized = (unsigned int)((double)normalized * (double)steps + 0.5);
+   ryannet_bitwriter_write_bits(writer, quantized, bit_count);
+}
+
+void ryannet_bitwriter_write_bytes(struct ryannet_bitwriter * writer, const void * buffer, int buffer_size_in_bytes)
+{
+   ryannet_bitwriter_align(writer);
+   if(writer->overflow_flag || writer->bit_position / 8 + buffer_size_in_bytes > writer->size_in_bytes)
+   {
+      writer->overflow_flag = 1;
+      return;
+   }
+   memcpy(writer->buffer + writer->bit_position / 8, buffer, (size_t)buffer_size_in_bytes);
+   writer->bit_position += buffer_size_in_bytes * 8;
+}
+
+void ryannet_bitwriter_align(struct ryannet_bitwriter * writer)
+{
+   if((writer->bit_position & 7) != 0)
+   {
+      ryannet_bitwriter_write_bits(writer, 0, 8 - (writer->bit_position & 7));
+   }
+}
+
+int ryannet_bitwriter_get_size(struct ryannet_bitwriter * writer)
+{
+   return (writer->bit_position + 7) / 8;
+}
+
+int ryannet_bitwriter_has_overflow(struct ryannet_bitwriter * writer)
+{
+   return writer->overflow_flag;
+}
+
+void ryannet_bitreader_init(struct ryannet_bitreader * reader, const void * buffer, int buffer_size_in_bytes)
+{
+   reader->buffer = buffer;
+   reader->size_in_bytes = buffer_size_in_bytes;
+   reader->bit_position = 0;
+   reader->overflow_flag = 0;
+}
+
+unsigned int ryannet_bitreader_read_bits(struct ryannet_bitreader * reader, int bit_count)
+{
+   unsigned int value;
+   int byte_index, bit_offset, chunk, shift;
+
+   if(reader->overflow_flag || bit_count < 1 || bit_count > 32 ||
+      reader->bit_position + bit_count > reader->size_in_bytes * 8)
+   {
+      reader->overflow_flag = 1;
+      return 0;
+   }
+   value = 0;
+   shift = 0;
+   while(bit_count > 0)
+   {
+      byte_index = reader->bit_position >> 3;
+      bit_offset = reader->bit_position & 7;
+      chunk = 8 - bit_offset;
+      if(chunk > bit_count)
+      {
+         chunk = bit_count;
+      }
+      value |= (unsigned int)((reader->buffer[byte_index] >> bit_offset) & ((1u << chunk) - 1)) << shift;
+      shift += chunk;
+      bit_count -= chunk;
+      reader->bit_position += chunk;
+   }
+   return value;
+}
+
+unsigned long long ryannet_bitreader_read_varint(struct ryannet_bitreader * reader)
+{
+   unsigned long long value;
+   unsigned int byte;
+   int shift;
+
+   value = 0;
+   shift = 0;
+   do
+   {
+      byte = ryannet_bitreader_read_bits(reader, 8);
+      if(shift > 63)
+      {
+         reader->overflow_flag = 1;
+         return 0;
+      }
+      value |= (unsigned long long)(byte & 0x7F) << shift;
+      shift += 7;
+   } while((byte & 0x80) != 0 && !reader->overflow_flag);
+   return value;
+}
+
+long long ryannet_bitreader_read_signed_varint(struct ryannet_bitreader * reader)
+{
+   unsigned long long value;
+   value = ryannet_bitreader_read_varint(reader);
+   return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+float ryannet_bitreader_read_float(struct ryannet_bitreader * reader)
+{
+   unsigned int bits;
+   float value;
+   bits = ryannet_bitreader_read_bits(reader, 32);
+   memcpy(&value, &bits, sizeof(float));
+   return value;
+}
+
+float ryannet_bitreader_read_float_quantized(struct ryannet_bitreader * reader, float min, float max, int bit_count)
+{
+   unsigned int steps, quantized;
+   if(bit_count < 1 || bit_count > 32)
+   {
+      reader->overflow_flag = 1;
+      return min;
+   }
+   steps = bit_count == 32 ? 0xFFFFFFFFu : (1u << bit_count) - 1;
+   quantized = ryannet_bitreader_read_bits(reader, bit_count);
+   return min + (float)((double)quantized / (double)steps) * (max - min);
+}
+
+void ryannet_bitreader_read_bytes(struct ryannet_bitreader * reader, void * buffer, int buffer_size_in_bytes)
+{
+   ryannet_bitreader_align(reader);
+   if(reader->overflow_flag || reader->bit_position / 8 + buffer_size_in_bytes > reader->size_in_bytes)
+   {
+      reader->overflow_flag = 1;
+      return;
+   }
+   memcpy(buffer, reader->buffer + reader->bit_position / 8, (size_t)buffer_size_in_bytes);
+   reader->bit_position += buffer_size_in_bytes * 8;
+}
+
+void ryannet_bitreader_align(struct ryannet_bitreader * reader)
+{
+   if((reader->bit_position & 7) != 0)
+   {
+      (void)ryannet_bitreader_read_bits(reader, 8 - (reader->bit_position & 7));
+   }
+}
+
+int ryannet_bitreader_has_overflow(struct ryannet_bitreader * reader)
+{
+   return reader->overflow_flag;
+}
+
+#if defined(RYANNET_AVX2) || defined(RYANNET_AVX2_DISPATCH)
+// Skips 32 bytes at a time, returns the first difference or where fewer
+// than 32 bytes are left. A NULL baseline is all zeros
+#ifdef RYANNET_AVX2_DISPATCH
+RYANNET_TARGET_AVX2
+#endif // RYANNET_AVX2_DISPATCH
+static int ryannet_delta_match_avx2(const unsigned char * baseline, const unsigned char * current, int position, int size)
+{
+   unsigned int mask;
+   while(position + 32 <= size)
+   {
+      mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+         baseline != NULL ? _mm256_loadu_si256((const __m256i *)(baseline + position)) : _mm256_setzero_si256(),
+         _mm256_loadu_si256((const __m256i *)(current + position))));
+      if(mask != 0xFFFFFFFFu)
+      {
+         return position + ryannet_count_trailing_zeros(~mask);
+      }
+      position += 32;
+   }
+   return position;
+}
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_AVX2_DISPATCH)
+
+// Counts how many bytes from position on are the same in both buffers, a
+// NULL baseline is all zeros
+static int ryannet_delta_match_length(const unsigned char * baseline, const unsigned char * current, int position, int size)
+{
+   int start;
+   unsigned int mask;
+   start = position;
+#if defined(RYANNET_AVX2)
+   position = ryannet_delta_match_avx2(baseline, current, position, size);
+#endif // defined(RYANNET_AVX2)
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(position + 16 <= size)
+   {
+      mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+         baseline != NULL ? _mm_loadu_si128((const __m128i *)(baseline + position)) : _mm_setzero_si128(),
+         _mm_loadu_si128((const __m128i *)(current + position))));
+      if(mask != 0xFFFFu)
+      {
+         return position - start + ryannet_count_trailing_zeros(~mask);
+      }
+      position += 16;
+#if defined(RYANNET_AVX2_DISPATCH)
+      // The call costs more than short runs save, so only go wide once a
+      // whole block matched
+      if(ryannet_cpu_avx2_flag)
+      {
+         position = ryannet_delta_match_avx2(baseline, current, position, size);
+      }
+#endif // defined(RYANNET_AVX2_DISPATCH)
+   }
+#else // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   (void)mask;
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(position < size && (baseline != NULL ? baseline[position] : 0) == current[position])
+   {
+      position ++;
+   }
+   return position - start;
+}
+
+// Counts how many bytes from position on differ, stopping at the first two
+// matching bytes in a row since a single match is cheaper to keep as literal.
+// A NULL baseline is all zeros
+static int ryannet_delta_literal_length(const unsigned char * baseline, const unsigned char * current, int position, int size)
+{
+   int start;
+   unsigned int mask, pairs;
+   start = position;
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(position + 16 <= size)
+   {
+      mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+         baseline != NULL ? _mm_loadu_si128((const __m128i *)(baseline + position)) : _mm_setzero_si128(),
+         _mm_loadu_si128((const __m128i *)(current + position))));
+      pairs = mask & (mask >> 1) & 0x7FFFu;
+      if(pairs != 0)
+      {
+         return position - start + ryannet_count_trailing_zeros(pairs);
+      }
+      // The last byte can still start a pair, so overlap it with the next block
+      position += 15;
+   }
+#else // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   (void)mask;
+   (void)pairs;
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(position < size)
+   {
+      if((baseline != NULL ? baseline[position] : 0) == current[position] &&
+         (position + 1 == size || (baseline != NULL ? baseline[position + 1] : 0) == current[position + 1]))
+      {
+         break;
+      }
+      position ++;
+   }
+   return position - start;
+}
+
+static void ryannet_delta_xor(unsigned char * out, const unsigned char * a, const unsigned char * b, int size)
+{
+   int i;
+   i = 0;
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(i + 16 <= size)
+   {
+      _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(
+         _mm_loadu_si128((const __m128i *)(a + i)),
+         _mm_loadu_si128((const __m128i *)(b + i))));
+      i += 16;
+   }
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   for(; i < size; i++)
+   {
+      out[i] = a[i] ^ b[i];
+   }
+}
+
+static int ryannet_delta_put_varint(unsigned char * out, int position, int capacity, unsigned int value)
+{
+   while(value >= 0x80)
+   {
+      if(position >= capacity)
+      {
+         return -1;
+      }
+      out[position] = (unsigned char)((value & 0x7F) | 0x80);
+      position ++;
+      value >>= 7;
+   }
+   if(position >= capacity)
+   {
+      return -1;
+   }
+   out[position] = (unsigned char)value;
+   return position + 1;
+}
+
+static int ryannet_delta_get_varint(const unsigned char * in, int position, int size, unsigned int * value)
+{
+   int shift;
+   *value = 0;
+   shift = 0;
+   while(position < size && shift < 32)
+   {
+      *value |= (unsigned int)(in[position] & 0x7F) << shift;
+      shift += 7;
+      position ++;
+      if((in[position - 1] & 0x80) == 0)
+      {
+         return position;
+      }
+   }
+   return -1;
+}
+
+int ryannet_delta_encode(const void * baseline, const void * current, int size_in_bytes, void * out, int out_size_in_bytes)
+{
+   const unsigned char * base, * now;
+   unsigned char * encoded;
+   int position, out_position, match, literal;
+
+   // No acknowledged baseline yet leaves base NULL, the helpers treat that as
+   // all zeros
+   base = baseline;
+   now = current;
+   encoded = out;
+   position = 0;
+   out_position = 0;
+   while(position < size_in_bytes && out_position != -1)
+   {
+      match = ryannet_delta_match_length(base, now, position, size_in_bytes);
+      position += match;
+      literal = ryannet_delta_literal_length(base, now, position, size_in_bytes);
+      out_position = ryannet_delta_put_varint(encoded, out_position, out_size_in_bytes, (unsigned int)match);
+      if(out_position != -1)
+      {
+         out_position = ryannet_delta_put_varint(encoded, out_position, out_size_in_bytes, (unsigned int)literal);
+      }
+      if(out_position != -1)
+      {
+         if(out_position + literal > out_size_in_bytes)
+         {
+            out_position = -1;
+         }
+         else
+         {
+            if(base == NULL)
+            {
+               memcpy(encoded + out_position, now + position, (size_t)literal);
+            }
+            else
+            {
+               ryannet_delta_xor(encoded + out_position, base + position, now + position, literal);
+            }
+            out_position += literal;
+            position += literal;
+         }
+      }
+   }
+   return out_position;
+}
+
+int ryannet_delta_decode(const void * baseline, const void * encoded, int encoded_size_in_bytes, void * out, int size_in_bytes)
+{
+   const unsigned char * in;
+   unsigned char * now;
+   unsigned int match, literal;
+   int position, in_position;
+
+   in = encoded;
+   now = out;
+   if(baseline == NULL)
+   {
+      memset(now, 0, (size_t)size_in_bytes);
+   }
+   else if(baseline != out)
+   {
+      memcpy(now, baseline, (size_t)size_in_bytes);
+   }
+   position = 0;
+   in_position = 0;
+   while(in_position < encoded_size_in_bytes)
+   {
+      in_position = ryannet_delta_get_varint(in, in_position, encoded_size_in_bytes, &match);
+      if(in_position == -1)
+      {
+         return 1;
+      }
+      in_position = ryannet_delta_get_varint(in, in_position, encoded_size_in_bytes, &literal);
+      if(in_position == -1 ||
+         match > (unsigned int)(size_in_bytes - position) ||
+         literal > (unsigned int)(size_in_bytes - position - (int)match) ||
+         literal > (unsigned int)(encoded_size_in_bytes - in_position))
+      {
+         return 1;
+      }
+      position += (int)match;
+      ryannet_delta_xor(now + position, now + position, in + in_position, (int)literal);
+      position += (int)literal;
+      in_position += (int)literal;
+   }
+   return 0;
+}
+
+#define CHACHA_ROTATE(value, count) (((value) << (count)) | ((value) >> (32 - (count))))
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+   a += b; d ^= a; d = CHACHA_ROTATE(d, 16); \
+   c += d; b ^= c; b = CHACHA_ROTATE(b, 12); \
+   a += b; d ^= a; d = CHACHA_ROTATE(d, 8); \
+   c += d; b ^= c; b = CHACHA_ROTATE(b, 7)
+
+static void ryannet_chacha20_setup(unsigned int state[16], const unsigned char key[32], const unsigned char nonce[12], unsigned int counter)
+{
+   int i;
+   state[0] = 0x61707865;
+   state[1] = 0x3320646e;
+   state[2] = 0x79622d32;
+   state[3] = 0x6b206574;
+   for(i = 0; i < 8; i++)
+   {
+      state[4 + i] = ryannet_load32(key + i * 4);
+   }
+   state[12] = counter;
+   state[13] = ryannet_load32(nonce);
+   state[14] = ryannet_load32(nonce + 4);
+   state[15] = ryannet_load32(nonce + 8);
+}
+
+static void ryannet_chacha20_rounds(unsigned int x[16])
+{
+   int i;
+   for(i = 0; i < 10; i++)
+   {
+      CHACHA_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+      CHACHA_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+      CHACHA_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+      CHACHA_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+      CHACHA_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+      CHACHA_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+      CHACHA_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+      CHACHA_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+   }
+}
+
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+#define CHACHA_ROTATE_SSE2(value, count) \
+   _mm_or_si128(_mm_slli_epi32((value), (count)), _mm_srli_epi32((value), 32 - (count)))
+#define CHACHA_QUARTER_ROUND_SSE2(a, b, c, d) \
+   a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTATE_SSE2(d, 16); \
+   c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTATE_SSE2(b, 12); \
+   a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTATE_SSE2(d, 8); \
+   c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTATE_SSE2(b, 7)
+
+// Four blocks at a time, each lane of a vector holds the same word of a different block
+static void ryannet_chacha20_xor_four_blocks(unsigned int state[16], const unsigned char * in, unsigned char * out)
+{
+   __m128i x[16], original[16];
+   __m128i t0, t1, t2, t3;
+   int i;
+
+   for(i = 0; i < 16; i++)
+   {
+      original[i] = _mm_set1_epi32((int)state[i]);
+   }
+   original[12] = _mm_add_epi32(original[12], _mm_set_epi32(3, 2, 1, 0));
+   for(i = 0; i < 16; i++)
+   {
+      x[i] = original[i];
+   }
+   for(i = 0; i < 10; i++)
+   {
+      CHACHA_QUARTER_ROUND_SSE2(x[0], x[4], x[8], x[12]);
+      CHACHA_QUARTER_ROUND_SSE2(x[1], x[5], x[9], x[13]);
+      CHACHA_QUARTER_ROUND_SSE2(x[2], x[6], x[10], x[14]);
+      CHACHA_QUARTER_ROUND_SSE2(x[3], x[7], x[11], x[15]);
+      CHACHA_QUARTER_ROUND_SSE2(x[0], x[5], x[10], x[15]);
+      CHACHA_QUARTER_ROUND_SSE2(x[1], x[6], x[11], x[12]);
+      CHACHA_QUARTER_ROUND_SSE2(x[2], x[7], x[8], x[13]);
+      CHACHA_QUARTER_ROUND_SSE2(x[3], x[4], x[9], x[14]);
+   }
+   for(i = 0; i < 16; i++)
+   {
+      x[i] = _mm_add_epi32(x[i], original[i]);
+   }
+
+   // Transpose each group of four words back into block order
+   for(i = 0; i < 16; i += 4)
+   {
+      t0 = _mm_unpacklo_epi32(x[i], x[i + 1]);
+      t1 = _mm_unpacklo_epi32(x[i + 2], x[i + 3]);
+      t2 = _mm_unpackhi_epi32(x[i], x[i + 1]);
+      t3 = _mm_unpackhi_epi32(x[i + 2], x[i + 3]);
+      _mm_storeu_si128((__m128i *)(out + i * 4), _mm_xor_si128(
+         _mm_loadu_si128((const __m128i *)(in + i * 4)), _mm_unpacklo_epi64(t0, t1)));
+      _mm_storeu_si128((__m128i *)(out + 64 + i * 4), _mm_xor_si128(
+         _mm_loadu_si128((const __m128i *)(in + 64 + i * 4)), _mm_unpackhi_epi64(t0, t1)));
+      _mm_storeu_si128((__m128i *)(out + 128 + i * 4), _mm_xor_si128(
+         _mm_loadu_si128((const __m128i *)(in + 128 + i * 4)), _mm_unpacklo_epi64(t2, t3)));
+      _mm_storeu_si128((__m128i *)(out + 192 + i * 4), _mm_xor_si128(
+         _mm_loadu_si128((const __m128i *)(in + 192 + i * 4)), _mm_unpackhi_epi64(t2, t3)));
+   }
+   state[12] += 4;
+}
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+
+static void ryannet_chacha20_xor(const unsigned char key[32], const unsigned char nonce[12], unsigned int counter,
+                                 const unsigned char * in, unsigned char * out, int size)
+{
+   unsigned int state[16], x[16];
+   unsigned char block[64];
+   int i, chunk;
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   unsigned char tail[256];
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+
+   ryannet_chacha20_setup(state, key, nonce, counter);
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(size >= 256)
+   {
+      ryannet_chacha20_xor_four_blocks(state, in, out);
+      in += 256;
+      out += 256;
+      size -= 256;
+   }
+   if(size > 64)
+   {
+      // Cheaper to run a padded four block pass than two or more single blocks
+      memcpy(tail, in, (size_t)size);
+      ryannet_chacha20_xor_four_blocks(state, tail, tail);
+      memcpy(out, tail, (size_t)size);
+      size = 0;
+   }
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   while(size > 0)
+   {
+      memcpy(x, state, sizeof(x));
+      ryannet_chacha20_rounds(x);
+      for(i = 0; i < 16; i++)
+      {
+         ryannet_store32(block + i * 4, x[i] + state[i]);
+      }
+      state[12] ++;
+      chunk = size < 64 ? size : 64;
+      for(i = 0; i < chunk; i++)
+      {
+         out[i] = in[i] ^ block[i];
+      }
+      in += chunk;
+      out += chunk;
+      size -= chunk;
+   }
+}
+
+// BLAKE2s-256 from RFC 7693, keyed with up to 32 bytes. Used to derive
+// session keys from the whole handshake.
+#define BLAKE2S_ROTATE_RIGHT(value, count) CHACHA_ROTATE((value), 32 - (count))
+#define BLAKE2S_MIX(a, b, c, d, x, y) \
+   a += b + (x); d ^= a; d = BLAKE2S_ROTATE_RIGHT(d, 16); \
+   c += d; b ^= c; b = BLAKE2S_ROTATE_RIGHT(b, 12); \
+   a += b + (y); d ^= a; d = BLAKE2S_ROTATE_RIGHT(d, 8); \
+   c += d; b ^= c; b = BLAKE2S_ROTATE_RIGHT(b, 7)
+
+static const unsigned int ryannet_blake2s_iv[8] =
+{
+   0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char ryannet_blake2s_sigma[10][16] =
+{
+   {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+   { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+   { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+   {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+   {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+   {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+   { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+   { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+   {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+   { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+static void ryannet_blake2s_compress(unsigned int h[8], const unsigned char block[64], unsigned int counter, int last_flag)
+{
+   const unsigned char * s;
+   unsigned int v[16], m[16];
+   int i;
+   for(i = 0; i < 16; i++)
+   {
+      m[i] = ryannet_load32(block + i * 4);
+   }
+   for(i = 0; i < 8; i++)
+   {
+      v[i] = h[i];
+      v[8 + i] = ryannet_blake2s_iv[i];
+   }
+   // Inputs here stay far below 4GB, so the high counter word is always 0
+   v[12] ^= counter;
+   if(last_flag)
+   {
+      v[14] = ~v[14];
+   }
+   for(i = 0; i < 10; i++)
+   {
+      s = ryannet_blake2s_sigma[i];
+      BLAKE2S_MIX(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+      BLAKE2S_MIX(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+      BLAKE2S_MIX(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+      BLAKE2S_MIX(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+      BLAKE2S_MIX(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+      BLAKE2S_MIX(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+      BLAKE2S_MIX(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+      BLAKE2S_MIX(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+   }
+   for(i = 0; i < 8; i++)
+   {
+      h[i] ^= v[i] ^ v[8 + i];
+   }
+}
+
+void ryannet_crypto_blake2s(unsigned char out[32], const void * key, int key_size_in_bytes, const void * buffer, int buffer_size_in_bytes)
+{
+   const unsigned char * in;
+   unsigned char block[64];
+   unsigned int h[8], counter;
+   int i;
+
+   for(i = 0; i < 8; i++)
+   {
+      h[i] = ryannet_blake2s_iv[i];
+   }
+   h[0] ^= 0x01010020 ^ ((unsigned int)key_size_in_bytes << 8);
+   counter = 0;
+   in = buffer;
+   if(key_size_in_bytes > 0)
+   {
+      // The key is hashed as a block of its own in front of the data
+      memset(block, 0, 64);
+      memcpy(block, key, (size_t)key_size_in_bytes);
+      counter = 64;
+      ryannet_blake2s_compress(h, block, counter, buffer_size_in_bytes == 0);
+   }
+   while(buffer_size_in_bytes > 64)
+   {
+      counter += 64;
+      ryannet_blake2s_compress(h, in, counter, 0);
+      in += 64;
+      buffer_size_in_bytes -= 64;
+   }
+   if(buffer_size_in_bytes > 0 || key_size_in_bytes == 0)
+   {
+      memset(block, 0, 64);
+      memcpy(block, in, (size_t)buffer_size_in_bytes);
+      counter += (unsigned int)buffer_size_in_bytes;
+      ryannet_blake2s_compress(h, block, counter, 1);
+   }
+   for(i = 0; i < 8; i++)
+   {
+      ryannet_store32(out + i * 4, h[i]);
+   }
+   memset(block, 0, 64);
+   memset(h, 0, sizeof(h));
+}
+
+struct ryannet_poly1305
+{
+   unsigned int r[5];
+   unsigned int h[5];
+   unsigned int pad[4];
+};
+
+static void ryannet_poly1305_init(struct ryannet_poly1305 * poly, const unsigned char key[32])
+{
+   poly->r[0] = (ryannet_load32(key + 0)) & 0x3ffffff;
+   poly->r[1] = (ryannet_load32(key + 3) >> 2) & 0x3ffff03;
+   poly->r[2] = (ryannet_load32(key + 6) >> 4) & 0x3ffc0ff;
+   poly->r[3] = (ryannet_load32(key + 9) >> 6) & 0x3f03fff;
+   poly->r[4] = (ryannet_load32(key + 12) >> 8) & 0x00fffff;
+   memset(poly->h, 0, sizeof(poly->h));
+   poly->pad[0] = ryannet_load32(key + 16);
+   poly->pad[1] = ryannet_load32(key + 20);
+   poly->pad[2] = ryannet_load32(key + 24);
+   poly->pad[3] = ryannet_load32(key + 28);
+}
+
+// Only whole blocks, the AEAD construction zero pads everything to 16 bytes
+static void ryannet_poly1305_blocks(struct ryannet_poly1305 * poly, const unsigned char * in, int size)
+{
+   unsigned int r0, r1, r2, r3, r4, s1, s2, s3, s4;
+   unsigned int h0, h1, h2, h3, h4, c;
+   unsigned long long d0, d1, d2, d3, d4;
+   unsigned char block[16];
+
+   r0 = poly->r[0]; r1 = poly->r[1]; r2 = poly->r[2]; r3 = poly->r[3]; r4 = poly->r[4];
+   s1 = r1 * 5; s2 = r2 * 5; s3 = r3 * 5; s4 = r4 * 5;
+   h0 = poly->h[0]; h1 = poly->h[1]; h2 = poly->h[2]; h3 = poly->h[3]; h4 = poly->h[4];
+
+   while(size > 0)
+   {
+      if(size < 16)
+      {
+         memset(block, 0, 16);
+         memcpy(block, in, (size_t)size);
+         in = block;
+         size = 16;
+      }
+      h0 += (ryannet_load32(in + 0)) & 0x3ffffff;
+      h1 += (ryannet_load32(in + 3) >> 2) & 0x3ffffff;
+      h2 += (ryannet_load32(in + 6) >> 4) & 0x3ffffff;
+      h3 += (ryannet_load32(in + 9) >> 6) & 0x3ffffff;
+      h4 += (ryannet_load32(in + 12) >> 8) | (1 << 24);
+
+      d0 = (unsigned long long)h0 * r0 + (unsigned long long)h1 * s4 + (unsigned long long)h2 * s3 + (unsigned long long)h3 * s2 + (unsigned long long)h4 * s1;
+      d1 = (unsigned long long)h0 * r1 + (unsigned long long)h1 * r0 + (unsigned long long)h2 * s4 + (unsigned long long)h3 * s3 + (unsigned long long)h4 * s2;
+      d2 = (unsigned long long)h0 * r2 + (unsigned long long)h1 * r1 + (unsigned long long)h2 * r0 + (unsigned long long)h3 * s4 + (unsigned long long)h4 * s3;
+      d3 = (unsigned long long)h0 * r3 + (unsigned long long)h1 * r2 + (unsigned long long)h2 * r1 + (unsigned long long)h3 * r0 + (unsigned long long)h4 * s4;
+      d4 = (unsigned long long)h0 * r4 + (unsigned long long)h1 * r3 + (unsigned long long)h2 * r2 + (unsigned long long)h3 * r1 + (unsigned long long)h4 * r0;
+
+      c = (unsigned int)(d0 >> 26); h0 = (unsigned int)d0 & 0x3ffffff;
+      d1 += c; c = (unsigned int)(d1 >> 26); h1 = (unsigned int)d1 & 0x3ffffff;
+      d2 += c; c = (unsigned int)(d2 >> 26); h2 = (unsigned int)d2 & 0x3ffffff;
+      d3 += c; c = (unsigned int)(d3 >> 26); h3 = (unsigned int)d3 & 0x3ffffff;
+      d4 += c; c = (unsigned int)(d4 >> 26); h4 = (unsigned int)d4 & 0x3ffffff;
+      h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+      h1 += c;
+
+      in += 16;
+      size -= 16;
+   }
+   poly->h[0] = h0; poly->h[1] = h1; poly->h[2] = h2; poly->h[3] = h3; poly->h[4] = h4;
+}
+
+static void ryannet_poly1305_finish(struct ryannet_poly1305 * poly, unsigned char tag[16])
+{
+   unsigned int h0, h1, h2, h3, h4, c;
+   unsigned int g0, g1, g2, g3, g4, mask;
+   unsigned long long f;
+
+   h0 = poly->h[0]; h1 = poly->h[1]; h2 = poly->h[2]; h3 = poly->h[3]; h4 = poly->h[4];
+   c = h1 >> 26; h1 &= 0x3ffffff;
+   h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+   h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+   h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+   h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+   h1 += c;
+
+   // Compute h - p and keep it if it did not go negative
+   g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+   g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+   g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+   g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+   g4 = h4 + c - (1 << 26);
+   mask = (g4 >> 31) - 1;
+   g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+   mask = ~mask;
+   h0 = (h0 & mask) | g0;
+   h1 = (h1 & mask) | g1;
+   h2 = (h2 & mask) | g2;
+   h3 = (h3 & mask) | g3;
+   h4 = (h4 & mask) | g4;
+
+   h0 = h0 | (h1 << 26);
+   h1 = (h1 >> 6) | (h2 << 20);
+   h2 = (h2 >> 12) | (h3 << 14);
+   h3 = (h3 >> 18) | (h4 << 8);
+
+   f = (unsigned long long)h0 + poly->pad[0]; ryannet_store32(tag + 0, (unsigned int)f);
+   f = (unsigned long long)h1 + poly->pad[1] + (f >> 32); ryannet_store32(tag + 4, (unsigned int)f);
+   f = (unsigned long long)h2 + poly->pad[2] + (f >> 32); ryannet_store32(tag + 8, (unsigned int)f);
+   f = (unsigned long long)h3 + poly->pad[3] + (f >> 32); ryannet_store32(tag + 12, (unsigned int)f);
+}
+
+// ChaCha20-Poly1305 as laid out in RFC 8439
+#define AEAD_SMALL_SIZE 192
+static void ryannet_aead_tag(const unsigned char poly_key[32],
+                             const unsigned char * additional, int additional_size,
+                             const unsigned char * cipher_text, int cipher_text_size, unsigned char tag[16])
+{
+   struct ryannet_poly1305 poly;
+   unsigned char lengths[16];
+   ryannet_poly1305_init(&poly, poly_key);
+   ryannet_poly1305_blocks(&poly, additional, additional_size);
+   ryannet_poly1305_blocks(&poly, cipher_text, cipher_text_size);
+   ryannet_store64(lengths, (unsigned long long)additional_size);
+   ryannet_store64(lengths + 8, (unsigned long long)cipher_text_size);
+   ryannet_poly1305_blocks(&poly, lengths, 16);
+   ryannet_poly1305_finish(&poly, tag);
+}
+
+// Makes the Poly1305 key from block 0. Small packets get blocks 1 to 3 in
+// the same vector pass and 1 is returned with their key stream in stream.
+static int ryannet_aead_key_stream(const unsigned char key[32], const unsigned char nonce[12], int size,
+                                   unsigned char poly_key[32], unsigned char stream[256])
+{
+#if defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   unsigned int state[16];
+   if(size <= AEAD_SMALL_SIZE)
+   {
+      ryannet_chacha20_setup(state, key, nonce, 0);
+      memset(stream, 0, 256);
+      ryannet_chacha20_xor_four_blocks(state, stream, stream);
+      memcpy(poly_key, stream, 32);
+      return 1;
+   }
+#else // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   (void)size;
+   (void)stream;
+#endif // defined(RYANNET_AVX2) || defined(RYANNET_SSE2)
+   memset(poly_key, 0, 32);
+   ryannet_chacha20_xor(key, nonce, 0, poly_key, poly_key, 32);
+   return 0;
+}
+
+static void ryannet_aead_seal(const unsigned char key[32], const unsigned char nonce[12],
+                              const unsigned char * additional, int additional_size,
+                              const unsigned char * plain_text, int size, unsigned char * out)
+{
+   unsigned char poly_key[32], stream[256];
+   int i;
+   if(ryannet_aead_key_stream(key, nonce, size, poly_key, stream))
+   {
+      for(i = 0; i < size; i++)
+      {
+         out[i] = plain_text[i] ^ stream[64 + i];
+      }
+   }
+   else
+   {
+      ryannet_chacha20_xor(key, nonce, 1, plain_text, out, size);
+   }
+   ryannet_aead_tag(poly_key, additional, additional_size, out, size, out + size);
+}
+
+static int ryannet_aead_open(const unsigned char key[32], const unsigned char nonce[12],
+                             const unsigned char * additional, int additional_size,
+                             const unsigned char * cipher_text, int size, unsigned char * out)
+{
+   unsigned char poly_key[32], stream[256], tag[16];
+   unsigned char difference;
+   int i, small_flag;
+   small_flag = ryannet_aead_key_stream(key, nonce, size, poly_key, stream);
+   ryannet_aead_tag(poly_key, additional, additional_size, cipher_text, size, tag);
+   difference = 0;
+   for(i = 0; i < 16; i++)
+   {
+      difference |= tag[i] ^ cipher_text[size + i];
+   }
+   if(difference != 0)
+   {
+      return 1;
+   }
+   if(small_flag)
+   {
+      for(i = 0; i < size; i++)
+      {
+         out[i] = cipher_text[i] ^ stream[64 + i];
+      }
+   }
+   else
+   {
+      ryannet_chacha20_xor(key, nonce, 1, cipher_text, out, size);
+   }
+   return 0;
+}
+
+// X25519 over 16 limbs of 16 bits, small and constant time rather than fast
+typedef long long ryannet_field[16];
+
+static void ryannet_field_carry(ryannet_field o)
+{
+   long long c;
+   int i;
+   for(i = 0; i < 16; i++)
+   {
+      o[i] += (1LL << 16);
+      c = o[i] >> 16;
+      o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+      o[i] -= c * 65536;
+   }
+}
+
+static void ryannet_field_select(ryannet_field p, ryannet_field q, int b)
+{
+   long long t, c;
+   int i;
+   c = ~((long long)b - 1);
+   for(i = 0; i < 16; i++)
+   {
+      t = c & (p[i] ^ q[i]);
+      p[i] ^= t;
+      q[i] ^= t;
+   }
+}
+
+static void ryannet_field_pack(unsigned char * o, const ryannet_field n)
+{
+   ryannet_field m, t;
+   int i, j, b;
+   for(i = 0; i < 16; i++)
+   {
+      t[i] = n[i];
+   }
+   ryannet_field_carry(t);
+   ryannet_field_carry(t);
+   ryannet_field_carry(t);
+   for(j = 0; j < 2; j++)
+   {
+      m[0] = t[0] - 0xffed;
+      for(i = 1; i < 15; i++)
+      {
+         m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+         m[i - 1] &= 0xffff;
+      }
+      m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+      b = (int)((m[15] >> 16) & 1);
+      m[14] &= 0xffff;
+      ryannet_field_select(t, m, 1 - b);
+   }
+   for(i = 0; i < 16; i++)
+   {
+      o[2 * i] = (unsigned char)(t[i] & 0xff);
+      o[2 * i + 1] = (unsigned char)(t[i] >> 8);
+   }
+}
+
+static void ryannet_field_unpack(ryannet_field o, const unsigned char * n)
+{
+   int i;
+   for(i = 0; i < 16; i++)
+   {
+      o[i] = n[2 * i] + ((long long)n[2 * i + 1] << 8);
+   }
+   o[15] &= 0x7fff;
+}
+
+static void ryannet_field_add(ryannet_field o, const ryannet_field a, const ryannet_field b)
+{
+   int i;
+   for(i = 0; i < 16; i++)
+   {
+      o[i] = a[i] + b[i];
+   }
+}
+
+static void ryannet_field_subtract(ryannet_field o, const ryannet_field a, const ryannet_field b)
+{
+   int i;
+   for(i = 0; i < 16; i++)
+   {
+      o[i] = a[i] - b[i];
+   }
+}
+
+static void ryannet_field_multiply(ryannet_field o, const ryannet_field a, const ryannet_field b)
+{
+   long long t[31];
+   int i, j;
+   for(i = 0; i < 31; i++)
+   {
+      t[i] = 0;
+   }
+   for(i = 0; i < 16; i++)
+   {
+      for(j = 0; j < 16; j++)
+      {
+         t[i + j] += a[i] * b[j];
+      }
+   }
+   for(i = 0; i < 15; i++)
+   {
+      t[i] += 38 * t[i + 16];
+   }
+   for(i = 0; i < 16; i++)
+   {
+      o[i] = t[i];
+   }
+   ryannet_field_carry(o);
+   ryannet_field_carry(o);
+}
+
+static void ryannet_field_invert(ryannet_field o, const ryannet_field in)
+{
+   ryannet_field c;
+   int a;
+   for(a = 0; a < 16; a++)
+   {
+      c[a] = in[a];
+   }
+   for(a = 253; a >= 0; a--)
+   {
+      ryannet_field_multiply(c, c, c);
+      if(a != 2 && a != 4)
+      {
+         ryannet_field_multiply(c, c, in);
+      }
+   }
+   for(a = 0; a < 16; a++)
+   {
+      o[a] = c[a];
+   }
+}
+
+static void ryannet_x25519(unsigned char out[32], const unsigned char scalar[32], const unsigned char point[32])
+{
+   static const ryannet_field constant_121665 = { 0xDB41, 1 };
+   unsigned char z[32];
+   ryannet_field a, b, c, d, e, f, x;
+   int i, r;
+
+   memcpy(z, scalar, 32);
+   z[31] = (unsigned char)((scalar[31] & 127) | 64);
+   z[0] &= 248;
+   ryannet_field_unpack(x, point);
+   for(i = 0; i < 16; i++)
+   {
+      b[i] = x[i];
+      d[i] = a[i] = c[i] = 0;
+   }
+   a[0] = d[0] = 1;
+   for(i = 254; i >= 0; i--)
+   {
+      r = (z[i >> 3] >> (i & 7)) & 1;
+      ryannet_field_select(a, b, r);
+      ryannet_field_select(c, d, r);
+      ryannet_field_add(e, a, c);
+      ryannet_field_subtract(a, a, c);
+      ryannet_field_add(c, b, d);
+      ryannet_field_subtract(b, b, d);
+      ryannet_field_multiply(d, e, e);
+      ryannet_field_multiply(f, a, a);
+      ryannet_field_multiply(a, c, a);
+      ryannet_field_multiply(c, b, e);
+      ryannet_field_add(e, a, c);
+      ryannet_field_subtract(a, a, c);
+      ryannet_field_multiply(b, a, a);
+      ryannet_field_subtract(c, d, f);
+      ryannet_field_multiply(a, c, constant_121665);
+      ryannet_field_add(a, a, d);
+      ryannet_field_multiply(c, c, a);
+      ryannet_field_multiply(a, d, f);
+      ryannet_field_multiply(d, b, x);
+      ryannet_field_multiply(b, e, e);
+      ryannet_field_select(a, b, r);
+      ryannet_field_select(c, d, r);
+   }
+   ryannet_field_invert(c, c);
+   ryannet_field_multiply(a, a, c);
+   ryannet_field_pack(out, a);
+}
+
+void ryannet_crypto_x25519(unsigned char out[32], const unsigned char scalar[32], const unsigned char point[32])
+{
+   ryannet_x25519(out, scalar, point);
+}
+
+void ryannet_crypto_aead_seal(const unsigned char key[32], const unsigned char nonce[12], const void * additional, int additional_size_in_bytes,
+                              const void * buffer, int buffer_size_in_bytes, void * out)
+{
+   ryannet_aead_seal(key, nonce, additional, additional_size_in_bytes, buffer, buffer_size_in_bytes, out);
+}
+
+int ryannet_crypto_aead_open(const unsigned char key[32], const unsigned char nonce[12], const void * additional, int additional_size_in_bytes,
+                             const void * sealed, int sealed_size_in_bytes, void * out)
+{
+   if(sealed_size_in_bytes < 16)
+   {
+      return 1;
+   }
+   return ryannet_aead_open(key, nonce, additional, additional_size_in_bytes, sealed, sealed_size_in_bytes - 16, out);
+}
+
+static int ryannet_random_bytes(unsigned char * out, int size)
+{
+#ifdef _WIN32
+   return RtlGenRandom(out, (ULONG)size) ? 0 : 1;
+#else // _WIN32
+   int fd, rv, got;
+   fd = open("/dev/urandom", O_RDONLY);
+   if(fd == -1)
+   {
+      return 1;
+   }
+   got = 0;
+   while(got < size)
+   {
+      rv = (int)read(fd, out + got, (size_t)(size - got));
+      if(rv <= 0)
+      {
+         break;
+      }
+      got += rv;
+   }
+   ryannet_close(fd);
+   return got == size ? 0 : 1;
+#endif // _WIN32
+}
+
+#define SECURE_TYPE_HELLO 1
+#define SECURE_TYPE_WELCOME 2
+#define SECURE_TYPE_DATA 3
+#define SECURE_HEADER_SIZE 9
+#define SECURE_TAG_SIZE 16
+#define SECURE_STATE_NEW 0
+#define SECURE_STATE_HELLO 1
+#define SECURE_STATE_ESTABLISHED 2
+
+struct ryannet_secure_session
+{
+   int state;
+   int pre_shared_key_flag;
+   unsigned char pre_shared_key[32];
+   unsigned char private_key[32];
+   unsigned char public_key[32];
+   unsigned char send_key[32];
+   unsigned char receive_key[32];
+   unsigned long long send_sequence;
+   unsigned long long receive_highest;
+   unsigned long long receive_window;
+};
+
+struct ryannet_secure_session * ryannet_secure_session_new(const unsigned char * pre_shared_key)
+{
+   struct ryannet_secure_session * session;
+   session = malloc(sizeof(struct ryannet_secure_session));
+   memset(session, 0, sizeof(struct ryannet_secure_session));
+   if(pre_shared_key != NULL)
+   {
+      memcpy(session->pre_shared_key, pre_shared_key, 32);
+      session->pre_shared_key_flag = 1;
+   }
+   return session;
+}
+
+void ryannet_secure_session_destroy(struct ryannet_secure_session * session)
+{
+   // Do not leave keys lying around in freed memory
+   memset(session, 0, sizeof(struct ryannet_secure_session));
+   free(session);
+}
+
+static int ryannet_secure_session_make_key_pair(struct ryannet_secure_session * session)
+{
+   static const unsigned char base_point[32] = { 9 };
+   if(ryannet_random_bytes(session->private_key, 32) != 0)
+   {
+      fprintf(stderr, "Error: Couldn't get random bytes\n");
+      return 1;
+   }
+   ryannet_x25519(session->public_key, session->private_key, base_point);
+   return 0;
+}
+
+static int ryannet_secure_session_derive(struct ryannet_secure_session * session, const unsigned char * peer_public_key,
+                                         const unsigned char * client_public_key, const unsigned char * server_public_key,
+                                         int client_flag)
+{
+   unsigned char transcript[96], master[32], keys[64], nonce[12];
+   unsigned char check;
+   int i;
+
+   ryannet_x25519(transcript, session->private_key, peer_public_key);
+   check = 0;
+   for(i = 0; i < 32; i++)
+   {
+      check |= transcript[i];
+   }
+   if(check == 0)
+   {
+      // Low order point from the peer
+      return 1;
+   }
+
+   // Both full public keys go in with the shared secret, keyed by the pre
+   // shared key when there is one, so any change to either side's half of
+   // the handshake ends in different keys. Without a pre shared key the
+   // exchange is anonymous.
+   memcpy(transcript + 32, client_public_key, 32);
+   memcpy(transcript + 64, server_public_key, 32);
+   ryannet_crypto_blake2s(master, session->pre_shared_key, session->pre_shared_key_flag ? 32 : 0, transcript, 96);
+   memset(keys, 0, 64);
+   memset(nonce, 0, 12);
+   ryannet_chacha20_xor(master, nonce, 0, keys, keys, 64);
+   if(client_flag)
+   {
+      memcpy(session->send_key, keys, 32);
+      memcpy(session->receive_key, keys + 32, 32);
+   }
+   else
+   {
+      memcpy(session->send_key, keys + 32, 32);
+      memcpy(session->receive_key, keys, 32);
+   }
+   memset(session->private_key, 0, 32);
+   memset(transcript, 0, 96);
+   memset(master, 0, 32);
+   memset(keys, 0, 64);
+   session->send_sequence = 0;
+   session->receive_highest = 0;
+   session->receive_window = 0;
+   return 0;
+}
+
+static void ryannet_secure_nonce(unsigned char nonce[12], unsigned long long sequence)
+{
+   memset(nonce, 0, 4);
+   ryannet_store64(nonce + 4, sequence);
+}
+
+// Returns 0 if the sequence has not been seen and is not too old
+static int ryannet_secure_session_replay_check(struct ryannet_secure_session * session, unsigned long long sequence)
+{
+   if(sequence > session->receive_highest)
+   {
+      return 0;
+   }
+   if(session->receive_highest - sequence >= 64)
+   {
+      return 1;
+   }
+   return (session->receive_window >> (session->receive_highest - sequence)) & 1 ? 1 : 0;
+}
+
+static void ryannet_secure_session_replay_mark(struct ryannet_secure_session * session, unsigned long long sequence)
+{
+   unsigned long long shift;
+   if(sequence > session->receive_highest)
+   {
+      shift = sequence - session->receive_highest;
+      session->receive_window = shift >= 64 ? 0 : session->receive_window << shift;
+      session->receive_highest = sequence;
+   }
+   session->receive_window |= 1ULL << (session->receive_highest - sequence);
+}
+
+int ryannet_secure_session_client_hello(struct ryannet_secure_session * session, void * out, int out_size_in_bytes)
+{
+   unsigned char * packet;
+   if(out_size_in_bytes < RYANNET_SECURE_HANDSHAKE_SIZE ||
+      ryannet_secure_session_make_key_pair(session) != 0)
+   {
+      return -1;
+   }
+   packet = out;
+   packet[0] = SECURE_TYPE_HELLO;
+   memcpy(packet + 1, session->public_key, 32);
+   // Pad the hello to the size of the reply so servers can't be used to amplify
+   memset(packet + 33, 0, RYANNET_SECURE_HANDSHAKE_SIZE - 33);
+   session->state = SECURE_STATE_HELLO;
+   return RYANNET_SECURE_HANDSHAKE_SIZE;
+}
+
+int ryannet_secure_session_server_accept(struct ryannet_secure_session * session, const void * hello, int hello_size_in_bytes, void * out, int out_size_in_bytes)
+{
+   const unsigned char * in;
+   unsigned char * packet;
+   unsigned char nonce[12];
+
+   in = hello;
+   if(hello_size_in_bytes != RYANNET_SECURE_HANDSHAKE_SIZE || in[0] != SECURE_TYPE_HELLO ||
+      out_size_in_bytes < RYANNET_SECURE_HANDSHAKE_SIZE ||
+      ryannet_secure_session_make_key_pair(session) != 0 ||
+      ryannet_secure_session_derive(session, in + 1, in + 1, session->public_key, 0) != 0)
+   {
+      return -1;
+   }
+
+   packet = out;
+   packet[0] = SECURE_TYPE_WELCOME;
+   memcpy(packet + 1, session->public_key, 32);
+   // Sequence 0 is spent on proving the server has the keys
+   ryannet_secure_nonce(nonce, 0);
+   ryannet_aead_seal(session->send_key, nonce, packet, 33, NULL, 0, packet + 33);
+   session->send_sequence = 1;
+   session->state = SECURE_STATE_ESTABLISHED;
+   return RYANNET_SECURE_HANDSHAKE_SIZE;
+}
+
+int ryannet_secure_session_client_finish(struct ryannet_secure_session * session, const void * welcome, int welcome_size_in_bytes)
+{
+   const unsigned char * in;
+   unsigned char nonce[12];
+
+   in = welcome;
+   if(session->state != SECURE_STATE_HELLO ||
+      welcome_size_in_bytes != RYANNET_SECURE_HANDSHAKE_SIZE || in[0] != SECURE_TYPE_WELCOME ||
+      ryannet_secure_session_derive(session, in + 1, session->public_key, in + 1, 1) != 0)
+   {
+      return 1;
+   }
+   ryannet_secure_nonce(nonce, 0);
+   if(ryannet_aead_open(session->receive_key, nonce, in, 33, in + 33, 0, NULL) != 0)
+   {
+      session->state = SECURE_STATE_NEW;
+      return 1;
+   }
+   ryannet_secure_session_replay_mark(session, 0);
+   session->send_sequence = 1;
+   session->state = SECURE_STATE_ESTABLISHED;
+   return 0;
+}
+
+int ryannet_secure_session_is_established(struct ryannet_secure_session * session)
+{
+   return session->state == SECURE_STATE_ESTABLISHED ? 1 : 0;
+}
+
+int ryannet_secure_session_seal(struct ryannet_secure_session * session, const void * buffer, int buffer_size_in_bytes, void * out, int out_size_in_bytes)
+{
+   unsigned char * packet;
+   unsigned char nonce[12];
+
+   if(session->state != SECURE_STATE_ESTABLISHED ||
+      out_size_in_bytes < buffer_size_in_bytes + RYANNET_SECURE_OVERHEAD)
+   {
+      return -1;
+   }
+   packet = out;
+   packet[0] = SECURE_TYPE_DATA;
+   ryannet_store64(packet + 1, session->send_sequence);
+   ryannet_secure_nonce(nonce, session->send_sequence);
+   session->send_sequence ++;
+   ryannet_aead_seal(session->send_key, nonce, packet, SECURE_HEADER_SIZE,
+                     buffer, buffer_size_in_bytes, packet + SECURE_HEADER_SIZE);
+   return buffer_size_in_bytes + RYANNET_SECURE_OVERHEAD;
+}
+
+int ryannet_secure_session_open(struct ryannet_secure_session * session, const void * packet, int packet_size_in_bytes, void * out, int out_size_in_bytes)
+{
+   const unsigned char * in;
+   unsigned char nonce[12];
+   unsigned long long sequence;
+   int size;
+
+   in = packet;
+   size = packet_size_in_bytes - RYANNET_SECURE_OVERHEAD;
+   if(session->state != SECURE_STATE_ESTABLISHED || size < 0 || size > out_size_in_bytes ||
+      in[0] != SECURE_TYPE_DATA)
+   {
+      return -1;
+   }
+   sequence = ryannet_load64(in + 1);
+   if(ryannet_secure_session_replay_check(session, sequence) != 0)
+   {
+      return -1;
+   }
+   ryannet_secure_nonce(nonce, sequence);
+   if(ryannet_aead_open(session->receive_key, nonce, in, SECURE_HEADER_SIZE,
+                        in + SECURE_HEADER_SIZE, size, out) != 0)
+   {
+      return -1;
+   }
+   // Only authentic packets move the window
+   ryannet_secure_session_replay_mark(session, sequence);
+   return size;
+}
+
+int ryannet_socket_udp_send_secure(struct ryannet_socket_udp * socket, struct ryannet_secure_session * session, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes)
+{
+   void * packet;
+   int size, sent_bytes;
+   size = buffer_size_in_bytes + RYANNET_SECURE_OVERHEAD;
+   packet = ryannet_buffer_alloc(size);
+   size = ryannet_secure_session_seal(session, buffer, buffer_size_in_bytes, packet, size);
+   if(size == -1)
+   {
+      sent_bytes = -1;
+   }
+   else
+   {
+      sent_bytes = ryannet_socket_udp_send(socket, destination, packet, size);
+      if(sent_bytes == size)
+      {
+         sent_bytes = buffer_size_in_bytes;
+      }
+   }
+   ryannet_buffer_free(packet);
+   return sent_bytes;
+}
+
+int ryannet_socket_udp_receive_secure(struct ryannet_socket_udp * socket, struct ryannet_secure_session * session, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source)
+{
+   void * packet;
+   int size, received_bytes;
+   size = buffer_size_in_bytes + RYANNET_SECURE_OVERHEAD;
+   packet = ryannet_buffer_alloc(size);
+   received_bytes = ryannet_socket_udp_receive(socket, packet, size, source);
+   if(received_bytes > 0)
+   {
+      received_bytes = ryannet_secure_session_open(session, packet, received_bytes, buffer, buffer_size_in_bytes);
+   }
+   ryannet_buffer_free(packet);
+   return received_bytes;
+}
+
+#define SIP_ROTATE(value, count) (((value) << (count)) | ((value) >> (64 - (count))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+   v0 += v1; v1 = SIP_ROTATE(v1, 13); v1 ^= v0; v0 = SIP_ROTATE(v0, 32); \
+   v2 += v3; v3 = SIP_ROTATE(v3, 16); v3 ^= v2; \
+   v0 += v3; v3 = SIP_ROTATE(v3, 21); v3 ^= v0; \
+   v2 += v1; v1 = SIP_ROTATE(v1, 17); v1 ^= v2; v2 = SIP_ROTATE(v2, 32)
+
+// SipHash-2-4, a keyed hash made for short inputs like addresses
+static unsigned long long ryannet_siphash(const unsigned char key[16], const unsigned char * in, int size)
+{
+   unsigned long long k0, k1, v0, v1, v2, v3, m, b;
+   int i, tail;
+
+   k0 = ryannet_load64(key);
+   k1 = ryannet_load64(key + 8);
+   v0 = k0 ^ 0x736f6d6570736575ULL;
+   v1 = k1 ^ 0x646f72616e646f6dULL;
+   v2 = k0 ^ 0x6c7967656e657261ULL;
+   v3 = k1 ^ 0x7465646279746573ULL;
+   b = (unsigned long long)size << 56;
+   tail = size & 7;
+   for(i = 0; i + 8 <= size; i += 8)
+   {
+      m = ryannet_load64(in + i);
+      v3 ^= m;
+      SIP_ROUND(v0, v1, v2, v3);
+      SIP_ROUND(v0, v1, v2, v3);
+      v0 ^= m;
+   }
+   while(tail > 0)
+   {
+      tail --;
+      b |= (unsigned long long)in[i + tail] << (8 * tail);
+   }
+   v3 ^= b;
+   SIP_ROUND(v0, v1, v2, v3);
+   SIP_ROUND(v0, v1, v2, v3);
+   v0 ^= b;
+   v2 ^= 0xff;
+   SIP_ROUND(v0, v1, v2, v3);
+   SIP_ROUND(v0, v1, v2, v3);
+   SIP_ROUND(v0, v1, v2, v3);
+   SIP_ROUND(v0, v1, v2, v3);
+   return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Packs the parts of a sockaddr that identify a peer, skipping padding and
+// anything else the kernel may leave different between packets
+#define COOKIE_BUCKET_COUNT 4096
+#define COOKIE_EPOCH_SIZE 4
+
+struct ryannet_cookie_bucket
+{
+   long long last_ns;
+   long long tokens_ns;
+};
+
+struct ryannet_cookie_guard
+{
+   long long rotation_ns;
+   long long token_ns;
+   long long burst_ns;
+   unsigned int epoch;
+   unsigned char secret[16];
+   unsigned char previous_secret[16];
+   unsigned char bucket_secret[16];
+   struct ryannet_cookie_bucket buckets[COOKIE_BUCKET_COUNT];
+};
+
+struct ryannet_cookie_guard * ryannet_cookie_guard_new(int packets_per_second, int burst, int rotation_seconds)
+{
+   struct ryannet_cookie_guard * guard;
+   guard = malloc(sizeof(struct ryannet_cookie_guard));
+   memset(guard, 0, sizeof(struct ryannet_cookie_guard));
+   // Buckets hold time rather than tokens, one token is worth token_ns
+   guard->token_ns = 1000000000LL / (packets_per_second > 0 ? packets_per_second : 1);
+   guard->burst_ns = guard->token_ns * (burst > 0 ? burst : 1);
+   guard->rotation_ns = (long long)(rotation_seconds > 0 ? rotation_seconds : 1) * 1000000000LL;
+   guard->epoch = (unsigned int)(ryannet_time_ns() / guard->rotation_ns);
+   if(ryannet_random_bytes(guard->secret, 16) != 0 ||
+      ryannet_random_bytes(guard->previous_secret, 16) != 0 ||
+      ryannet_random_bytes(guard->bucket_secret, 16) != 0)
+   {
+      fprintf(stderr, "Error: Couldn't get random bytes\n");
+      free(guard);
+      return NULL;
+   }
+   return guard;
+}
+
+void ryannet_cookie_guard_destroy(struct ryannet_cookie_guard * guard)
+{
+   memset(guard, 0, sizeof(struct ryannet_cookie_guard));
+   free(guard);
+}
+
+int ryannet_cookie_guard_allow(struct ryannet_cookie_guard * guard, struct ryannet_address * source)
+{
+   struct ryannet_cookie_bucket * bucket;
+   unsigned char key[ADDRESS_KEY_SIZE];
+   long long now, tokens;
+   int size;
+
+   size = ryannet_address_key(&source->raw, key);
+   // Keyed so a flood can't be aimed at one bucket, colliding peers share a limit
+   bucket = &guard->buckets[ryannet_siphash(guard->bucket_secret, key, size) % COOKIE_BUCKET_COUNT];
+   now = ryannet_time_ns();
+   tokens = bucket->tokens_ns + (now - bucket->last_ns);
+   if(tokens > guard->burst_ns)
+   {
+      tokens = guard->burst_ns;
+   }
+   bucket->last_ns = now;
+   if(tokens < guard->token_ns)
+   {
+      bucket->tokens_ns = tokens;
+      return 0;
+   }
+   bucket->tokens_ns = tokens - guard->token_ns;
+   return 1;
+}
+
+static void ryannet_cookie_guard_rotate(struct ryannet_cookie_guard * guard)
+{
+   unsigned int epoch;
+   epoch = (unsigned int)(ryannet_time_ns() / guard->rotation_ns);
+   if(epoch == guard->epoch)
+   {
+      return;
+   }
+   if(epoch == guard->epoch + 1)
+   {
+      memcpy(guard->previous_secret, guard->secret, 16);
+   }
+   else
+   {
+      (void)ryannet_random_bytes(guard->previous_secret, 16);
+   }
+   (void)ryannet_random_bytes(guard->secret, 16);
+   guard->epoch = epoch;
+}
+
+static unsigned long long ryannet_cookie_guard_hash(const unsigned char secret[16], unsigned int epoch, struct ryannet_address * source)
+{
+   unsigned char key[ADDRESS_KEY_SIZE + COOKIE_EPOCH_SIZE];
+   int size;
+   ryannet_store32(key, epoch);
+   size = ryannet_address_key(&source->raw, key + COOKIE_EPOCH_SIZE);
+   return ryannet_siphash(secret, key, size + COOKIE_EPOCH_SIZE);
+}
+
+void ryannet_cookie_guard_make(struct ryannet_cookie_guard * guard, struct ryannet_address * source, unsigned char * cookie)
+{
+   ryannet_cookie_guard_rotate(guard);
+   ryannet_store32(cookie, guard->epoch);
+   ryannet_store64(cookie + COOKIE_EPOCH_SIZE, ryannet_cookie_guard_hash(guard->secret, guard->epoch, source));
+}
+
+int ryannet_cookie_guard_check(struct ryannet_cookie_guard * guard, struct ryannet_address * source, const unsigned char * cookie)
+{
+   unsigned char expected[8];
+   unsigned char difference;
+   unsigned int epoch;
+   int i;
+
+   ryannet_cookie_guard_rotate(guard);
+   epoch = ryannet_load32(cookie);
+   if(epoch == guard->epoch)
+   {
+      ryannet_store64(expected, ryannet_cookie_guard_hash(guard->secret, epoch, source));
+   }
+   else if(epoch + 1 == guard->epoch)
+   {
+      ryannet_store64(expected, ryannet_cookie_guard_hash(guard->previous_secret, epoch, source));
+   }
+   else
+   {
+      return 0;
+   }
+   difference = 0;
+   for(i = 0; i < 8; i++)
+   {
+      difference |= expected[i] ^ cookie[COOKIE_EPOCH_SIZE + i];
+   }
+   return difference == 0 ? 1 : 0;
+}
+
+int ryannet_socket_udp_set_max_pacing_rate(struct ryannet_socket_udp * socket, unsigned long long bytes_per_second)
+{
+#if defined(__linux__) && defined(SO_MAX_PACING_RATE)
+   socket->max_pacing_rate = bytes_per_second;
+   if(socket->fd != -1 &&
+      setsockopt(socket->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &socket->max_pacing_rate, sizeof(socket->max_pacing_rate)) == -1)
+   {
+      return 1;
+   }
+   return 0;
+#else // SO_MAX_PACING_RATE
+   (void)socket;
+   (void)bytes_per_second;
+   return 1;
+#endif // SO_MAX_PACING_RATE
+}
+
+// SO_TXTIME is accepted whatever the qdisc, but only fq holds packets stamped
+// on CLOCK_MONOTONIC until their time. etf needs CLOCK_TAI and any other qdisc
+// sends them at once in a burst. There is no cheap way to ask which qdisc a
+// route ends up on, so the caller vouches.
+int ryannet_socket_udp_enable_txtime(struct ryannet_socket_udp * socket, int fq_flag)
+{
+   if(!fq_flag)
+   {
+      socket->txtime_flag = 0;
+      return 1;
+   }
+   socket->txtime_flag = 1;
+   if(socket->fd != -1)
+   {
+      ryannet_socket_udp_apply_options(socket);
+   }
+   return socket->txtime_flag ? 0 : 1;
+}
+
+#if defined(__linux__) && defined(SO_TXTIME)
+static int ryannet_socket_udp_send_at(struct ryannet_socket_udp * sock, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes, long long txtime_ns)
+{
+   union
+   {
+      char buffer[CMSG_SPACE(sizeof(unsigned long long))];
+      struct cmsghdr align;
+   } control;
+   unsigned long long txtime;
+   struct cmsghdr * cmsg;
+   struct msghdr header;
+   struct iovec vector;
+   int sent_bytes;
+
+   txtime = (unsigned long long)txtime_ns;
+   vector.iov_base = (void *)buffer;
+   vector.iov_len = buffer_size_in_bytes;
+   memset(&header, 0, sizeof(struct msghdr));
+   header.msg_name = &destination->raw;
+   header.msg_namelen = ryannet_address_raw_length(&destination->raw);
+   header.msg_iov = &vector;
+   header.msg_iovlen = 1;
+   header.msg_control = control.buffer;
+   header.msg_controllen = sizeof(control.buffer);
+   cmsg = CMSG_FIRSTHDR(&header);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_TXTIME;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned long long));
+   memcpy(CMSG_DATA(cmsg), &txtime, sizeof(unsigned long long));
+   ryannet_timestamps_begin(sock->timestamps);
+   sent_bytes = (int)sendmsg(sock->fd, &header, 0);
+   ryannet_timestamps_sent(sock->timestamps, sent_bytes >= 0 ? 1 : 0);
+   if(sent_bytes >= 0)
+   {
+      ryannet_recorder_write(sock->recorder, RYANNET_RECORD_SENT, &destination->raw, buffer, sent_bytes);
+   }
+   return sent_bytes;
+}
+#endif // SO_TXTIME
+
+
+// Wire cost of a datagram beyond its payload, IPv4 plus UDP headers
+#define PACER_PACKET_OVERHEAD 28
+// How far ahead of now the kernel may be asked to hold packets
+#define PACER_HORIZON_NS 100000000LL
+
+struct ryannet_paced_message
+{
+   struct ryannet_message * message;
+   int priority;
+   struct ryannet_paced_message * next;
+};
+
+struct ryannet_pacer
+{
+   struct ryannet_socket_udp * socket;
+   struct ryannet_address destination;
+   unsigned long long bytes_per_second;
+   long long burst_ns;
+   long long next_send_ns;
+   int budget;
+   int tick_sent_flag;
+   int queued_bytes;
+   struct ryannet_paced_message * head;
+};
+
+struct ryannet_pacer * ryannet_pacer_new(struct ryannet_socket_udp * socket, struct ryannet_address * destination, unsigned long long bytes_per_second, int burst_bytes)
+{
+   struct ryannet_pacer * pacer;
+   pacer = malloc(sizeof(struct ryannet_pacer));
+   pacer->socket = socket;
+   pacer->destination.address = ryannet_string_copy(destination->address);
+   pacer->destination.port = ryannet_string_copy(destination->port);
+   memcpy(&pacer->destination.raw, &destination->raw, sizeof(struct sockaddr_storage));
+   pacer->bytes_per_second = 0;
+   pacer->burst_ns = 0;
+   pacer->next_send_ns = 0;
+   pacer->budget = -1;
+   pacer->tick_sent_flag = 0;
+   pacer->queued_bytes = 0;
+   pacer->head = NULL;
+   ryannet_pacer_set_rate(pacer, bytes_per_second, burst_bytes);
+   return pacer;
+}
+
+void ryannet_pacer_destroy(struct ryannet_pacer * pacer)
+{
+   struct ryannet_paced_message * paced;
+   while(pacer->head != NULL)
+   {
+      paced = pacer->head;
+      pacer->head = paced->next;
+      ryannet_message_release(paced->message);
+      free(paced);
+   }
+   free(pacer->destination.address);
+   free(pacer->destination.port);
+   free(pacer);
+}
+
+static long long ryannet_pacer_cost_ns(struct ryannet_pacer * pacer, int size_in_bytes)
+{
+   if(pacer->bytes_per_second == 0)
+   {
+      return 0;
+   }
+   return (long long)(size_in_bytes + PACER_PACKET_OVERHEAD) * 1000000000LL / (long long)pacer->bytes_per_second;
+}
+
+void ryannet_pacer_set_rate(struct ryannet_pacer * pacer, unsigned long long bytes_per_second, int burst_bytes)
+{
+   pacer->bytes_per_second = bytes_per_second;
+   pacer->burst_ns = ryannet_pacer_cost_ns(pacer, burst_bytes > PACER_PACKET_OVERHEAD ? burst_bytes - PACER_PACKET_OVERHEAD : 0);
+}
+
+int ryannet_pacer_queue(struct ryannet_pacer * pacer, struct ryannet_message * message, int priority)
+{
+   struct ryannet_paced_message * paced, ** link;
+   paced = malloc(sizeof(struct ryannet_paced_message));
+   ryannet_message_retain(message);
+   paced->message = message;
+   paced->priority = priority;
+   // Highest priority first, first in first out within a priority
+   link = &pacer->head;
+   while(*link != NULL && (*link)->priority >= priority)
+   {
+      link = &(*link)->next;
+   }
+   paced->next = *link;
+   *link = paced;
+   pacer->queued_bytes += message->size;
+   return 0;
+}
+
+int ryannet_pacer_drop(struct ryannet_pacer * pacer, int below_priority)
+{
+   struct ryannet_paced_message * paced, ** link;
+   int count;
+   count = 0;
+   link = &pacer->head;
+   while(*link != NULL)
+   {
+      paced = *link;
+      if(paced->priority < below_priority)
+      {
+         *link = paced->next;
+         pacer->queued_bytes -= paced->message->size;
+         ryannet_message_release(paced->message);
+         free(paced);
+         count ++;
+      }
+      else
+      {
+         link = &paced->next;
+      }
+   }
+   return count;
+}
+
+void ryannet_pacer_begin_tick(struct ryannet_pacer * pacer, int budget_in_bytes)
+{
+   pacer->budget = budget_in_bytes;
+   pacer->tick_sent_flag = 0;
+}
+
+int ryannet_pacer_flush(struct ryannet_pacer * pacer)
+{
+   struct ryannet_paced_message * paced;
+   long long now, send_ns;
+   int count, rv, size;
+
+   count = 0;
+   now = ryannet_time_ns();
+   // Idle time only builds up credit for one burst
+   if(pacer->next_send_ns < now - pacer->burst_ns)
+   {
+      pacer->next_send_ns = now - pacer->burst_ns;
+   }
+   while(pacer->head != NULL)
+   {
+      paced = pacer->head;
+      size = paced->message->size;
+      // A message larger than the whole budget still goes out on its own
+      // rather than blocking the queue forever
+      if(pacer->budget >= 0 && size > pacer->budget && pacer->tick_sent_flag)
+      {
+         break;
+      }
+      send_ns = pacer->next_send_ns;
+#if defined(__linux__) && defined(SO_TXTIME)
+      if(pacer->socket->txtime_flag && pacer->socket->fd != -1)
+      {
+         // The kernel holds the packet until its slot
+         if(send_ns > now + PACER_HORIZON_NS)
+         {
+            break;
+         }
+         rv = ryannet_socket_udp_send_at(pacer->socket, &pacer->destination, paced->message->data, size, send_ns > now ? send_ns : now);
+      }
+      else
+#endif // SO_TXTIME
+      {
+         if(send_ns > now)
+         {
+            break;
+         }
+         rv = ryannet_socket_udp_send(pacer->socket, &pacer->destination, paced->message->data, size);
+      }
+      if(rv == -1)
+      {
+         return -1;
+      }
+      pacer->next_send_ns = send_ns + ryannet_pacer_cost_ns(pacer, size);
+      if(pacer->budget >= 0)
+      {
+         pacer->budget = size > pacer->budget ? 0 : pacer->budget - size;
+      }
+      pacer->tick_sent_flag = 1;
+      pacer->head = paced->next;
+      pacer->queued_bytes -= size;
+      ryannet_message_release(paced->message);
+      free(paced);
+      count ++;
+   }
+   return count;
+}
+
+int ryannet_pacer_get_wait_us(struct ryannet_pacer * pacer)
+{
+   long long wait;
+   if(pacer->head == NULL ||
+      (pacer->budget >= 0 && pacer->head->message->size > pacer->budget && pacer->tick_sent_flag))
+   {
+      return -1;
+   }
+   wait = pacer->next_send_ns - ryannet_time_ns();
+   if(pacer->socket->txtime_flag)
+   {
+      wait -= PACER_HORIZON_NS;
+   }
+   return wait > 0 ? (int)((wait + 999) / 1000) : 0;
+}
+
+int ryannet_pacer_get_queued_bytes(struct ryannet_pacer * pacer)
+{
+   return pacer->queued_bytes;
+}
+
+
+int ryannet_socket_udp_enable_timestamps(struct ryannet_socket_udp * socket)
+{
+#ifdef RYANNET_TIMESTAMPING
+   if(socket->timestamps == NULL)
+   {
+      socket->timestamps = ryannet_timestamps_new(0);
+      if(socket->fd != -1)
+      {
+         ryannet_socket_udp_apply_options(socket);
+      }
+   }
+   return socket->timestamps != NULL ? 0 : 1;
+#else // RYANNET_TIMESTAMPING
+   (void)socket;
+   return 1;
+#endif // RYANNET_TIMESTAMPING
+}
+
+int ryannet_socket_tcp_enable_timestamps(struct ryannet_socket_tcp * socket)
+{
+#ifdef RYANNET_TIMESTAMPING
+   if(socket->timestamps != NULL)
+   {
+      return 0;
+   }
+   if(socket->fd == -1 || socket->shm != NULL || ryannet_timestamps_apply(socket->fd) != 0)
+   {
+      return 1;
+   }
+   socket->timestamps = ryannet_timestamps_new(1);
+   return 0;
+#else // RYANNET_TIMESTAMPING
+   (void)socket;
+   return 1;
+#endif // RYANNET_TIMESTAMPING
+}
+
+int ryannet_socket_udp_collect_timestamps(struct ryannet_socket_udp * socket)
+{
+#ifdef RYANNET_TIMESTAMPING
+   if(socket->timestamps != NULL && socket->fd != -1)
+   {
+      return ryannet_timestamps_collect(socket->timestamps, socket->fd);
+   }
+#endif // RYANNET_TIMESTAMPING
+   (void)socket;
+   return 0;
+}
+
+int ryannet_socket_tcp_collect_timestamps(struct ryannet_socket_tcp * socket)
+{
+#ifdef RYANNET_TIMESTAMPING
+   if(socket->timestamps != NULL)
+   {
+      return ryannet_timestamps_collect(socket->timestamps, socket->fd);
+   }
+#endif // RYANNET_TIMESTAMPING
+   (void)socket;
+   return 0;
+}
+
+struct ryannet_histogram * ryannet_socket_udp_get_receive_delay(struct ryannet_socket_udp * socket)
+{
+   return socket->timestamps != NULL ? &socket->timestamps->rx : NULL;
+}
+
+struct ryannet_histogram * ryannet_socket_udp_get_send_delay(struct ryannet_socket_udp * socket)
+{
+   return socket->timestamps != NULL ? &socket->timestamps->tx : NULL;
+}
+
+struct ryannet_histogram * ryannet_socket_tcp_get_receive_delay(struct ryannet_socket_tcp * socket)
+{
+   return socket->timestamps != NULL ? &socket->timestamps->rx : NULL;
+}
+
+struct ryannet_histogram * ryannet_socket_tcp_get_send_delay(struct ryannet_socket_tcp * socket)
+{
+   return socket->timestamps != NULL ? &socket->timestamps->tx : NULL;
+}
+
+
+void ryannet_impairment_init(struct ryannet_impairment * impairment)
+{
+   memset(impairment, 0, sizeof(struct ryannet_impairment));
+   impairment->jitter_distribution = RYANNET_JITTER_UNIFORM;
+   impairment->reorder_ms = 10;
+   impairment->seed = 1;
+}
+
+// splitmix64, small and the same on every platform so runs repeat exactly
+static unsigned long long ryannet_random_next(unsigned long long * state)
+{
+   unsigned long long z;
+   *state += 0x9E3779B97F4A7C15ULL;
+   z = *state;
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+static double ryannet_random_uniform(unsigned long long * state)
+{
+   return (double)(ryannet_random_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long long ryannet_impairment_delay_ns(const struct ryannet_impairment * impairment, unsigned long long * state)
+{
+   double sample;
+   long long delay;
+   int i;
+   delay = (long long)impairment->latency_ms * 1000000LL;
+   if(impairment->jitter_ms > 0)
+   {
+      if(impairment->jitter_distribution == RYANNET_JITTER_NORMAL)
+      {
+         // Sum of twelve uniforms is close enough to a unit normal
+         sample = -6.0;
+         for(i = 0; i < 12; i++)
+         {
+            sample += ryannet_random_uniform(state);
+         }
+      }
+      else
+      {
+         sample = ryannet_random_uniform(state) * 2.0 - 1.0;
+      }
+      delay += (long long)(sample * impairment->jitter_ms * 1000000.0);
+   }
+   return delay > 0 ? delay : 0;
+}
+
+struct ryannet_delayed_packet
+{
+   long long due_ns;
+   unsigned long long sequence;
+   int size;
+   struct sockaddr_storage raw;
+};
+
+// Min heap on due time, sequence keeps packets due together in send order
+struct ryannet_delay_queue
+{
+   struct ryannet_impairment config;
+   unsigned long long random_state;
+   unsigned long long sequence;
+   long long link_free_ns;
+   struct ryannet_delayed_packet ** heap;
+   int count;
+   int size;
+   struct ryannet_impairment_stats stats;
+};
+
+static void ryannet_delay_queue_init(struct ryannet_delay_queue * queue, const struct ryannet_impairment * impairment)
+{
+   memset(queue, 0, sizeof(struct ryannet_delay_queue));
+   if(impairment != NULL)
+   {
+      queue->config = *impairment;
+   }
+   else
+   {
+      ryannet_impairment_init(&queue->config);
+   }
+   queue->random_state = queue->config.seed;
+}
+
+static void ryannet_delay_queue_free(struct ryannet_delay_queue * queue)
+{
+   while(queue->count > 0)
+   {
+      queue->count --;
+      ryannet_buffer_free(queue->heap[queue->count]);
+   }
+   free(queue->heap);
+}
+
+static int ryannet_delayed_packet_before(struct ryannet_delayed_packet * a, struct ryannet_delayed_packet * b)
+{
+   return a->due_ns < b->due_ns || (a->due_ns == b->due_ns && a->sequence < b->sequence);
+}
+
+static void ryannet_delay_queue_insert(struct ryannet_delay_queue * queue, long long due_ns, const void * buffer, int size, struct sockaddr_storage * raw)
+{
+   struct ryannet_delayed_packet * packet;
+   int index, parent;
+
+   packet = ryannet_buffer_alloc((int)sizeof(struct ryannet_delayed_packet) + size);
+   packet->due_ns = due_ns;
+   packet->sequence = queue->sequence ++;
+   packet->size = size;
+   memcpy(&packet->raw, raw, sizeof(struct sockaddr_storage));
+   memcpy(packet + 1, buffer, (size_t)size);
+
+   if(queue->count == queue->size)
+   {
+      queue->size = queue->size == 0 ? 64 : queue->size * 2;
+      queue->heap = realloc(queue->heap, sizeof(struct ryannet_delayed_packet *) * queue->size);
+   }
+   index = queue->count;
+   queue->count ++;
+   while(index > 0)
+   {
+      parent = (index - 1) / 2;
+      if(!ryannet_delayed_packet_before(packet, queue->heap[parent]))
+      {
+         break;
+      }
+      queue->heap[index] = queue->heap[parent];
+      index = parent;
+   }
+   queue->heap[index] = packet;
+}
+
+static struct ryannet_delayed_packet * ryannet_delay_queue_pop(struct ryannet_delay_queue * queue, long long now)
+{
+   struct ryannet_delayed_packet * top, * last;
+   int index, child;
+
+   if(queue->count == 0 || queue->heap[0]->due_ns > now)
+   {
+      return NULL;
+   }
+   top = queue->heap[0];
+   queue->count --;
+   last = queue->heap[queue->count];
+   index = 0;
+   while(1)
+   {
+      child = index * 2 + 1;
+      if(child >= queue->count)
+      {
+         break;
+      }
+      if(child + 1 < queue->count && ryannet_delayed_packet_before(queue->heap[child + 1], queue->heap[child]))
+      {
+         child ++;
+      }
+      if(!ryannet_delayed_packet_before(queue->heap[child], last))
+      {
+         break;
+      }
+      queue->heap[index] = queue->heap[child];
+      index = child;
+   }
+   if(queue->count > 0)
+   {
+      queue->heap[index] = last;
+   }
+   queue->stats.delivered ++;
+   return top;
+}
+
+static void ryannet_delay_queue_push(struct ryannet_delay_queue * queue, const void * buffer, int size, struct sockaddr_storage * raw)
+{
+   struct ryannet_impairment * config;
+   long long now, depart, delay;
+   int copies, i;
+
+   config = &queue->config;
+   queue->stats.packets ++;
+   if(ryannet_random_uniform(&queue->random_state) < config->loss)
+   {
+      queue->stats.dropped ++;
+      return;
+   }
+   copies = 1;
+   if(ryannet_random_uniform(&queue->random_state) < config->duplicate)
+   {
+      copies = 2;
+      queue->stats.duplicated ++;
+   }
+
+   now = ryannet_time_ns();
+   depart = now;
+   if(config->bytes_per_second > 0)
+   {
+      // The bottleneck link sends one packet at a time and tail drops once
+      // its queue is full
+      if(queue->link_free_ns < now)
+      {
+         queue->link_free_ns = now;
+      }
+      if(config->queue_limit_bytes > 0 &&
+         (queue->link_free_ns - now) * (long long)config->bytes_per_second / 1000000000LL + size > config->queue_limit_bytes)
+      {
+         queue->stats.dropped ++;
+         return;
+      }
+      queue->link_free_ns += (long long)(size + PACER_PACKET_OVERHEAD) * 1000000000LL / (long long)config->bytes_per_second;
+      depart = queue->link_free_ns;
+   }
+
+   for(i = 0; i < copies; i++)
+   {
+      delay = ryannet_impairment_delay_ns(config, &queue->random_state);
+      if(ryannet_random_uniform(&queue->random_state) < config->reorder)
+      {
+         delay += (long long)config->reorder_ms * 1000000LL;
+         queue->stats.reordered ++;
+      }
+      ryannet_delay_queue_insert(queue, depart + delay, buffer, size, raw);
+   }
+}
+
+
+#define IMPAIRED_DATAGRAM_SIZE 65536
+struct ryannet_impaired_udp
+{
+   struct ryannet_socket_udp * socket;
+   struct ryannet_delay_queue outgoing;
+   struct ryannet_delay_queue incoming;
+   unsigned char * scratch;
+};
+
+struct ryannet_impaired_udp * ryannet_impaired_udp_new(struct ryannet_socket_udp * socket, const struct ryannet_impairment * outgoing, const struct ryannet_impairment * incoming)
+{
+   struct ryannet_impaired_udp * impaired;
+   impaired = malloc(sizeof(struct ryannet_impaired_udp));
+   impaired->socket = socket;
+   ryannet_delay_queue_init(&impaired->outgoing, outgoing);
+   ryannet_delay_queue_init(&impaired->incoming, incoming);
+   impaired->scratch = ryannet_buffer_alloc(IMPAIRED_DATAGRAM_SIZE);
+   return impaired;
+}
+
+void ryannet_impaired_udp_destroy(struct ryannet_impaired_udp * impaired)
+{
+   ryannet_delay_queue_free(&impaired->outgoing);
+   ryannet_delay_queue_free(&impaired->incoming);
+   ryannet_buffer_free(impaired->scratch);
+   free(impaired);
+}
+
+int ryannet_impaired_udp_send(struct ryannet_impaired_udp * impaired, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes)
+{
+   if(buffer_size_in_bytes < 0 || buffer_size_in_bytes > IMPAIRED_DATAGRAM_SIZE)
+   {
+      return -1;
+   }
+   if(impaired->socket->fd == -1 && ryannet_socket_udp_open(impaired->socket, destination) != 0)
+   {
+      return -1;
+   }
+   ryannet_delay_queue_push(&impaired->outgoing, buffer, buffer_size_in_bytes, &destination->raw);
+   return buffer_size_in_bytes;
+}
+
+int ryannet_impaired_udp_pump(struct ryannet_impaired_udp * impaired)
+{
+   struct ryannet_delayed_packet * packet;
+   struct ryannet_address address;
+   long long now;
+   int moved, size;
+
+   moved = 0;
+   address.address = NULL;
+   address.port = NULL;
+   now = ryannet_time_ns();
+   while((packet = ryannet_delay_queue_pop(&impaired->outgoing, now)) != NULL)
+   {
+      memcpy(&address.raw, &packet->raw, sizeof(struct sockaddr_storage));
+      (void)ryannet_socket_udp_send(impaired->socket, &address, packet + 1, packet->size);
+      ryannet_buffer_free(packet);
+      moved ++;
+   }
+   if(impaired->socket->fd != -1)
+   {
+      while((size = ryannet_socket_udp_receive_nonblock(impaired->socket, impaired->scratch, IMPAIRED_DATAGRAM_SIZE, &address)) > 0)
+      {
+         ryannet_delay_queue_push(&impaired->incoming, impaired->scratch, size, &address.raw);
+         moved ++;
+      }
+   }
+   return moved;
+}
+
+int ryannet_impaired_udp_receive_nonblock(struct ryannet_impaired_udp * impaired, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source)
+{
+   struct ryannet_delayed_packet * packet;
+   int size;
+
+   (void)ryannet_impaired_udp_pump(impaired);
+   packet = ryannet_delay_queue_pop(&impaired->incoming, ryannet_time_ns());
+   if(packet == NULL)
+   {
+      return 0;
+   }
+   // Like recvfrom, anything past the end of the buffer is lost
+   size = packet->size < buffer_size_in_bytes ? packet->size : buffer_size_in_bytes;
+   memcpy(buffer, packet + 1, (size_t)size);
+   memcpy(&source->raw, &packet->raw, sizeof(struct sockaddr_storage));
+   ryannet_buffer_free(packet);
+   return size;
+}
+
+int ryannet_impaired_udp_get_wait_us(struct ryannet_impaired_udp * impaired)
+{
+   long long next, wait;
+   next = -1;
+   if(impaired->outgoing.count > 0)
+   {
+      next = impaired->outgoing.heap[0]->due_ns;
+   }
+   if(impaired->incoming.count > 0 && (next == -1 || impaired->incoming.heap[0]->due_ns < next))
+   {
+      next = impaired->incoming.heap[0]->due_ns;
+   }
+   if(next == -1)
+   {
+      return -1;
+   }
+   wait = next - ryannet_time_ns();
+   return wait > 0 ? (int)((wait + 999) / 1000) : 0;
+}
+
+void ryannet_impaired_udp_get_stats(struct ryannet_impaired_udp * impaired, struct ryannet_impairment_stats * outgoing, struct ryannet_impairment_stats * incoming)
+{
+   if(outgoing != NULL)
+   {
+      *outgoing = impaired->outgoing.stats;
+   }
+   if(incoming != NULL)
+   {
+      *incoming = impaired->incoming.stats;
+   }
+}
+
+
+#define PROXY_CHUNK_SIZE 16384
+#define PROXY_DEFAULT_QUEUE_LIMIT 65536
+// Data in flight on the simulated wire, only there to bound memory
+#define PROXY_MAX_IN_FLIGHT (16 * 1024 * 1024)
+
+struct ryannet_delayed_chunk
+{
+   long long due_ns;
+   struct ryannet_message * message;
+   struct ryannet_delayed_chunk * next;
+};
+
+struct ryannet_impaired_direction
+{
+   struct ryannet_socket_tcp * from;
+   struct ryannet_socket_tcp * to;
+   long long link_free_ns;
+   long long last_due_ns;
+   int queued_bytes;
+   // Set once everything from one side is passed on and the other side
+   // has been shut down, or it can no longer be written to
+   int finished_flag;
+   struct ryannet_delayed_chunk * head;
+   struct ryannet_delayed_chunk * tail;
+};
+
+struct ryannet_impaired_connection
+{
+   struct ryannet_socket_tcp * client;
+   struct ryannet_socket_tcp * server;
+   struct ryannet_impaired_direction up;
+   struct ryannet_impaired_direction down;
+   struct ryannet_impaired_connection * next;
+};
+
+struct ryannet_impaired_proxy
+{
+   struct ryannet_socket_tcp * listener;
+   char * target_address;
+   char * target_port;
+   struct ryannet_impairment config;
+   unsigned long long random_state;
+   struct ryannet_impaired_connection * connections;
+   unsigned char * scratch;
+};
+
+struct ryannet_impaired_proxy * ryannet_impaired_proxy_new(const char * bind_address, const char * bind_port, const char * target_address, const char * target_port, const struct ryannet_impairment * impairment)
+{
+   struct ryannet_impaired_proxy * proxy;
+   struct ryannet_socket_tcp * listener;
+
+   listener = ryannet_socket_tcp_new();
+   if(ryannet_socket_tcp_bind(listener, bind_address, bind_port) != 0)
+   {
+      ryannet_socket_tcp_destroy(listener);
+      return NULL;
+   }
+   proxy = malloc(sizeof(struct ryannet_impaired_proxy));
+   proxy->listener = listener;
+   proxy->target_address = ryannet_string_copy(target_address);
+   proxy->target_port = ryannet_string_copy(target_port);
+   if(impairment != NULL)
+   {
+      proxy->config = *impairment;
+   }
+   else
+   {
+      ryannet_impairment_init(&proxy->config);
+   }
+   proxy->random_state = proxy->config.seed;
+   proxy->connections = NULL;
+   proxy->scratch = ryannet_buffer_alloc(PROXY_CHUNK_SIZE);
+   return proxy;
+}
+
+static void ryannet_impaired_direction_init(struct ryannet_impaired_direction * direction, struct ryannet_socket_tcp * from, struct ryannet_socket_tcp * to)
+{
+   direction->from = from;
+   direction->to = to;
+   direction->link_free_ns = 0;
+   direction->last_due_ns = 0;
+   direction->queued_bytes = 0;
+   direction->finished_flag = 0;
+   direction->head = NULL;
+   direction->tail = NULL;
+}
+
+static void ryannet_impaired_direction_free(struct ryannet_impaired_direction * direction)
+{
+   struct ryannet_delayed_chunk * chunk;
+   while(direction->head != NULL)
+   {
+      chunk = direction->head;
+      direction->head = chunk->next;
+      ryannet_message_release(chunk->message);
+      free(chunk);
+   }
+}
+
+static void ryannet_impaired_connection_destroy(struct ryannet_impaired_connection * connection)
+{
+   ryannet_impaired_direction_free(&connection->up);
+   ryannet_impaired_direction_free(&connection->down);
+   ryannet_socket_tcp_destroy(connection->client);
+   ryannet_socket_tcp_destroy(connection->server);
+   free(connection);
+}
+
+void ryannet_impaired_proxy_destroy(struct ryannet_impaired_proxy * proxy)
+{
+   struct ryannet_impaired_connection * connection;
+   while(proxy->connections != NULL)
+   {
+      connection = proxy->connections;
+      proxy->connections = connection->next;
+      ryannet_impaired_connection_destroy(connection);
+   }
+   ryannet_socket_tcp_destroy(proxy->listener);
+   free(proxy->target_address);
+   free(proxy->target_port);
+   ryannet_buffer_free(proxy->scratch);
+   free(proxy);
+}
+
+static int ryannet_impaired_direction_pump(struct ryannet_impaired_proxy * proxy, struct ryannet_impaired_direction * direction)
+{
+   struct ryannet_delayed_chunk * chunk;
+   long long now, depart, due, backlog;
+   int limit, size, moved;
+
+   if(direction->finished_flag)
+   {
+      return 0;
+   }
+   moved = 0;
+   limit = proxy->config.queue_limit_bytes > 0 ? proxy->config.queue_limit_bytes : PROXY_DEFAULT_QUEUE_LIMIT;
+   now = ryannet_time_ns();
+   while(!direction->from->remote_closed_flag && direction->queued_bytes < PROXY_MAX_IN_FLIGHT &&
+         ryannet_socket_tcp_queue_is_empty(direction->to))
+   {
+      // Stop reading while the bottleneck is backed up so the sender sees
+      // a full window, data already on the wire does not count
+      if(proxy->config.bytes_per_second > 0 && direction->link_free_ns > now)
+      {
+         backlog = (direction->link_free_ns - now) * (long long)proxy->config.bytes_per_second / 1000000000LL;
+         if(backlog >= limit)
+         {
+            break;
+         }
+      }
+      size = ryannet_socket_tcp_receive_nonblock(direction->from, proxy->scratch, PROXY_CHUNK_SIZE);
+      if(size == -1)
+      {
+         direction->from->remote_closed_flag = 1;
+      }
+      if(size <= 0)
+      {
+         break;
+      }
+      depart = now;
+      if(proxy->config.bytes_per_second > 0)
+      {
+         if(direction->link_free_ns < now)
+         {
+            direction->link_free_ns = now;
+         }
+         direction->link_free_ns += (long long)size * 1000000000LL / (long long)proxy->config.bytes_per_second;
+         depart = direction->link_free_ns;
+      }
+      // A stream can not reorder, so jitter only ever holds data back
+      due = depart + ryannet_impairment_delay_ns(&proxy->config, &proxy->random_state);
+      if(due < direction->last_due_ns)
+      {
+         due = direction->last_due_ns;
+      }
+      direction->last_due_ns = due;
+
+      chunk = malloc(sizeof(struct ryannet_delayed_chunk));
+      chunk->due_ns = due;
+      chunk->message = ryannet_message_new(proxy->scratch, size);
+      chunk->next = NULL;
+      if(direction->tail == NULL)
+      {
+         direction->head = chunk;
+      }
+      else
+      {
+         direction->tail->next = chunk;
+      }
+      direction->tail = chunk;
+      direction->queued_bytes += size;
+      moved ++;
+   }
+
+   while(direction->head != NULL && direction->head->due_ns <= now)
+   {
+      chunk = direction->head;
+      direction->head = chunk->next;
+      if(direction->head == NULL)
+      {
+         direction->tail = NULL;
+      }
+      (void)ryannet_socket_tcp_queue(direction->to, chunk->message);
+      direction->queued_bytes -= chunk->message->size;
+      ryannet_message_release(chunk->message);
+      free(chunk);
+      moved ++;
+   }
+   if(!ryannet_socket_tcp_queue_is_empty(direction->to) &&
+      ryannet_socket_tcp_flush_nonblock(direction->to) == -1)
+   {
+      // Nobody left to deliver to
+      ryannet_impaired_direction_free(direction);
+      direction->finished_flag = 1;
+   }
+   else if(direction->from->remote_closed_flag && direction->head == NULL &&
+           ryannet_socket_tcp_queue_is_empty(direction->to))
+   {
+      // Pass the half close on, the other direction keeps going
+      (void)ryannet_socket_tcp_shutdown(direction->to);
+      direction->finished_flag = 1;
+   }
+   return moved;
+}
+
+int ryannet_impaired_proxy_pump(struct ryannet_impaired_proxy * proxy)
+{
+   struct ryannet_impaired_connection * connection, ** link;
+   struct ryannet_socket_tcp * client, * server;
+   int moved;
+
+   moved = 0;
+   while((client = ryannet_socket_tcp_accept_nonblock(proxy->listener)) != NULL)
+   {
+      server = ryannet_socket_tcp_new();
+      if(ryannet_socket_tcp_connect(server, proxy->target_address, proxy->target_port) != 0)
+      {
+         ryannet_socket_tcp_destroy(server);
+         ryannet_socket_tcp_destroy(client);
+         continue;
+      }
+      connection = malloc(sizeof(struct ryannet_impaired_connection));
+      connection->client = client;
+      connection->server = server;
+      ryannet_impaired_direction_init(&connection->up, client, server);
+      ryannet_impaired_direction_init(&connection->down, server, client);
+      connection->next = proxy->connections;
+      proxy->connections = connection;
+   }
+
+   link = &proxy->connections;
+   while(*link != NULL)
+   {
+      connection = *link;
+      moved += ryannet_impaired_direction_pump(proxy, &connection->up);
+      moved += ryannet_impaired_direction_pump(proxy, &connection->down);
+      // The pair ends once both directions are closed and drained
+      if(connection->up.finished_flag && connection->down.finished_flag)
+      {
+         *link = connection->next;
+         ryannet_impaired_connection_destroy(connection);
+      }
+      else
+      {
+         link = &connection->next;
+      }
+   }
+   return moved;
+}
+
+int ryannet_impaired_proxy_get_connection_count(struct ryannet_impaired_proxy * proxy)
+{
+   struct ryannet_impaired_connection * connection;
+   int count;
+   count = 0;
+   for(connection = proxy->connections; connection != NULL; connection = connection->next)
+   {
+      count ++;
+   }
+   return count;
+}
+
+
+struct ryannet_recorder * ryannet_recorder_new(const char * path, long long max_size_in_bytes)
+{
+   struct ryannet_recorder * recorder;
+   unsigned char header[RECORDER_HEADER_SIZE];
+
+   memcpy(header, RECORDER_MAGIC, 8);
+   ryannet_store64(header + 8, (unsigned long long)time(NULL));
+   recorder = malloc(sizeof(struct ryannet_recorder));
+   memset(recorder, 0, sizeof(struct ryannet_recorder));
+   recorder->start_ns = ryannet_time_ns();
+   recorder->used = RECORDER_HEADER_SIZE;
+   if(max_size_in_bytes > 0)
+   {
+      recorder->limit = max_size_in_bytes > RECORDER_HEADER_SIZE ? max_size_in_bytes : RECORDER_HEADER_SIZE;
+   }
+#ifdef _WIN32
+   recorder->file = fopen(path, "wb");
+   if(recorder->file == NULL)
+   {
+      fprintf(stderr, "Error: Couldn't Open %s\n", path);
+      free(recorder);
+      return NULL;
+   }
+   fwrite(header, 1, RECORDER_HEADER_SIZE, recorder->file);
+#else // _WIN32
+   recorder->capacity = RECORDER_INITIAL_CAPACITY;
+   if(recorder->limit > 0 && recorder->capacity > recorder->limit)
+   {
+      recorder->capacity = recorder->limit;
+   }
+   recorder->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if(recorder->fd == -1 || ftruncate(recorder->fd, (off_t)recorder->capacity) == -1)
+   {
+      fprintf(stderr, "Error: Couldn't Open %s: %s\n", path, strerror(errno));
+      if(recorder->fd != -1)
+      {
+         close(recorder->fd);
+      }
+      free(recorder);
+      return NULL;
+   }
+   recorder->map = mmap(NULL, (size_t)recorder->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0);
+   if(recorder->map == MAP_FAILED)
+   {
+      fprintf(stderr, "Error: Couldn't Map %s: %s\n", path, strerror(errno));
+      close(recorder->fd);
+      free(recorder);
+      return NULL;
    }
-   if(socket->remote.port != NULL)
+   memcpy(recorder->map, header, RECORDER_HEADER_SIZE);
+#endif // _WIN32
+   return recorder;
+}
+
+void ryannet_recorder_destroy(struct ryannet_recorder * recorder)
+{
+#ifdef _WIN32
+   fclose(recorder->file);
+#else // _WIN32
+   if(recorder->map != NULL)
    {
-      free(socket->remote.port);
+      (void)munmap(recorder->map, (size_t)recorder->capacity);
    }
-   free(socket);
+   // Trim the unused tail the map grew into
+   (void)ftruncate(recorder->fd, (off_t)recorder->used);
+   close(recorder->fd);
+#endif // _WIN32
+   free(recorder);
 }
 
+unsigned long long ryannet_recorder_get_count(struct ryannet_recorder * recorder)
+{
+   return recorder->records;
+}
 
-static int ryannet_set_tcp_nodelay(int fd)
+unsigned long long ryannet_recorder_get_dropped(struct ryannet_recorder * recorder)
 {
-   int rv;
+   return recorder->dropped;
+}
+
+void ryannet_socket_udp_set_recorder(struct ryannet_socket_udp * socket, struct ryannet_recorder * recorder)
+{
+   socket->recorder = recorder;
+}
+
+void ryannet_socket_tcp_set_recorder(struct ryannet_socket_tcp * socket, struct ryannet_recorder * recorder)
+{
+   socket->recorder = recorder;
+}
+
+
+struct ryannet_replay
+{
+   unsigned char * data;
+   long long size;
+};
+
+struct ryannet_replay * ryannet_replay_new(const char * path)
+{
+   struct ryannet_replay * replay;
+   unsigned char * data;
+   long long size;
 #ifdef _WIN32
-   char yes = TRUE;
-   int length = sizeof(BOOL);
+   FILE * file;
+   file = fopen(path, "rb");
+   if(file == NULL)
+   {
+      fprintf(stderr, "Error: Couldn't Open %s\n", path);
+      return NULL;
+   }
+   fseek(file, 0, SEEK_END);
+   size = (long long)ftell(file);
+   fseek(file, 0, SEEK_SET);
+   data = malloc(size > 0 ? (size_t)size : 1);
+   if(fread(data, 1, (size_t)size, file) != (size_t)size)
+   {
+      size = 0;
+   }
+   fclose(file);
 #else // _WIN32
-   int yes = 1;
-   socklen_t length = sizeof(int);
-#endif // _WIN32
-   if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, length) == -1)
+   struct stat info;
+   int fd;
+   fd = open(path, O_RDONLY);
+   if(fd == -1 || fstat(fd, &info) == -1)
    {
-      rv = 1;
+      fprintf(stderr, "Error: Couldn't Open %s: %s\n", path, strerror(errno));
+      if(fd != -1)
+      {
+         close(fd);
+      }
+      return NULL;
    }
-   else
+   size = (long long)info.st_size;
+   data = size > 0 ? mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+   close(fd);
+   if(data == MAP_FAILED)
    {
-      rv = 0;
+      fprintf(stderr, "Error: Couldn't Map %s\n", path);
+      return NULL;
    }
-   return rv;
+#endif // _WIN32
+   if(size < RECORDER_HEADER_SIZE || memcmp(data, RECORDER_MAGIC, 8) != 0)
+   {
+      fprintf(stderr, "Error: %s is not a capture\n", path);
+#ifdef _WIN32
+      free(data);
+#else // _WIN32
+      (void)munmap(data, (size_t)size);
+#endif // _WIN32
+      return NULL;
+   }
+   replay = malloc(sizeof(struct ryannet_replay));
+   replay->data = data;
+   replay->size = size;
+   return replay;
 }
 
-static int ryannet_set_reuseaddr(int fd)
+void ryannet_replay_destroy(struct ryannet_replay * replay)
 {
-   int rv;
 #ifdef _WIN32
-   char yes = TRUE;
-   int length = sizeof(BOOL);
+   free(replay->data);
 #else // _WIN32
-   int yes = 1;
-   socklen_t length = sizeof(int);
+   (void)munmap(replay->data, (size_t)replay->size);
 #endif // _WIN32
-   if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, length) == -1)
+   free(replay);
+}
+
+// Returns the record at offset and steps past it, NULL at the end
+static const unsigned char * ryannet_replay_next(struct ryannet_replay * replay, long long * offset)
+{
+   const unsigned char * record;
+   long long length;
+   if(*offset + RECORD_HEADER_SIZE > replay->size)
    {
-      rv = 1;
+      return NULL;
    }
-   else
+   record = replay->data + *offset;
+   if(!(record[12] & RECORD_FLAG_VALID))
    {
-      rv = 0;
+      return NULL;
    }
-   return rv;
+   length = RECORD_HEADER_SIZE + record[13] + (long long)ryannet_load32(record + 8);
+   if(*offset + length > replay->size)
+   {
+      return NULL;
+   }
+   *offset += length;
+   return record;
 }
 
-static int ryannet_clear_v6only(int fd, int family)
+// Only what the recorded sockets received is replayed
+static int ryannet_replay_wanted(const unsigned char * record, int tcp_flag)
 {
-   int rv;
+   return (record[12] & RYANNET_RECORD_SENT) == 0 &&
+          ((record[12] & RYANNET_RECORD_TCP) != 0) == (tcp_flag != 0);
+}
+
+static unsigned int ryannet_replay_hash(const unsigned char * key, int size)
+{
+   unsigned int hash;
+   int i;
+   hash = 2166136261u;
+   for(i = 0; i < size; i++)
+   {
+      hash = (hash ^ key[i]) * 16777619u;
+   }
+   return hash;
+}
+
+// Gives every wanted record the index of the peer that sent it
+static int ryannet_replay_find_peers(struct ryannet_replay * replay, int tcp_flag, int ** record_peers, int * record_count)
+{
+   const unsigned char ** peer_keys;
+   const unsigned char * record;
+   int * table, * peers;
+   long long offset;
+   unsigned int mask, slot;
+   int count, table_size, peer_count, peer, i;
+
+   count = 0;
+   offset = RECORDER_HEADER_SIZE;
+   while((record = ryannet_replay_next(replay, &offset)) != NULL)
+   {
+      count += ryannet_replay_wanted(record, tcp_flag);
+   }
+   table_size = 16;
+   while(table_size < count * 2)
+   {
+      table_size *= 2;
+   }
+   mask = (unsigned int)table_size - 1;
+   table = malloc(sizeof(int) * table_size);
+   memset(table, 0, sizeof(int) * table_size);
+   peer_keys = malloc(sizeof(unsigned char *) * (count > 0 ? count : 1));
+   peers = malloc(sizeof(int) * (count > 0 ? count : 1));
+
+   peer_count = 0;
+   i = 0;
+   offset = RECORDER_HEADER_SIZE;
+   while((record = ryannet_replay_next(replay, &offset)) != NULL)
+   {
+      if(!ryannet_replay_wanted(record, tcp_flag))
+      {
+         continue;
+      }
+      // Slots hold peer index plus one so zero means empty
+      slot = ryannet_replay_hash(record + RECORD_HEADER_SIZE, record[13]) & mask;
+      while(table[slot] != 0)
+      {
+         peer = table[slot] - 1;
+         if(peer_keys[peer][13] == record[13] &&
+            memcmp(peer_keys[peer] + RECORD_HEADER_SIZE, record + RECORD_HEADER_SIZE, record[13]) == 0)
+         {
+            break;
+         }
+         slot = (slot + 1) & mask;
+      }
+      if(table[slot] == 0)
+      {
+         peer_keys[peer_count] = record;
+         peer_count ++;
+         table[slot] = peer_count;
+      }
+      peers[i] = table[slot] - 1;
+      i ++;
+   }
+   free(table);
+   free(peer_keys);
+   *record_peers = peers;
+   *record_count = count;
+   return peer_count;
+}
+
+struct ryannet_replay_client
+{
+   struct ryannet_socket_udp * udp;
+   struct ryannet_socket_tcp * tcp;
+   long long last_send_ns;
+   int waiting_flag;
+};
+
+#define REPLAY_BUFFER_SIZE 65536
+#define REPLAY_DRAIN_NS 100000000LL
+// How many records go out between checks for replies when running flat out
+#define REPLAY_DRAIN_EVERY 16
+
 #ifdef _WIN32
-   char no = FALSE;
-   int length = sizeof(BOOL);
+typedef WSAPOLLFD ryannet_replay_pollfd;
 #else // _WIN32
-   int no = 0;
-   socklen_t length = sizeof(int);
+typedef struct pollfd ryannet_replay_pollfd;
 #endif // _WIN32
-   if(family == AF_INET6)
+
+static void ryannet_replay_drain(struct ryannet_replay_client * clients, ryannet_replay_pollfd * fds, int count, int timeout_ms, unsigned char * buffer, struct ryannet_address * source, struct ryannet_replay_stats * stats)
+{
+   struct ryannet_replay_client * client;
+   long long now;
+   int i, rv, size;
+
+   for(i = 0; i < count; i++)
    {
-      if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, length) == -1)
+      client = &clients[i];
+      fds[i].fd = client->udp != NULL ? client->udp->fd : (client->tcp != NULL ? client->tcp->fd : -1);
+#ifdef _WIN32
+      fds[i].events = POLLRDNORM;
+#else // _WIN32
+      fds[i].events = POLLIN;
+#endif // _WIN32
+      fds[i].revents = 0;
+   }
+#ifdef _WIN32
+   rv = WSAPoll(fds, (ULONG)count, timeout_ms);
+#else // _WIN32
+   rv = poll(fds, (nfds_t)count, timeout_ms);
+#endif // _WIN32
+   if(rv <= 0)
+   {
+      return;
+   }
+   now = ryannet_time_ns();
+   for(i = 0; i < count; i++)
+   {
+      if(fds[i].revents == 0)
       {
-         rv = 1;
+         continue;
+      }
+      client = &clients[i];
+      if(client->udp != NULL)
+      {
+         size = ryannet_socket_udp_receive(client->udp, buffer, REPLAY_BUFFER_SIZE, source);
       }
       else
       {
-         rv = 0;
+         size = ryannet_socket_tcp_receive(client->tcp, buffer, REPLAY_BUFFER_SIZE);
+         if(size <= 0)
+         {
+            ryannet_socket_tcp_destroy(client->tcp);
+            client->tcp = NULL;
+         }
+      }
+      if(size <= 0)
+      {
+         continue;
+      }
+      stats->packets_received ++;
+      stats->bytes_received += (unsigned long long)size;
+      if(client->waiting_flag)
+      {
+         ryannet_histogram_add(&stats->response, now - client->last_send_ns);
+         client->waiting_flag = 0;
       }
    }
-   else
-   {
-      rv = 0;
-   }
-
-   return rv;
 }
 
-int ryannet_socket_tcp_connect(struct ryannet_socket_tcp * sock, const char * remote_address, const char * remote_port)
+int ryannet_replay_run(struct ryannet_replay * replay, const char * address, const char * port, int tcp_flag, double speed, int fanout, struct ryannet_replay_stats * stats)
 {
-   struct addrinfo hints, *servinfo, *p;
-   int rv;
-   socklen_t length;
+   struct ryannet_replay_client * clients, * client;
+   struct ryannet_address * target, * source;
+   ryannet_replay_pollfd * fds;
+   const unsigned char * record;
+   unsigned char * buffer;
+   long long offset, first_ns, start, due, now, end;
+   int * record_peers;
+   int record_count, peer_count, client_count, index, size, rv, i;
 
-   memset(&hints, 0, sizeof(struct addrinfo));
-   hints.ai_family = AF_UNSPEC;
-   hints.ai_socktype = SOCK_STREAM;
-   
-   rv = getaddrinfo(remote_address, remote_port, &hints, &servinfo);
-   if(rv != 0)
+   memset(stats, 0, sizeof(struct ryannet_replay_stats));
+   if(fanout < 1)
    {
-      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
+      fanout = 1;
+   }
+   peer_count = ryannet_replay_find_peers(replay, tcp_flag, &record_peers, &record_count);
+   client_count = peer_count * fanout;
+   if(client_count == 0)
+   {
+      free(record_peers);
       return 1;
    }
 
-   for(p = servinfo; p != NULL; p = p->ai_next)
+   target = ryannet_address_new();
+   ryannet_address_set(target, address, port);
+   source = ryannet_address_new();
+   clients = malloc(sizeof(struct ryannet_replay_client) * client_count);
+   fds = malloc(sizeof(ryannet_replay_pollfd) * client_count);
+   buffer = ryannet_buffer_alloc(REPLAY_BUFFER_SIZE);
+   for(i = 0; i < client_count; i++)
    {
-      sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-      if(sock->fd == -1)
+      client = &clients[i];
+      client->udp = NULL;
+      client->tcp = NULL;
+      client->last_send_ns = 0;
+      client->waiting_flag = 0;
+      if(tcp_flag)
       {
-         // TODO: Maybe Error Handling
-         continue;
+         client->tcp = ryannet_socket_tcp_new();
+         if(ryannet_socket_tcp_connect(client->tcp, address, port) != 0)
+         {
+            ryannet_socket_tcp_destroy(client->tcp);
+            client->tcp = NULL;
+            continue;
+         }
       }
+      else
+      {
+         client->udp = ryannet_socket_udp_new();
+      }
+      stats->clients ++;
+   }
 
-
-      rv = ryannet_set_tcp_nodelay(sock->fd);
-      if(rv == 1)
+   // Each recorded peer is played by fanout clients, all sending what it sent
+   first_ns = -1;
+   start = ryannet_time_ns();
+   now = start;
+   index = 0;
+   offset = RECORDER_HEADER_SIZE;
+   while((record = ryannet_replay_next(replay, &offset)) != NULL)
+   {
+      if(!ryannet_replay_wanted(record, tcp_flag))
       {
-         // TODO: Maybe Error Handling
-         ryannet_close(sock->fd);
-         sock->fd = -1;
          continue;
       }
+      if(first_ns == -1)
+      {
+         first_ns = (long long)ryannet_load64(record);
+      }
+      due = start;
+      if(speed > 0.0)
+      {
+         due += (long long)((double)((long long)ryannet_load64(record) - first_ns) / speed);
+      }
+      while((now = ryannet_time_ns()) < due)
+      {
+         ryannet_replay_drain(clients, fds, client_count, (int)((due - now) / 1000000LL), buffer, source, stats);
+      }
+      ryannet_histogram_add(&stats->lateness, now - due);
 
-      rv = connect(sock->fd, p->ai_addr, p->ai_addrlen);
-      if(rv == -1)
+      size = (int)ryannet_load32(record + 8);
+      for(i = 0; i < fanout; i++)
       {
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         // TODO: Maybe Error Handling
-         continue;
+         client = &clients[record_peers[index] * fanout + i];
+         if(client->udp != NULL)
+         {
+            rv = ryannet_socket_udp_send(client->udp, target, record + RECORD_HEADER_SIZE + record[13], size);
+         }
+         else if(client->tcp != NULL)
+         {
+            rv = ryannet_socket_tcp_send(client->tcp, record + RECORD_HEADER_SIZE + record[13], size);
+         }
+         else
+         {
+            continue;
+         }
+         if(rv >= 0)
+         {
+            stats->packets_sent ++;
+            stats->bytes_sent += (unsigned long long)size;
+            client->last_send_ns = now;
+            client->waiting_flag = 1;
+         }
+      }
+      index ++;
+      if(index % REPLAY_DRAIN_EVERY == 0)
+      {
+         ryannet_replay_drain(clients, fds, client_count, 0, buffer, source, stats);
       }
-      break;
    }
+   stats->elapsed_ns = now - start;
 
+   // Give the last replies a chance to come back
+   end = ryannet_time_ns() + REPLAY_DRAIN_NS;
+   while((now = ryannet_time_ns()) < end)
+   {
+      ryannet_replay_drain(clients, fds, client_count, (int)((end - now) / 1000000LL), buffer, source, stats);
+   }
 
-   if(sock->fd == -1)
+   for(i = 0; i < client_count; i++)
    {
-      // TODO: Error Handing
-      fprintf(stderr, "Error: Couldn't Connect to %s : %s\n", remote_address, remote_port);
-      return 1;
+      if(clients[i].udp != NULL)
+      {
+         ryannet_socket_udp_destroy(clients[i].udp);
+      }
+      if(clients[i].tcp != NULL)
+      {
+         ryannet_socket_tcp_destroy(clients[i].tcp);
+      }
    }
+   ryannet_buffer_free(buffer);
+   free(fds);
+   free(clients);
+   free(record_peers);
+   ryannet_address_destroy(source);
+   ryannet_address_destroy(target);
+   return 0;
+}
 
 
-   // Copy Local
-   length = sizeof(struct sockaddr_storage);
-   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
-   ryannet_fill_address(&sock->local);
-   // Copy Remote
-   memcpy(&sock->remote.raw, p->ai_addr, p->ai_addrlen);
-   ryannet_fill_address(&sock->remote);
-   
-   sock->connected_flag = 1;
+// Multiplexed streams. Frames are an 8 byte header, 2 byte payload length,
+// 1 byte type, 1 reserved byte and 4 byte stream id, all little-endian,
+// then the payload. A window frame carries 4 bytes of credit.
+#define MUX_FRAME_HEADER_SIZE 8
+#define MUX_MAX_PAYLOAD 1024
+#define MUX_FRAME_DATA 0
+#define MUX_FRAME_WINDOW 1
+// Bytes a stream may have in flight before the reader hands credit back
+#define MUX_STREAM_WINDOW 65536
+#define MUX_CREDIT_THRESHOLD (MUX_STREAM_WINDOW / 4)
+// Frames are built this many bytes at a time, so an urgent frame never
+// waits behind more than one batch of bulk in our own queue
+#define MUX_BATCH_SIZE 8192
+// And no more than this much unsent data is left sitting in the kernel
+#define MUX_NOTSENT_LOWAT 16384
+#define MUX_INPUT_SIZE 16384
+
+struct ryannet_mux_chunk
+{
+   struct ryannet_message * message;
+   struct ryannet_mux_chunk * next;
+};
+
+struct ryannet_mux_stream
+{
+   unsigned int id;
+   int priority;
+   int weight;
+   int deficit;
+   int send_window;
+   int queued_bytes;
+   int head_offset;
+   struct ryannet_mux_chunk * head;
+   struct ryannet_mux_chunk * tail;
+   // Ring sized to the window, the peer can never overrun it
+   unsigned char * receive_data;
+   int receive_start;
+   int receive_count;
+   int credit;
+};
+
+struct ryannet_mux
+{
+   struct ryannet_socket_tcp * socket;
+   struct ryannet_mux_stream * streams;
+   int count;
+   int size;
+   int current;
+   unsigned char * scratch;
+   unsigned char * input;
+   int input_used;
+   // Streams opened by data from the peer, each holds a whole window
+   int peer_stream_count;
+};
+
+struct ryannet_mux * ryannet_mux_new(struct ryannet_socket_tcp * socket)
+{
+   struct ryannet_mux * mux;
+#ifdef TCP_NOTSENT_LOWAT
+   int lowat;
+#endif // TCP_NOTSENT_LOWAT
+   mux = malloc(sizeof(struct ryannet_mux));
+   mux->socket = socket;
+   mux->size = 4;
+   mux->count = 0;
+   mux->current = 0;
+   mux->streams = malloc(sizeof(struct ryannet_mux_stream) * mux->size);
+   mux->scratch = ryannet_buffer_alloc(MUX_BATCH_SIZE);
+   mux->input = ryannet_buffer_alloc(MUX_INPUT_SIZE);
+   mux->input_used = 0;
+   mux->peer_stream_count = 0;
+#ifdef TCP_NOTSENT_LOWAT
+   // Keeps bulk from piling up in the kernel where it can't be preempted
+   if(socket->shm == NULL && socket->fd != -1)
+   {
+      lowat = MUX_NOTSENT_LOWAT;
+      (void)setsockopt(socket->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(int));
+   }
+#endif // TCP_NOTSENT_LOWAT
+   return mux;
+}
+
+void ryannet_mux_destroy(struct ryannet_mux * mux)
+{
+   struct ryannet_mux_chunk * chunk, * next;
+   int i;
+   for(i = 0; i < mux->count; i++)
+   {
+      for(chunk = mux->streams[i].head; chunk != NULL; chunk = next)
+      {
+         next = chunk->next;
+         ryannet_message_release(chunk->message);
+         free(chunk);
+      }
+      ryannet_buffer_free(mux->streams[i].receive_data);
+   }
+   free(mux->streams);
+   ryannet_buffer_free(mux->scratch);
+   ryannet_buffer_free(mux->input);
+   free(mux);
+}
+
+static struct ryannet_mux_stream * ryannet_mux_find(struct ryannet_mux * mux, unsigned int stream_id)
+{
+   int i;
+   for(i = 0; i < mux->count; i++)
+   {
+      if(mux->streams[i].id == stream_id)
+      {
+         return &mux->streams[i];
+      }
+   }
+   return NULL;
+}
+
+static struct ryannet_mux_stream * ryannet_mux_open(struct ryannet_mux * mux, unsigned int stream_id)
+{
+   struct ryannet_mux_stream * stream;
+   stream = ryannet_mux_find(mux, stream_id);
+   if(stream != NULL)
+   {
+      return stream;
+   }
+   if(mux->count >= mux->size)
+   {
+      mux->size *= 2;
+      mux->streams = realloc(mux->streams, sizeof(struct ryannet_mux_stream) * mux->size);
+   }
+   stream = &mux->streams[mux->count];
+   mux->count ++;
+   memset(stream, 0, sizeof(struct ryannet_mux_stream));
+   stream->id = stream_id;
+   stream->weight = 1;
+   stream->send_window = MUX_STREAM_WINDOW;
+   stream->receive_data = ryannet_buffer_alloc(MUX_STREAM_WINDOW);
+   return stream;
+}
 
-   freeaddrinfo(servinfo);
+int ryannet_mux_open_stream(struct ryannet_mux * mux, unsigned int stream_id, int priority, int weight)
+{
+   struct ryannet_mux_stream * stream;
+   stream = ryannet_mux_open(mux, stream_id);
+   stream->priority = priority;
+   stream->weight = weight > 0 ? weight : 1;
+   return 0;
+}
 
+int ryannet_mux_queue(struct ryannet_mux * mux, unsigned int stream_id, struct ryannet_message * message)
+{
+   struct ryannet_mux_stream * stream;
+   struct ryannet_mux_chunk * chunk;
+   if(message->size <= 0)
+   {
+      return 0;
+   }
+   stream = ryannet_mux_open(mux, stream_id);
+   chunk = malloc(sizeof(struct ryannet_mux_chunk));
+   ryannet_message_retain(message);
+   chunk->message = message;
+   chunk->next = NULL;
+   if(stream->tail == NULL)
+   {
+      stream->head = chunk;
+   }
+   else
+   {
+      stream->tail->next = chunk;
+   }
+   stream->tail = chunk;
+   stream->queued_bytes += message->size;
    return 0;
-   
 }
 
-int ryannet_socket_tcp_bind(struct ryannet_socket_tcp * sock, const char * bind_address, const char * bind_port)
+int ryannet_mux_send(struct ryannet_mux * mux, unsigned int stream_id, const void * buffer, int buffer_size_in_bytes)
 {
-   struct addrinfo hints, *servinfo, *p;
+   struct ryannet_message * message;
    int rv;
-   socklen_t length;
+   message = ryannet_message_new(buffer, buffer_size_in_bytes);
+   rv = ryannet_mux_queue(mux, stream_id, message);
+   ryannet_message_release(message);
+   return rv;
+}
 
-   //ryannet_getaddrinfo_dump(bind_address, bind_port);
+static int ryannet_mux_sendable(struct ryannet_mux_stream * stream)
+{
+   return stream->queued_bytes > 0 && stream->send_window > 0;
+}
 
-   memset(&hints, 0, sizeof(struct addrinfo));
-   if(bind_address == NULL)
+// Strict priority between levels, deficit round robin by weight within one
+static struct ryannet_mux_stream * ryannet_mux_pick(struct ryannet_mux * mux)
+{
+   struct ryannet_mux_stream * stream;
+   int priority, found_flag, i, k;
+
+   found_flag = 0;
+   priority = 0;
+   for(i = 0; i < mux->count; i++)
    {
-      // Windows and linux have differing opinons on what to do here, so
-      // we will take the choice away
-      hints.ai_family = AF_INET;
+      if(ryannet_mux_sendable(&mux->streams[i]) && (!found_flag || mux->streams[i].priority > priority))
+      {
+         priority = mux->streams[i].priority;
+         found_flag = 1;
+      }
    }
-   else
+   if(!found_flag)
    {
-      hints.ai_family = AF_UNSPEC;
+      return NULL;
    }
-   hints.ai_socktype = SOCK_STREAM;
-   hints.ai_flags = AI_PASSIVE; // Use any local IPV4 or IPV6 address I have
-   
-   rv = getaddrinfo(bind_address, bind_port, &hints, &servinfo);
-   if(rv != 0)
+
+   // Keep serving the current stream until its quantum runs out
+   if(mux->current < mux->count)
    {
-      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
-      return 1;
+      stream = &mux->streams[mux->current];
+      if(stream->priority == priority && ryannet_mux_sendable(stream) && stream->deficit > 0)
+      {
+         return stream;
+      }
+   }
+   for(k = 1; k <= mux->count; k++)
+   {
+      i = (mux->current + k) % mux->count;
+      stream = &mux->streams[i];
+      if(stream->priority == priority && ryannet_mux_sendable(stream))
+      {
+         stream->deficit += stream->weight * MUX_MAX_PAYLOAD;
+         mux->current = i;
+         return stream;
+      }
    }
+   return NULL;
+}
 
-   for(p = servinfo; p != NULL; p = p->ai_next)
+static void ryannet_mux_write_header(unsigned char * out, int length, int type, unsigned int stream_id)
+{
+   out[0] = (unsigned char)(length & 0xff);
+   out[1] = (unsigned char)((length >> 8) & 0xff);
+   out[2] = (unsigned char)type;
+   out[3] = 0;
+   ryannet_store32(out + 4, stream_id);
+}
+
+// Fills the scratch buffer with credit frames and then data frames
+static int ryannet_mux_build(struct ryannet_mux * mux)
+{
+   struct ryannet_mux_stream * stream;
+   struct ryannet_mux_chunk * chunk;
+   int used, length, copied, piece, i;
+
+   used = 0;
+   for(i = 0; i < mux->count && used + MUX_FRAME_HEADER_SIZE + 4 <= MUX_BATCH_SIZE; i++)
    {
-      sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-      if(sock->fd == -1)
+      stream = &mux->streams[i];
+      if(stream->credit >= MUX_CREDIT_THRESHOLD)
       {
-         // TODO: Maybe Error Handling
-         continue;
+         ryannet_mux_write_header(mux->scratch + used, 4, MUX_FRAME_WINDOW, stream->id);
+         ryannet_store32(mux->scratch + used + MUX_FRAME_HEADER_SIZE, (unsigned int)stream->credit);
+         used += MUX_FRAME_HEADER_SIZE + 4;
+         stream->credit = 0;
       }
+   }
 
+   while(used + MUX_FRAME_HEADER_SIZE < MUX_BATCH_SIZE && (stream = ryannet_mux_pick(mux)) != NULL)
+   {
+      length = stream->queued_bytes;
+      length = length < MUX_MAX_PAYLOAD ? length : MUX_MAX_PAYLOAD;
+      length = length < stream->send_window ? length : stream->send_window;
+      length = length < MUX_BATCH_SIZE - used - MUX_FRAME_HEADER_SIZE ? length : MUX_BATCH_SIZE - used - MUX_FRAME_HEADER_SIZE;
+      ryannet_mux_write_header(mux->scratch + used, length, MUX_FRAME_DATA, stream->id);
+      used += MUX_FRAME_HEADER_SIZE;
 
-      rv = ryannet_set_reuseaddr(sock->fd);
-      if(rv == 1)
+      // Frames can take from several queued messages
+      copied = 0;
+      while(copied < length)
       {
-         // TODO: Maybe Error Handling
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         continue;
+         chunk = stream->head;
+         piece = chunk->message->size - stream->head_offset;
+         piece = piece < length - copied ? piece : length - copied;
+         memcpy(mux->scratch + used + copied, chunk->message->data + stream->head_offset, (size_t)piece);
+         copied += piece;
+         stream->head_offset += piece;
+         if(stream->head_offset == chunk->message->size)
+         {
+            stream->head = chunk->next;
+            if(stream->head == NULL)
+            {
+               stream->tail = NULL;
+            }
+            stream->head_offset = 0;
+            ryannet_message_release(chunk->message);
+            free(chunk);
+         }
+      }
+      used += length;
+      stream->queued_bytes -= length;
+      stream->send_window -= length;
+      stream->deficit -= length;
+      if(stream->queued_bytes == 0)
+      {
+         stream->deficit = 0;
       }
+   }
+   return used;
+}
 
-      rv = ryannet_clear_v6only(sock->fd, p->ai_family);
-      if(rv == 1)
+int ryannet_mux_flush(struct ryannet_mux * mux)
+{
+   int total_sent, bytes_sent, size;
+   total_sent = 0;
+   while(1)
+   {
+      // Only build more once the last batch is out, that is where priority applies
+      if(!ryannet_socket_tcp_queue_is_empty(mux->socket))
       {
-         // TODO: Maybe Error Handling
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         continue;
+         bytes_sent = ryannet_socket_tcp_flush_nonblock(mux->socket);
+         if(bytes_sent == -1)
+         {
+            return -1;
+         }
+         total_sent += bytes_sent;
+         if(!ryannet_socket_tcp_queue_is_empty(mux->socket))
+         {
+            break;
+         }
+      }
+      size = ryannet_mux_build(mux);
+      if(size == 0)
+      {
+         break;
       }
+      (void)ryannet_socket_tcp_enqueue(mux->socket, mux->scratch, size);
+   }
+   return total_sent;
+}
 
-      rv = bind(sock->fd, p->ai_addr, p->ai_addrlen);
-      if(rv == -1)
+static int ryannet_mux_parse(struct ryannet_mux * mux)
+{
+   struct ryannet_mux_stream * stream;
+   const unsigned char * frame;
+   unsigned int credit;
+   int offset, length, frames, end, piece;
+
+   frames = 0;
+   offset = 0;
+   while(mux->input_used - offset >= MUX_FRAME_HEADER_SIZE)
+   {
+      frame = mux->input + offset;
+      length = frame[0] | (frame[1] << 8);
+      if(length > MUX_MAX_PAYLOAD)
       {
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         // TODO: Maybe Error Handling
-         continue;
+         fprintf(stderr, "Error: Mux frame of %d bytes\n", length);
+         return -1;
       }
-      break;
+      if(frame[2] != MUX_FRAME_DATA && (frame[2] != MUX_FRAME_WINDOW || length != 4))
+      {
+         fprintf(stderr, "Error: Mux frame of type %d and %d bytes\n", frame[2], length);
+         return -1;
+      }
+      if(mux->input_used - offset < MUX_FRAME_HEADER_SIZE + length)
+      {
+         break;
+      }
+      stream = ryannet_mux_find(mux, ryannet_load32(frame + 4));
+      if(stream == NULL)
+      {
+         // Only data opens a stream, credit for one we never sent on is bogus
+         if(frame[2] != MUX_FRAME_DATA)
+         {
+            fprintf(stderr, "Error: Mux frame for unknown stream %u\n", ryannet_load32(frame + 4));
+            return -1;
+         }
+         if(mux->peer_stream_count >= RYANNET_MUX_MAX_PEER_STREAMS)
+         {
+            fprintf(stderr, "Error: Mux peer opened more than %d streams\n", RYANNET_MUX_MAX_PEER_STREAMS);
+            return -1;
+         }
+         stream = ryannet_mux_open(mux, ryannet_load32(frame + 4));
+         mux->peer_stream_count ++;
+      }
+      if(frame[2] == MUX_FRAME_DATA)
+      {
+         if(length > MUX_STREAM_WINDOW - stream->receive_count)
+         {
+            fprintf(stderr, "Error: Mux stream %u overran its window\n", stream->id);
+            return -1;
+         }
+         end = (stream->receive_start + stream->receive_count) % MUX_STREAM_WINDOW;
+         piece = MUX_STREAM_WINDOW - end < length ? MUX_STREAM_WINDOW - end : length;
+         memcpy(stream->receive_data + end, frame + MUX_FRAME_HEADER_SIZE, (size_t)piece);
+         memcpy(stream->receive_data, frame + MUX_FRAME_HEADER_SIZE + piece, (size_t)(length - piece));
+         stream->receive_count += length;
+      }
+      else
+      {
+         // Credit never takes a window past what the peer can buffer
+         credit = ryannet_load32(frame + MUX_FRAME_HEADER_SIZE);
+         if(credit > (unsigned int)(MUX_STREAM_WINDOW - stream->send_window))
+         {
+            fprintf(stderr, "Error: Mux stream %u got %u bytes of credit\n", stream->id, credit);
+            return -1;
+         }
+         stream->send_window += (int)credit;
+      }
+      offset += MUX_FRAME_HEADER_SIZE + length;
+      frames ++;
    }
+   mux->input_used -= offset;
+   memmove(mux->input, mux->input + offset, (size_t)mux->input_used);
+   return frames;
+}
 
-   if(sock->fd != -1)
+int ryannet_mux_pump(struct ryannet_mux * mux)
+{
+   int frames, received, rv;
+   frames = 0;
+   while((received = ryannet_socket_tcp_receive_nonblock(mux->socket, mux->input + mux->input_used, MUX_INPUT_SIZE - mux->input_used)) > 0)
    {
-      rv = listen(sock->fd, 10);
+      mux->input_used += received;
+      rv = ryannet_mux_parse(mux);
       if(rv == -1)
       {
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         // TODO: Error Handling
+         return -1;
       }
+      frames += rv;
    }
+   if(received == -1 || !ryannet_socket_tcp_is_connected(mux->socket))
+   {
+      return -1;
+   }
+   return frames;
+}
 
-
-   if(sock->fd == -1)
+int ryannet_mux_receive(struct ryannet_mux * mux, unsigned int stream_id, void * buffer, int buffer_size_in_bytes)
+{
+   struct ryannet_mux_stream * stream;
+   int size, piece;
+   stream = ryannet_mux_find(mux, stream_id);
+   if(stream == NULL || stream->receive_count == 0)
    {
-      // TODO: Error Handing
-      fprintf(stderr, "Error: Couldn't Bind to %s : %s\n", bind_address, bind_port);
-      return 1;
+      return 0;
    }
-   
-   // Copy Local
-   length = sizeof(struct sockaddr_storage);
-   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
-   ryannet_fill_address(&sock->local);
+   size = buffer_size_in_bytes < stream->receive_count ? buffer_size_in_bytes : stream->receive_count;
+   piece = MUX_STREAM_WINDOW - stream->receive_start < size ? MUX_STREAM_WINDOW - stream->receive_start : size;
+   memcpy(buffer, stream->receive_data + stream->receive_start, (size_t)piece);
+   memcpy((unsigned char *)buffer + piece, stream->receive_data, (size_t)(size - piece));
+   stream->receive_start = (stream->receive_start + size) % MUX_STREAM_WINDOW;
+   stream->receive_count -= size;
+   // Handed back to the sender by the next flush
+   stream->credit += size;
+   return size;
+}
 
-   sock->connected_flag = 1;
-   freeaddrinfo(servinfo);
+int ryannet_mux_get_receive_size(struct ryannet_mux * mux, unsigned int stream_id)
+{
+   struct ryannet_mux_stream * stream;
+   stream = ryannet_mux_find(mux, stream_id);
+   return stream != NULL ? stream->receive_count : 0;
+}
 
-   return 0;
-   
+int ryannet_mux_get_queued_bytes(struct ryannet_mux * mux, unsigned int stream_id)
+{
+   struct ryannet_mux_stream * stream;
+   stream = ryannet_mux_find(mux, stream_id);
+   return stream != NULL ? stream->queued_bytes : 0;
 }
 
-struct ryannet_socket_tcp * ryannet_socket_tcp_accept(struct ryannet_socket_tcp * socket)
+int ryannet_mux_get_send_window(struct ryannet_mux * mux, unsigned int stream_id)
 {
-   struct ryannet_socket_tcp * new_socket;
-   socklen_t length;
-   length = sizeof(struct sockaddr_storage);
-   new_socket = ryannet_socket_tcp_new();
-   new_socket->fd = accept(socket->fd, (struct sockaddr *)&new_socket->remote.raw, &length);
-   if(new_socket->fd == -1)
-   {
-      // TODO: Error Handling
-      fprintf(stderr, "Error durring accept: %s\n", strerror(errno));
-      ryannet_socket_tcp_destroy(new_socket);
-      return NULL;
-   }
+   struct ryannet_mux_stream * stream;
+   stream = ryannet_mux_find(mux, stream_id);
+   return stream != NULL ? stream->send_window : MUX_STREAM_WINDOW;
+}
 
-   (void)ryannet_set_tcp_nodelay(new_socket->fd);
 
-   // Copy Remote
-   ryannet_fill_address(&new_socket->remote);
+// Streaming LZ compression. Blocks use LZ4's sequence format: a token with
+// literal and match length nibbles, the literals, a 2 byte offset and
+// length overflow bytes of 255. Offsets reach back across earlier blocks
+// and the dictionary, up to 64KB. Each block starts with a method byte,
+// raw blocks follow with the bytes as is, LZ blocks with a varint of the
+// original size and then the sequences.
+#define COMPRESS_WINDOW 65536
+#define COMPRESS_MAX_OFFSET 65535
+#define COMPRESS_HISTORY_SIZE (COMPRESS_WINDOW + RYANNET_COMPRESS_BLOCK_SIZE)
+#define COMPRESS_HASH_BITS 14
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_METHOD_RAW 0
+#define COMPRESS_METHOD_LZ 1
 
-   // Copy Local
-   length = sizeof(struct sockaddr_storage);
-   getsockname(new_socket->fd, (struct sockaddr *)&new_socket->local.raw, &length);
-   ryannet_fill_address(&new_socket->local);
+struct ryannet_compressor
+{
+   unsigned char * history;
+   int used;
+   // Where each hashed 4 bytes was last seen in history, -1 for nowhere
+   int table[1 << COMPRESS_HASH_BITS];
+};
 
-   new_socket->connected_flag = 1;
-   return new_socket;
-}
+struct ryannet_decompressor
+{
+   unsigned char * history;
+   int used;
+};
 
-struct ryannet_socket_tcp * ryannet_socket_tcp_accept_nonblock(struct ryannet_socket_tcp * socket)
+static unsigned int ryannet_compress_read32(const unsigned char * in)
 {
-   struct ryannet_socket_tcp * new_socket;
-   int rv;
-#ifdef _WIN32
-   WSAPOLLFD fds;
-   fds.fd = socket->fd;
-   fds.events = POLLRDNORM;
+   unsigned int value;
+   memcpy(&value, in, sizeof(unsigned int));
+   return value;
+}
 
-   rv = WSAPoll(&fds, 1, 0);
-#else // _WIN32
-   struct pollfd fds;
-   fds.fd = socket->fd;
-   fds.events = POLLIN;
+static unsigned int ryannet_compress_hash(const unsigned char * in)
+{
+   return (ryannet_compress_read32(in) * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
 
-   rv = poll(&fds, 1, 0);
-#endif // _WIN32
-   if(rv > 0)
-   {
-      new_socket = ryannet_socket_tcp_accept(socket);
-   }
-   else if(rv < 0)
+// Drops all but the last window when size more bytes won't fit, returns
+// how far everything moved down
+static int ryannet_compress_make_room(unsigned char * history, int * used, int size)
+{
+   int shift;
+   if(*used + size <= COMPRESS_HISTORY_SIZE)
    {
-      // Error Here
-      fprintf(stderr, "polling Error: %s\n", strerror(errno));
-      new_socket = NULL;
+      return 0;
    }
-   else
+   shift = *used - COMPRESS_WINDOW;
+   memmove(history, history + shift, COMPRESS_WINDOW);
+   *used = COMPRESS_WINDOW;
+   return shift;
+}
+
+struct ryannet_compressor * ryannet_compressor_new(const void * dictionary, int dictionary_size_in_bytes)
+{
+   struct ryannet_compressor * compressor;
+   int i;
+   compressor = malloc(sizeof(struct ryannet_compressor));
+   compressor->history = ryannet_buffer_alloc(COMPRESS_HISTORY_SIZE);
+   compressor->used = 0;
+   memset(compressor->table, 0xff, sizeof(compressor->table));
+   if(dictionary != NULL && dictionary_size_in_bytes > 0)
    {
-      new_socket = NULL;
+      // Only the end of the dictionary is in reach
+      if(dictionary_size_in_bytes > COMPRESS_WINDOW)
+      {
+         dictionary = (const unsigned char *)dictionary + dictionary_size_in_bytes - COMPRESS_WINDOW;
+         dictionary_size_in_bytes = COMPRESS_WINDOW;
+      }
+      memcpy(compressor->history, dictionary, (size_t)dictionary_size_in_bytes);
+      compressor->used = dictionary_size_in_bytes;
+      for(i = 0; i + COMPRESS_MIN_MATCH <= compressor->used; i++)
+      {
+         compressor->table[ryannet_compress_hash(compressor->history + i)] = i;
+      }
    }
-
-      
-
-   return new_socket;
+   return compressor;
 }
 
-int ryannet_socket_tcp_receive(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes)
+void ryannet_compressor_destroy(struct ryannet_compressor * compressor)
 {
-   int bytes_received;
+   ryannet_buffer_free(compressor->history);
+   free(compressor);
+}
 
-   bytes_received = recv(socket->fd, buffer, (size_t)buffer_size_in_bytes, 0);
-   if(bytes_received == 0)
-   {
-      socket->remote_closed_flag = 1;
-   }
-   else if(bytes_received == -1)
+static unsigned char * ryannet_compress_put_length(unsigned char * out, int length)
+{
+   while(length >= 255)
    {
-      fprintf(stderr, "Error durring receive: %s\n", strerror(errno));
+      *out = 255;
+      out ++;
+      length -= 255;
    }
-   return bytes_received;
+   *out = (unsigned char)length;
+   return out + 1;
 }
 
-int ryannet_socket_tcp_receive_nonblock(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes)
+// Encodes history from start for size bytes, -1 once it passes limit
+static int ryannet_compress_lz(struct ryannet_compressor * compressor, int start, int size, unsigned char * out, int limit)
 {
-   int bytes_sent;
-   int rv;
-#ifdef _WIN32
-   WSAPOLLFD fds;
-   fds.fd = socket->fd;
-   fds.events = POLLRDNORM;
-
-   rv = WSAPoll(&fds, 1, 0);
-#else // _WIN32
-   struct pollfd fds;
-   fds.fd = socket->fd;
-   fds.events = POLLIN;
+   const unsigned char * base;
+   unsigned char * op, * oend, * token;
+   unsigned int hash;
+   int ip, anchor, end, ref, length, literal;
 
-   rv = poll(&fds, 1, 0);
-#endif // _WIN32
-   if(rv > 0)
+   base = compressor->history;
+   op = out;
+   oend = out + limit;
+   ip = start;
+   anchor = start;
+   end = start + size;
+   while(ip + COMPRESS_MIN_MATCH <= end)
    {
-      bytes_sent = ryannet_socket_tcp_receive(socket, buffer, buffer_size_in_bytes);
+      hash = ryannet_compress_hash(base + ip);
+      ref = compressor->table[hash];
+      compressor->table[hash] = ip;
+      if(ref < 0 || ip - ref > COMPRESS_MAX_OFFSET ||
+         ryannet_compress_read32(base + ref) != ryannet_compress_read32(base + ip))
+      {
+         // Step faster the longer nothing matches, incompressible data stays cheap
+         ip += 1 + ((ip - anchor) >> 6);
+         continue;
+      }
+      length = COMPRESS_MIN_MATCH;
+      while(ip + length < end && base[ref + length] == base[ip + length])
+      {
+         length ++;
+      }
+
+      literal = ip - anchor;
+      if(oend - op < 1 + literal / 255 + 1 + literal + 2 + (length - COMPRESS_MIN_MATCH) / 255 + 1)
+      {
+         return -1;
+      }
+      token = op;
+      op ++;
+      *token = (unsigned char)((literal >= 15 ? 15 : literal) << 4);
+      if(literal >= 15)
+      {
+         op = ryannet_compress_put_length(op, literal - 15);
+      }
+      memcpy(op, base + anchor, (size_t)literal);
+      op += literal;
+      op[0] = (unsigned char)((ip - ref) & 0xff);
+      op[1] = (unsigned char)((ip - ref) >> 8);
+      op += 2;
+      length -= COMPRESS_MIN_MATCH;
+      *token |= (unsigned char)(length >= 15 ? 15 : length);
+      if(length >= 15)
+      {
+         op = ryannet_compress_put_length(op, length - 15);
+      }
+      ip += length + COMPRESS_MIN_MATCH;
+      anchor = ip;
+      if(ip + COMPRESS_MIN_MATCH <= end)
+      {
+         compressor->table[ryannet_compress_hash(base + ip - 2)] = ip - 2;
+      }
    }
-   else if(rv < 0)
+
+   literal = end - anchor;
+   if(oend - op < 1 + literal / 255 + 1 + literal)
    {
-      // Error
-      bytes_sent = -1;
-      fprintf(stderr, "Error durring poll: %s\n", strerror(errno));
+      return -1;
    }
-   else
+   token = op;
+   op ++;
+   *token = (unsigned char)((literal >= 15 ? 15 : literal) << 4);
+   if(literal >= 15)
    {
-      bytes_sent = 0;
+      op = ryannet_compress_put_length(op, literal - 15);
    }
-   return bytes_sent;
-
+   memcpy(op, base + anchor, (size_t)literal);
+   op += literal;
+   return (int)(op - out);
 }
 
-int ryannet_socket_tcp_send(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes)
+int ryannet_compressor_compress(struct ryannet_compressor * compressor, const void * buffer, int buffer_size_in_bytes, void * out, int out_size_in_bytes)
 {
-   int bytes_sent;
+   unsigned char * encoded;
+   int shift, start, header, size, i;
 
-   bytes_sent = (int)send(socket->fd, buffer, (size_t)buffer_size_in_bytes, 0);
-   if(bytes_sent == -1)
+   if(buffer_size_in_bytes < 0 || buffer_size_in_bytes > RYANNET_COMPRESS_BLOCK_SIZE ||
+      out_size_in_bytes < RYANNET_COMPRESS_BOUND(buffer_size_in_bytes))
    {
-      fprintf(stderr, "Error durring send: %s\n", strerror(errno));
+      return -1;
    }
-   return bytes_sent;
-}
-
-
-struct ryannet_address * ryannet_socket_tcp_get_address_local(struct ryannet_socket_tcp * socket)
-{
-   if(socket->fd == -1)
+   shift = ryannet_compress_make_room(compressor->history, &compressor->used, buffer_size_in_bytes);
+   if(shift > 0)
    {
-      return NULL;
+      for(i = 0; i < (1 << COMPRESS_HASH_BITS); i++)
+      {
+         compressor->table[i] = compressor->table[i] >= shift ? compressor->table[i] - shift : -1;
+      }
    }
-   return &socket->local;
-   
-}
+   start = compressor->used;
+   memcpy(compressor->history + start, buffer, (size_t)buffer_size_in_bytes);
+   compressor->used += buffer_size_in_bytes;
 
-struct ryannet_address * ryannet_socket_tcp_get_address_remote(struct ryannet_socket_tcp * socket)
-{
-   if(socket->fd == -1)
+   // Anything that doesn't come out smaller than raw goes raw
+   encoded = out;
+   encoded[0] = COMPRESS_METHOD_LZ;
+   header = ryannet_delta_put_varint(encoded, 1, out_size_in_bytes, (unsigned int)buffer_size_in_bytes);
+   size = ryannet_compress_lz(compressor, start, buffer_size_in_bytes, encoded + header, buffer_size_in_bytes + 1 - header - 1);
+   if(size == -1)
    {
-      return NULL;
+      encoded[0] = COMPRESS_METHOD_RAW;
+      memcpy(encoded + 1, buffer, (size_t)buffer_size_in_bytes);
+      return buffer_size_in_bytes + 1;
    }
-   return &socket->remote;
+   return header + size;
 }
 
-int ryannet_socket_tcp_is_connected(struct ryannet_socket_tcp * socket)
+struct ryannet_decompressor * ryannet_decompressor_new(const void * dictionary, int dictionary_size_in_bytes)
 {
-   int rv;
-   if(socket->connected_flag == 1 && 
-      socket->remote_closed_flag == 0 &&
-      socket->fd != -1)
-   {
-      rv = 1;
-   }
-   else
+   struct ryannet_decompressor * decompressor;
+   decompressor = malloc(sizeof(struct ryannet_decompressor));
+   decompressor->history = ryannet_buffer_alloc(COMPRESS_HISTORY_SIZE);
+   decompressor->used = 0;
+   if(dictionary != NULL && dictionary_size_in_bytes > 0)
    {
-      rv = 0;
+      if(dictionary_size_in_bytes > COMPRESS_WINDOW)
+      {
+         dictionary = (const unsigned char *)dictionary + dictionary_size_in_bytes - COMPRESS_WINDOW;
+         dictionary_size_in_bytes = COMPRESS_WINDOW;
+      }
+      memcpy(decompressor->history, dictionary, (size_t)dictionary_size_in_bytes);
+      decompressor->used = dictionary_size_in_bytes;
    }
-   return rv;
+   return decompressor;
 }
 
-struct ryannet_socket_udp * ryannet_socket_udp_new(void)
+void ryannet_decompressor_destroy(struct ryannet_decompressor * decompressor)
 {
-   struct ryannet_socket_udp * socket;
-   socket = malloc(sizeof(struct ryannet_socket_udp));
-   socket->fd = -1;
-   socket->local.address = NULL;
-   socket->local.port = NULL;
-   memset(&socket->local.raw, 0, sizeof(struct sockaddr_storage));
-
-   return socket;
+   ryannet_buffer_free(decompressor->history);
+   free(decompressor);
 }
 
-void ryannet_socket_udp_destroy(struct ryannet_socket_udp * socket)
+static int ryannet_compress_get_length(const unsigned char * in, int * position, int size, int length)
 {
-   if(socket->fd != -1)
+   if(length < 15)
    {
-      ryannet_close(socket->fd);
-   }
-   if(socket->local.address != NULL)
-   {
-      free(socket->local.address);
+      return length;
    }
-   if(socket->local.port != NULL)
+   while(*position < size)
    {
-      free(socket->local.port);
+      length += in[*position];
+      *position += 1;
+      if(in[*position - 1] != 255)
+      {
+         return length;
+      }
    }
-   free(socket);
+   return -1;
 }
 
-int ryannet_socket_udp_bind(struct ryannet_socket_udp * sock, const char * bind_address, const char * bind_port)
+// Decodes a block onto the end of history, -1 when it is corrupt
+static int ryannet_decompressor_decode(struct ryannet_decompressor * decompressor, const unsigned char * in, int size, int * start)
 {
-   struct addrinfo hints, *servinfo, *p;
-   int rv;
-   socklen_t length;
+   unsigned char * base;
+   unsigned int original;
+   int ip, op, end, token, literal, length, offset;
 
-   memset(&hints, 0, sizeof(struct addrinfo));
-   if(bind_address == NULL)
+   if(size < 1)
    {
-      // Windows and linux have differing opinons on what to do here, so
-      // we will take the choice away
-      hints.ai_family = AF_INET;
+      return -1;
    }
-   else
+   base = decompressor->history;
+   if(in[0] == COMPRESS_METHOD_RAW)
    {
-      hints.ai_family = AF_UNSPEC;
+      if(size - 1 > RYANNET_COMPRESS_BLOCK_SIZE)
+      {
+         return -1;
+      }
+      (void)ryannet_compress_make_room(base, &decompressor->used, size - 1);
+      *start = decompressor->used;
+      memcpy(base + decompressor->used, in + 1, (size_t)(size - 1));
+      decompressor->used += size - 1;
+      return size - 1;
    }
-   hints.ai_socktype = SOCK_DGRAM;
-   hints.ai_flags = AI_PASSIVE; // Use any local IPV4 or IPV6 address I have
-   
-   rv = getaddrinfo(bind_address, bind_port, &hints, &servinfo);
-   if(rv != 0)
+   if(in[0] != COMPRESS_METHOD_LZ)
    {
-      fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
-      return 1;
+      return -1;
    }
-
-   for(p = servinfo; p != NULL; p = p->ai_next)
+   ip = ryannet_delta_get_varint(in, 1, size, &original);
+   if(ip == -1 || original > RYANNET_COMPRESS_BLOCK_SIZE)
    {
-      sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-      if(sock->fd == -1)
+      return -1;
+   }
+   (void)ryannet_compress_make_room(base, &decompressor->used, (int)original);
+   op = decompressor->used;
+   end = op + (int)original;
+   while(1)
+   {
+      if(ip >= size)
       {
-         // TODO: Maybe Error Handling
-         continue;
+         return -1;
       }
-
-      rv = ryannet_clear_v6only(sock->fd, p->ai_family);
-      if(rv == 1)
+      token = in[ip];
+      ip ++;
+      literal = ryannet_compress_get_length(in, &ip, size, token >> 4);
+      if(literal == -1 || literal > size - ip || literal > end - op)
       {
-         // TODO: Maybe Error Handling
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         continue;
+         return -1;
       }
-
-
-      rv = bind(sock->fd, p->ai_addr, p->ai_addrlen);
-      if(rv == -1)
+      memcpy(base + op, in + ip, (size_t)literal);
+      ip += literal;
+      op += literal;
+      if(ip == size)
       {
-         ryannet_close(sock->fd);
-         sock->fd = -1;
-         // TODO: Maybe Error Handling
-         continue;
+         break;
       }
-      break;
-   }
-
-
-   if(sock->fd == -1)
-   {
-      // TODO: Error Handing
-      fprintf(stderr, "Error: Couldn't Bind to %s : %s\n", bind_address, bind_port);
-      return 1;
-   }
-
-   // Copy Local
-   length = sizeof(struct sockaddr_storage);
-   getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
-   ryannet_fill_address(&sock->local);
-
-   freeaddrinfo(servinfo);
-
-   return 0;
-}
-
-int ryannet_socket_udp_send(struct ryannet_socket_udp * sock, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes)
-{
-   int sent_bytes;
-   if(sock->fd == -1)
-   {
-      struct addrinfo hints, *servinfo, *p;
-      int rv;
-      socklen_t length;
 
-      memset(&hints, 0, sizeof(struct addrinfo));
-      hints.ai_family = AF_UNSPEC;
-      hints.ai_socktype = SOCK_DGRAM;
-      
-      rv = getaddrinfo(destination->address, destination->port, &hints, &servinfo);
-      if(rv != 0)
+      if(size - ip < 2)
       {
-         fprintf(stderr, "getaddrinfo %s\n", gai_strerror(rv));
-         return 1;
+         return -1;
       }
-
-      for(p = servinfo; p != NULL; p = p->ai_next)
+      offset = in[ip] | (in[ip + 1] << 8);
+      ip += 2;
+      length = ryannet_compress_get_length(in, &ip, size, token & 15);
+      if(length == -1 || offset == 0 || offset > op)
       {
-         sock->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-         if(sock->fd == -1)
-         {
-            // TODO: Maybe Error Handling
-            continue;
-         }
-         break;
+         return -1;
       }
-
-      if(sock->fd == -1)
+      length += COMPRESS_MIN_MATCH;
+      if(length > end - op)
       {
-         // TODO: Error Handing
-         fprintf(stderr, "Error: Couldn't Create Socket to %s : %s\n", destination->address, destination->port);
-         return 1;
+         return -1;
+      }
+      if(offset >= length)
+      {
+         memcpy(base + op, base + op - offset, (size_t)length);
+         op += length;
+      }
+      else
+      {
+         // Overlapping matches repeat the last offset bytes
+         while(length > 0)
+         {
+            base[op] = base[op - offset];
+            op ++;
+            length --;
+         }
       }
+   }
+   if(op != end)
+   {
+      return -1;
+   }
+   *start = decompressor->used;
+   decompressor->used = end;
+   return (int)original;
+}
 
-      // Copy Local
-      length = sizeof(struct sockaddr_storage);
-      getsockname(sock->fd, (struct sockaddr *)&sock->local.raw, &length);
-      ryannet_fill_address(&sock->local);
+// Size a block will decode to, read before anything goes into history
+static int ryannet_decompressor_peek_size(const unsigned char * in, int size)
+{
+   unsigned int original;
+   if(size < 1)
+   {
+      return -1;
    }
-   if(sock->fd != -1)
+   if(in[0] == COMPRESS_METHOD_RAW)
    {
-      sent_bytes = sendto(sock->fd, buffer, buffer_size_in_bytes, 0, (struct sockaddr *) &destination->raw, sizeof(struct sockaddr_storage));
+      return size - 1;
    }
-   else
+   if(in[0] != COMPRESS_METHOD_LZ || ryannet_delta_get_varint(in, 1, size, &original) == -1 ||
+      original > RYANNET_COMPRESS_BLOCK_SIZE)
    {
-      sent_bytes = 0;
+      return -1;
    }
-   return sent_bytes;
+   return (int)original;
 }
 
-int ryannet_socket_udp_receive(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source)
+int ryannet_decompressor_decompress(struct ryannet_decompressor * decompressor, const void * encoded, int encoded_size_in_bytes, void * out, int out_size_in_bytes)
 {
-   int received_bytes;
-   socklen_t length;
-
-   length = sizeof(struct sockaddr_storage);
-   if(socket->fd != -1)
+   int size, start;
+   // A buffer that is too small must not cost the block its place in history
+   size = ryannet_decompressor_peek_size(encoded, encoded_size_in_bytes);
+   if(size == -1 || size > out_size_in_bytes)
    {
-      received_bytes = recvfrom(socket->fd, buffer, buffer_size_in_bytes, 0, (struct sockaddr *)&source->raw, &length);
+      return -1;
    }
-   else
+   size = ryannet_decompressor_decode(decompressor, encoded, encoded_size_in_bytes, &start);
+   if(size == -1)
    {
-      received_bytes = 0;
+      return -1;
    }
-   return received_bytes;
+   memcpy(out, decompressor->history + start, (size_t)size);
+   return size;
 }
-int ryannet_socket_udp_receive_nonblock(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source)
-{
-   int received_bytes;
-   int rv;
-#ifdef _WIN32
-   WSAPOLLFD fds;
-   fds.fd = socket->fd;
-   fds.events = POLLRDNORM;
 
-   rv = WSAPoll(&fds, 1, 0);
-#else // _WIN32
-   struct pollfd fds;
-   fds.fd = socket->fd;
-   fds.events = POLLIN;
 
-   rv = poll(&fds, 1, 0);
-#endif // _WIN32
-   if(rv > 0)
+// Compressed TCP frames are a varint block size followed by the block
+#define COMPRESS_FRAME_HEADER_SIZE 3
+#define COMPRESS_FRAME_SIZE (COMPRESS_FRAME_HEADER_SIZE + RYANNET_COMPRESS_BOUND(RYANNET_COMPRESS_BLOCK_SIZE))
+
+int ryannet_socket_tcp_enable_compression(struct ryannet_socket_tcp * socket, const void * dictionary, int dictionary_size_in_bytes)
+{
+   struct ryannet_compression * compression;
+   if(socket->compression != NULL)
    {
-      received_bytes = ryannet_socket_udp_receive(socket, buffer,  buffer_size_in_bytes, source);
+      ryannet_compression_destroy(socket->compression);
    }
-   else if(rv < 0)
+   compression = malloc(sizeof(struct ryannet_compression));
+   compression->compressor = ryannet_compressor_new(dictionary, dictionary_size_in_bytes);
+   compression->decompressor = ryannet_decompressor_new(dictionary, dictionary_size_in_bytes);
+   compression->staging = ryannet_buffer_alloc(COMPRESS_FRAME_SIZE);
+   compression->input = ryannet_buffer_alloc(COMPRESS_FRAME_SIZE);
+   compression->input_start = 0;
+   compression->input_end = 0;
+   compression->pending_start = 0;
+   compression->pending_size = 0;
+   socket->compression = compression;
+   return 0;
+}
+
+int ryannet_socket_tcp_send_compressed(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes)
+{
+   struct ryannet_compression * compression;
+   unsigned char * frame, * block;
+   int offset, chunk, size, header, rv;
+
+   compression = socket->compression;
+   if(compression == NULL)
    {
-      // Error
-      received_bytes = -1;
-      fprintf(stderr, "Error durring poll: %s\n", strerror(errno));
+      return ryannet_socket_tcp_send(socket, buffer, buffer_size_in_bytes);
    }
-   else
+   block = compression->staging + COMPRESS_FRAME_HEADER_SIZE;
+   offset = 0;
+   do
    {
-      received_bytes = 0;
-   }
-   return received_bytes;
+      chunk = buffer_size_in_bytes - offset;
+      chunk = chunk < RYANNET_COMPRESS_BLOCK_SIZE ? chunk : RYANNET_COMPRESS_BLOCK_SIZE;
+      size = ryannet_compressor_compress(compression->compressor, (const unsigned char *)buffer + offset, chunk,
+                                         block, RYANNET_COMPRESS_BOUND(RYANNET_COMPRESS_BLOCK_SIZE));
+      // Write the size just in front of the block so it all goes in one send
+      header = size < 0x80 ? 1 : (size < 0x4000 ? 2 : 3);
+      frame = block - header;
+      (void)ryannet_delta_put_varint(frame, 0, header, (unsigned int)size);
+      size += header;
+      while(size > 0)
+      {
+         rv = ryannet_socket_tcp_send(socket, frame, size);
+         if(rv <= 0)
+         {
+            return -1;
+         }
+         frame += rv;
+         size -= rv;
+      }
+      offset += chunk;
+   } while(offset < buffer_size_in_bytes);
+   return buffer_size_in_bytes;
 }
 
-struct ryannet_address * ryannet_socket_udp_get_address_local(struct ryannet_socket_udp * socket)
+static int ryannet_socket_tcp_receive_compressed_flag(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes, int nonblock_flag)
 {
-   if(socket->fd == -1)
+   struct ryannet_compression * compression;
+   unsigned int block_size;
+   int header, received, size;
+
+   compression = socket->compression;
+   if(compression == NULL)
    {
-      return NULL;
+      return nonblock_flag ? ryannet_socket_tcp_receive_nonblock(socket, buffer, buffer_size_in_bytes) :
+                             ryannet_socket_tcp_receive(socket, buffer, buffer_size_in_bytes);
    }
-   return &socket->local;
+   while(compression->pending_size == 0)
+   {
+      header = ryannet_delta_get_varint(compression->input, compression->input_start, compression->input_end, &block_size);
+      if((header == -1 && compression->input_end - compression->input_start >= COMPRESS_FRAME_HEADER_SIZE) ||
+         (header != -1 && block_size > (unsigned int)RYANNET_COMPRESS_BOUND(RYANNET_COMPRESS_BLOCK_SIZE)))
+      {
+         fprintf(stderr, "Error: Compressed block of %u bytes\n", block_size);
+         return -1;
+      }
+      if(header != -1 && compression->input_end - header >= (int)block_size)
+      {
+         size = ryannet_decompressor_decode(compression->decompressor, compression->input + header, (int)block_size, &compression->pending_start);
+         if(size == -1)
+         {
+            fprintf(stderr, "Error: Corrupt compressed block\n");
+            return -1;
+         }
+         compression->pending_size = size;
+         compression->input_start = header + (int)block_size;
+         continue;
+      }
+
+      // Need more, slide what is left to the front so a whole frame fits
+      compression->input_end -= compression->input_start;
+      memmove(compression->input, compression->input + compression->input_start, (size_t)compression->input_end);
+      compression->input_start = 0;
+      if(nonblock_flag)
+      {
+         received = ryannet_socket_tcp_receive_nonblock(socket, compression->input + compression->input_end, COMPRESS_FRAME_SIZE - compression->input_end);
+      }
+      else
+      {
+         received = ryannet_socket_tcp_receive(socket, compression->input + compression->input_end, COMPRESS_FRAME_SIZE - compression->input_end);
+      }
+      if(received <= 0)
+      {
+         return received;
+      }
+      compression->input_end += received;
+   }
+
+   size = buffer_size_in_bytes < compression->pending_size ? buffer_size_in_bytes : compression->pending_size;
+   memcpy(buffer, compression->decompressor->history + compression->pending_start, (size_t)size);
+   compression->pending_start += size;
+   compression->pending_size -= size;
+   return size;
+}
+
+int ryannet_socket_tcp_receive_compressed(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes)
+{
+   return ryannet_socket_tcp_receive_compressed_flag(socket, buffer, buffer_size_in_bytes, 0);
 }
 
+int ryannet_socket_tcp_receive_compressed_nonblock(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes)
+{
+   return ryannet_socket_tcp_receive_compressed_flag(socket, buffer, buffer_size_in_bytes, 1);
+}
@@ -1,13 +1,56 @@
 #ifndef __RYANNET_H__
 #define __RYANNET_H__
 
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
 struct ryannet_address;
 struct ryannet_socket_tcp;
 struct ryannet_socket_udp;
+struct ryannet_message;
+struct ryannet_group;
+struct ryannet_secure_session;
+struct ryannet_cookie_guard;
+struct ryannet_pacer;
+struct ryannet_impaired_udp;
+struct ryannet_impaired_proxy;
+struct ryannet_recorder;
+struct ryannet_replay;
+struct ryannet_mux;
+struct ryannet_compressor;
+struct ryannet_decompressor;
 
 int ryannet_init(void);
 void ryannet_destroy(void);
 
+// Size classed buffer pool. Each thread keeps a small free list per class and
+// only touches the shared pool in batches. Requests bigger than the largest
+// class fall back to malloc. Call ryannet_buffer_thread_release before a
+// thread exits to hand its cached buffers back. The pool's slabs are kept until
+// the process exits, so buffers may still be freed after ryannet_destroy and
+// are reused after the next ryannet_init.
+struct ryannet_buffer_stats
+{
+   int block_size; // 0 for the malloc fallback
+   unsigned long long reserved_bytes;
+   unsigned long long blocks_total;
+   unsigned long long blocks_free; // Not counting buffers held in thread caches
+   unsigned long long allocations;
+   unsigned long long releases;
+};
+
+void * ryannet_buffer_alloc(int size_in_bytes);
+void ryannet_buffer_free(void * buffer);
+int ryannet_buffer_get_capacity(void * buffer);
+void ryannet_buffer_thread_release(void);
+
+// Thread caches report their counts when they trade with the shared pool, so
+// allocations and releases from other threads may lag a little.
+int ryannet_buffer_get_class_count(void);
+// Returns -1 for a class_index out of range.
+int ryannet_buffer_get_stats(int class_index, struct ryannet_buffer_stats * stats);
+
 struct ryannet_address * ryannet_address_new(void);
 int ryannet_address_set(struct ryannet_address * address, const char * node, const char * port);
 void ryannet_address_destroy(struct ryannet_address * address);
@@ -18,6 +61,14 @@ const char * ryannet_address_get_port(struct ryannet_address * address);
 struct ryannet_socket_tcp * ryannet_socket_tcp_new(void);
 void ryannet_socket_tcp_destroy(struct ryannet_socket_tcp * socket);
 
+// Besides host names and IPs, addresses can name local transports, the port
+// is ignored for these:
+//   "shm:name"            shared memory (Linux)
+//   "unix:/path"          unix stream socket, or datagram for udp sockets
+//   "unixpacket:/path"    unix seqpacket socket, keeps message boundaries
+// Unix paths starting with @ are in the abstract namespace. Binding a shm
+// name or unix path a running server holds fails, one left by a crashed
+// server is taken over. Blocked shm calls notice a crashed peer within 100ms.
 int ryannet_socket_tcp_connect(struct ryannet_socket_tcp * socket, const char * remote_address, const char * remote_port);
 
 int ryannet_socket_tcp_bind(struct ryannet_socket_tcp * socket, const char * bind_address, const char * bind_port);
@@ -30,11 +81,58 @@ int ryannet_socket_tcp_receive(struct ryannet_socket_tcp * socket, void * buffer
 int ryannet_socket_tcp_receive_nonblock(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes);
 int ryannet_socket_tcp_send(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes);
 
+// Receive straight into a pool buffer. Returns NULL when nothing was received
+// and received_bytes holds the receive result. Free with ryannet_buffer_free.
+void * ryannet_socket_tcp_receive_buffer(struct ryannet_socket_tcp * socket, int max_size_in_bytes, int * received_bytes);
+
+// Streams count bytes of file_fd starting at *offset. *offset is advanced by
+// the number of bytes sent so a partial transfer can be resumed. Returns the
+// bytes sent, or -1 on error. The blocking version uses sendfile on Linux. The
+// nonblock version copies through a buffer and stops at the first send that
+// would block, leaving the socket's mode alone. Windows has no such send, so
+// there it only checks for room before each 16KB chunk, and a chunk can
+// wait for the part of itself that did not fit.
+long long ryannet_socket_tcp_send_file(struct ryannet_socket_tcp * socket, int file_fd, long long * offset, long long count);
+long long ryannet_socket_tcp_send_file_nonblock(struct ryannet_socket_tcp * socket, int file_fd, long long * offset, long long count);
+
+// Messages are immutable and reference counted so one copy of the bytes can
+// be queued on any number of connections. new starts with one reference.
+struct ryannet_message * ryannet_message_new(const void * buffer, int buffer_size_in_bytes);
+void ryannet_message_retain(struct ryannet_message * message);
+void ryannet_message_release(struct ryannet_message * message);
+const void * ryannet_message_get_data(struct ryannet_message * message);
+int ryannet_message_get_size(struct ryannet_message * message);
+
+// Queued messages are only written by flush. The nonblock flush stops once
+// the socket is full and keeps the remainder for the next call.
+// queue and enqueue are lock free and can be called from any thread, flush
+// and every other socket function must stay on the thread that owns the socket.
+int ryannet_socket_tcp_queue(struct ryannet_socket_tcp * socket, struct ryannet_message * message);
+int ryannet_socket_tcp_enqueue(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes);
+int ryannet_socket_tcp_queue_is_empty(struct ryannet_socket_tcp * socket);
+int ryannet_socket_tcp_flush(struct ryannet_socket_tcp * socket);
+int ryannet_socket_tcp_flush_nonblock(struct ryannet_socket_tcp * socket);
+
+// Without a wake handle the owner has to call flush every tick to notice
+// queued messages. With it enabled the handle turns readable when a queue
+// call finds the queue empty, so the owner can sleep in poll on it next to
+// its sockets. flush clears it. Returns 1 where not available (Windows).
+int ryannet_socket_tcp_enable_queue_wake(struct ryannet_socket_tcp * socket);
+int ryannet_socket_tcp_get_queue_wake_handle(struct ryannet_socket_tcp * socket);
+
 struct ryannet_address * ryannet_socket_tcp_get_address_local(struct ryannet_socket_tcp * socket);
 struct ryannet_address * ryannet_socket_tcp_get_address_remote(struct ryannet_socket_tcp * socket);
 
+// Half close, the peer's receive returns 0 once it has read everything sent
+// before, and this side can still receive.
+int ryannet_socket_tcp_shutdown(struct ryannet_socket_tcp * socket);
+
 int ryannet_socket_tcp_is_connected(struct ryannet_socket_tcp * socket);
 
+// The OS socket for polling alongside other sockets, -1 for shared memory
+// connections. On Windows this is the SOCKET value.
+int ryannet_socket_tcp_get_handle(struct ryannet_socket_tcp * socket);
+
 
 
 struct ryannet_socket_udp * ryannet_socket_udp_new(void);
@@ -45,9 +143,355 @@ int ryannet_socket_udp_bind(struct ryannet_socket_udp * socket, const char * bin
 int ryannet_socket_udp_send(struct ryannet_socket_udp * socket, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes);
 int ryannet_socket_udp_receive(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source);
 int ryannet_socket_udp_receive_nonblock(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source);
+void * ryannet_socket_udp_receive_buffer(struct ryannet_socket_udp * socket, int max_size_in_bytes, struct ryannet_address * source, int * received_bytes);
 
 struct ryannet_address * ryannet_socket_udp_get_address_local(struct ryannet_socket_udp * socket);
 
+// -1 until the socket is bound or first sends
+int ryannet_socket_udp_get_handle(struct ryannet_socket_udp * socket);
+
+
+// Groups fan one message out to a set of TCP and UDP peers. TCP peers only
+// get the message queued, which is safe from any thread, and each socket's
+// owner sends it with its next flush (see enable_queue_wake). UDP peers
+// sharing a socket are sent in batches right away, so send must be called
+// on the thread that owns the group's UDP sockets.
+struct ryannet_group * ryannet_group_new(void);
+void ryannet_group_destroy(struct ryannet_group * group);
+
+int ryannet_group_add_tcp(struct ryannet_group * group, struct ryannet_socket_tcp * socket);
+int ryannet_group_add_udp(struct ryannet_group * group, struct ryannet_socket_udp * socket, struct ryannet_address * destination);
+void ryannet_group_remove_tcp(struct ryannet_group * group, struct ryannet_socket_tcp * socket);
+void ryannet_group_remove_udp(struct ryannet_group * group, struct ryannet_socket_udp * socket, struct ryannet_address * destination);
+int ryannet_group_get_count(struct ryannet_group * group);
+
+int ryannet_group_send(struct ryannet_group * group, struct ryannet_message * message);
+
+
+// Bit packing for building packets. Values are written least significant bit
+// first so the output is the same on every host. Writes past the end of the
+// buffer and reads past the end of the data set the overflow flag instead.
+struct ryannet_bitwriter
+{
+   unsigned char * buffer;
+   int size_in_bytes;
+   int bit_position;
+   int overflow_flag;
+};
+
+struct ryannet_bitreader
+{
+   const unsigned char * buffer;
+   int size_in_bytes;
+   int bit_position;
+   int overflow_flag;
+};
+
+void ryannet_bitwriter_init(struct ryannet_bitwriter * writer, void * buffer, int buffer_size_in_bytes);
+void ryannet_bitwriter_write_bits(struct ryannet_bitwriter * writer, unsigned int value, int bit_count);
+void ryannet_bitwriter_write_varint(struct ryannet_bitwriter * writer, unsigned long long value);
+void ryannet_bitwriter_write_signed_varint(struct ryannet_bitwriter * writer, long long value);
+void ryannet_bitwriter_write_float(struct ryannet_bitwriter * writer, float value);
+void ryannet_bitwriter_write_float_quantized(struct ryannet_bitwriter * writer, float value, float min, float max, int bit_count);
+void ryannet_bitwriter_write_bytes(struct ryannet_bitwriter * writer, const void * buffer, int buffer_size_in_bytes);
+void ryannet_bitwriter_align(struct ryannet_bitwriter * writer);
+int ryannet_bitwriter_get_size(struct ryannet_bitwriter * writer);
+int ryannet_bitwriter_has_overflow(struct ryannet_bitwriter * writer);
+
+void ryannet_bitreader_init(struct ryannet_bitreader * reader, const void * buffer, int buffer_size_in_bytes);
+unsigned int ryannet_bitreader_read_bits(struct ryannet_bitreader * reader, int bit_count);
+unsigned long long ryannet_bitreader_read_varint(struct ryannet_bitreader * reader);
+long long ryannet_bitreader_read_signed_varint(struct ryannet_bitreader * reader);
+float ryannet_bitreader_read_float(struct ryannet_bitreader * reader);
+float ryannet_bitreader_read_float_quantized(struct ryannet_bitreader * reader, float min, float max, int bit_count);
+void ryannet_bitreader_read_bytes(struct ryannet_bitreader * reader, void * buffer, int buffer_size_in_bytes);
+void ryannet_bitreader_align(struct ryannet_bitreader * reader);
+int ryannet_bitreader_has_overflow(struct ryannet_bitreader * reader);
+
+// Snapshot delta compression. current is XORed against a baseline the peer
+// already has (NULL means all zeros) and stored as runs of unchanged bytes
+// and changed bytes. encode returns the encoded size, or -1 if out is too
+// small. decode returns 0 on success, baseline and out may be the same buffer.
+int ryannet_delta_encode(const void * baseline, const void * current, int size_in_bytes, void * out, int out_size_in_bytes);
+int ryannet_delta_decode(const void * baseline, const void * encoded, int encoded_size_in_bytes, void * out, int size_in_bytes);
+
+// Encrypted datagrams with ChaCha20-Poly1305. A session starts with an X25519
+// exchange: the client sends client_hello, the server answers with the
+// output of server_accept, and the client checks it with client_finish.
+// Keys come from BLAKE2s over the shared secret and both public keys.
+// Both handshake packets are RYANNET_SECURE_HANDSHAKE_SIZE bytes. With a 32
+// byte pre shared key only peers holding the key can finish the exchange,
+// with NULL the exchange is anonymous. Sealed packets are
+// RYANNET_SECURE_OVERHEAD bytes bigger than the payload. open returns -1 for
+// forged, corrupted and replayed packets.
+#define RYANNET_SECURE_HANDSHAKE_SIZE 49
+#define RYANNET_SECURE_OVERHEAD 25
+
+struct ryannet_secure_session * ryannet_secure_session_new(const unsigned char * pre_shared_key);
+void ryannet_secure_session_destroy(struct ryannet_secure_session * session);
+
+int ryannet_secure_session_client_hello(struct ryannet_secure_session * session, void * out, int out_size_in_bytes);
+int ryannet_secure_session_server_accept(struct ryannet_secure_session * session, const void * hello, int hello_size_in_bytes, void * out, int out_size_in_bytes);
+int ryannet_secure_session_client_finish(struct ryannet_secure_session * session, const void * welcome, int welcome_size_in_bytes);
+int ryannet_secure_session_is_established(struct ryannet_secure_session * session);
+
+int ryannet_secure_session_seal(struct ryannet_secure_session * session, const void * buffer, int buffer_size_in_bytes, void * out, int out_size_in_bytes);
+int ryannet_secure_session_open(struct ryannet_secure_session * session, const void * packet, int packet_size_in_bytes, void * out, int out_size_in_bytes);
+
+// The primitives under secure sessions, for known answer tests. aead_seal
+// writes the cipher text and a 16 byte tag, aead_open takes both and returns
+// 0 when the tag checks out. blake2s is unkeyed with a key_size of 0.
+void ryannet_crypto_x25519(unsigned char out[32], const unsigned char scalar[32], const unsigned char point[32]);
+void ryannet_crypto_aead_seal(const unsigned char key[32], const unsigned char nonce[12], const void * additional, int additional_size_in_bytes,
+                              const void * buffer, int buffer_size_in_bytes, void * out);
+int ryannet_crypto_aead_open(const unsigned char key[32], const unsigned char nonce[12], const void * additional, int additional_size_in_bytes,
+                             const void * sealed, int sealed_size_in_bytes, void * out);
+void ryannet_crypto_blake2s(unsigned char out[32], const void * key, int key_size_in_bytes, const void * buffer, int buffer_size_in_bytes);
+
+int ryannet_socket_udp_send_secure(struct ryannet_socket_udp * socket, struct ryannet_secure_session * session, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes);
+int ryannet_socket_udp_receive_secure(struct ryannet_socket_udp * socket, struct ryannet_secure_session * session, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source);
+
+// Cheap filtering for handshakes from unknown UDP peers, before any per peer
+// state exists. allow is a token bucket keyed on the source address and
+// returns 0 when the source is over its rate. make fills a
+// RYANNET_COOKIE_SIZE cookie bound to the source address that the peer has
+// to echo back, check returns 1 when it is genuine and recent. Cookies stay
+// good for one to two rotation periods. Nothing allocates after new.
+#define RYANNET_COOKIE_SIZE 12
+
+struct ryannet_cookie_guard * ryannet_cookie_guard_new(int packets_per_second, int burst, int rotation_seconds);
+void ryannet_cookie_guard_destroy(struct ryannet_cookie_guard * guard);
+
+int ryannet_cookie_guard_allow(struct ryannet_cookie_guard * guard, struct ryannet_address * source);
+void ryannet_cookie_guard_make(struct ryannet_cookie_guard * guard, struct ryannet_address * source, unsigned char * cookie);
+int ryannet_cookie_guard_check(struct ryannet_cookie_guard * guard, struct ryannet_address * source, const unsigned char * cookie);
+
+// Pacing spreads a tick's worth of datagrams out at a set bitrate instead of
+// bursting them. set_max_pacing_rate caps the whole socket in the kernel
+// (SO_MAX_PACING_RATE), which only takes effect under the fq qdisc, and returns
+// 1 where the option does not exist. enable_txtime lets pacers hand each
+// packet its departure time (SO_TXTIME) instead of waiting for it. Departure
+// times are on CLOCK_MONOTONIC, which only the fq qdisc accepts (etf wants
+// CLOCK_TAI), so pass fq_flag 1 only when fq is on the outgoing interface.
+// With 0, or where SO_TXTIME does not exist, it returns 1 and pacers keep
+// pacing in userspace. Without txtime a pacer only sends packets whose slot has
+// come, so keep calling flush while get_wait_us is not -1, it says how long
+// until the next slot. Each tick's budget goes to the highest priority
+// messages first, whatever does not fit stays queued until drop discards it.
+int ryannet_socket_udp_set_max_pacing_rate(struct ryannet_socket_udp * socket, unsigned long long bytes_per_second);
+int ryannet_socket_udp_enable_txtime(struct ryannet_socket_udp * socket, int fq_flag);
+
+struct ryannet_pacer * ryannet_pacer_new(struct ryannet_socket_udp * socket, struct ryannet_address * destination, unsigned long long bytes_per_second, int burst_bytes);
+void ryannet_pacer_destroy(struct ryannet_pacer * pacer);
+void ryannet_pacer_set_rate(struct ryannet_pacer * pacer, unsigned long long bytes_per_second, int burst_bytes);
+
+int ryannet_pacer_queue(struct ryannet_pacer * pacer, struct ryannet_message * message, int priority);
+int ryannet_pacer_drop(struct ryannet_pacer * pacer, int below_priority);
+void ryannet_pacer_begin_tick(struct ryannet_pacer * pacer, int budget_in_bytes);
+int ryannet_pacer_flush(struct ryannet_pacer * pacer);
+int ryannet_pacer_get_wait_us(struct ryannet_pacer * pacer);
+int ryannet_pacer_get_queued_bytes(struct ryannet_pacer * pacer);
+
+// Power of two buckets of nanosecond durations. Percentiles come back as
+// the top of the bucket they land in, so are within a factor of two.
+#define RYANNET_HISTOGRAM_BUCKETS 40
+struct ryannet_histogram
+{
+   unsigned long long buckets[RYANNET_HISTOGRAM_BUCKETS];
+   unsigned long long count;
+   long long total_ns;
+   long long max_ns;
+};
+
+void ryannet_histogram_clear(struct ryannet_histogram * histogram);
+void ryannet_histogram_add(struct ryannet_histogram * histogram, long long value_ns);
+long long ryannet_histogram_get_percentile(struct ryannet_histogram * histogram, double percentile);
+
+// Kernel software timestamps (SO_TIMESTAMPING), Linux only, enable returns 1
+// elsewhere. Once enabled every receive records how long the data sat in
+// the socket buffer before the application read it, and every send records
+// how long it took to reach the driver, so kernel time can be told apart
+// from time spent in the tick loop. Send times arrive on the error queue,
+// which shares the receive buffer, and every receive drains it, blocking
+// ones while they wait. A socket that sends without receiving must call
+// collect every tick or incoming data starts being dropped. kernel_ns is
+// the realtime clock arrival time, 0 when there is none. Enable TCP sockets
+// once connected and before sending.
+int ryannet_socket_udp_enable_timestamps(struct ryannet_socket_udp * socket);
+int ryannet_socket_tcp_enable_timestamps(struct ryannet_socket_tcp * socket);
+
+int ryannet_socket_udp_receive_timestamped(struct ryannet_socket_udp * socket, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source, long long * kernel_ns);
+int ryannet_socket_tcp_receive_timestamped(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes, long long * kernel_ns);
+
+int ryannet_socket_udp_collect_timestamps(struct ryannet_socket_udp * socket);
+int ryannet_socket_tcp_collect_timestamps(struct ryannet_socket_tcp * socket);
+
+// NULL until timestamps are enabled
+struct ryannet_histogram * ryannet_socket_udp_get_receive_delay(struct ryannet_socket_udp * socket);
+struct ryannet_histogram * ryannet_socket_udp_get_send_delay(struct ryannet_socket_udp * socket);
+struct ryannet_histogram * ryannet_socket_tcp_get_receive_delay(struct ryannet_socket_tcp * socket);
+struct ryannet_histogram * ryannet_socket_tcp_get_send_delay(struct ryannet_socket_tcp * socket);
+
+// Network condition simulator for testing over loopback. Every packet may be
+// lost, duplicated, delayed by latency plus jitter, held back reorder_ms to
+// arrive out of order, and squeezed through a bottleneck of bytes_per_second
+// that tail drops past queue_limit_bytes (0 for no limit). The same seed
+// gives the same run. init sets up a perfect link.
+#define RYANNET_JITTER_UNIFORM 0
+#define RYANNET_JITTER_NORMAL  1
+struct ryannet_impairment
+{
+   int latency_ms;
+   int jitter_ms;
+   int jitter_distribution;
+   double loss;
+   double duplicate;
+   double reorder;
+   int reorder_ms;
+   unsigned long long bytes_per_second;
+   int queue_limit_bytes;
+   unsigned long long seed;
+};
+
+struct ryannet_impairment_stats
+{
+   unsigned long long packets;
+   unsigned long long dropped;
+   unsigned long long duplicated;
+   unsigned long long reordered;
+   unsigned long long delivered;
+};
+
+void ryannet_impairment_init(struct ryannet_impairment * impairment);
+
+// Wraps a UDP socket, which it does not own, impairing what it sends and
+// what it receives (NULL for a perfect link). Sends are held until pump
+// releases them, so pump at least every get_wait_us (-1 when nothing is
+// held) and whenever the socket may have data.
+struct ryannet_impaired_udp * ryannet_impaired_udp_new(struct ryannet_socket_udp * socket, const struct ryannet_impairment * outgoing, const struct ryannet_impairment * incoming);
+void ryannet_impaired_udp_destroy(struct ryannet_impaired_udp * impaired);
+
+int ryannet_impaired_udp_send(struct ryannet_impaired_udp * impaired, struct ryannet_address * destination, const void * buffer, int buffer_size_in_bytes);
+int ryannet_impaired_udp_receive_nonblock(struct ryannet_impaired_udp * impaired, void * buffer, int buffer_size_in_bytes, struct ryannet_address * source);
+int ryannet_impaired_udp_pump(struct ryannet_impaired_udp * impaired);
+int ryannet_impaired_udp_get_wait_us(struct ryannet_impaired_udp * impaired);
+void ryannet_impaired_udp_get_stats(struct ryannet_impaired_udp * impaired, struct ryannet_impairment_stats * outgoing, struct ryannet_impairment_stats * incoming);
+
+// TCP proxy that forwards connections made to the bind address on to the
+// target, applying latency, jitter and the bandwidth limit in both
+// directions. Loss, duplication and reordering are left to real TCP. A
+// side that closes is passed on as a half close, so the other direction
+// keeps flowing until it closes too. All the work happens in pump, which
+// never blocks apart from connecting to the target.
+struct ryannet_impaired_proxy * ryannet_impaired_proxy_new(const char * bind_address, const char * bind_port, const char * target_address, const char * target_port, const struct ryannet_impairment * impairment);
+void ryannet_impaired_proxy_destroy(struct ryannet_impaired_proxy * proxy);
+
+int ryannet_impaired_proxy_pump(struct ryannet_impaired_proxy * proxy);
+int ryannet_impaired_proxy_get_connection_count(struct ryannet_impaired_proxy * proxy);
+
+// Capture of everything a socket sends and receives, with the time and the
+// peer address, appended to a memory mapped file. One recorder can be
+// shared by many sockets and threads. Set a NULL recorder to stop. Files
+// are capped at max_size_in_bytes when it is above 0, later records are
+// counted as dropped. send_file payloads are not recorded.
+#define RYANNET_RECORD_SENT 0x01
+#define RYANNET_RECORD_TCP  0x02
+
+struct ryannet_recorder * ryannet_recorder_new(const char * path, long long max_size_in_bytes);
+void ryannet_recorder_destroy(struct ryannet_recorder * recorder);
+unsigned long long ryannet_recorder_get_count(struct ryannet_recorder * recorder);
+unsigned long long ryannet_recorder_get_dropped(struct ryannet_recorder * recorder);
+
+void ryannet_socket_udp_set_recorder(struct ryannet_socket_udp * socket, struct ryannet_recorder * recorder);
+void ryannet_socket_tcp_set_recorder(struct ryannet_socket_tcp * socket, struct ryannet_recorder * recorder);
+
+// Replays what the recorded sockets received, UDP or TCP, into a server.
+// Every recorded peer becomes fanout synthetic clients sending its
+// payloads on its schedule, sped up by speed (0 to go flat out). lateness
+// is how far behind schedule each send went out, response the time from a
+// client's send to its next reply.
+struct ryannet_replay_stats
+{
+   int clients;
+   unsigned long long packets_sent;
+   unsigned long long bytes_sent;
+   unsigned long long packets_received;
+   unsigned long long bytes_received;
+   long long elapsed_ns;
+   struct ryannet_histogram lateness;
+   struct ryannet_histogram response;
+};
+
+struct ryannet_replay * ryannet_replay_new(const char * path);
+void ryannet_replay_destroy(struct ryannet_replay * replay);
+
+int ryannet_replay_run(struct ryannet_replay * replay, const char * address, const char * port, int tcp_flag, double speed, int fanout, struct ryannet_replay_stats * stats);
+// Streams multiplexed over one TCP connection, each with its own 64KB flow
+// control window. Sends are cut into frames of at most 1KB. The highest
+// priority stream with data and window always goes next, streams sharing a
+// priority split the link by weight. Both ends need a mux on the socket.
+// pump reads whatever has arrived, flush sends queued data and hands read
+// credit back to the peer, so call both every tick. Streams the peer sends
+// data on first are opened with priority 0 and weight 1. Each one holds a
+// window of memory, so a peer opening more than RYANNET_MUX_MAX_PEER_STREAMS,
+// or sending window credit for a stream that is not open, fails pump.
+#define RYANNET_MUX_MAX_PEER_STREAMS 64
+struct ryannet_mux * ryannet_mux_new(struct ryannet_socket_tcp * socket);
+void ryannet_mux_destroy(struct ryannet_mux * mux);
+
+int ryannet_mux_open_stream(struct ryannet_mux * mux, unsigned int stream_id, int priority, int weight);
+int ryannet_mux_queue(struct ryannet_mux * mux, unsigned int stream_id, struct ryannet_message * message);
+int ryannet_mux_send(struct ryannet_mux * mux, unsigned int stream_id, const void * buffer, int buffer_size_in_bytes);
+int ryannet_mux_flush(struct ryannet_mux * mux);
+
+int ryannet_mux_pump(struct ryannet_mux * mux);
+int ryannet_mux_receive(struct ryannet_mux * mux, unsigned int stream_id, void * buffer, int buffer_size_in_bytes);
+
+int ryannet_mux_get_receive_size(struct ryannet_mux * mux, unsigned int stream_id);
+int ryannet_mux_get_queued_bytes(struct ryannet_mux * mux, unsigned int stream_id);
+int ryannet_mux_get_send_window(struct ryannet_mux * mux, unsigned int stream_id);
+// TCP Fast Open, enable it before bind or connect. Listeners then hand out
+// cookies, and connect_with_data sends its first bytes in the SYN once the
+// client holds a cookie for that server. The first connection to a server
+// fetches the cookie with a normal handshake, as does any connection where
+// either side can't do fast open. connect_with_data returns bytes sent like
+// tcp_send or -1 when it couldn't connect. Linux servers also need
+// net.ipv4.tcp_fastopen set to 3. Returns 1 where not available.
+int ryannet_socket_tcp_enable_fastopen(struct ryannet_socket_tcp * socket);
+int ryannet_socket_tcp_connect_with_data(struct ryannet_socket_tcp * socket, const char * remote_address, const char * remote_port, const void * buffer, int buffer_size_in_bytes);
+
+// Streaming LZ compression. History carries over from block to block, so
+// small messages that repeat earlier ones shrink to a few bytes. Both ends
+// must start from the same dictionary, sample traffic works best, or NULL.
+// Blocks are at most RYANNET_COMPRESS_BLOCK_SIZE and encode to at most
+// RYANNET_COMPRESS_BOUND bytes, data that won't shrink is sent raw. Blocks
+// have to be decompressed in the order they were compressed. decompress
+// returns -1 without touching the stream when out is too small, so the same
+// block can be tried again with a bigger buffer.
+#define RYANNET_COMPRESS_BLOCK_SIZE 65536
+#define RYANNET_COMPRESS_BOUND(size) ((size) + 1)
+
+struct ryannet_compressor * ryannet_compressor_new(const void * dictionary, int dictionary_size_in_bytes);
+void ryannet_compressor_destroy(struct ryannet_compressor * compressor);
+int ryannet_compressor_compress(struct ryannet_compressor * compressor, const void * buffer, int buffer_size_in_bytes, void * out, int out_size_in_bytes);
+
+struct ryannet_decompressor * ryannet_decompressor_new(const void * dictionary, int dictionary_size_in_bytes);
+void ryannet_decompressor_destroy(struct ryannet_decompressor * decompressor);
+int ryannet_decompressor_decompress(struct ryannet_decompressor * decompressor, const void * encoded, int encoded_size_in_bytes, void * out, int out_size_in_bytes);
+
+// Compresses a TCP connection, both ends enable it with the same
+// dictionary. send_compressed writes everything before it returns,
+// receive_compressed reads the stream back like tcp_receive. Without
+// compression enabled they are plain tcp_send and tcp_receive.
+int ryannet_socket_tcp_enable_compression(struct ryannet_socket_tcp * socket, const void * dictionary, int dictionary_size_in_bytes);
+int ryannet_socket_tcp_send_compressed(struct ryannet_socket_tcp * socket, const void * buffer, int buffer_size_in_bytes);
+int ryannet_socket_tcp_receive_compressed(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes);
+int ryannet_socket_tcp_receive_compressed_nonblock(struct ryannet_socket_tcp * socket, void * buffer, int buffer_size_in_bytes);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
 #endif // __RYANNET_H__
 
 
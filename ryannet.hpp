@@ -0,0 +1,693 @@
+#ifndef __RYANNET_HPP__
+#define __RYANNET_HPP__
+
+// C++20 layer over ryannet.h. Every call goes straight to the C function
+// with the span's pointer and size, nothing is copied or allocated on the
+// way. Failures come back as the same return codes the C API uses. Spans
+// of any plain type work, and the std::byte overloads take vectors and
+// arrays of std::byte directly.
+
+#include "ryannet.h"
+#include <climits>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#else // _WIN32
+#include <poll.h>
+#endif // _WIN32
+
+namespace ryannet
+{
+
+namespace detail
+{
+
+inline int clamp_size(std::size_t size)
+{
+   return size > (std::size_t)INT_MAX ? INT_MAX : (int)size;
+}
+
+} // namespace detail
+
+// Calls ryannet_init for the lifetime of the object
+class library
+{
+public:
+   library() : result_(ryannet_init()) {}
+   ~library() { ryannet_destroy(); }
+   library(const library &) = delete;
+   library & operator=(const library &) = delete;
+
+   int result() const { return result_; }
+
+private:
+   int result_;
+};
+
+class address
+{
+public:
+   address() : address_(ryannet_address_new()) {}
+   address(const char * node, const char * port) : address_(ryannet_address_new())
+   {
+      (void)ryannet_address_set(address_, node, port);
+   }
+   ~address() { reset(); }
+
+   address(const address &) = delete;
+   address & operator=(const address &) = delete;
+   address(address && other) noexcept : address_(std::exchange(other.address_, nullptr)) {}
+   address & operator=(address && other) noexcept
+   {
+      if(this != &other)
+      {
+         reset();
+         address_ = std::exchange(other.address_, nullptr);
+      }
+      return *this;
+   }
+
+   int set(const char * node, const char * port) { return ryannet_address_set(address_, node, port); }
+   const char * host() const { return ryannet_address_get_address(address_); }
+   const char * port() const { return ryannet_address_get_port(address_); }
+
+   ryannet_address * native() const { return address_; }
+
+private:
+   void reset()
+   {
+      if(address_ != nullptr)
+      {
+         ryannet_address_destroy(address_);
+         address_ = nullptr;
+      }
+   }
+
+   ryannet_address * address_;
+};
+
+class tcp_socket
+{
+public:
+   tcp_socket() : socket_(ryannet_socket_tcp_new()) {}
+   // Takes ownership of a socket from the C API
+   explicit tcp_socket(ryannet_socket_tcp * socket) : socket_(socket) {}
+   ~tcp_socket() { reset(); }
+
+   tcp_socket(const tcp_socket &) = delete;
+   tcp_socket & operator=(const tcp_socket &) = delete;
+   tcp_socket(tcp_socket && other) noexcept : socket_(std::exchange(other.socket_, nullptr)) {}
+   tcp_socket & operator=(tcp_socket && other) noexcept
+   {
+      if(this != &other)
+      {
+         reset();
+         socket_ = std::exchange(other.socket_, nullptr);
+      }
+      return *this;
+   }
+
+   int connect(const char * remote_address, const char * remote_port)
+   {
+      return ryannet_socket_tcp_connect(socket_, remote_address, remote_port);
+   }
+   int bind(const char * bind_address, const char * bind_port)
+   {
+      return ryannet_socket_tcp_bind(socket_, bind_address, bind_port);
+   }
+   int enable_fastopen() { return ryannet_socket_tcp_enable_fastopen(socket_); }
+   template<class T, std::size_t N>
+   int connect_with_data(const char * remote_address, const char * remote_port, std::span<T, N> buffer)
+   {
+      static_assert(std::is_trivially_copyable_v<T>, "send needs a span of plain data");
+      return ryannet_socket_tcp_connect_with_data(socket_, remote_address, remote_port, buffer.data(), detail::clamp_size(buffer.size_bytes()));
+   }
+   int connect_with_data(const char * remote_address, const char * remote_port, std::span<const std::byte> buffer)
+   {
+      return connect_with_data<const std::byte>(remote_address, remote_port, buffer);
+   }
+   // Empty on failure or when nothing is waiting
+   tcp_socket accept() { return tcp_socket(ryannet_socket_tcp_accept(socket_)); }
+   tcp_socket accept_nonblock() { return tcp_socket(ryannet_socket_tcp_accept_nonblock(socket_)); }
+
+   template<class T, std::size_t N>
+   int receive(std::span<T, N> buffer)
+   {
+      static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>, "receive needs a writable span of plain data");
+      return ryannet_socket_tcp_receive(socket_, buffer.data(), detail::clamp_size(buffer.size_bytes()));
+   }
+   int receive(std::span<std::byte> buffer) { return receive<std::byte>(buffer); }
+   template<class T, std::size_t N>
+   int receive_nonblock(std::span<T, N> buffer)
+   {
+      static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>, "receive needs a writable span of plain data");
+      return ryannet_socket_tcp_receive_nonblock(socket_, buffer.data(), detail::clamp_size(buffer.size_bytes()));
+   }
+   int receive_nonblock(std::span<std::byte> buffer) { return receive_nonblock<std::byte>(buffer); }
+   template<class T, std::size_t N>
+   int send(std::span<T, N> buffer)
+   {
+      static_assert(std::is_trivially_copyable_v<T>, "send needs a span of plain data");
+      return ryannet_socket_tcp_send(socket_, buffer.data(), detail::clamp_size(buffer.size_bytes()));
+   }
+   int send(std::span<const std::byte> buffer) { return send<const std::byte>(buffer); }
+
+   bool is_connected() const { return socket_ != nullptr && ryannet_socket_tcp_is_connected(socket_); }
+   int handle() const { return ryannet_socket_tcp_get_handle(socket_); }
+
+   explicit operator bool() const { return socket_ != nullptr; }
+   ryannet_socket_tcp * native() const { return socket_; }
+   ryannet_socket_tcp * release() { return std::exchange(socket_, nullptr); }
+
+private:
+   void reset()
+   {
+      if(socket_ != nullptr)
+      {
+         ryannet_socket_tcp_destroy(socket_);
+         socket_ = nullptr;
+      }
+   }
+
+   ryannet_socket_tcp * socket_;
+};
+
+class udp_socket
+{
+public:
+   udp_socket() : socket_(ryannet_socket_udp_new()) {}
+   explicit udp_socket(ryannet_socket_udp * socket) : socket_(socket) {}
+   ~udp_socket() { reset(); }
+
+   udp_socket(const udp_socket &) = delete;
+   udp_socket & operator=(const udp_socket &) = delete;
+   udp_socket(udp_socket && other) noexcept : socket_(std::exchange(other.socket_, nullptr)) {}
+   udp_socket & operator=(udp_socket && other) noexcept
+   {
+      if(this != &other)
+      {
+         reset();
+         socket_ = std::exchange(other.socket_, nullptr);
+      }
+      return *this;
+   }
+
+   int bind(const char * bind_address, const char * bind_port)
+   {
+      return ryannet_socket_udp_bind(socket_, bind_address, bind_port);
+   }
+
+   template<class T, std::size_t N>
+   int send(const address & destination, std::span<T, N> buffer)
+   {
+      static_assert(std::is_trivially_copyable_v<T>, "send needs a span of plain data");
+      return ryannet_socket_udp_send(socket_, destination.native(), buffer.data(), detail::clamp_size(buffer.size_bytes()));
+   }
+   int send(const address & destination, std::span<const std::byte> buffer) { return send<const std::byte>(destination, buffer); }
+   template<class T, std::size_t N>
+   int receive(std::span<T, N> buffer, address & source)
+   {
+      static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>, "receive needs a writable span of plain data");
+      return ryannet_socket_udp_receive(socket_, buffer.data(), detail::clamp_size(buffer.size_bytes()), source.native());
+   }
+   int receive(std::span<std::byte> buffer, address & source) { return receive<std::byte>(buffer, source); }
+   template<class T, std::size_t N>
+   int receive_nonblock(std::span<T, N> buffer, address & source)
+   {
+      static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>, "receive needs a writable span of plain data");
+      return ryannet_socket_udp_receive_nonblock(socket_, buffer.data(), detail::clamp_size(buffer.size_bytes()), source.native());
+   }
+   int receive_nonblock(std::span<std::byte> buffer, address & source) { return receive_nonblock<std::byte>(buffer, source); }
+
+   int handle() const { return ryannet_socket_udp_get_handle(socket_); }
+
+   explicit operator bool() const { return socket_ != nullptr; }
+   ryannet_socket_udp * native() const { return socket_; }
+   ryannet_socket_udp * release() { return std::exchange(socket_, nullptr); }
+
+private:
+   void reset()
+   {
+      if(socket_ != nullptr)
+      {
+         ryannet_socket_udp_destroy(socket_);
+         socket_ = nullptr;
+      }
+   }
+
+   ryannet_socket_udp * socket_;
+};
+
+
+// Coroutines. A task starts when it is awaited or spawned on an
+// event_loop, and hands its result back to whoever awaited it.
+template<class T = void>
+class task;
+
+namespace detail
+{
+
+struct promise_base
+{
+   std::coroutine_handle<> continuation;
+   std::exception_ptr exception;
+
+   std::suspend_always initial_suspend() noexcept { return {}; }
+
+   struct final_awaiter
+   {
+      bool await_ready() noexcept { return false; }
+      template<class P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> coroutine) noexcept
+      {
+         std::coroutine_handle<> next = coroutine.promise().continuation;
+         return next ? next : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+   };
+   final_awaiter final_suspend() noexcept { return {}; }
+
+   void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<class T>
+struct promise : promise_base
+{
+   std::optional<T> value;
+
+   task<T> get_return_object();
+   template<class U>
+   void return_value(U && result) { value.emplace(std::forward<U>(result)); }
+   T take()
+   {
+      if(exception)
+      {
+         std::rethrow_exception(exception);
+      }
+      return std::move(*value);
+   }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+   task<void> get_return_object();
+   void return_void() {}
+   void take()
+   {
+      if(exception)
+      {
+         std::rethrow_exception(exception);
+      }
+   }
+};
+
+} // namespace detail
+
+template<class T>
+class task
+{
+public:
+   using promise_type = detail::promise<T>;
+
+   explicit task(std::coroutine_handle<promise_type> coroutine) : coroutine_(coroutine) {}
+   ~task()
+   {
+      if(coroutine_)
+      {
+         coroutine_.destroy();
+      }
+   }
+   task(const task &) = delete;
+   task & operator=(const task &) = delete;
+   task(task && other) noexcept : coroutine_(std::exchange(other.coroutine_, nullptr)) {}
+   task & operator=(task && other) noexcept
+   {
+      if(this != &other)
+      {
+         if(coroutine_)
+         {
+            coroutine_.destroy();
+         }
+         coroutine_ = std::exchange(other.coroutine_, nullptr);
+      }
+      return *this;
+   }
+
+   bool await_ready() const noexcept { return !coroutine_ || coroutine_.done(); }
+   std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+   {
+      coroutine_.promise().continuation = awaiting;
+      return coroutine_;
+   }
+   T await_resume() { return coroutine_.promise().take(); }
+
+   bool done() const { return !coroutine_ || coroutine_.done(); }
+   std::coroutine_handle<promise_type> handle() const { return coroutine_; }
+
+private:
+   std::coroutine_handle<promise_type> coroutine_;
+};
+
+template<class T>
+inline task<T> detail::promise<T>::get_return_object()
+{
+   return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object()
+{
+   return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+
+// Waits on many sockets with one poll call. Awaiting a receive or accept
+// parks the coroutine until its socket is readable, then makes the
+// nonblocking C call and only resumes it once that got something. A wake
+// up with nothing to read, like timestamps on the error queue or another
+// coroutine reading first, parks it again. Empty datagrams look the same
+// as nothing and are skipped. Sends go straight to the C call and only
+// stall the loop when the kernel send buffer is full. Sockets without a
+// handle, like shared memory ones, skip the poll and block.
+class event_loop
+{
+public:
+   struct waiter
+   {
+      int handle;
+      short events;
+      std::coroutine_handle<> coroutine;
+      // Called once the handle is ready, false waits for the next time
+      bool (*attempt)(void * context);
+      void * context;
+   };
+
+   event_loop() = default;
+   event_loop(const event_loop &) = delete;
+   event_loop & operator=(const event_loop &) = delete;
+
+   // Starts the task right away, the loop keeps it until it finishes
+   void spawn(task<void> && work)
+   {
+      std::coroutine_handle<> coroutine = work.handle();
+      tasks_.push_back(std::move(work));
+      coroutine.resume();
+   }
+
+   void wait(waiter * entry) { waiting_.push_back(entry); }
+
+   // Polls once and resumes everything that became ready. Returns the
+   // number of coroutines resumed or -1 on a poll error.
+   int run_once(int timeout_ms)
+   {
+      std::size_t i, kept;
+      int rv;
+
+      fds_.resize(waiting_.size());
+      for(i = 0; i < waiting_.size(); i++)
+      {
+#ifdef _WIN32
+         fds_[i].fd = (SOCKET)waiting_[i]->handle;
+#else // _WIN32
+         fds_[i].fd = waiting_[i]->handle;
+#endif // _WIN32
+         fds_[i].events = waiting_[i]->events;
+         fds_[i].revents = 0;
+      }
+#ifdef _WIN32
+      rv = WSAPoll(fds_.data(), (ULONG)fds_.size(), timeout_ms);
+#else // _WIN32
+      rv = poll(fds_.data(), (nfds_t)fds_.size(), timeout_ms);
+#endif // _WIN32
+      if(rv <= 0)
+      {
+         reap();
+         return rv;
+      }
+
+      // Pull the ready ones out before resuming since they can wait again
+      ready_.clear();
+      kept = 0;
+      for(i = 0; i < waiting_.size(); i++)
+      {
+         if(fds_[i].revents != 0 &&
+            (waiting_[i]->attempt == nullptr || waiting_[i]->attempt(waiting_[i]->context)))
+         {
+            ready_.push_back(waiting_[i]->coroutine);
+         }
+         else
+         {
+            waiting_[kept] = waiting_[i];
+            kept ++;
+         }
+      }
+      waiting_.resize(kept);
+      for(i = 0; i < ready_.size(); i++)
+      {
+         ready_[i].resume();
+      }
+      reap();
+      return (int)ready_.size();
+   }
+
+   // Runs until every spawned task has finished or nothing is left to wait on
+   void run()
+   {
+      reap();
+      while(!tasks_.empty() && !waiting_.empty())
+      {
+         if(run_once(-1) < 0)
+         {
+            break;
+         }
+      }
+   }
+
+   std::size_t get_task_count() const { return tasks_.size(); }
+
+   // Awaitables
+   class tcp_receive;
+   class tcp_send;
+   class tcp_accept;
+   class udp_receive;
+
+   template<class T, std::size_t N>
+   tcp_receive receive(tcp_socket & socket, std::span<T, N> buffer);
+   tcp_receive receive(tcp_socket & socket, std::span<std::byte> buffer);
+   template<class T, std::size_t N>
+   tcp_send send(tcp_socket & socket, std::span<T, N> buffer);
+   tcp_send send(tcp_socket & socket, std::span<const std::byte> buffer);
+   tcp_accept accept(tcp_socket & socket);
+   template<class T, std::size_t N>
+   udp_receive receive(udp_socket & socket, std::span<T, N> buffer, address & source);
+   udp_receive receive(udp_socket & socket, std::span<std::byte> buffer, address & source);
+
+private:
+   void reap()
+   {
+      std::size_t i, kept;
+      kept = 0;
+      for(i = 0; i < tasks_.size(); i++)
+      {
+         if(!tasks_[i].done())
+         {
+            if(kept != i)
+            {
+               tasks_[kept] = std::move(tasks_[i]);
+            }
+            kept ++;
+         }
+      }
+      tasks_.erase(tasks_.begin() + (std::ptrdiff_t)kept, tasks_.end());
+   }
+
+   std::vector<task<void>> tasks_;
+   std::vector<waiter *> waiting_;
+   std::vector<std::coroutine_handle<>> ready_;
+#ifdef _WIN32
+   std::vector<WSAPOLLFD> fds_;
+#else // _WIN32
+   std::vector<struct pollfd> fds_;
+#endif // _WIN32
+};
+
+#ifdef _WIN32
+#define RYANNET_HPP_POLL_READ POLLRDNORM
+#else // _WIN32
+#define RYANNET_HPP_POLL_READ POLLIN
+#endif // _WIN32
+
+class event_loop::tcp_receive
+{
+public:
+   tcp_receive(event_loop & loop, tcp_socket & socket, void * buffer, int size)
+      : loop_(loop), socket_(socket), buffer_(buffer), size_(size), result_(0), done_(false),
+        waiter_{socket.handle(), RYANNET_HPP_POLL_READ, nullptr, attempt, this} {}
+   // The waiter points back here
+   tcp_receive(const tcp_receive &) = delete;
+   tcp_receive & operator=(const tcp_receive &) = delete;
+
+   bool await_ready() { return waiter_.handle < 0 || attempt(this); }
+   void await_suspend(std::coroutine_handle<> coroutine)
+   {
+      waiter_.coroutine = coroutine;
+      loop_.wait(&waiter_);
+   }
+   int await_resume() { return done_ ? result_ : ryannet_socket_tcp_receive(socket_.native(), buffer_, size_); }
+
+private:
+   // 0 is only an answer once the peer has closed
+   static bool attempt(void * context)
+   {
+      tcp_receive * self = static_cast<tcp_receive *>(context);
+      self->result_ = ryannet_socket_tcp_receive_nonblock(self->socket_.native(), self->buffer_, self->size_);
+      self->done_ = self->result_ != 0 || !self->socket_.is_connected();
+      return self->done_;
+   }
+
+   event_loop & loop_;
+   tcp_socket & socket_;
+   void * buffer_;
+   int size_;
+   int result_;
+   bool done_;
+   waiter waiter_;
+};
+
+class event_loop::tcp_send
+{
+public:
+   tcp_send(tcp_socket & socket, const void * buffer, int size) : socket_(socket), buffer_(buffer), size_(size) {}
+
+   bool await_ready() const noexcept { return true; }
+   void await_suspend(std::coroutine_handle<>) noexcept {}
+   int await_resume() { return ryannet_socket_tcp_send(socket_.native(), buffer_, size_); }
+
+private:
+   tcp_socket & socket_;
+   const void * buffer_;
+   int size_;
+};
+
+class event_loop::tcp_accept
+{
+public:
+   tcp_accept(event_loop & loop, tcp_socket & socket)
+      : loop_(loop), socket_(socket), done_(false), waiter_{socket.handle(), RYANNET_HPP_POLL_READ, nullptr, attempt, this} {}
+   tcp_accept(const tcp_accept &) = delete;
+   tcp_accept & operator=(const tcp_accept &) = delete;
+
+   bool await_ready() { return waiter_.handle < 0 || attempt(this); }
+   void await_suspend(std::coroutine_handle<> coroutine)
+   {
+      waiter_.coroutine = coroutine;
+      loop_.wait(&waiter_);
+   }
+   tcp_socket await_resume() { return done_ ? std::move(result_) : socket_.accept(); }
+
+private:
+   static bool attempt(void * context)
+   {
+      tcp_accept * self = static_cast<tcp_accept *>(context);
+      self->result_ = self->socket_.accept_nonblock();
+      self->done_ = (bool)self->result_;
+      return self->done_;
+   }
+
+   event_loop & loop_;
+   tcp_socket & socket_;
+   tcp_socket result_{nullptr};
+   bool done_;
+   waiter waiter_;
+};
+
+class event_loop::udp_receive
+{
+public:
+   udp_receive(event_loop & loop, udp_socket & socket, void * buffer, int size, address & source)
+      : loop_(loop), socket_(socket), buffer_(buffer), size_(size), source_(source), result_(0), done_(false),
+        waiter_{socket.handle(), RYANNET_HPP_POLL_READ, nullptr, attempt, this} {}
+   udp_receive(const udp_receive &) = delete;
+   udp_receive & operator=(const udp_receive &) = delete;
+
+   bool await_ready() { return waiter_.handle < 0 || attempt(this); }
+   void await_suspend(std::coroutine_handle<> coroutine)
+   {
+      waiter_.coroutine = coroutine;
+      loop_.wait(&waiter_);
+   }
+   int await_resume() { return done_ ? result_ : ryannet_socket_udp_receive(socket_.native(), buffer_, size_, source_.native()); }
+
+private:
+   static bool attempt(void * context)
+   {
+      udp_receive * self = static_cast<udp_receive *>(context);
+      self->result_ = ryannet_socket_udp_receive_nonblock(self->socket_.native(), self->buffer_, self->size_, self->source_.native());
+      self->done_ = self->result_ != 0;
+      return self->done_;
+   }
+
+   event_loop & loop_;
+   udp_socket & socket_;
+   void * buffer_;
+   int size_;
+   address & source_;
+   int result_;
+   bool done_;
+   waiter waiter_;
+};
+
+#undef RYANNET_HPP_POLL_READ
+
+template<class T, std::size_t N>
+inline event_loop::tcp_receive event_loop::receive(tcp_socket & socket, std::span<T, N> buffer)
+{
+   static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>, "receive needs a writable span of plain data");
+   return tcp_receive(*this, socket, buffer.data(), detail::clamp_size(buffer.size_bytes()));
+}
+
+inline event_loop::tcp_receive event_loop::receive(tcp_socket & socket, std::span<std::byte> buffer)
+{
+   return receive<std::byte>(socket, buffer);
+}
+
+template<class T, std::size_t N>
+inline event_loop::tcp_send event_loop::send(tcp_socket & socket, std::span<T, N> buffer)
+{
+   static_assert(std::is_trivially_copyable_v<T>, "send needs a span of plain data");
+   return tcp_send(socket, buffer.data(), detail::clamp_size(buffer.size_bytes()));
+}
+
+inline event_loop::tcp_send event_loop::send(tcp_socket & socket, std::span<const std::byte> buffer)
+{
+   return send<const std::byte>(socket, buffer);
+}
+
+inline event_loop::tcp_accept event_loop::accept(tcp_socket & socket)
+{
+   return tcp_accept(*this, socket);
+}
+
+template<class T, std::size_t N>
+inline event_loop::udp_receive event_loop::receive(udp_socket & socket, std::span<T, N> buffer, address & source)
+{
+   static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>, "receive needs a writable span of plain data");
+   return udp_receive(*this, socket, buffer.data(), detail::clamp_size(buffer.size_bytes()), source);
+}
+
+inline event_loop::udp_receive event_loop::receive(udp_socket & socket, std::span<std::byte> buffer, address & source)
+{
+   return receive<std::byte>(socket, buffer, source);
+}
+
+} // namespace ryannet
+
+#endif // __RYANNET_HPP__